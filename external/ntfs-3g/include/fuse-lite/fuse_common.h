@@ -50,6 +50,26 @@ extern "C" {
 
 #define FUSE_CAP_BIG_WRITES	(1 << 5)
 
+/*
+ * FUSE_CAP_SPLICE_WRITE: replies may be spliced to the fuse device
+ */
+#define FUSE_CAP_SPLICE_WRITE	(1 << 7)
+
+/*
+ * FUSE_CAP_READDIRPLUS: directories are read along with the
+ *	attributes of their entries
+ */
+#define FUSE_CAP_READDIRPLUS	(1 << 13)
+
+/*
+ * FUSE_CAP_WRITEBACK_CACHE: the kernel caches writes, and owns the
+ *	size and modification time of files being written to
+ * FUSE_CAP_PARALLEL_DIROPS: lookups and readdirs may be issued
+ *	concurrently in the same directory
+ */
+#define FUSE_CAP_WRITEBACK_CACHE	(1 << 16)
+#define FUSE_CAP_PARALLEL_DIROPS	(1 << 18)
+
 /**
  * Information about open files
  *
@@ -125,10 +145,18 @@ struct fuse_conn_info {
 
 	unsigned capable;
 	unsigned want;
+
+	/**
+	 * Granularity of file times in nanoseconds, zero meaning
+	 * one nanosecond (read-write, only used with protocol 7.23
+	 * or newer)
+	 */
+	unsigned time_gran;
+
 	/**
 	 * For future use.
 	 */
-	unsigned reserved[25];
+	unsigned reserved[24];
     };
 
 struct fuse_session;
@@ -807,6 +807,35 @@ struct fuse_lowlevel_ops {
 	 */
 	void (*bmap) (fuse_req_t req, fuse_ino_t ino, size_t blocksize,
 		      uint64_t idx);
+
+	/**
+	 * Read directory with attributes
+	 *
+	 * Send a buffer filled using fuse_add_direntry_plus(), with size
+	 * not exceeding the requested size.  Send an empty buffer on end
+	 * of stream.
+	 *
+	 * Only used when FUSE_CAP_READDIRPLUS was requested in the init
+	 * method, and then it replaces readdir.  Unlike lookup, an entry
+	 * with a zero inode number does not mean the name is missing, it
+	 * is just not entered into the kernel cache, and such entries
+	 * do not take a lookup count.
+	 *
+	 * fi->fh will contain the value set by the opendir method, or
+	 * will be undefined if the opendir method didn't set any value.
+	 *
+	 * Valid replies:
+	 *   fuse_reply_buf
+	 *   fuse_reply_err
+	 *
+	 * @param req request handle
+	 * @param ino the inode number
+	 * @param size maximum number of bytes to send
+	 * @param off offset to continue reading the directory stream
+	 * @param fi file information
+	 */
+	void (*readdirplus) (fuse_req_t req, fuse_ino_t ino, size_t size,
+			     off_t off, struct fuse_file_info *fi);
 };
 
 /**
@@ -929,6 +958,26 @@ int fuse_reply_write(fuse_req_t req, size_t count);
  */
 int fuse_reply_buf(fuse_req_t req, const char *buf, size_t size);
 
+/**
+ * Reply with data read from a file descriptor
+ *
+ * When FUSE_CAP_SPLICE_WRITE has been requested in init() and the
+ * kernel supports it, the data is moved from the descriptor to the
+ * fuse device through a pipe, without being copied to user space.
+ * Otherwise it is read into a temporary buffer and sent as with
+ * fuse_reply_buf().  A short read at end of file shortens the reply.
+ *
+ * Possible requests:
+ *   read
+ *
+ * @param req request handle
+ * @param fd file descriptor to read the data from
+ * @param pos position of the data in the file
+ * @param size the size of data in bytes
+ * @return zero for success, -errno for failure to send reply
+ */
+int fuse_reply_data(fuse_req_t req, int fd, off_t pos, size_t size);
+
 #ifdef POSIXACLS
 /**
  * Reply with data vector
@@ -1026,6 +1075,65 @@ size_t fuse_add_direntry(fuse_req_t req, char *buf, size_t bufsize,
 			 const char *name, const struct stat *stbuf,
 			 off_t off);
 
+/**
+ * Add a directory entry with its attributes to the buffer
+ *
+ * Same as fuse_add_direntry(), but the entry is described by a
+ * fuse_entry_param, as for a lookup reply.  The inode number and the
+ * type of the entry are taken from e->attr.  If e->ino is zero, the
+ * kernel only gets the name and type.
+ *
+ * @param req request handle
+ * @param buf the point where the new entry will be added to the buffer
+ * @param bufsize remaining size of the buffer
+ * @param the name of the entry
+ * @param e the entry parameters
+ * @param off the offset of the next entry
+ * @return the space needed for the entry
+ */
+size_t fuse_add_direntry_plus(fuse_req_t req, char *buf, size_t bufsize,
+			      const char *name,
+			      const struct fuse_entry_param *e, off_t off);
+
+/* ----------------------------------------------------------- *
+ * Notification						       *
+ * ----------------------------------------------------------- */
+
+/**
+ * Notify to invalidate cache for an inode
+ *
+ * Only the attributes are invalidated when off is negative, which
+ * is safe at any time.  Invalidating the data needs the pages to be
+ * locked, so this must not be done while processing a request which
+ * may hold such locks.
+ *
+ * @param ch the channel through which to send the invalidation
+ * @param ino the inode number
+ * @param off the offset in the inode where to start invalidating
+ *            or negative to invalidate attributes only
+ * @param len the amount of cache to invalidate or 0 for all
+ * @return zero for success, -errno for failure
+ */
+int fuse_lowlevel_notify_inval_inode(struct fuse_chan *ch, fuse_ino_t ino,
+                                     off_t off, off_t len);
+
+/**
+ * Notify to invalidate parent attributes and the dentry matching
+ * parent/name
+ *
+ * The kernel locks the parent directory while doing so, so this must
+ * not be called from the thread processing the requests : another
+ * thread may be holding the lock while waiting for a reply.
+ *
+ * @param ch the channel through which to send the invalidation
+ * @param parent inode number
+ * @param name file name
+ * @param namelen strlen() of file name
+ * @return zero for success, -errno for failure
+ */
+int fuse_lowlevel_notify_inval_entry(struct fuse_chan *ch, fuse_ino_t parent,
+                                     const char *name, size_t namelen);
+
 /* ----------------------------------------------------------- *
  * Utility functions					       *
  * ----------------------------------------------------------- */
@@ -1233,6 +1341,14 @@ void fuse_session_reset(struct fuse_session *se);
  */
 int fuse_session_exited(struct fuse_session *se);
 
+/**
+ * Get the user data provided to the session
+ *
+ * @param se the session
+ * @return the user data
+ */
+void *fuse_session_data(struct fuse_session *se);
+
 /**
  * Enter a single threaded event loop
  *
@@ -92,6 +92,7 @@ struct _ntfs_attr_search_ctx {
 	ntfs_inode *base_ntfs_ino;
 	MFT_RECORD *base_mrec;
 	ATTR_RECORD *base_attr;
+	struct NTFS_POOL *pool;	/* where to recycle, if any */
 };
 
 extern void ntfs_attr_reinit_search_ctx(ntfs_attr_search_ctx *ctx);
@@ -198,6 +199,7 @@ struct _ntfs_attr {
 	u8 compression_block_size_bits;
 	u8 compression_block_clusters;
 	s8 unused_runs; /* pre-reserved entries available */
+	struct NTFS_POOL *pool;	/* where to recycle, if any */
 };
 
 /**
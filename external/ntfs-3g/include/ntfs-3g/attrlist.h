@@ -31,6 +31,12 @@ extern int ntfs_attrlist_need(ntfs_inode *ni);
 extern int ntfs_attrlist_entry_add(ntfs_inode *ni, ATTR_RECORD *attr);
 extern int ntfs_attrlist_entry_rm(ntfs_attr_search_ctx *ctx);
 
+extern void ntfs_attrlist_index_free(ntfs_inode *ni);
+extern ATTR_LIST_ENTRY *ntfs_attrlist_index_type(ntfs_inode *ni,
+			ATTR_TYPES type);
+extern ATTR_LIST_ENTRY *ntfs_attrlist_index_vcn(ntfs_inode *ni,
+			ATTR_LIST_ENTRY *ale, VCN vcn);
+
 /**
  * ntfs_attrlist_mark_dirty - set the attribute list dirty
  * @ni:		ntfs inode which base inode contain dirty attribute list
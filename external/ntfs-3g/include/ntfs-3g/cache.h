@@ -64,6 +64,17 @@ struct CACHED_LOOKUP {
 	u64 inum;
 } ;
 
+	/* the records are stored in vol->mftrec_data, see mft.c */
+struct CACHED_MFTREC {
+	struct CACHED_MFTREC *next;
+	struct CACHED_MFTREC *previous;
+	const char *unused;	/* not used */
+	size_t varsize;		/* not used */
+	union ALIGNMENT payload[0];
+		/* above fields must match "struct CACHED_GENERIC" */
+	u64 inum;
+} ;
+
 enum {
 	CACHE_FREE = 1,
 	CACHE_NOHASH = 2
@@ -112,6 +123,8 @@ int ntfs_remove_cache(struct CACHE_HEADER *cache,
 			struct CACHED_GENERIC *item, int flags);
 
 void ntfs_create_lru_caches(ntfs_volume *vol);
+int ntfs_set_lookup_cache_size(ntfs_volume *vol, int count);
+int ntfs_set_mftrec_cache_size(ntfs_volume *vol, int count);
 void ntfs_free_lru_caches(ntfs_volume *vol);
 
 #endif /* _NTFS_CACHE_H_ */
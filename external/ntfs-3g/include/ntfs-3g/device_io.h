@@ -39,6 +39,10 @@
 /* Not for Windows use standard Unix style low level device operations. */
 #define ntfs_device_default_io_ops ntfs_device_unix_io_ops
 
+struct ntfs_device;
+
+int ntfs_device_unix_io_fd(struct ntfs_device *dev);
+
 #else /* HAVE_WINDOWS_H */
 
 #ifndef HDIO_GETGEO
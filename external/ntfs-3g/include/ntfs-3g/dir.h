@@ -26,6 +26,8 @@
 #define _NTFS_DIR_H
 
 #include "types.h"
+#include "layout.h"
+#include "support.h"
 
 #define PATH_SEP '/'
 
@@ -59,8 +61,24 @@ extern ntfschar NTFS_INDEX_O[3];
 extern ntfschar NTFS_INDEX_Q[3];
 extern ntfschar NTFS_INDEX_R[3];
 
+/*
+ * The name in a file name attribute, without taking the address of
+ * a member of a packed structure, which the compiler warns about.
+ */
+static __inline__ const ntfschar *ntfs_fn_name(const FILE_NAME_ATTR *fn)
+{
+	return ((const ntfschar*)((const u8*)fn
+				+ offsetof(FILE_NAME_ATTR, file_name)));
+}
+
 extern u64 ntfs_inode_lookup_by_name(ntfs_inode *dir_ni,
 		const ntfschar *uname, const int uname_len);
+extern void ntfs_dir_hash_free(ntfs_inode *ni);
+extern void ntfs_dir_hash_add(ntfs_inode *dir_ni, const FILE_NAME_ATTR *fn,
+		MFT_REF mref);
+extern void ntfs_dir_hash_remove(ntfs_inode *dir_ni,
+		const FILE_NAME_ATTR *fn);
+extern void ntfs_dir_hash_resized(ntfs_inode *dir_ni);
 extern u64 ntfs_inode_lookup_by_mbsname(ntfs_inode *dir_ni, const char *name);
 extern void ntfs_inode_update_mbsname(ntfs_inode *dir_ni, const char *name,
 				u64 inum);
@@ -69,6 +87,9 @@ extern ntfs_inode *ntfs_pathname_to_inode(ntfs_volume *vol, ntfs_inode *parent,
 		const char *pathname);
 extern ntfs_inode *ntfs_create(ntfs_inode *dir_ni, le32 securid,
 		const ntfschar *name, u8 name_len, mode_t type);
+extern int ntfs_create_many(ntfs_inode *dir_ni, le32 securid,
+		const ntfschar **names, const u8 *name_lens, mode_t type,
+		ntfs_inode **nis, int count);
 extern ntfs_inode *ntfs_create_device(ntfs_inode *dir_ni, le32 securid,
 		const ntfschar *name, u8 name_len, mode_t type, dev_t dev);
 extern ntfs_inode *ntfs_create_symlink(ntfs_inode *dir_ni, le32 securid,
@@ -108,6 +129,20 @@ typedef int (*ntfs_filldir_t)(void *dirent, const ntfschar *name,
 extern int ntfs_readdir(ntfs_inode *dir_ni, s64 *pos,
 		void *dirent, ntfs_filldir_t filldir);
 
+/*
+ * Same as ntfs_filldir_t, with the file name attribute of the entry
+ * as found in the directory index (NULL for "." and "..").
+ */
+typedef int (*ntfs_filldir_plus_t)(void *dirent, const ntfschar *name,
+		const int name_len, const int name_type, const s64 pos,
+		const MFT_REF mref, const unsigned dt_type,
+		const FILE_NAME_ATTR *fn);
+
+extern int ntfs_readdir_plus(ntfs_inode *dir_ni, s64 *pos,
+		void *dirent, ntfs_filldir_plus_t filldir);
+
+extern int ntfs_dir_prefetch(ntfs_inode *dir_ni);
+
 ntfs_inode *ntfs_dir_parent_inode(ntfs_inode *ni);
 
 int ntfs_get_ntfs_dos_name(ntfs_inode *ni, ntfs_inode *dir_ni,
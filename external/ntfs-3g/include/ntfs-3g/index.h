@@ -63,6 +63,8 @@
 
 #define  MAX_PARENT_VCN		32
 
+struct INDEX_BATCH;
+
 typedef int (*COLLATE)(ntfs_volume *vol, const void *data1, int len1,
 					 const void *data2, int len2);
 
@@ -86,6 +88,7 @@ typedef int (*COLLATE)(ntfs_volume *vol, const void *data1, int len1,
  * @ib_dirty:		TRUE if index block was changed
  * @block_size:		index block size
  * @vcn_size_bits:	VCN size bits for this index block
+ * @batch:		index blocks kept in memory, or NULL if not batching
  *
  * @ni is the inode this context belongs to.
  *
@@ -131,6 +134,7 @@ typedef struct {
 	BOOL ib_dirty;
 	u32 block_size;
 	u8 vcn_size_bits;
+	struct INDEX_BATCH *batch; /* blocks kept in memory during a batch */
 } ntfs_index_context;
 
 extern ntfs_index_context *ntfs_index_ctx_get(ntfs_inode *ni,
@@ -144,6 +148,8 @@ extern int ntfs_index_lookup(const void *key, const int key_len,
 extern INDEX_ENTRY *ntfs_index_next(INDEX_ENTRY *ie,
 		ntfs_index_context *ictx);
 
+extern int ntfs_index_add_filenames(ntfs_inode *ni, FILE_NAME_ATTR **fns,
+		const MFT_REF *mrefs, int count, int *added);
 extern int ntfs_index_add_filename(ntfs_inode *ni, FILE_NAME_ATTR *fn,
 		MFT_REF mref);
 extern int ntfs_index_remove(ntfs_inode *dir_ni, ntfs_inode *ni,
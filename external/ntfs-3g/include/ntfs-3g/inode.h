@@ -97,6 +97,9 @@ typedef enum {
 #define NInoFileNameTestAndClearDirty(ni)	\
 				    test_and_clear_nino_flag(ni, FileNameDirty)
 
+struct ATTRLIST_INDEX;
+struct DIR_HASH;
+
 /**
  * struct _ntfs_inode - The NTFS in-memory inode structure.
  *
@@ -118,6 +121,13 @@ struct _ntfs_inode {
 	 */
 	u32 attr_list_size;	/* Length of attribute list value in bytes. */
 	u8 *attr_list;		/* Attribute list value itself. */
+	struct ATTRLIST_INDEX *attr_index; /* Index of the attribute list,
+				   computed when first needed. */
+	struct DIR_HASH *dir_hash; /* Hashed names of a big directory,
+				   computed when searched often. */
+	u32 dir_lookups;	/* Count of searches in the directory
+				   since the hash was last considered,
+				   or all ones if it could not be built. */
 	/* Below fields are always valid. */
 	s32 nr_extents;		/* For a base mft record, the number of
 				   attached extent inodes (0 if none), for
@@ -61,6 +61,16 @@ static __inline__ int ntfs_mft_record_read(const ntfs_volume *vol,
 extern int ntfs_mft_record_check(const ntfs_volume *vol, const MFT_REF mref, 
 		MFT_RECORD *m);
 
+extern int ntfs_mft_prefetch(ntfs_volume *vol, MFT_REF *refs, int count);
+
+#if CACHE_MFTREC_SIZE
+
+struct CACHED_GENERIC;
+
+extern int ntfs_mft_record_hash(const struct CACHED_GENERIC *item);
+
+#endif
+
 extern int ntfs_file_record_read(const ntfs_volume *vol, const MFT_REF mref,
 		MFT_RECORD **mrec, ATTR_RECORD **attr);
 
@@ -1,6 +1,7 @@
 /*
  * misc.h : miscellaneous exports
  *		- memory allocation
+ *		- recycling of memory blocks
  *
  * Copyright (c) 2008 Jean-Pierre Andre
  *
@@ -25,6 +26,23 @@
 
 void *ntfs_calloc(size_t size);
 void *ntfs_malloc(size_t size);
+unsigned long ntfs_heap_allocations(void);
+
+/*
+ *		Pool of memory blocks of the same size, which are recycled
+ *	instead of being freed. A zeroed pool is empty and ready to use.
+ */
+
+struct NTFS_POOL {
+	void *first;		/* chain of free blocks */
+	int count;		/* number of free blocks */
+	unsigned long allocated;/* blocks obtained from heap */
+	unsigned long reused;	/* blocks obtained from pool */
+} ;
+
+void *ntfs_pool_get(struct NTFS_POOL *pool, size_t size);
+void ntfs_pool_put(struct NTFS_POOL *pool, void *p);
+void ntfs_pool_release(struct NTFS_POOL *pool);
 
 #endif /* _NTFS_MISC_H_ */
 
@@ -32,6 +32,12 @@ extern int ntfs_mst_post_read_fixup_warn(NTFS_RECORD *b, const u32 size,
 					BOOL warn);
 extern int ntfs_mst_pre_write_fixup(NTFS_RECORD *b, const u32 size);
 extern void ntfs_mst_post_write_fixup(NTFS_RECORD *b);
+extern int ntfs_mst_post_read_fixups(NTFS_RECORD *b, const u32 size,
+					s64 count, BOOL warn);
+extern s64 ntfs_mst_pre_write_fixups(NTFS_RECORD *b, const u32 size,
+					s64 count);
+extern void ntfs_mst_post_write_fixups(NTFS_RECORD *b, const u32 size,
+					s64 count);
 
 #endif /* defined _NTFS_MST_H */
 
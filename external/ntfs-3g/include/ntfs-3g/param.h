@@ -25,8 +25,13 @@
 #define CACHE_INODE_SIZE 32	/* inode cache, zero or >= 3 and not too big */
 #define CACHE_NIDATA_SIZE 64	/* idata cache, zero or >= 3 and not too big */
 #define CACHE_LOOKUP_SIZE 64	/* lookup cache, zero or >= 3 and not too big */
+#define CACHE_LOOKUP_MAX 65536	/* max lookup cache size set by mount option */
+#define CACHE_LOOKUP_HASH 1024	/* count of lookup cache hash heads */
 #define CACHE_SECURID_SIZE 16    /* securid cache, zero or >= 3 and not too big */
 #define CACHE_LEGACY_SIZE 8    /* legacy cache size, zero or >= 3 and not too big */
+#define CACHE_MFTREC_SIZE 4096	/* mft record cache, zero or >= 3 */
+#define CACHE_MFTREC_BUDGET 4194304 /* default bytes of mft records in cache */
+#define CACHE_MFTREC_MAX 65536	/* max mft record cache size set by mount option */
 
 #define FORCE_FORMAT_v1x 0	/* Insert security data as in NTFS v1.x */
 #define OWNERFROMACL 1		/* Get the owner from ACL (not Windows owner) */
@@ -64,10 +69,99 @@ enum {
  *	can be allocated per bitmap chunk. So, there is a danger when the
  *	number of chunks (capacity/(32768*clsiz)) is less than the number
  *	of clusters in the biggest write buffer (131072/clsiz). Hence
- *	a safe minimal capacity is 4GB
+ *	a safe minimal capacity is 4GB for 128K buffers, and generally
+ *	the write buffers should not be bigger than capacity/32768.
  */
 
-#define SAFE_CAPACITY_FOR_BIG_WRITES 0x100000000LL
+#define SAFE_CAPACITY_PER_WRITE_BYTE 32768
+#define MIN_WRITE_SIZE 4096	/* size of fuse writes when not big */
+
+/*
+ *		Use of spliced reads
+ *
+ *	When the fuse device accepts splicing, a read request which
+ *	maps to a single run of clusters is moved straight from the
+ *	device to fuse. Setting up the splice costs more system calls
+ *	than a plain copy, so this is only done for big requests.
+ */
+
+#define MIN_SPLICED_READ 65536
+
+/*
+ *		Parameters for allocation pools
+ *
+ *	Inodes, mft records, attributes and search contexts are
+ *	recycled through per-volume pools, so that the usual read
+ *	requests do not allocate memory. This is the maximum count of
+ *	free blocks kept in each pool.
+ */
+
+#define POOL_FREE_MAX 16
+
+/*
+ *		Parameters for mft record prefetching
+ *
+ *	When the attributes of the files in a directory are being looked
+ *	up, the mft records of the entries may be read ahead into the mft
+ *	record cache. Records which are at most MFT_PREFETCH_GAP apart are
+ *	read in a single request (also reading the unwanted ones in
+ *	between), of at most MFT_PREFETCH_MAX records. Directories whose
+ *	index is bigger than MFT_PREFETCH_INDEX_MAX bytes (about a thousand
+ *	entries, a quarter of the cache) are not prefetched.
+ */
+
+#define MFT_PREFETCH_GAP 8
+#define MFT_PREFETCH_MAX 64
+#define MFT_PREFETCH_INDEX_MAX 131072
+
+/*
+ *		Parameters for kernel cacheing
+ *
+ *	When no access check is done by the file system, the low level
+ *	driver lets the kernel keep the attributes and entries it gets,
+ *	and notifies the changes the kernel cannot see by itself. The
+ *	timeout only matters for the changes made by other means (such
+ *	as Windows in a virtual machine sharing the partition), and
+ *	mounting such a shared partition is unsafe anyway.
+ */
+
+#define CACHE_TIMEOUT 10.0	/* seconds */
+
+/*
+ *		Parameters for attribute lists
+ *
+ *	Attribute lists with at least ATTRLIST_INDEX_MIN entries get an
+ *	index of their entries, so that the attributes of fragmented
+ *	files are located by dichotomy instead of a linear search.
+ */
+
+#define ATTRLIST_INDEX_MIN 16
+
+/*
+ *		Parameters for hashed directories
+ *
+ *	The names of a directory whose index allocation is at least
+ *	DIR_HASH_MIN_SIZE bytes are hashed in memory when it has been
+ *	searched DIR_HASH_HOT times while open or cached, so that further
+ *	searches do not walk the B+tree. The hash tables of a volume use
+ *	at most DIR_HASH_BUDGET bytes, and the index blocks are read
+ *	by DIR_HASH_READ bytes when building the table.
+ */
+
+#define DIR_HASH_MIN_SIZE 1048576
+#define DIR_HASH_HOT 8
+#define DIR_HASH_BUDGET 16777216
+#define DIR_HASH_READ 65536
+
+/*
+ *		Parameters for batched insertions into directories
+ *
+ *	When many names are inserted into a directory by a single call,
+ *	up to INDEX_BATCH_BLOCKS index blocks are kept in memory, and
+ *	they are only written when evicted or when the batch ends.
+ */
+
+#define INDEX_BATCH_BLOCKS 64
 
 /*
  *		Parameters for runlists
@@ -35,6 +35,12 @@ extern int ntfs_names_full_collate(const ntfschar *name1, const u32 name1_len,
 		const IGNORE_CASE_BOOL ic,
 		const ntfschar *upcase, const u32 upcase_len);
 
+extern int ntfs_names_full_collate_upcased(const ntfschar *name1,
+		const ntfschar *upname1, const u32 name1_len,
+		const ntfschar *name2, const u32 name2_len,
+		const IGNORE_CASE_BOOL ic,
+		const ntfschar *upcase, const u32 upcase_len);
+
 extern int ntfs_ucsncmp(const ntfschar *s1, const ntfschar *s2, size_t n);
 
 extern int ntfs_ucsncasecmp(const ntfschar *s1, const ntfschar *s2, size_t n,
@@ -49,6 +49,7 @@ typedef struct _ntfs_volume ntfs_volume;
 #include "param.h"
 #include "types.h"
 #include "support.h"
+#include "misc.h"
 #include "device.h"
 #include "inode.h"
 #include "attrib.h"
@@ -275,6 +276,15 @@ struct _ntfs_volume {
 #if CACHE_LEGACY_SIZE
 	struct CACHE_HEADER *legacy_cache;
 #endif
+#if CACHE_MFTREC_SIZE
+	struct CACHE_HEADER *mftrec_cache;
+	void *mftrec_data;	/* storage for the cached mft records */
+#endif
+	s64 dir_hash_bytes;	/* memory used by the directory hash tables */
+	struct NTFS_POOL inode_pool;	/* recycled ntfs_inode */
+	struct NTFS_POOL mrec_pool;	/* recycled mft records */
+	struct NTFS_POOL attr_pool;	/* recycled ntfs_attr */
+	struct NTFS_POOL ctx_pool;	/* recycled search contexts */
 
 };
 
@@ -6,6 +6,8 @@
     See the file COPYING.LIB
 */
 
+#define _GNU_SOURCE /* for splice() and vmsplice() */
+
 #include "config.h"
 #include "fuse_lowlevel.h"
 #include "fuse_kernel.h"
@@ -25,6 +27,10 @@
 #define PARAM(inarg) (((const char *)(inarg)) + sizeof(*(inarg)))
 #define OFFSET_MAX 0x7fffffffffffffffLL
 
+#if defined(HAVE_SPLICE) && defined(HAVE_VMSPLICE) && defined(F_SETPIPE_SZ)
+#define FUSE_USE_SPLICE 1
+#endif
+
 struct fuse_ll;
 
 struct fuse_req {
@@ -60,6 +66,10 @@ struct fuse_ll {
     struct fuse_req interrupts;
     pthread_mutex_t lock;
     int got_destroy;
+#ifdef FUSE_USE_SPLICE
+    int splice_pipe[2];
+    size_t splice_pipe_size;
+#endif
 };
 
 static void convert_stat(const struct stat *stbuf, struct fuse_attr *attr)
@@ -192,6 +202,23 @@ static int send_reply(fuse_req_t req, int error, const void *arg,
     return send_reply_iov(req, error, iov, count);
 }
 
+static int send_notify_iov(struct fuse_ll *f, struct fuse_chan *ch,
+                           int notify_code, struct iovec *iov, int count)
+{
+    struct fuse_out_header out;
+
+    out.unique = 0;
+    out.error = notify_code;
+    iov[0].iov_base = &out;
+    iov[0].iov_len = sizeof(struct fuse_out_header);
+    out.len = iov_length(iov, count);
+
+    if (f->debug)
+        fprintf(stderr, "NOTIFY: code=%d length=%u\n",
+                notify_code, out.len);
+    return fuse_chan_send(ch, iov, count);
+}
+
 #if 0 /* not used */
 int fuse_reply_iov(fuse_req_t req, const struct iovec *iov, int count)
 {
@@ -314,6 +341,28 @@ static void fill_entry(struct fuse_entry_out *arg,
     convert_stat(&e->attr, &arg->attr);
 }
 
+size_t fuse_add_direntry_plus(fuse_req_t req, char *buf, size_t bufsize,
+                              const char *name,
+                              const struct fuse_entry_param *e, off_t off)
+{
+    unsigned namelen = strlen(name);
+    unsigned entlen = FUSE_NAME_OFFSET_DIRENTPLUS + namelen;
+    unsigned entsize = FUSE_DIRENT_ALIGN(entlen);
+    struct fuse_direntplus *dp = (struct fuse_direntplus *) buf;
+
+    (void) req;
+    if (entsize <= bufsize && buf) {
+        memset(buf, 0, entsize);
+        fill_entry(&dp->entry_out, e);
+        dp->dirent.ino = e->attr.st_ino;
+        dp->dirent.off = off;
+        dp->dirent.namelen = namelen;
+        dp->dirent.type = (e->attr.st_mode & 0170000) >> 12;
+        memcpy(dp->dirent.name, name, namelen);
+    }
+    return entsize;
+}
+
 static void fill_open(struct fuse_open_out *arg,
                       const struct fuse_file_info *f)
 {
@@ -416,6 +465,139 @@ int fuse_reply_buf(fuse_req_t req, const char *buf, size_t size)
     return send_reply_ok(req, buf, size);
 }
 
+#ifdef FUSE_USE_SPLICE
+
+/*
+ * The session loop is single threaded, so a single pipe per session
+ * is enough.  It is created on first use and enlarged to hold a full
+ * reply, which fails when the size exceeds /proc/sys/fs/pipe-max-size.
+ */
+static int splice_pipe_get(struct fuse_ll *f, size_t size)
+{
+    int res;
+
+    if (f->splice_pipe[0] == -1) {
+        if (pipe(f->splice_pipe) == -1) {
+            f->splice_pipe[0] = -1;
+            return -1;
+        }
+        f->splice_pipe_size = getpagesize() * 16;
+    }
+    if (f->splice_pipe_size < size) {
+        res = fcntl(f->splice_pipe[0], F_SETPIPE_SZ, size);
+        if (res == -1)
+            return -1;
+        f->splice_pipe_size = res;
+    }
+    return 0;
+}
+
+static void splice_pipe_drop(struct fuse_ll *f)
+{
+    if (f->splice_pipe[0] != -1) {
+        close(f->splice_pipe[0]);
+        close(f->splice_pipe[1]);
+        f->splice_pipe[0] = -1;
+        f->splice_pipe[1] = -1;
+    }
+}
+
+/*
+ * Send a reply by splicing the header and the data into the pipe,
+ * then the pipe into the fuse device.
+ *
+ * Returns 1 if the reply could not be prepared, the request is then
+ * left pending for sending through the copying path.
+ */
+static int send_reply_splice(fuse_req_t req, int fd, off_t pos, size_t size)
+{
+    struct fuse_ll *f = req->f;
+    struct fuse_out_header out;
+    struct iovec iov;
+    loff_t off = pos;
+    size_t len = sizeof(struct fuse_out_header) + size;
+    size_t done;
+    ssize_t res;
+
+    if (splice_pipe_get(f, len))
+        return 1;
+
+    out.unique = req->unique;
+    out.error = 0;
+    out.len = len;
+    iov.iov_base = &out;
+    iov.iov_len = sizeof(struct fuse_out_header);
+    res = vmsplice(f->splice_pipe[1], &iov, 1, 0);
+    if (res != sizeof(struct fuse_out_header))
+        goto drop;
+    for (done = 0; done < size; done += res) {
+        res = splice(fd, &off, f->splice_pipe[1], NULL, size - done, 0);
+        if (res <= 0)
+            goto drop;
+    }
+
+    if (f->debug)
+        fprintf(stderr, "   unique: %llu, success, outsize: %i (splice)\n",
+                (unsigned long long) out.unique, out.len);
+    res = splice(f->splice_pipe[0], NULL, fuse_chan_fd(req->ch), NULL, len,
+                 SPLICE_F_MOVE);
+    if (res == -1) {
+        res = -errno;
+        /* ENOENT means the operation was interrupted */
+        if (!fuse_session_exited(fuse_chan_session(req->ch))
+            && res != -ENOENT)
+            perror("fuse: splicing device");
+        splice_pipe_drop(f);
+    } else if ((size_t) res != len) {
+        fprintf(stderr, "fuse: short splice to device: %zi/%zu\n",
+                res, len);
+        splice_pipe_drop(f);
+        res = -EIO;
+    } else
+        res = 0;
+    free_req(req);
+    return res;
+
+ drop:
+        /* discard a partially filled pipe */
+    splice_pipe_drop(f);
+    return 1;
+}
+
+#endif /* FUSE_USE_SPLICE */
+
+int fuse_reply_data(fuse_req_t req, int fd, off_t pos, size_t size)
+{
+    char *buf;
+    size_t done;
+    ssize_t res;
+
+#ifdef FUSE_USE_SPLICE
+    if (size && (req->f->conn.capable & req->f->conn.want
+                 & FUSE_CAP_SPLICE_WRITE)) {
+        res = send_reply_splice(req, fd, pos, size);
+        if (res <= 0)
+            return res;
+    }
+#endif
+    buf = (char *) malloc(size ? size : 1);
+    if (buf == NULL)
+        return fuse_reply_err(req, ENOMEM);
+    for (done = 0; done < size; done += res) {
+        res = pread(fd, buf + done, size - done, pos + done);
+        if (res == -1) {
+            res = -errno;
+            free(buf);
+            return fuse_reply_err(req, -res);
+        }
+        if (!res)
+            break;
+    }
+    res = send_reply_ok(req, buf, done);
+    free(buf);
+    return res;
+}
+
 #if HAVE_SYS_STATVFS_H
 int fuse_reply_statfs(fuse_req_t req, const struct statvfs *stbuf)
 {
@@ -466,6 +648,63 @@ int fuse_reply_bmap(fuse_req_t req, uint64_t idx)
     return send_reply_ok(req, &arg, sizeof(arg));
 }
 
+static struct fuse_ll *notify_target(struct fuse_chan *ch)
+{
+    struct fuse_session *se;
+
+    se = (ch ? fuse_chan_session(ch) : NULL);
+    return (se ? (struct fuse_ll *) fuse_session_data(se) : NULL);
+}
+
+int fuse_lowlevel_notify_inval_inode(struct fuse_chan *ch, fuse_ino_t ino,
+                                     off_t off, off_t len)
+{
+    struct fuse_notify_inval_inode_out outarg;
+    struct fuse_ll *f;
+    struct iovec iov[2];
+
+    f = notify_target(ch);
+    if (!f)
+        return -EINVAL;
+    /* notifications were introduced in protocol 7.12 */
+    if (f->conn.proto_minor < 12)
+        return -ENOSYS;
+
+    outarg.ino = ino;
+    outarg.off = off;
+    outarg.len = len;
+
+    iov[1].iov_base = &outarg;
+    iov[1].iov_len = sizeof(outarg);
+
+    return send_notify_iov(f, ch, FUSE_NOTIFY_INVAL_INODE, iov, 2);
+}
+
+int fuse_lowlevel_notify_inval_entry(struct fuse_chan *ch, fuse_ino_t parent,
+                                     const char *name, size_t namelen)
+{
+    struct fuse_notify_inval_entry_out outarg;
+    struct fuse_ll *f;
+    struct iovec iov[3];
+
+    f = notify_target(ch);
+    if (!f)
+        return -EINVAL;
+    if (f->conn.proto_minor < 12)
+        return -ENOSYS;
+
+    outarg.parent = parent;
+    outarg.namelen = namelen;
+    outarg.padding = 0;
+
+    iov[1].iov_base = &outarg;
+    iov[1].iov_len = sizeof(outarg);
+    iov[2].iov_base = (void *) name;
+    iov[2].iov_len = namelen + 1;
+
+    return send_notify_iov(f, ch, FUSE_NOTIFY_INVAL_ENTRY, iov, 3);
+}
+
 static void do_lookup(fuse_req_t req, fuse_ino_t nodeid, const void *inarg)
 {
     const char *name = (const char *) inarg;
@@ -783,6 +1022,22 @@ static void do_readdir(fuse_req_t req, fuse_ino_t nodeid, const void *inarg)
         fuse_reply_err(req, ENOSYS);
 }
 
+static void do_readdirplus(fuse_req_t req, fuse_ino_t nodeid,
+                           const void *inarg)
+{
+    const struct fuse_read_in *arg = (const struct fuse_read_in *) inarg;
+    struct fuse_file_info fi;
+
+    memset(&fi, 0, sizeof(fi));
+    fi.fh = arg->fh;
+    fi.fh_old = fi.fh;
+
+    if (req->f->op.readdirplus)
+        req->f->op.readdirplus(req, nodeid, arg->size, arg->offset, &fi);
+    else
+        fuse_reply_err(req, ENOSYS);
+}
+
 static void do_releasedir(fuse_req_t req, fuse_ino_t nodeid, const void *inarg)
 {
     const struct fuse_release_in *arg = (const struct fuse_release_in *) inarg;
@@ -1023,6 +1278,7 @@ static void do_init(fuse_req_t req, fuse_ino_t nodeid, const void *inarg)
     struct fuse_init_out outarg;
     struct fuse_ll *f = req->f;
     size_t bufsize = fuse_chan_bufsize(req->ch);
+    size_t outsize;
 
     (void) nodeid;
     if (f->debug) {
@@ -1053,6 +1309,16 @@ static void do_init(fuse_req_t req, fuse_ino_t nodeid, const void *inarg)
 #endif
 	if (arg->flags & FUSE_BIG_WRITES)
 	    f->conn.capable |= FUSE_CAP_BIG_WRITES;
+#ifdef FUSE_USE_SPLICE
+	if (arg->major > 7 || (arg->major == 7 && arg->minor >= 14))
+	    f->conn.capable |= FUSE_CAP_SPLICE_WRITE;
+#endif
+	if (arg->flags & FUSE_DO_READDIRPLUS)
+	    f->conn.capable |= FUSE_CAP_READDIRPLUS;
+	if (arg->flags & FUSE_WRITEBACK_CACHE)
+	    f->conn.capable |= FUSE_CAP_WRITEBACK_CACHE;
+	if (arg->flags & FUSE_PARALLEL_DIROPS)
+	    f->conn.capable |= FUSE_CAP_PARALLEL_DIROPS;
     } else {
         f->conn.async_read = 0;
         f->conn.max_readahead = 0;
@@ -1099,17 +1365,48 @@ static void do_init(fuse_req_t req, fuse_ino_t nodeid, const void *inarg)
 #endif
     if (f->conn.want & FUSE_CAP_BIG_WRITES)
 	outarg.flags |= FUSE_BIG_WRITES;
+    if ((f->conn.want & f->conn.capable & FUSE_CAP_READDIRPLUS)
+	&& f->op.readdirplus)
+	outarg.flags |= FUSE_DO_READDIRPLUS;
+    if (f->conn.want & f->conn.capable & FUSE_CAP_WRITEBACK_CACHE)
+	outarg.flags |= FUSE_WRITEBACK_CACHE;
+    if (f->conn.want & f->conn.capable & FUSE_CAP_PARALLEL_DIROPS)
+	outarg.flags |= FUSE_PARALLEL_DIROPS;
     outarg.max_readahead = f->conn.max_readahead;
     outarg.max_write = f->conn.max_write;
+	/*
+	 * Requests are limited to 32 pages unless the kernel is told
+	 * otherwise. Only do so when big writes are wanted, as reads
+	 * would also get bigger.
+	 */
+    if ((arg->flags & FUSE_MAX_PAGES)
+	&& (f->conn.want & (FUSE_CAP_BIG_WRITES | FUSE_CAP_WRITEBACK_CACHE))) {
+	size_t pagesize = getpagesize();
+
+	if (outarg.max_write > 32 * pagesize) {
+	    outarg.flags |= FUSE_MAX_PAGES;
+	    outarg.max_pages = (outarg.max_write + pagesize - 1) / pagesize;
+	}
+    }
+    outarg.time_gran = f->conn.time_gran;
 
     if (f->debug) {
         fprintf(stderr, "   INIT: %u.%u\n", outarg.major, outarg.minor);
         fprintf(stderr, "   flags=0x%08x\n", outarg.flags);
         fprintf(stderr, "   max_readahead=0x%08x\n", outarg.max_readahead);
         fprintf(stderr, "   max_write=0x%08x\n", outarg.max_write);
+        if (outarg.flags & FUSE_MAX_PAGES)
+            fprintf(stderr, "   max_pages=%u\n", outarg.max_pages);
     }
 
-    send_reply_ok(req, &outarg, arg->minor < 5 ? 8 : sizeof(outarg));
+    if (arg->minor < 5)
+        outsize = 8;
+    else
+        if (arg->minor < 23)
+            outsize = FUSE_COMPAT_22_INIT_OUT_SIZE;
+        else
+            outsize = sizeof(outarg);
+    send_reply_ok(req, &outarg, outsize);
 }
 
 static void do_destroy(fuse_req_t req, fuse_ino_t nodeid, const void *inarg)
@@ -1200,6 +1497,7 @@ static struct {
     [FUSE_INTERRUPT]   = { do_interrupt,   "INTERRUPT"   },
     [FUSE_BMAP]        = { do_bmap,        "BMAP"        },
     [FUSE_DESTROY]     = { do_destroy,     "DESTROY"     },
+    [FUSE_READDIRPLUS] = { do_readdirplus, "READDIRPLUS" },
 };
 
 #define FUSE_MAXOP (sizeof(fuse_ll_ops) / sizeof(fuse_ll_ops[0]))
@@ -1248,6 +1546,7 @@ static void fuse_ll_process(void *data, const char *buf, size_t len,
              in->opcode != FUSE_INIT && in->opcode != FUSE_READ &&
              in->opcode != FUSE_WRITE && in->opcode != FUSE_FSYNC &&
              in->opcode != FUSE_RELEASE && in->opcode != FUSE_READDIR &&
+             in->opcode != FUSE_READDIRPLUS &&
              in->opcode != FUSE_FSYNCDIR && in->opcode != FUSE_RELEASEDIR) {
         fuse_reply_err(req, EACCES);
     } else if (in->opcode >= FUSE_MAXOP || !fuse_ll_ops[in->opcode].func)
@@ -1341,6 +1640,9 @@ static void fuse_ll_destroy(void *data)
             f->op.destroy(f->userdata);
     }
 
+#ifdef FUSE_USE_SPLICE
+    splice_pipe_drop(f);
+#endif
     pthread_mutex_destroy(&f->lock);
     free(f);
 }
@@ -1373,6 +1675,10 @@ struct fuse_session *fuse_lowlevel_new(struct fuse_args *args,
     list_init_req(&f->list);
     list_init_req(&f->interrupts);
     fuse_mutex_init(&f->lock);
+#ifdef FUSE_USE_SPLICE
+    f->splice_pipe[0] = -1;
+    f->splice_pipe[1] = -1;
+#endif
 
     if (fuse_opt_parse(args, f, fuse_ll_opts, fuse_ll_opt_proc) == -1)
         goto out_free;
@@ -411,9 +411,11 @@ ntfs_attr *ntfs_attr_open(ntfs_inode *ni, const ATTR_TYPES type,
 		errno = EINVAL;
 		goto out;
 	}
-	na = ntfs_calloc(sizeof(ntfs_attr));
+	na = (ntfs_attr*)ntfs_pool_get(&ni->vol->attr_pool, sizeof(ntfs_attr));
 	if (!na)
 		goto out;
+	memset(na, 0, sizeof(ntfs_attr));
+	na->pool = &ni->vol->attr_pool;
 	if (name && name != AT_UNNAMED && name != NTFS_INDEX_I30) {
 		name = ntfs_ucsndup(name, name_len);
 		if (!name)
@@ -521,7 +523,7 @@ put_err_out:
 	ntfs_attr_put_search_ctx(ctx);
 err_out:
 	free(newname);
-	free(na);
+	ntfs_pool_put(na->pool, na);
 	na = NULL;
 	goto out;
 }
@@ -543,7 +545,10 @@ void ntfs_attr_close(ntfs_attr *na)
 	if (na->name != AT_UNNAMED && na->name != NTFS_INDEX_I30
 				&& na->name != STREAM_SDS)
 		free(na->name);
-	free(na);
+	if (na->pool)
+		ntfs_pool_put(na->pool, na);
+	else
+		free(na);
 }
 
 /**
@@ -2541,7 +2546,6 @@ s64 ntfs_attr_mst_pread(ntfs_attr *na, const s64 pos, const s64 bk_cnt,
 		const u32 bk_size, void *dst)
 {
 	s64 br;
-	u8 *end;
 	BOOL warn;
 
 	ntfs_log_trace("Entering for inode 0x%llx, attr type 0x%x, pos 0x%llx.\n",
@@ -2558,9 +2562,7 @@ s64 ntfs_attr_mst_pread(ntfs_attr *na, const s64 pos, const s64 bk_cnt,
 	br /= bk_size;
 		/* log errors unless silenced */
 	warn = !na->ni || !na->ni->vol || !NVolNoFixupWarn(na->ni->vol);
-	for (end = (u8*)dst + br * bk_size; (u8*)dst < end; dst = (u8*)dst +
-			bk_size)
-		ntfs_mst_post_read_fixup_warn((NTFS_RECORD*)dst, bk_size, warn);
+	ntfs_mst_post_read_fixups((NTFS_RECORD*)dst, bk_size, br, warn);
 	/* Finally, return the number of blocks read. */
 	return br;
 }
@@ -2609,20 +2611,13 @@ s64 ntfs_attr_mst_pwrite(ntfs_attr *na, const s64 pos, s64 bk_cnt,
 	}
 	if (!bk_cnt)
 		return 0;
-	/* Prepare data for writing. */
-	for (i = 0; i < bk_cnt; ++i) {
-		int err;
-
-		err = ntfs_mst_pre_write_fixup((NTFS_RECORD*)
-				((u8*)src + i * bk_size), bk_size);
-		if (err < 0) {
-			/* Abort write at this position. */
-			ntfs_log_perror("%s #1", __FUNCTION__);
-			if (!i)
-				return err;
-			bk_cnt = i;
-			break;
-		}
+	/* Prepare data for writing, aborting at a bad record. */
+	i = ntfs_mst_pre_write_fixups((NTFS_RECORD*)src, bk_size, bk_cnt);
+	if (i < bk_cnt) {
+		ntfs_log_perror("%s #1", __FUNCTION__);
+		if (i < 0)
+			return i;
+		bk_cnt = i;
 	}
 	/* Write the prepared data. */
 	written = ntfs_attr_pwrite(na, pos, bk_cnt * bk_size, src);
@@ -2631,9 +2626,7 @@ s64 ntfs_attr_mst_pwrite(ntfs_attr *na, const s64 pos, s64 bk_cnt,
 				(long long)written);
 	}
 	/* Quickly deprotect the data again. */
-	for (i = 0; i < bk_cnt; ++i)
-		ntfs_mst_post_write_fixup((NTFS_RECORD*)((u8*)src + i *
-				bk_size));
+	ntfs_mst_post_write_fixups((NTFS_RECORD*)src, bk_size, bk_cnt);
 	if (written <= 0)
 		return written;
 	/* Finally, return the number of complete blocks written. */
@@ -2934,7 +2927,7 @@ static int ntfs_external_attr_find(ATTR_TYPES type, const ntfschar *name,
 {
 	ntfs_inode *base_ni, *ni;
 	ntfs_volume *vol;
-	ATTR_LIST_ENTRY *al_entry, *next_al_entry;
+	ATTR_LIST_ENTRY *al_entry, *next_al_entry, *vcn_al_entry;
 	u8 *al_start, *al_end;
 	ATTR_RECORD *a;
 	ntfschar *al_name;
@@ -2977,6 +2970,15 @@ static int ntfs_external_attr_find(ATTR_TYPES type, const ntfschar *name,
 				le32_to_cpu(al_entry->type) >
 				le32_to_cpu(AT_ATTRIBUTE_LIST))
 			goto find_attr_list_attr;
+		/*
+		 * When searching from the beginning of a long attribute
+		 * list, skip to the first entry of the type searched for.
+		 */
+		if ((type != AT_UNUSED) && is_first_search) {
+			next_al_entry = ntfs_attrlist_index_type(base_ni, type);
+			if (next_al_entry)
+				al_entry = next_al_entry;
+		}
 	} else {
 		al_entry = (ATTR_LIST_ENTRY*)((char*)ctx->al_entry +
 				le16_to_cpu(ctx->al_entry->length));
@@ -3093,8 +3095,19 @@ find_attr_list_attr:
 		 * unnamed. Now check @lowest_vcn. Continue search if the
 		 * next attribute list entry still fits @lowest_vcn. Otherwise
 		 * we have reached the right one or the search has failed.
+		 * When the attribute list is indexed, the last entry which
+		 * fits is located directly.
 		 */
-		if (lowest_vcn && (u8*)next_al_entry >= al_start	    &&
+		vcn_al_entry = (lowest_vcn
+			? ntfs_attrlist_index_vcn(base_ni, al_entry, lowest_vcn)
+			: (ATTR_LIST_ENTRY*)NULL);
+		if (vcn_al_entry) {
+			al_entry = ctx->al_entry = vcn_al_entry;
+			next_al_entry = (ATTR_LIST_ENTRY*)((u8*)vcn_al_entry
+					+ le16_to_cpu(vcn_al_entry->length));
+			al_name = (ntfschar*)((u8*)al_entry
+					+ al_entry->name_offset);
+		} else if (lowest_vcn && (u8*)next_al_entry >= al_start	    &&
 				(u8*)next_al_entry + 6 < al_end	    &&
 				(u8*)next_al_entry + le16_to_cpu(
 					next_al_entry->length) <= al_end    &&
@@ -3456,7 +3469,16 @@ ntfs_attr_search_ctx *ntfs_attr_get_search_ctx(ntfs_inode *ni, MFT_RECORD *mrec)
 		ntfs_log_perror("NULL arguments");
 		return NULL;
 	}
-	ctx = ntfs_malloc(sizeof(ntfs_attr_search_ctx));
+	if (ni && ni->vol) {
+		ctx = (ntfs_attr_search_ctx*)ntfs_pool_get(&ni->vol->ctx_pool,
+					sizeof(ntfs_attr_search_ctx));
+		if (ctx)
+			ctx->pool = &ni->vol->ctx_pool;
+	} else {
+		ctx = ntfs_malloc(sizeof(ntfs_attr_search_ctx));
+		if (ctx)
+			ctx->pool = (struct NTFS_POOL*)NULL;
+	}
 	if (ctx)
 		ntfs_attr_init_search_ctx(ctx, ni, mrec);
 	return ctx;
@@ -3471,7 +3493,10 @@ ntfs_attr_search_ctx *ntfs_attr_get_search_ctx(ntfs_inode *ni, MFT_RECORD *mrec)
 void ntfs_attr_put_search_ctx(ntfs_attr_search_ctx *ctx)
 {
 	// NOTE: save errno if it could change and function stays void!
-	free(ctx);
+	if (ctx && ctx->pool)
+		ntfs_pool_put(ctx->pool, ctx);
+	else
+		free(ctx);
 }
 
 /**
@@ -4059,6 +4084,7 @@ int ntfs_attr_record_rm(ntfs_attr_search_ctx *ctx)
 	if (type == AT_ATTRIBUTE_LIST) {
 		if (NInoAttrList(base_ni) && base_ni->attr_list)
 			free(base_ni->attr_list);
+		ntfs_attrlist_index_free(base_ni);
 		base_ni->attr_list = NULL;
 		NInoClearAttrList(base_ni);
 		NInoAttrListClearDirty(base_ni);
@@ -36,6 +36,7 @@
 #include <errno.h>
 #endif
 
+#include "param.h"
 #include "types.h"
 #include "layout.h"
 #include "attrib.h"
@@ -45,6 +46,22 @@
 #include "logging.h"
 #include "misc.h"
 
+/*
+ *		Index of the entries in an attribute list
+ *
+ *	The entries are sorted by type, name and lowest vcn, so that
+ *	an array of their offsets can be searched by dichotomy. A list
+ *	which is not sorted this way gets an index with no entries, so
+ *	that it is searched linearly without being checked again.
+ */
+
+struct ATTRLIST_INDEX {
+	const u8 *attr_list;	/* the attribute list indexed */
+	u32 attr_list_size;
+	u32 count;		/* count of entries, zero if not indexed */
+	u32 offsets[1];		/* offsets of entries, actually count */
+} ;
+
 /**
  * ntfs_attrlist_need - check whether inode need attribute list
  * @ni:		opened ntfs inode for which perform check
@@ -219,6 +236,7 @@ int ntfs_attrlist_entry_add(ntfs_inode *ni, ATTR_RECORD *attr)
 
 	/* Set new runlist. */
 	free(ni->attr_list);
+	ntfs_attrlist_index_free(ni);
 	ni->attr_list = new_al;
 	ni->attr_list_size = ni->attr_list_size + entry_len;
 	NInoAttrListSetDirty(ni);
@@ -299,6 +317,7 @@ int ntfs_attrlist_entry_rm(ntfs_attr_search_ctx *ctx)
 
 	/* Set new runlist. */
 	free(base_ni->attr_list);
+	ntfs_attrlist_index_free(base_ni);
 	base_ni->attr_list = new_al;
 	base_ni->attr_list_size = new_al_len;
 	NInoAttrListSetDirty(base_ni);
@@ -312,3 +331,213 @@ err_out:
 	errno = err;
 	return -1;
 }
+
+/**
+ * ntfs_attrlist_index_free - forget the index of an attribute list
+ * @ni:		base inode of the attribute list
+ *
+ * To be called whenever entries are inserted into or removed from the
+ * attribute list of @ni, or the attribute list is replaced.
+ */
+void ntfs_attrlist_index_free(ntfs_inode *ni)
+{
+	if (ni->attr_index) {
+		free(ni->attr_index);
+		ni->attr_index = (struct ATTRLIST_INDEX*)NULL;
+	}
+}
+
+static BOOL ntfs_attrlist_same_attr(const ATTR_LIST_ENTRY *a,
+			const ATTR_LIST_ENTRY *b)
+{
+	return ((a->type == b->type)
+		&& (a->name_length == b->name_length)
+		&& !memcmp((const u8*)a + a->name_offset,
+			(const u8*)b + b->name_offset, 2*a->name_length));
+}
+
+/*
+ *		Check the order of the entries of an attribute list
+ *
+ *	The types must not decrease, the entries of an attribute
+ *	(same type and name) must be contiguous, and their lowest
+ *	vcns must increase.
+ */
+
+static BOOL ntfs_attrlist_sorted(const u8 *attr_list, const u32 *offsets,
+			u32 count)
+{
+	const ATTR_LIST_ENTRY *ale;
+	const ATTR_LIST_ENTRY *prev;
+	const ATTR_LIST_ENTRY *other;
+	u32 type_start;
+	u32 i, j;
+
+	type_start = 0;
+	for (i=1; i<count; i++) {
+		ale = (const ATTR_LIST_ENTRY*)(attr_list + offsets[i]);
+		prev = (const ATTR_LIST_ENTRY*)(attr_list + offsets[i - 1]);
+		if (le32_to_cpu(ale->type) < le32_to_cpu(prev->type))
+			return (FALSE);
+		if (ale->type != prev->type)
+			type_start = i;
+		else if (ntfs_attrlist_same_attr(ale, prev)) {
+			if (sle64_to_cpu(ale->lowest_vcn)
+					<= sle64_to_cpu(prev->lowest_vcn))
+				return (FALSE);
+		} else {
+				/* a new attribute must not have been met */
+			for (j=type_start; j<i; j++) {
+				other = (const ATTR_LIST_ENTRY*)(attr_list
+							+ offsets[j]);
+				if (ntfs_attrlist_same_attr(ale, other))
+					return (FALSE);
+			}
+		}
+	}
+	return (TRUE);
+}
+
+/*
+ *		Get the index of an attribute list, building it if needed
+ *
+ *	Returns NULL if the list is too short to be worth an index,
+ *		or not sorted as expected (the linear search is then used),
+ *		or memory could not be allocated
+ */
+
+static struct ATTRLIST_INDEX *ntfs_attrlist_index(ntfs_inode *ni)
+{
+	struct ATTRLIST_INDEX *index;
+	const ATTR_LIST_ENTRY *ale;
+	const u8 *p;
+	const u8 *end;
+	u32 count;
+
+	index = ni->attr_index;
+	if (!index
+	    || (index->attr_list != ni->attr_list)
+	    || (index->attr_list_size != ni->attr_list_size)) {
+		ntfs_attrlist_index_free(ni);
+		if (!ni->attr_list || (ni->attr_list_size
+			    < ATTRLIST_INDEX_MIN*offsetof(ATTR_LIST_ENTRY, name)))
+			return ((struct ATTRLIST_INDEX*)NULL);
+		/* count the entries, checking they are consistent */
+		count = 0;
+		p = ni->attr_list;
+		end = p + ni->attr_list_size;
+		while (p < end) {
+			ale = (const ATTR_LIST_ENTRY*)p;
+			if (((p + offsetof(ATTR_LIST_ENTRY, name)) > end)
+			    || !ale->length
+			    || ((p + le16_to_cpu(ale->length)) > end)
+			    || ((ale->name_offset + 2*ale->name_length)
+					> le16_to_cpu(ale->length)))
+				return ((struct ATTRLIST_INDEX*)NULL);
+			count++;
+			p += le16_to_cpu(ale->length);
+		}
+		index = (struct ATTRLIST_INDEX*)ntfs_malloc(
+			sizeof(struct ATTRLIST_INDEX) + count*sizeof(u32));
+		if (!index)
+			return ((struct ATTRLIST_INDEX*)NULL);
+		index->attr_list = ni->attr_list;
+		index->attr_list_size = ni->attr_list_size;
+		count = 0;
+		for (p=ni->attr_list; p<end;
+			    p+=le16_to_cpu(((const ATTR_LIST_ENTRY*)p)->length))
+			index->offsets[count++] = p - ni->attr_list;
+		if (!ntfs_attrlist_sorted(ni->attr_list, index->offsets,
+				count)) {
+			ntfs_log_debug("Attribute list of inode %lld not "
+				"sorted, not indexed\n", (long long)ni->mft_no);
+			count = 0;
+		}
+		index->count = count;
+		ni->attr_index = index;
+	}
+	return (index->count ? index : (struct ATTRLIST_INDEX*)NULL);
+}
+
+/**
+ * ntfs_attrlist_index_type - locate the first entry for a type
+ * @ni:		base inode of the attribute list
+ * @type:	attribute type to locate
+ *
+ * Returns the first entry of the attribute list of @ni whose type is not
+ * lower than @type, or the end of the attribute list if there is none,
+ * or NULL if the list is not indexed (it has then to be searched linearly).
+ */
+ATTR_LIST_ENTRY *ntfs_attrlist_index_type(ntfs_inode *ni, ATTR_TYPES type)
+{
+	struct ATTRLIST_INDEX *index;
+	const ATTR_LIST_ENTRY *ale;
+	u32 lo, hi, mid;
+
+	index = ntfs_attrlist_index(ni);
+	if (!index)
+		return ((ATTR_LIST_ENTRY*)NULL);
+	lo = 0;
+	hi = index->count;
+	while (lo < hi) {
+		mid = (lo + hi) >> 1;
+		ale = (const ATTR_LIST_ENTRY*)(ni->attr_list
+					+ index->offsets[mid]);
+		if (le32_to_cpu(ale->type) < le32_to_cpu(type))
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	if (lo == index->count)
+		return ((ATTR_LIST_ENTRY*)(ni->attr_list + ni->attr_list_size));
+	return ((ATTR_LIST_ENTRY*)(ni->attr_list + index->offsets[lo]));
+}
+
+/**
+ * ntfs_attrlist_index_vcn - locate the entry of an extent of an attribute
+ * @ni:		base inode of the attribute list
+ * @ale:	first entry of the attribute in the attribute list
+ * @vcn:	vcn to locate
+ *
+ * Returns the last entry for the same attribute as @ale (which is assumed
+ * to be the first one) whose lowest vcn is not greater than @vcn, or @ale
+ * if there is none, or NULL if the list is not indexed.
+ */
+ATTR_LIST_ENTRY *ntfs_attrlist_index_vcn(ntfs_inode *ni, ATTR_LIST_ENTRY *ale,
+			VCN vcn)
+{
+	struct ATTRLIST_INDEX *index;
+	const ATTR_LIST_ENTRY *probe;
+	u32 offset;
+	u32 lo, hi, mid;
+
+	index = ntfs_attrlist_index(ni);
+	if (!index)
+		return ((ATTR_LIST_ENTRY*)NULL);
+		/* get the rank of @ale */
+	offset = (u8*)ale - ni->attr_list;
+	lo = 0;
+	hi = index->count;
+	while (lo < hi) {
+		mid = (lo + hi) >> 1;
+		if (index->offsets[mid] < offset)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	if ((lo == index->count) || (index->offsets[lo] != offset))
+		return ((ATTR_LIST_ENTRY*)NULL);
+		/* the entries of the attribute follow with increasing vcns */
+	hi = index->count;
+	while ((hi - lo) > 1) {
+		mid = (lo + hi) >> 1;
+		probe = (const ATTR_LIST_ENTRY*)(ni->attr_list
+					+ index->offsets[mid]);
+		if (ntfs_attrlist_same_attr(probe, ale)
+		    && (sle64_to_cpu(probe->lowest_vcn) <= vcn))
+			lo = mid;
+		else
+			hi = mid;
+	}
+	return ((ATTR_LIST_ENTRY*)(ni->attr_list + index->offsets[lo]));
+}
@@ -33,6 +33,7 @@
 #include "types.h"
 #include "security.h"
 #include "cache.h"
+#include "mft.h"
 #include "misc.h"
 #include "logging.h"
 
@@ -574,7 +575,7 @@ void ntfs_create_lru_caches(ntfs_volume *vol)
 	vol->lookup_cache = ntfs_create_cache("lookup",
 		(cache_free)NULL, ntfs_dir_lookup_hash,
 		sizeof(struct CACHED_LOOKUP),
-		CACHE_LOOKUP_SIZE, 2*CACHE_LOOKUP_SIZE);
+		CACHE_LOOKUP_SIZE, CACHE_LOOKUP_HASH);
 #endif
 	vol->securid_cache = ntfs_create_cache("securid",(cache_free)NULL,
 		(cache_hash)NULL,sizeof(struct CACHED_SECURID), CACHE_SECURID_SIZE, 0);
@@ -584,6 +585,101 @@ void ntfs_create_lru_caches(ntfs_volume *vol)
 #endif
 }
 
+/*
+ *		Change the number of entries in the lookup cache
+ *
+ *	The current entries are dropped, and a count of zero disables
+ *	the cache.
+ *	Returns 0 if successful, -1 if the count is not valid or the
+ *	cache could not be allocated (then there is no lookup cache).
+ */
+
+int ntfs_set_lookup_cache_size(ntfs_volume *vol, int count)
+{
+	int res;
+
+	res = -1;
+#if CACHE_LOOKUP_SIZE
+	if (vol && (!count || ((count >= 3) && (count <= CACHE_LOOKUP_MAX)))) {
+		ntfs_free_cache(vol->lookup_cache);
+		vol->lookup_cache = (struct CACHE_HEADER*)NULL;
+		res = 0;
+		if (count) {
+			vol->lookup_cache = ntfs_create_cache("lookup",
+				(cache_free)NULL, ntfs_dir_lookup_hash,
+				sizeof(struct CACHED_LOOKUP),
+				count, CACHE_LOOKUP_HASH);
+			if (!vol->lookup_cache)
+				res = -1;
+		}
+	}
+#else
+	if (vol && !count)
+		res = 0;
+#endif
+	if (res)
+		ntfs_log_error("Failed to set the lookup cache size to %d\n",
+				count);
+	return (res);
+}
+
+/*
+ *		Set the number of mft records kept in the mft record cache
+ *
+ *	The mft record cache is not created at mount time, as it is only
+ *	useful to long running processes, and its size matters on small
+ *	devices. The records are stored in a single block, so a negative
+ *	count means a default count depending on the record size. The
+ *	current records are dropped, and a count of zero disables the
+ *	cache.
+ *	Returns 0 if successful, -1 if the count is not valid or the
+ *	cache could not be allocated (then there is no mft record cache).
+ */
+
+int ntfs_set_mftrec_cache_size(ntfs_volume *vol, int count)
+{
+	int res;
+
+	res = -1;
+#if CACHE_MFTREC_SIZE
+	if (vol && (count < 0)) {
+		count = CACHE_MFTREC_BUDGET >> vol->mft_record_size_bits;
+		if (count > CACHE_MFTREC_SIZE)
+			count = CACHE_MFTREC_SIZE;
+		if (count < 3)
+			count = 0;
+	}
+	if (vol && (!count || ((count >= 3) && (count <= CACHE_MFTREC_MAX)))) {
+		ntfs_free_cache(vol->mftrec_cache);
+		vol->mftrec_cache = (struct CACHE_HEADER*)NULL;
+		free(vol->mftrec_data);
+		vol->mftrec_data = (void*)NULL;
+		res = 0;
+		if (count) {
+			vol->mftrec_data = ntfs_malloc((size_t)count
+					<< vol->mft_record_size_bits);
+			if (vol->mftrec_data)
+				vol->mftrec_cache = ntfs_create_cache("mftrec",
+					(cache_free)NULL, ntfs_mft_record_hash,
+					sizeof(struct CACHED_MFTREC),
+					count, 2*CACHE_MFTREC_SIZE);
+			if (!vol->mftrec_cache) {
+				free(vol->mftrec_data);
+				vol->mftrec_data = (void*)NULL;
+				res = -1;
+			}
+		}
+	}
+#else
+	if (vol && (count <= 0))
+		res = 0;
+#endif
+	if (res)
+		ntfs_log_error("Failed to set the mft record cache size to %d\n",
+				count);
+	return (res);
+}
+
 /*
  *		Free all LRU caches
  */
@@ -603,4 +699,8 @@ void ntfs_free_lru_caches(ntfs_volume *vol)
 #if CACHE_LEGACY_SIZE
 	ntfs_free_cache(vol->legacy_cache);
 #endif
+#if CACHE_MFTREC_SIZE
+	ntfs_free_cache(vol->mftrec_cache);
+	free(vol->mftrec_data);
+#endif
 }
@@ -329,7 +329,7 @@ out:
 s64 ntfs_mst_pread(struct ntfs_device *dev, const s64 pos, s64 count,
 		const u32 bksize, void *b)
 {
-	s64 br, i;
+	s64 br;
 
 	if (bksize & (bksize - 1) || bksize % NTFS_BLOCK_SIZE) {
 		errno = EINVAL;
@@ -346,9 +346,7 @@ s64 ntfs_mst_pread(struct ntfs_device *dev, const s64 pos, s64 count,
 	 * magic will be detected later on.
 	 */
 	count = br / bksize;
-	for (i = 0; i < count; ++i)
-		ntfs_mst_post_read_fixup((NTFS_RECORD*)
-				((u8*)b + i * bksize), bksize);
+	ntfs_mst_post_read_fixups((NTFS_RECORD*)b, bksize, count, TRUE);
 	/* Finally, return the number of complete blocks read. */
 	return count;
 }
@@ -386,7 +384,7 @@ s64 ntfs_mst_pread(struct ntfs_device *dev, const s64 pos, s64 count,
 s64 ntfs_mst_pwrite(struct ntfs_device *dev, const s64 pos, s64 count,
 		const u32 bksize, void *b)
 {
-	s64 written, i;
+	s64 written;
 
 	if (count < 0 || bksize % NTFS_BLOCK_SIZE) {
 		errno = EINVAL;
@@ -394,25 +392,14 @@ s64 ntfs_mst_pwrite(struct ntfs_device *dev, const s64 pos, s64 count,
 	}
 	if (!count)
 		return 0;
-	/* Prepare data for writing. */
-	for (i = 0; i < count; ++i) {
-		int err;
-
-		err = ntfs_mst_pre_write_fixup((NTFS_RECORD*)
-				((u8*)b + i * bksize), bksize);
-		if (err < 0) {
-			/* Abort write at this position. */
-			if (!i)
-				return err;
-			count = i;
-			break;
-		}
-	}
+	/* Prepare data for writing, aborting at a bad record. */
+	count = ntfs_mst_pre_write_fixups((NTFS_RECORD*)b, bksize, count);
+	if (count < 0)
+		return count;
 	/* Write the prepared data. */
 	written = ntfs_pwrite(dev, pos, count * bksize, b);
 	/* Quickly deprotect the data again. */
-	for (i = 0; i < count; ++i)
-		ntfs_mst_post_write_fixup((NTFS_RECORD*)((u8*)b + i * bksize));
+	ntfs_mst_post_write_fixups((NTFS_RECORD*)b, bksize, count);
 	if (written <= 0)
 		return written;
 	/* Finally, return the number of complete blocks written. */
@@ -196,27 +196,485 @@ static int lookup_cache_inv_compare(const struct CACHED_GENERIC *cached,
 /*
  *		Lookup hashing
  *
- *	Based on first, second and and last char
+ *	Based on the parent directory and the whole name, as names
+ *	in the same directory often only differ by a few chars
  */
 
 int ntfs_dir_lookup_hash(const struct CACHED_GENERIC *cached)
 {
+	const struct CACHED_LOOKUP *c = (const struct CACHED_LOOKUP*) cached;
 	const unsigned char *name;
 	int count;
-	unsigned int val;
+	int i;
+	u32 val;
 
-	name = (const unsigned char*)cached->variable;
-	count = cached->varsize;
+	name = (const unsigned char*)c->name;
+	count = c->namesize;
 	if (!name || !count) {
 		ntfs_log_error("Bad lookup cache entry\n");
 		return (-1);
 	}
-	val = (name[0] << 2) + (name[1] << 1) + name[count - 1] + count;
-	return (val % (2*CACHE_LOOKUP_SIZE));
+	val = 2166136261U ^ (u32)c->parent;
+	for (i=0; i<count; i++) {
+		val ^= name[i];
+		val *= 16777619U;
+	}
+	return (val % CACHE_LOOKUP_HASH);
 }
 
 #endif
 
+/*
+ *		Hashed directories
+ *
+ *	Searching a name in a big directory requires reading and
+ *	deprotecting several index blocks. When a directory whose
+ *	index allocation is at least DIR_HASH_MIN_SIZE bytes has been
+ *	searched DIR_HASH_HOT times, all its names are hashed in memory
+ *	(upcased, so that case insensitive searches are possible), and
+ *	further searches do not walk the B+tree any more.
+ *
+ *	The hash table is attached to the inode of the directory, and
+ *	it is updated when entries are inserted into or removed from
+ *	the index, or dropped on any inconsistency. The memory used by
+ *	the hash tables of a volume is limited to DIR_HASH_BUDGET.
+ *	When a directory cannot be hashed, it is not tried again until
+ *	its index allocation has grown, or its inode has been released.
+ */
+
+struct DIR_HASH_ENTRY {
+	struct DIR_HASH_ENTRY *next;
+	MFT_REF mref;
+	u32 hash;
+	u8 name_len;
+	ntfschar name[1];	/* actually name_len characters */
+} ;
+
+struct DIR_HASH {
+	struct DIR_HASH_ENTRY **heads;
+	u32 mask;		/* count of heads minus one */
+	u32 count;		/* count of names */
+	s64 bytes;		/* memory used by the table and names */
+} ;
+
+#define DIR_HASH_HEADS 1024	/* initial count of heads */
+#define DIR_HASH_NEVER ((u32)-1) /* dir_lookups when not to be hashed */
+
+static u32 ntfs_dir_hash_name(const ntfschar *upname, int len)
+{
+	u32 h;
+	int i;
+
+	h = 2166136261U;
+	for (i=0; i<len; i++) {
+		h ^= le16_to_cpu(upname[i]);
+		h *= 16777619U;
+	}
+	return (h);
+}
+
+/*
+ *		Free the hash table of a directory, if any
+ */
+
+void ntfs_dir_hash_free(ntfs_inode *ni)
+{
+	struct DIR_HASH *dh;
+	struct DIR_HASH_ENTRY *e;
+	struct DIR_HASH_ENTRY *next;
+	u32 i;
+
+	dh = ni->dir_hash;
+	if (dh) {
+		for (i=0; i<=dh->mask; i++)
+			for (e=dh->heads[i]; e; e=next) {
+				next = e->next;
+				free(e);
+			}
+		free(dh->heads);
+		if (ni->vol)
+			ni->vol->dir_hash_bytes -= dh->bytes;
+		free(dh);
+		ni->dir_hash = (struct DIR_HASH*)NULL;
+	}
+}
+
+/*
+ *		Double the count of heads when there are too many names
+ */
+
+static void ntfs_dir_hash_grow(ntfs_volume *vol, struct DIR_HASH *dh)
+{
+	struct DIR_HASH_ENTRY **heads;
+	struct DIR_HASH_ENTRY *e;
+	struct DIR_HASH_ENTRY *next;
+	u32 newmask;
+	u32 i;
+
+	newmask = 2*dh->mask + 1;
+	if ((vol->dir_hash_bytes + (s64)(dh->mask + 1)*sizeof(*heads))
+			> DIR_HASH_BUDGET)
+		return;
+	heads = (struct DIR_HASH_ENTRY**)ntfs_calloc((newmask + 1)
+					*sizeof(*heads));
+	if (heads) {
+		for (i=0; i<=dh->mask; i++)
+			for (e=dh->heads[i]; e; e=next) {
+				next = e->next;
+				e->next = heads[e->hash & newmask];
+				heads[e->hash & newmask] = e;
+			}
+		free(dh->heads);
+		dh->heads = heads;
+		vol->dir_hash_bytes += (s64)(dh->mask + 1)*sizeof(*heads);
+		dh->bytes += (s64)(dh->mask + 1)*sizeof(*heads);
+		dh->mask = newmask;
+	}
+}
+
+/*
+ *		Insert a name into a hash table
+ *
+ *	Returns 0 if successful, or -1 if no memory, or the budget
+ *	would be exceeded.
+ */
+
+static int ntfs_dir_hash_insert(ntfs_volume *vol, struct DIR_HASH *dh,
+			const FILE_NAME_ATTR *fn, MFT_REF mref)
+{
+	struct DIR_HASH_ENTRY *e;
+	ntfschar upname[NTFS_MAX_NAME_LEN];
+	const ntfschar *name;
+	size_t size;
+	int len;
+
+	name = ntfs_fn_name(fn);
+	len = fn->file_name_length;
+
+	size = offsetof(struct DIR_HASH_ENTRY, name) + len*sizeof(ntfschar);
+	if ((len > NTFS_MAX_NAME_LEN)
+	    || ((vol->dir_hash_bytes + (s64)size) > DIR_HASH_BUDGET))
+		return (-1);
+	e = (struct DIR_HASH_ENTRY*)ntfs_malloc(size);
+	if (!e)
+		return (-1);
+	memcpy(upname, name, len*sizeof(ntfschar));
+	ntfs_name_upcase(upname, len, vol->upcase, vol->upcase_len);
+	e->hash = ntfs_dir_hash_name(upname, len);
+	e->mref = mref;
+	e->name_len = len;
+	memcpy(e->name, name, len*sizeof(ntfschar));
+	e->next = dh->heads[e->hash & dh->mask];
+	dh->heads[e->hash & dh->mask] = e;
+	dh->count++;
+	dh->bytes += size;
+	vol->dir_hash_bytes += size;
+	if (dh->count > 2*(dh->mask + 1))
+		ntfs_dir_hash_grow(vol, dh);
+	return (0);
+}
+
+/*
+ *		Hash the names found in a list of index entries
+ *
+ *	Returns 0 if successful, or -1 if the entries are not consistent
+ *	or could not be inserted.
+ */
+
+static int ntfs_dir_hash_entries(ntfs_volume *vol, struct DIR_HASH *dh,
+			INDEX_HEADER *ih, u8 *limit)
+{
+	INDEX_ENTRY *ie;
+	u8 *index_end;
+	FILE_NAME_ATTR *fn;
+
+	index_end = (u8*)ih + le32_to_cpu(ih->index_length);
+	ie = (INDEX_ENTRY*)((u8*)ih + le32_to_cpu(ih->entries_offset));
+	if ((index_end > limit) || ((u8*)ie >= index_end))
+		return (-1);
+	while (!(ie->ie_flags & INDEX_ENTRY_END)) {
+		if (((u8*)ie + sizeof(INDEX_ENTRY_HEADER) > index_end)
+		    || !le16_to_cpu(ie->length)
+		    || ((u8*)ie + le16_to_cpu(ie->length) > index_end)
+		    || (le16_to_cpu(ie->key_length)
+				< offsetof(FILE_NAME_ATTR, file_name)))
+			return (-1);
+		fn = &ie->key.file_name;
+		if ((offsetof(FILE_NAME_ATTR, file_name)
+				+ fn->file_name_length*sizeof(ntfschar))
+			> le16_to_cpu(ie->key_length))
+			return (-1);
+		if (ntfs_dir_hash_insert(vol, dh, fn,
+				le64_to_cpu(ie->indexed_file)))
+			return (-1);
+		ie = (INDEX_ENTRY*)((u8*)ie + le16_to_cpu(ie->length));
+		if ((u8*)ie + sizeof(INDEX_ENTRY_HEADER) > index_end)
+			return (-1);
+	}
+	return (0);
+}
+
+/*
+ *		Hash the names in the index blocks in use
+ *
+ *	The index blocks are read in allocation order, not in
+ *	collation order, for reading the index sequentially.
+ *
+ *	Returns 0 if successful, or -1 if there was an error.
+ */
+
+static int ntfs_dir_hash_blocks(ntfs_inode *dir_ni, struct DIR_HASH *dh,
+			ntfs_attr *ia_na, u32 block_size)
+{
+	ntfs_volume *vol;
+	u8 *bmp;
+	u8 *buf;
+	INDEX_BLOCK *ib;
+	s64 bmp_size;
+	s64 blocks;
+	s64 first;
+	s64 count;
+	s64 br;
+	s64 i;
+	int err;
+
+	vol = dir_ni->vol;
+	err = -1;
+	bmp = (u8*)ntfs_attr_readall(dir_ni, AT_BITMAP, NTFS_INDEX_I30, 4,
+				&bmp_size);
+	buf = (u8*)ntfs_malloc(DIR_HASH_READ);
+	if (bmp && buf && (block_size <= DIR_HASH_READ)) {
+		blocks = ia_na->data_size/block_size;
+		if (blocks > (bmp_size << 3))
+			blocks = bmp_size << 3;
+		err = 0;
+		first = 0;
+		while (!err && (first < blocks)) {
+			/* skip the blocks not in use */
+			if (!(bmp[first >> 3] & (1 << (first & 7)))) {
+				first++;
+				continue;
+			}
+			/* read the following blocks in use together */
+			count = 1;
+			while (((first + count) < blocks)
+			    && ((count + 1)*block_size <= DIR_HASH_READ)
+			    && (bmp[(first + count) >> 3]
+					& (1 << ((first + count) & 7))))
+				count++;
+			br = ntfs_attr_mst_pread(ia_na, first*block_size,
+					count, block_size, buf);
+			if (br != count)
+				err = -1;
+			for (i=0; !err && (i<count); i++) {
+				ib = (INDEX_BLOCK*)&buf[i*block_size];
+				if (!ntfs_is_indx_record(ib->magic)
+				    || (sle64_to_cpu(ib->index_block_vcn)
+					!= (((first + i)*block_size)
+					    >> (vol->cluster_size <= block_size
+						? vol->cluster_size_bits
+						: NTFS_BLOCK_SIZE_BITS)))
+				    || ntfs_dir_hash_entries(vol, dh,
+						&ib->index,
+						(u8*)ib + block_size))
+					err = -1;
+			}
+			first += count;
+		}
+	}
+	free(buf);
+	free(bmp);
+	return (err);
+}
+
+/*
+ *		Build the hash table of a directory
+ *
+ *	Returns the hash table, or NULL if the directory is too small,
+ *	the budget is exhausted or the index could not be read.
+ */
+
+static struct DIR_HASH *ntfs_dir_hash_build(ntfs_inode *dir_ni)
+{
+	ntfs_volume *vol;
+	ntfs_attr_search_ctx *ctx;
+	ntfs_attr *ia_na;
+	struct DIR_HASH *dh;
+	INDEX_ROOT *ir;
+	u32 block_size;
+	int err;
+
+	vol = dir_ni->vol;
+	dh = (struct DIR_HASH*)NULL;
+	ia_na = ntfs_attr_open(dir_ni, AT_INDEX_ALLOCATION, NTFS_INDEX_I30, 4);
+	if (!ia_na)
+		return (dh);
+		/*
+		 * A hash entry is about half the size of an index
+		 * entry, do not try when obviously over budget.
+		 */
+	if ((ia_na->data_size < DIR_HASH_MIN_SIZE)
+	    || ((vol->dir_hash_bytes + ia_na->data_size/2)
+			> DIR_HASH_BUDGET)) {
+		ntfs_attr_close(ia_na);
+		return (dh);
+	}
+	ctx = ntfs_attr_get_search_ctx(dir_ni, NULL);
+	if (ctx && !ntfs_attr_lookup(AT_INDEX_ROOT, NTFS_INDEX_I30, 4,
+				CASE_SENSITIVE, 0, NULL, 0, ctx)) {
+		dh = (struct DIR_HASH*)ntfs_malloc(sizeof(struct DIR_HASH));
+		if (dh) {
+			dh->mask = DIR_HASH_HEADS - 1;
+			dh->count = 0;
+			dh->bytes = sizeof(struct DIR_HASH)
+				+ DIR_HASH_HEADS*sizeof(struct DIR_HASH_ENTRY*);
+			dh->heads = (struct DIR_HASH_ENTRY**)ntfs_calloc(
+				DIR_HASH_HEADS*sizeof(struct DIR_HASH_ENTRY*));
+			if (dh->heads) {
+				vol->dir_hash_bytes += dh->bytes;
+				dir_ni->dir_hash = dh;
+				ir = (INDEX_ROOT*)((u8*)ctx->attr
+					+ le16_to_cpu(ctx->attr->value_offset));
+				block_size = le32_to_cpu(ir->index_block_size);
+				err = ntfs_dir_hash_entries(vol, dh,
+					&ir->index, (u8*)ctx->attr
+					+ le32_to_cpu(ctx->attr->length));
+				if (!err)
+					err = ntfs_dir_hash_blocks(dir_ni, dh,
+						ia_na, block_size);
+				if (err) {
+					ntfs_log_debug("Could not hash"
+						" directory %lld\n",
+						(long long)dir_ni->mft_no);
+					ntfs_dir_hash_free(dir_ni);
+					dh = (struct DIR_HASH*)NULL;
+				}
+			} else {
+				free(dh);
+				dh = (struct DIR_HASH*)NULL;
+			}
+		}
+	}
+	if (ctx)
+		ntfs_attr_put_search_ctx(ctx);
+	ntfs_attr_close(ia_na);
+	return (dh);
+}
+
+/*
+ *		Search a name in the hash table of a directory
+ *
+ *	The names are assumed to be valid, and the search yields
+ *	the same result as searching in the index : an exact match,
+ *	or a case insensitive match if the search is not case
+ *	sensitive and there is no exact match.
+ *
+ *	Returns the mft reference, or zero if there is no such name
+ */
+
+static u64 ntfs_dir_hash_search(ntfs_inode *dir_ni,
+			const ntfschar *uname, const ntfschar *upname,
+			int uname_len, IGNORE_CASE_BOOL case_sensitivity)
+{
+	ntfs_volume *vol;
+	const struct DIR_HASH_ENTRY *e;
+	u64 mref;
+	u32 h;
+
+	vol = dir_ni->vol;
+	mref = 0;
+	h = ntfs_dir_hash_name(upname, uname_len);
+	for (e=dir_ni->dir_hash->heads[h & dir_ni->dir_hash->mask];
+			e; e=e->next) {
+		if ((e->hash == h) && (e->name_len == uname_len)) {
+			if (!memcmp(e->name, uname,
+					uname_len*sizeof(ntfschar)))
+				return (e->mref);
+			if ((case_sensitivity == IGNORE_CASE)
+			    && !mref
+			    && !ntfs_names_full_collate_upcased(uname,
+					upname, uname_len,
+					e->name, e->name_len, IGNORE_CASE,
+					vol->upcase, vol->upcase_len))
+				mref = e->mref;
+		}
+	}
+	return (mref);
+}
+
+/*
+ *		Allow hashing again a directory whose index allocation grew
+ *
+ *	The hash table could not be built for the former size, the
+ *	directory may now be big enough or the failure may be cured.
+ */
+
+void ntfs_dir_hash_resized(ntfs_inode *dir_ni)
+{
+	if (dir_ni->dir_lookups == DIR_HASH_NEVER)
+		dir_ni->dir_lookups = 0;
+}
+
+/*
+ *		Insert a new name into the hash table of a directory
+ *
+ *	To be called after the name has been inserted into the index.
+ *	The hash table is dropped if the name cannot be inserted.
+ */
+
+void ntfs_dir_hash_add(ntfs_inode *dir_ni, const FILE_NAME_ATTR *fn,
+			MFT_REF mref)
+{
+	if (dir_ni->dir_hash
+	    && ntfs_dir_hash_insert(dir_ni->vol, dir_ni->dir_hash,
+				fn, mref))
+		ntfs_dir_hash_free(dir_ni);
+}
+
+/*
+ *		Remove a name from the hash table of a directory
+ *
+ *	To be called after the name has been removed from the index.
+ *	The hash table is dropped if the name is not found.
+ */
+
+void ntfs_dir_hash_remove(ntfs_inode *dir_ni, const FILE_NAME_ATTR *fn)
+{
+	struct DIR_HASH *dh;
+	struct DIR_HASH_ENTRY *e;
+	struct DIR_HASH_ENTRY **pe;
+	ntfschar upname[NTFS_MAX_NAME_LEN];
+	int len;
+	u32 h;
+
+	dh = dir_ni->dir_hash;
+	if (dh) {
+		len = fn->file_name_length;
+		memcpy(upname, fn->file_name, len*sizeof(ntfschar));
+		ntfs_name_upcase(upname, len, dir_ni->vol->upcase,
+					dir_ni->vol->upcase_len);
+		h = ntfs_dir_hash_name(upname, len);
+		pe = &dh->heads[h & dh->mask];
+		while (*pe && (((*pe)->hash != h)
+			    || ((*pe)->name_len != len)
+			    || memcmp((*pe)->name, fn->file_name,
+					len*sizeof(ntfschar))))
+			pe = &(*pe)->next;
+		e = *pe;
+		if (e) {
+			*pe = e->next;
+			dh->count--;
+			dh->bytes -= offsetof(struct DIR_HASH_ENTRY, name)
+					+ len*sizeof(ntfschar);
+			dir_ni->vol->dir_hash_bytes -=
+					offsetof(struct DIR_HASH_ENTRY, name)
+					+ len*sizeof(ntfschar);
+			free(e);
+		} else
+			ntfs_dir_hash_free(dir_ni);
+	}
+}
+
 /**
  * ntfs_inode_lookup_by_name - find an inode in a directory given its name
  * @dir_ni:	ntfs inode of the directory in which to search for the name
@@ -259,6 +717,7 @@ u64 ntfs_inode_lookup_by_name(ntfs_inode *dir_ni,
 	int eo, rc;
 	u32 index_block_size;
 	u8 index_vcn_size_bits;
+	ntfschar upname[NTFS_MAX_NAME_LEN];
 
 	ntfs_log_trace("Entering\n");
 
@@ -266,6 +725,34 @@ u64 ntfs_inode_lookup_by_name(ntfs_inode *dir_ni,
 		errno = EINVAL;
 		return -1;
 	}
+		/* No name can be longer than NTFS_MAX_NAME_LEN */
+	if (uname_len > NTFS_MAX_NAME_LEN) {
+		errno = ENOENT;
+		return -1;
+	}
+		/* Upcase once the name to collate against all the entries */
+	memcpy(upname, uname, uname_len*sizeof(ntfschar));
+	ntfs_name_upcase(upname, uname_len, vol->upcase, vol->upcase_len);
+		/* Use the hash table of a big directory searched often */
+	if (!dir_ni->dir_hash
+	    && (dir_ni->dir_lookups != DIR_HASH_NEVER)
+	    && (++dir_ni->dir_lookups >= DIR_HASH_HOT)) {
+			/* do not read the whole index again after a failure */
+		if (ntfs_dir_hash_build(dir_ni))
+			dir_ni->dir_lookups = 0;
+		else
+			dir_ni->dir_lookups = DIR_HASH_NEVER;
+	}
+	if (dir_ni->dir_hash) {
+		mref = ntfs_dir_hash_search(dir_ni, uname, upname, uname_len,
+				NVolCaseSensitive(vol)
+					? CASE_SENSITIVE : IGNORE_CASE);
+		if (!mref) {
+			errno = ENOENT;
+			return -1;
+		}
+		return mref;
+	}
 
 	ctx = ntfs_attr_get_search_ctx(dir_ni, NULL);
 	if (!ctx)
@@ -323,7 +810,7 @@ u64 ntfs_inode_lookup_by_name(ntfs_inode *dir_ni,
 		 * Not a perfect match, need to do full blown collation so we
 		 * know which way in the B+tree we have to go.
 		 */
-		rc = ntfs_names_full_collate(uname, uname_len,
+		rc = ntfs_names_full_collate_upcased(uname, upname, uname_len,
 				(ntfschar*)&ie->key.file_name.file_name,
 				ie->key.file_name.file_name_length,
 				case_sensitivity, vol->upcase, vol->upcase_len);
@@ -463,7 +950,7 @@ descend_into_child_node:
 		 * Not a perfect match, need to do full blown collation so we
 		 * know which way in the B+tree we have to go.
 		 */
-		rc = ntfs_names_full_collate(uname, uname_len,
+		rc = ntfs_names_full_collate_upcased(uname, upname, uname_len,
 				(ntfschar*)&ie->key.file_name.file_name,
 				ie->key.file_name.file_name_length,
 				case_sensitivity, vol->upcase, vol->upcase_len);
@@ -648,6 +1135,97 @@ void ntfs_inode_update_mbsname(ntfs_inode *dir_ni, const char *name, u64 inum)
 #endif
 }
 
+/*
+ *		Lookup a component of a path
+ *
+ *	The lookup cache is used when there is one, it is keyed by the
+ *	inode number of the directory, so that the directory only has
+ *	to be opened (into *pdir_ni) when the name is not in the cache.
+ *	Only the names which were found are entered, as names may be
+ *	created without the cache being updated, and the cached names
+ *	which were not found are searched again.
+ *
+ *	Returns the inode number
+ *		or -1 if not possible (errno tells why)
+ */
+
+static u64 ntfs_lookup_component(ntfs_volume *vol, u64 dir_inum,
+			ntfs_inode **pdir_ni, const char *name)
+{
+	ntfschar *uname;
+	int uname_len;
+	u64 inum;
+#if CACHE_LOOKUP_SIZE
+	struct CACHED_LOOKUP item;
+	struct CACHED_LOOKUP *cached;
+	char *cached_name;
+
+	item.name = (const char*)NULL;
+	cached_name = (char*)NULL;
+	if (vol->lookup_cache) {
+		if (!NVolCaseSensitive(vol)) {
+			cached_name = ntfs_uppercase_mbs(name,
+				vol->upcase, vol->upcase_len);
+			item.name = cached_name;
+		} else
+			item.name = name;
+		if (item.name) {
+			item.namesize = strlen(item.name) + 1;
+			item.parent = dir_inum;
+			cached = (struct CACHED_LOOKUP*)ntfs_fetch_cache(
+					vol->lookup_cache,
+					GENERIC(&item), lookup_cache_compare);
+			if (cached && (cached->inum != (u64)-1)) {
+				inum = cached->inum;
+				free(cached_name);
+				return (inum);
+			}
+		}
+	}
+#endif
+	if (!*pdir_ni) {
+		*pdir_ni = ntfs_inode_open(vol, dir_inum);
+		if (!*pdir_ni) {
+			ntfs_log_debug("Cannot open inode %llu: %s.\n",
+					(unsigned long long)dir_inum, name);
+#if CACHE_LOOKUP_SIZE
+			free(cached_name);
+#endif
+			errno = EIO;
+			return ((u64)-1);
+		}
+	}
+	uname = (ntfschar*)NULL;
+	uname_len = ntfs_mbstoucs(name, &uname);
+	if (uname_len < 0) {
+		ntfs_log_perror("Could not convert filename to Unicode:"
+				" '%s'", name);
+		inum = (u64)-1;
+	} else if (uname_len > NTFS_MAX_NAME_LEN) {
+		errno = ENAMETOOLONG;
+		inum = (u64)-1;
+	} else {
+		inum = ntfs_inode_lookup_by_name(*pdir_ni, uname, uname_len);
+		if (inum == (u64)-1)
+			errno = ENOENT;
+#if CACHE_LOOKUP_SIZE
+		else if (item.name) {
+			item.inum = inum;
+			cached = (struct CACHED_LOOKUP*)ntfs_enter_cache(
+					vol->lookup_cache,
+					GENERIC(&item), lookup_cache_compare);
+			if (cached)
+				cached->inum = inum;
+		}
+#endif
+	}
+	free(uname);
+#if CACHE_LOOKUP_SIZE
+	free(cached_name);
+#endif
+	return (inum);
+}
+
 /**
  * ntfs_pathname_to_inode - Find the inode which represents the given pathname
  * @vol:       An ntfs volume obtained from ntfs_mount
@@ -657,6 +1235,8 @@ void ntfs_inode_update_mbsname(ntfs_inode *dir_ni, const char *name, u64 inum)
  * Take an ASCII pathname and find the inode that represents it.  The function
  * splits the path and then descends the directory tree.  If @parent is NULL,
  * then the root directory '.' will be used as the base for the search.
+ * The directories along the path are only opened when their names are
+ * not found in the lookup cache.
  *
  * Return:  inode  Success, the pathname was valid
  *	    NULL   Error, the pathname was invalid, or some other error occurred
@@ -665,11 +1245,11 @@ ntfs_inode *ntfs_pathname_to_inode(ntfs_volume *vol, ntfs_inode *parent,
 		const char *pathname)
 {
 	u64 inum;
-	int len, err = 0;
+	u64 dir_inum;
+	int err = 0;
 	char *p, *q;
 	ntfs_inode *ni;
 	ntfs_inode *result = NULL;
-	ntfschar *unicode = NULL;
 	char *ascii = NULL;
 #if CACHE_INODE_SIZE
 	struct CACHED_INODE item;
@@ -702,6 +1282,7 @@ ntfs_inode *ntfs_pathname_to_inode(ntfs_volume *vol, ntfs_inode *parent,
 #endif
 	if (parent) {
 		ni = parent;
+		dir_inum = parent->mft_no;
 	} else {
 #if CACHE_INODE_SIZE
 			/*
@@ -730,14 +1311,9 @@ ntfs_inode *ntfs_pathname_to_inode(ntfs_volume *vol, ntfs_inode *parent,
 			goto out;
 		}
 #endif
-		ni = ntfs_inode_open(vol, FILE_root);
-		if (!ni) {
-			ntfs_log_debug("Couldn't open the inode of the root "
-					"directory.\n");
-			err = EIO;
-			result = (ntfs_inode*)NULL;
-			goto out;
-		}
+			/* the root directory is opened when needed */
+		ni = (ntfs_inode*)NULL;
+		dir_inum = FILE_root;
 	}
 
 	while (p && *p) {
@@ -762,21 +1338,11 @@ ntfs_inode *ntfs_pathname_to_inode(ntfs_volume *vol, ntfs_inode *parent,
 			}
 		}
 			/*
-			 * if not in cache, translate, search, then
+			 * if not in cache, search, then
 			 * insert into cache if found
 			 */
 		if (!cached) {
-			len = ntfs_mbstoucs(p, &unicode);
-			if (len < 0) {
-				ntfs_log_perror("Could not convert filename to Unicode:"
-					" '%s'", p);
-				err = errno;
-				goto close;
-			} else if (len > NTFS_MAX_NAME_LEN) {
-				err = ENAMETOOLONG;
-				goto close;
-			}
-			inum = ntfs_inode_lookup_by_name(ni, unicode, len);
+			inum = ntfs_lookup_component(vol, dir_inum, &ni, p);
 			if (!parent && (inum != (u64) -1)) {
 				item.inum = inum;
 				ntfs_enter_cache(vol->xinode_cache,
@@ -785,49 +1351,40 @@ ntfs_inode *ntfs_pathname_to_inode(ntfs_volume *vol, ntfs_inode *parent,
 			}
 		}
 #else
-		len = ntfs_mbstoucs(p, &unicode);
-		if (len < 0) {
-			ntfs_log_perror("Could not convert filename to Unicode:"
-					" '%s'", p);
-			err = errno;
-			goto close;
-		} else if (len > NTFS_MAX_NAME_LEN) {
-			err = ENAMETOOLONG;
-			goto close;
-		}
-		inum = ntfs_inode_lookup_by_name(ni, unicode, len);
+		inum = ntfs_lookup_component(vol, dir_inum, &ni, p);
 #endif
 		if (inum == (u64) -1) {
-			ntfs_log_debug("Couldn't find name '%s' in pathname "
-					"'%s'.\n", p, pathname);
-			err = ENOENT;
+			err = errno;
+			if (err == ENOENT)
+				ntfs_log_debug("Couldn't find name '%s' in "
+					"pathname '%s'.\n", p, pathname);
 			goto close;
 		}
 
-		if (ni != parent)
+		if (ni && (ni != parent))
 			if (ntfs_inode_close(ni)) {
 				err = errno;
 				goto out;
 			}
 
-		inum = MREF(inum);
-		ni = ntfs_inode_open(vol, inum);
-		if (!ni) {
-			ntfs_log_debug("Cannot open inode %llu: %s.\n",
-					(unsigned long long)inum, p);
-			err = EIO;
-			goto close;
-		}
+		ni = (ntfs_inode*)NULL;
+		dir_inum = MREF(inum);
 	
-		free(unicode);
-		unicode = NULL;
-
 		if (q) *q++ = PATH_SEP; /* JPA */
 		p = q;
 		while (p && *p && *p == PATH_SEP)
 			p++;
 	}
 
+	if (!ni) {
+		ni = ntfs_inode_open(vol, dir_inum);
+		if (!ni) {
+			ntfs_log_debug("Cannot open inode %llu: %s.\n",
+					(unsigned long long)dir_inum, pathname);
+			err = EIO;
+			goto out;
+		}
+	}
 	result = ni;
 	ni = NULL;
 close:
@@ -836,7 +1393,6 @@ close:
 			err = errno;
 out:
 	free(ascii);
-	free(unicode);
 	if (err)
 		errno = err;
 	return result;
@@ -960,11 +1516,11 @@ static u32 ntfs_dir_entry_type(ntfs_inode *dir_ni, MFT_REF mref,
  * @filldir:	filldir callback supplied by the caller
  *
  * Pass information specifying the current directory entry @ie to the @filldir
- * callback.
+ * callback, along with the file name attribute found in the index.
  */
 static int ntfs_filldir(ntfs_inode *dir_ni, s64 *pos, u8 ivcn_bits,
 		const INDEX_TYPE index_type, index_union iu, INDEX_ENTRY *ie,
-		void *dirent, ntfs_filldir_t filldir)
+		void *dirent, ntfs_filldir_plus_t filldir)
 {
 	FILE_NAME_ATTR *fn = &ie->key.file_name;
 	unsigned dt_type;
@@ -1007,7 +1563,7 @@ static int ntfs_filldir(ntfs_inode *dir_ni, s64 *pos, u8 ivcn_bits,
 			res = filldir(dirent, fn->file_name,
 					fn->file_name_length,
 					fn->file_name_type, *pos,
-					mref, dt_type);
+					mref, dt_type, fn);
 		} else {
 			loname = (ntfschar*)ntfs_malloc(2*fn->file_name_length);
 			if (loname) {
@@ -1019,7 +1575,7 @@ static int ntfs_filldir(ntfs_inode *dir_ni, s64 *pos, u8 ivcn_bits,
 				res = filldir(dirent, loname,
 					fn->file_name_length,
 					fn->file_name_type, *pos,
-					mref, dt_type);
+					mref, dt_type, fn);
 				free(loname);
 			} else
 				res = -1;
@@ -1094,6 +1650,28 @@ err_out:
 	return ERR_MREF(-1);
 }
 
+/*
+ *		Adapter for callers of ntfs_readdir() which do not need
+ *	the file name attributes
+ */
+
+struct READDIR_ADAPTER {
+	void *dirent;
+	ntfs_filldir_t filldir;
+};
+
+static int ntfs_filldir_adapter(void *dirent, const ntfschar *name,
+		const int name_len, const int name_type, const s64 pos,
+		const MFT_REF mref, const unsigned dt_type,
+		const FILE_NAME_ATTR *fn __attribute__((unused)))
+{
+	struct READDIR_ADAPTER *adapter;
+
+	adapter = (struct READDIR_ADAPTER*)dirent;
+	return (adapter->filldir(adapter->dirent, name, name_len,
+			name_type, pos, mref, dt_type));
+}
+
 /**
  * ntfs_readdir - read the contents of an ntfs directory
  * @dir_ni:	ntfs inode of current directory
@@ -1112,6 +1690,125 @@ err_out:
  */
 int ntfs_readdir(ntfs_inode *dir_ni, s64 *pos,
 		void *dirent, ntfs_filldir_t filldir)
+{
+	struct READDIR_ADAPTER adapter;
+
+	if (!filldir) {
+		errno = EINVAL;
+		return -1;
+	}
+	adapter.dirent = dirent;
+	adapter.filldir = filldir;
+	return (ntfs_readdir_plus(dir_ni, pos, &adapter, ntfs_filldir_adapter));
+}
+
+#if CACHE_MFTREC_SIZE
+
+struct PREFETCH_CONTEXT {
+	ntfs_volume *vol;
+	int count;
+	MFT_REF refs[MFT_PREFETCH_MAX];
+} ;
+
+static int ntfs_prefetch_filldir(void *dirent,
+		const ntfschar *name __attribute__((unused)),
+		const int name_len __attribute__((unused)),
+		const int name_type, const s64 pos __attribute__((unused)),
+		const MFT_REF mref,
+		const unsigned dt_type __attribute__((unused)),
+		const FILE_NAME_ATTR *fn __attribute__((unused)))
+{
+	struct PREFETCH_CONTEXT *prefetch;
+
+	prefetch = (struct PREFETCH_CONTEXT*)dirent;
+	if ((MREF(mref) >= FILE_first_user)
+	    && (name_type != FILE_NAME_DOS)) {
+		prefetch->refs[prefetch->count++] = mref;
+		if (prefetch->count >= MFT_PREFETCH_MAX) {
+			ntfs_mft_prefetch(prefetch->vol, prefetch->refs,
+					prefetch->count);
+			prefetch->count = 0;
+		}
+	}
+	return (0);
+}
+
+#endif /* CACHE_MFTREC_SIZE */
+
+/*
+ *		Prefetch the mft records of the entries of a directory
+ *
+ *	The mft records are read into the mft record cache, so that
+ *	getting the attributes of the files does not need a device access
+ *	per file. This is only worth doing when the attributes are going
+ *	to be looked up, which the caller has to determine, and the
+ *	directories too big for the cache are ignored.
+ *
+ *	Returns 0 if the records were prefetched,
+ *		-1 otherwise (not an error, there is no errno)
+ */
+
+int ntfs_dir_prefetch(ntfs_inode *dir_ni)
+{
+	int res;
+#if CACHE_MFTREC_SIZE
+	struct PREFETCH_CONTEXT *prefetch;
+	ntfs_attr *ia_na;
+	s64 pos;
+	int olderrno;
+
+	res = -1;
+	olderrno = errno;
+	if (dir_ni && dir_ni->vol->mftrec_cache
+	    && (dir_ni->mrec->flags & MFT_RECORD_IS_DIRECTORY)) {
+		ia_na = ntfs_attr_open(dir_ni, AT_INDEX_ALLOCATION,
+					NTFS_INDEX_I30, 4);
+		if (!ia_na || (ia_na->data_size <= MFT_PREFETCH_INDEX_MAX)) {
+			prefetch = (struct PREFETCH_CONTEXT*)ntfs_malloc(
+					sizeof(struct PREFETCH_CONTEXT));
+			if (prefetch) {
+				prefetch->vol = dir_ni->vol;
+				prefetch->count = 0;
+				pos = 0;
+				if (!ntfs_readdir_plus(dir_ni, &pos, prefetch,
+						ntfs_prefetch_filldir)) {
+					if (prefetch->count)
+						ntfs_mft_prefetch(prefetch->vol,
+							prefetch->refs,
+							prefetch->count);
+					res = 0;
+				}
+				free(prefetch);
+			}
+		}
+		if (ia_na)
+			ntfs_attr_close(ia_na);
+	}
+	errno = olderrno;
+#else
+	res = -1;
+#endif
+	return (res);
+}
+
+/**
+ * ntfs_readdir_plus - read an ntfs directory with the index file names
+ * @dir_ni:	ntfs inode of current directory
+ * @pos:	current position in directory
+ * @dirent:	context for filldir callback supplied by the caller
+ * @filldir:	filldir callback supplied by the caller
+ *
+ * Same as ntfs_readdir(), except that the callback also gets the file
+ * name attribute stored in the index entry, which holds a copy of the
+ * sizes and times of the file, or NULL for the emulated "." and "..".
+ * The copy is only updated when the file is closed, or for the file
+ * name used by Windows when the file has several ones, so the caller
+ * has to decide whether it can rely on it.
+ *
+ * Return 0 on success or -1 on error with errno set to the error code.
+ */
+int ntfs_readdir_plus(ntfs_inode *dir_ni, s64 *pos,
+		void *dirent, ntfs_filldir_plus_t filldir)
 {
 	s64 i_size, br, ia_pos, bmp_pos, ia_start;
 	ntfs_volume *vol;
@@ -1166,7 +1863,7 @@ int ntfs_readdir(ntfs_inode *dir_ni, s64 *pos,
 		rc = filldir(dirent, dotdot, 1, FILE_NAME_POSIX, *pos,
 				MK_MREF(dir_ni->mft_no,
 				le16_to_cpu(dir_ni->mrec->sequence_number)),
-				NTFS_DT_DIR);
+				NTFS_DT_DIR, (const FILE_NAME_ATTR*)NULL);
 		if (rc)
 			goto err_out;
 		++*pos;
@@ -1181,7 +1878,8 @@ int ntfs_readdir(ntfs_inode *dir_ni, s64 *pos,
 		}
 
 		rc = filldir(dirent, dotdot, 2, FILE_NAME_POSIX, *pos,
-				parent_mref, NTFS_DT_DIR);
+				parent_mref, NTFS_DT_DIR,
+				(const FILE_NAME_ATTR*)NULL);
 		if (rc)
 			goto err_out;
 		++*pos;
@@ -1449,41 +2147,77 @@ err_out:
 }
 
 
-/**
- * __ntfs_create - create object on ntfs volume
- * @dir_ni:	ntfs inode for directory in which create new object
- * @securid:	id of inheritable security descriptor, 0 if none
- * @name:	unicode name of new object
- * @name_len:	length of the name in unicode characters
- * @type:	type of the object to create
- * @dev:	major and minor device numbers (obtained from makedev())
- * @target:	target in unicode (only for symlinks)
- * @target_len:	length of target in unicode characters
+/*
+ *		Set the hard links count and directory flag of a created inode
  *
- * Internal, use ntfs_create{,_device,_symlink} wrappers instead.
+ *	To be called once its name has been inserted into the index
+ */
+
+static void __ntfs_create_done(ntfs_inode *ni, mode_t type)
+{
+	ni->mrec->link_count = cpu_to_le16(1);
+	if (S_ISDIR(type))
+		ni->mrec->flags |= MFT_RECORD_IS_DIRECTORY;
+	ntfs_inode_mark_dirty(ni);
+}
+
+/*
+ *		Undo the creation of an inode whose name is not indexed
  *
- * @type can be:
- *	S_IFREG		to create regular file
- *	S_IFDIR		to create directory
- *	S_IFBLK		to create block device
- *	S_IFCHR		to create character device
- *	S_IFLNK		to create symbolic link
- *	S_IFIFO		to create FIFO
- *	S_IFSOCK	to create socket
- * other values are invalid.
+ *	Returns the error code to report, possibly updated
+ */
+
+static int __ntfs_create_rollback(ntfs_inode *ni, int rollback_sd,
+		int rollback_data, int err)
+{
+	if (rollback_sd)
+		ntfs_attr_remove(ni, AT_SECURITY_DESCRIPTOR, AT_UNNAMED, 0);
+	
+	if (rollback_data)
+		ntfs_attr_remove(ni, AT_DATA, AT_UNNAMED, 0);
+	/*
+	 * Free extent MFT records (should not exist any with current
+	 * ntfs_create implementation, but for any case if something will be
+	 * changed in the future).
+	 */
+	while (ni->nr_extents)
+		if (ntfs_mft_record_free(ni->vol, *(ni->extent_nis))) {
+			err = errno;
+			ntfs_log_error("Failed to free extent MFT record.  "
+					"Leaving inconsistent metadata.\n");
+		}
+	if (ntfs_mft_record_free(ni->vol, ni))
+		ntfs_log_error("Failed to free MFT record.  "
+				"Leaving inconsistent metadata. Run chkdsk.\n");
+	return (err);
+}
+
+/*
+ *		Undo the creation of an inode built by __ntfs_create_inode()
  *
- * @dev is used only if @type is S_IFBLK or S_IFCHR, in other cases its value
- * ignored.
+ *	Its own security descriptor is only present when no securid
+ *	was given, and its DATA attribute when it is not a directory.
  *
- * @target and @target_len are used only if @type is S_IFLNK, in other cases
- * their value ignored.
+ *	Returns the error code to report, possibly updated
+ */
+
+static int __ntfs_create_undo(ntfs_inode *ni, le32 securid, mode_t type,
+		int err)
+{
+	return (__ntfs_create_rollback(ni, !securid, !S_ISDIR(type), err));
+}
+
+/*
+ *		Create an inode with its attributes, but not its index entry
  *
- * Return opened ntfs inode that describes created object on success or NULL
- * on error with errno set to the error code.
+ *	Same arguments as __ntfs_create(), the FILE_NAME attribute to
+ *	insert into the index of the parent directory is returned
+ *	through @pfn, and has to be freed by the caller.
  */
-static ntfs_inode *__ntfs_create(ntfs_inode *dir_ni, le32 securid,
+
+static ntfs_inode *__ntfs_create_inode(ntfs_inode *dir_ni, le32 securid,
 		const ntfschar *name, u8 name_len, mode_t type, dev_t dev,
-		const ntfschar *target, int target_len)
+		const ntfschar *target, int target_len, FILE_NAME_ATTR **pfn)
 {
 	ntfs_inode *ni;
 	int rollback_data = 0, rollback_sd = 0;
@@ -1572,8 +2306,8 @@ static ntfs_inode *__ntfs_create(ntfs_inode *dir_ni, le32 securid,
 			err = errno;
 			goto err_out;
 		}
+		rollback_sd = 1;
 	}
-	rollback_sd = 1;
 
 	if (S_ISDIR(type)) {
 		INDEX_ROOT *ir = NULL;
@@ -1703,51 +2437,85 @@ static ntfs_inode *__ntfs_create(ntfs_inode *dir_ni, le32 securid,
 		ntfs_log_error("Failed to add FILE_NAME attribute.\n");
 		goto err_out;
 	}
-	/* Add FILE_NAME attribute to index. */
-	if (ntfs_index_add_filename(dir_ni, fn, MK_MREF(ni->mft_no,
-			le16_to_cpu(ni->mrec->sequence_number)))) {
-		err = errno;
-		ntfs_log_perror("Failed to add entry to the index");
-		goto err_out;
-	}
-	/* Set hard links count and directory flag. */
-	ni->mrec->link_count = cpu_to_le16(1);
-	if (S_ISDIR(type))
-		ni->mrec->flags |= MFT_RECORD_IS_DIRECTORY;
-	ntfs_inode_mark_dirty(ni);
-	/* Done! */
-	free(fn);
 	free(si);
-	ntfs_log_trace("Done.\n");
+	*pfn = fn;
 	return ni;
 err_out:
 	ntfs_log_trace("Failed.\n");
 
-	if (rollback_sd)
-		ntfs_attr_remove(ni, AT_SECURITY_DESCRIPTOR, AT_UNNAMED, 0);
-	
-	if (rollback_data)
-		ntfs_attr_remove(ni, AT_DATA, AT_UNNAMED, 0);
-	/*
-	 * Free extent MFT records (should not exist any with current
-	 * ntfs_create implementation, but for any case if something will be
-	 * changed in the future).
-	 */
-	while (ni->nr_extents)
-		if (ntfs_mft_record_free(ni->vol, *(ni->extent_nis))) {
-			err = errno;
-			ntfs_log_error("Failed to free extent MFT record.  "
-					"Leaving inconsistent metadata.\n");
-		}
-	if (ntfs_mft_record_free(ni->vol, ni))
-		ntfs_log_error("Failed to free MFT record.  "
-				"Leaving inconsistent metadata. Run chkdsk.\n");
+	err = __ntfs_create_rollback(ni, rollback_sd, rollback_data, err);
 	free(fn);
 	free(si);
 	errno = err;
 	return NULL;
 }
 
+/**
+ * __ntfs_create - create object on ntfs volume
+ * @dir_ni:	ntfs inode for directory in which create new object
+ * @securid:	id of inheritable security descriptor, 0 if none
+ * @name:	unicode name of new object
+ * @name_len:	length of the name in unicode characters
+ * @type:	type of the object to create
+ * @dev:	major and minor device numbers (obtained from makedev())
+ * @target:	target in unicode (only for symlinks)
+ * @target_len:	length of target in unicode characters
+ *
+ * Internal, use ntfs_create{,_device,_symlink} wrappers instead.
+ *
+ * @type can be:
+ *	S_IFREG		to create regular file
+ *	S_IFDIR		to create directory
+ *	S_IFBLK		to create block device
+ *	S_IFCHR		to create character device
+ *	S_IFLNK		to create symbolic link
+ *	S_IFIFO		to create FIFO
+ *	S_IFSOCK	to create socket
+ * other values are invalid.
+ *
+ * @dev is used only if @type is S_IFBLK or S_IFCHR, in other cases its value
+ * ignored.
+ *
+ * @target and @target_len are used only if @type is S_IFLNK, in other cases
+ * their value ignored.
+ *
+ * Return opened ntfs inode that describes created object on success or NULL
+ * on error with errno set to the error code.
+ */
+static ntfs_inode *__ntfs_create(ntfs_inode *dir_ni, le32 securid,
+		const ntfschar *name, u8 name_len, mode_t type, dev_t dev,
+		const ntfschar *target, int target_len)
+{
+	ntfs_inode *ni;
+	FILE_NAME_ATTR *fn;
+	MFT_REF mref;
+	int added, err;
+
+	ni = __ntfs_create_inode(dir_ni, securid, name, name_len, type, dev,
+			target, target_len, &fn);
+	if (!ni)
+		return NULL;
+	/* Add FILE_NAME attribute to index. */
+	mref = MK_MREF(ni->mft_no, le16_to_cpu(ni->mrec->sequence_number));
+	if (ntfs_index_add_filenames(dir_ni, &fn, &mref, 1, &added)) {
+		err = errno;
+		ntfs_log_perror("Failed to add entry to the index");
+		if (added) {
+			/* the name may be on disk, keep a valid inode */
+			__ntfs_create_done(ni, type);
+			ntfs_inode_close(ni);
+		} else
+			err = __ntfs_create_undo(ni, securid, type, err);
+		free(fn);
+		errno = err;
+		return NULL;
+	}
+	__ntfs_create_done(ni, type);
+	free(fn);
+	ntfs_log_trace("Done.\n");
+	return ni;
+}
+
 /**
  * Some wrappers around __ntfs_create() ...
  */
@@ -1763,6 +2531,96 @@ ntfs_inode *ntfs_create(ntfs_inode *dir_ni, le32 securid, const ntfschar *name,
 	return __ntfs_create(dir_ni, securid, name, name_len, type, 0, NULL, 0);
 }
 
+/**
+ * ntfs_create_many - create many objects in the same directory
+ * @dir_ni:	ntfs inode for directory in which create new objects
+ * @securid:	id of inheritable security descriptor, 0 if none
+ * @names:	unicode names of new objects
+ * @name_lens:	lengths of the names in unicode characters
+ * @type:	type of the objects, as for ntfs_create()
+ * @nis:	array where the opened inodes are returned
+ * @count:	number of objects to create
+ *
+ * All the inodes are created first, then their names are inserted
+ * into the directory index by a single batch, which is much faster
+ * than creating them one by one when the directory is big, and even
+ * faster when the names are sorted in the collation order of the index.
+ *
+ * If an error occurs, the objects whose names could be inserted into
+ * the index, which are the first ones in @names, are still created,
+ * even when the index could not be fully written. The entries of @nis
+ * for the objects which could not be created are set to NULL.
+ *
+ * Return 0 if all the objects were created or -1 on error with errno
+ * set to the error code. In both cases, the non-NULL inodes in @nis
+ * have to be closed by the caller.
+ */
+
+int ntfs_create_many(ntfs_inode *dir_ni, le32 securid,
+		const ntfschar **names, const u8 *name_lens, mode_t type,
+		ntfs_inode **nis, int count)
+{
+	FILE_NAME_ATTR **fns;
+	MFT_REF *mrefs;
+	int created, added, err, i;
+
+	if (!dir_ni || !names || !name_lens || !nis || (count < 0)
+	    || (type != S_IFREG && type != S_IFDIR && type != S_IFIFO &&
+			type != S_IFSOCK)) {
+		ntfs_log_error("Invalid arguments.\n");
+		errno = EINVAL;
+		return -1;
+	}
+	for (i=0; i<count; i++)
+		nis[i] = (ntfs_inode*)NULL;
+	fns = (FILE_NAME_ATTR**)ntfs_malloc(count*sizeof(FILE_NAME_ATTR*) + 1);
+	mrefs = (MFT_REF*)ntfs_malloc(count*sizeof(MFT_REF) + 1);
+	if (!fns || !mrefs) {
+		free(fns);
+		free(mrefs);
+		return -1;
+	}
+	err = 0;
+	for (created=0; created<count; created++) {
+		nis[created] = __ntfs_create_inode(dir_ni, securid,
+				names[created], name_lens[created], type, 0,
+				(const ntfschar*)NULL, 0, &fns[created]);
+		if (!nis[created]) {
+			err = errno;
+			break;
+		}
+		mrefs[created] = MK_MREF(nis[created]->mft_no,
+			le16_to_cpu(nis[created]->mrec->sequence_number));
+	}
+	added = 0;
+	if (created
+	    && ntfs_index_add_filenames(dir_ni, fns, mrefs, created, &added)) {
+		if (!err)
+			err = errno;
+		ntfs_log_perror("Failed to add entries to the index");
+	}
+		/*
+		 * The names which were inserted may be on disk even if
+		 * the index could not be written, so their inodes have
+		 * to be kept. Only undo the creation of the other ones.
+		 */
+	for (i=0; i<added; i++)
+		__ntfs_create_done(nis[i], type);
+	for (i=added; i<created; i++) {
+		err = __ntfs_create_undo(nis[i], securid, type, err);
+		nis[i] = (ntfs_inode*)NULL;
+	}
+	for (i=0; i<created; i++)
+		free(fns[i]);
+	free(fns);
+	free(mrefs);
+	if (err) {
+		errno = err;
+		return -1;
+	}
+	return 0;
+}
+
 ntfs_inode *ntfs_create_device(ntfs_inode *dir_ni, le32 securid,
 		const ntfschar *name, u8 name_len, mode_t type, dev_t dev)
 {
@@ -80,23 +80,118 @@ static VCN ntfs_ib_pos_to_vcn(ntfs_index_context *icx, s64 pos)
 	return pos >> icx->vcn_size_bits;
 }
 
-static int ntfs_ib_write(ntfs_index_context *icx, INDEX_BLOCK *ib)
+/*
+ *		Index blocks kept in memory while inserting a batch of names
+ *
+ *	Blocks are read once and written once per batch, unless they
+ *	have to be evicted because the batch touches too many of them.
+ */
+
+struct INDEX_BATCH_BLOCK {
+	VCN vcn;
+	u32 age;
+	BOOL dirty;
+	INDEX_BLOCK *ib;
+} ;
+
+struct INDEX_BATCH {
+	int count;
+	u32 clock;
+	u32 block_size;
+	u8 vcn_size_bits;
+	struct INDEX_BATCH_BLOCK blocks[INDEX_BATCH_BLOCKS];
+} ;
+
+static int ntfs_ib_store(ntfs_attr *na, INDEX_BLOCK *ib, u32 block_size,
+			u8 vcn_size_bits)
 {
 	s64 ret, vcn = sle64_to_cpu(ib->index_block_vcn);
 	
 	ntfs_log_trace("vcn: %lld\n", (long long)vcn);
 	
-	ret = ntfs_attr_mst_pwrite(icx->ia_na, ntfs_ib_vcn_to_pos(icx, vcn),
-				   1, icx->block_size, ib);
+	if (!na) {
+		errno = EIO;
+		return STATUS_ERROR;
+	}
+	ret = ntfs_attr_mst_pwrite(na, vcn << vcn_size_bits,
+				   1, block_size, ib);
 	if (ret != 1) {
 		ntfs_log_perror("Failed to write index block %lld, inode %llu",
-			(long long)vcn, (unsigned long long)icx->ni->mft_no);
+			(long long)vcn, (unsigned long long)na->ni->mft_no);
 		return STATUS_ERROR;
 	}
 	
 	return STATUS_OK;
 }
 
+static struct INDEX_BATCH_BLOCK *ntfs_batch_find(struct INDEX_BATCH *batch,
+			VCN vcn)
+{
+	int i;
+
+	for (i=0; i<batch->count; i++)
+		if (batch->blocks[i].vcn == vcn)
+			return (&batch->blocks[i]);
+	return ((struct INDEX_BATCH_BLOCK*)NULL);
+}
+
+/*
+ *		Keep a copy of an index block in the batch
+ *
+ *	When the batch is full, the least recently used block is
+ *	evicted, and written if it was modified.
+ *	Returns STATUS_ERROR if the copy could not be kept, in which
+ *	case the caller has to write the block itself if it is dirty.
+ */
+
+static int ntfs_batch_keep(ntfs_index_context *icx, INDEX_BLOCK *ib,
+			BOOL dirty)
+{
+	struct INDEX_BATCH *batch;
+	struct INDEX_BATCH_BLOCK *b;
+	VCN vcn;
+	int i;
+
+	batch = icx->batch;
+	vcn = sle64_to_cpu(ib->index_block_vcn);
+	b = ntfs_batch_find(batch, vcn);
+	if (!b) {
+		if (batch->count < INDEX_BATCH_BLOCKS) {
+			b = &batch->blocks[batch->count];
+			b->ib = (INDEX_BLOCK*)ntfs_malloc(icx->block_size);
+			if (!b->ib)
+				return (STATUS_ERROR);
+			batch->count++;
+			batch->block_size = icx->block_size;
+			batch->vcn_size_bits = icx->vcn_size_bits;
+		} else {
+			b = &batch->blocks[0];
+			for (i=1; i<batch->count; i++)
+				if (batch->blocks[i].age < b->age)
+					b = &batch->blocks[i];
+			if (b->dirty
+			    && ntfs_ib_store(icx->ia_na, b->ib,
+					batch->block_size, batch->vcn_size_bits))
+				return (STATUS_ERROR);
+		}
+		b->vcn = vcn;
+		b->dirty = FALSE;
+	}
+	memcpy(b->ib, ib, icx->block_size);
+	if (dirty)
+		b->dirty = TRUE;
+	b->age = ++batch->clock;
+	return (STATUS_OK);
+}
+
+static int ntfs_ib_write(ntfs_index_context *icx, INDEX_BLOCK *ib)
+{
+	if (icx->batch && !ntfs_batch_keep(icx, ib, TRUE))
+		return STATUS_OK;
+	return ntfs_ib_store(icx->ia_na, ib, icx->block_size,
+			icx->vcn_size_bits);
+}
+
 static int ntfs_icx_ib_write(ntfs_index_context *icx)
 {
 		if (ntfs_ib_write(icx, icx->ib))
@@ -188,6 +283,7 @@ void ntfs_index_ctx_reinit(ntfs_index_context *icx)
 		.ni = icx->ni,
 		.name = icx->name,
 		.name_len = icx->name_len,
+		.batch = icx->batch,
 	};
 }
 
@@ -482,9 +578,12 @@ static INDEX_ROOT *ntfs_ir_lookup2(ntfs_inode *ni, ntfschar *name, u32 len)
  *   STATUS_ERROR with errno set if on unexpected error during lookup.
  */
 static int ntfs_ie_lookup(const void *key, const int key_len,
+			  const ntfschar *upkey,
 			  ntfs_index_context *icx, INDEX_HEADER *ih,
 			  VCN *vcn, INDEX_ENTRY **ie_out)
 {
+	ntfs_volume *vol = icx->ni->vol;
+	const FILE_NAME_ATTR *fn;
 	INDEX_ENTRY *ie;
 	u8 *index_end;
 	int rc, item = 0;
@@ -517,13 +616,24 @@ static int ntfs_ie_lookup(const void *key, const int key_len,
 		 * Not a perfect match, need to do full blown collation so we
 		 * know which way in the B+tree we have to go.
 		 */
-		if (!icx->collate) {
-			ntfs_log_error("Collation function not defined\n");
-			errno = EOPNOTSUPP;
-			return STATUS_ERROR;
+		if (upkey) {
+			/* file name key, with its name upcased */
+			fn = (const FILE_NAME_ATTR*)key;
+			rc = ntfs_names_full_collate_upcased(ntfs_fn_name(fn),
+				upkey, fn->file_name_length,
+				ntfs_fn_name(&ie->key.file_name),
+				ie->key.file_name.file_name_length,
+				CASE_SENSITIVE, vol->upcase, vol->upcase_len);
+		} else {
+			if (!icx->collate) {
+				ntfs_log_error("Collation function not"
+					" defined\n");
+				errno = EOPNOTSUPP;
+				return STATUS_ERROR;
+			}
+			rc = icx->collate(vol, key, key_len,
+				&ie->key, le16_to_cpu(ie->key_length));
 		}
-		rc = icx->collate(icx->ni->vol, key, key_len,
-					&ie->key, le16_to_cpu(ie->key_length));
 		if (rc == NTFS_COLLATION_ERROR) {
 			ntfs_log_error("Collation error. Perhaps a filename "
 				       "contains invalid characters?\n");
@@ -590,10 +700,20 @@ static ntfs_attr *ntfs_ia_open(ntfs_index_context *icx, ntfs_inode *ni)
 
 static int ntfs_ib_read(ntfs_index_context *icx, VCN vcn, INDEX_BLOCK *dst)
 {
+	struct INDEX_BATCH_BLOCK *b;
 	s64 pos, ret;
 
 	ntfs_log_trace("vcn: %lld\n", (long long)vcn);
 	
+	if (icx->batch) {
+		b = ntfs_batch_find(icx->batch, vcn);
+		if (b) {
+			memcpy(dst, b->ib, icx->block_size);
+			b->age = ++icx->batch->clock;
+			return 0;
+		}
+	}
+	
 	pos = ntfs_ib_vcn_to_pos(icx, vcn);
 
 	ret = ntfs_attr_mst_pread(icx->ia_na, pos, 1, icx->block_size, (u8 *)dst);
@@ -609,6 +729,9 @@ static int ntfs_ib_read(ntfs_index_context *icx, VCN vcn, INDEX_BLOCK *dst)
 	if (ntfs_ia_check(icx, dst, vcn))
 		return -1;
 	
+	/* a failure only means the block will be read again */
+	if (icx->batch)
+		ntfs_batch_keep(icx, dst, FALSE);
 	return 0;
 }
 
@@ -673,6 +796,9 @@ int ntfs_index_lookup(const void *key, const int key_len, ntfs_index_context *ic
 	INDEX_ROOT *ir;
 	INDEX_ENTRY *ie;
 	INDEX_BLOCK *ib = NULL;
+	const FILE_NAME_ATTR *fn;
+	const ntfschar *upkey;
+	ntfschar upname[NTFS_MAX_NAME_LEN];
 	int ret, err = 0;
 
 	ntfs_log_trace("Entering\n");
@@ -710,13 +836,29 @@ int ntfs_index_lookup(const void *key, const int key_len, ntfs_index_context *ic
 				(unsigned)le32_to_cpu(ir->collation_rule));
 		goto err_out;
 	}
+		/*
+		 * When searching a file name, upcase it once for
+		 * collating against all the entries met
+		 */
+	upkey = (const ntfschar*)NULL;
+	fn = (const FILE_NAME_ATTR*)key;
+	if ((ir->collation_rule == COLLATION_FILE_NAME)
+	    && (key_len >= (int)offsetof(FILE_NAME_ATTR, file_name))
+	    && (key_len >= (int)(offsetof(FILE_NAME_ATTR, file_name)
+				+ fn->file_name_length*sizeof(ntfschar)))) {
+		memcpy(upname, fn->file_name,
+				fn->file_name_length*sizeof(ntfschar));
+		ntfs_name_upcase(upname, fn->file_name_length,
+				ni->vol->upcase, ni->vol->upcase_len);
+		upkey = upname;
+	}
 	
 	old_vcn = VCN_INDEX_ROOT_PARENT;
 	/* 
 	 * FIXME: check for both ir and ib that the first index entry is
 	 * within the index block.
 	 */
-	ret = ntfs_ie_lookup(key, key_len, icx, &ir->index, &vcn, &ie);
+	ret = ntfs_ie_lookup(key, key_len, upkey, icx, &ir->index, &vcn, &ie);
 	if (ret == STATUS_ERROR) {
 		err = errno;
 		goto err_out;
@@ -758,7 +900,7 @@ descend_into_child_node:
 	if (ntfs_ib_read(icx, vcn, ib))
 		goto err_out;
 	
-	ret = ntfs_ie_lookup(key, key_len, icx, &ib->index, &vcn, &ie);
+	ret = ntfs_ie_lookup(key, key_len, upkey, icx, &ib->index, &vcn, &ie);
 	if (ret != STATUS_KEEP_SEARCHING) {
 		err = errno;
 		if (ret == STATUS_ERROR)
@@ -976,6 +1118,8 @@ static VCN ntfs_ibm_get_free(ntfs_index_context *icx)
 	}
 	
 	vcn = ntfs_ibm_pos_to_vcn(icx, size * 8);
+		/* the index allocation grows, a directory may now be hashed */
+	ntfs_dir_hash_resized(icx->ni);
 out:	
 	ntfs_log_trace("allocated vcn: %lld\n", (long long)vcn);
 
@@ -1552,12 +1696,154 @@ int ntfs_index_add_filename(ntfs_inode *ni, FILE_NAME_ATTR *fn, MFT_REF mref)
 	ret = ntfs_ie_add(icx, ie);
 	err = errno;
 	ntfs_index_ctx_put(icx);
+	if (ret)
+		ntfs_dir_hash_free(ni);
+	else
+		ntfs_dir_hash_add(ni, fn, mref);
 	errno = err;
 out:
 	free(ie);
 	return ret;
 }
 
+static int ntfs_batch_compare(const void *p1, const void *p2)
+{
+	const struct INDEX_BATCH_BLOCK *b1 = (const struct INDEX_BATCH_BLOCK*)p1;
+	const struct INDEX_BATCH_BLOCK *b2 = (const struct INDEX_BATCH_BLOCK*)p2;
+
+	return (b1->vcn < b2->vcn ? -1 : (b1->vcn > b2->vcn ? 1 : 0));
+}
+
+/*
+ *		Write the modified blocks of a batch and free the batch
+ *
+ *	The blocks are written in the order of their vcn, so that the
+ *	index allocation is extended only once.
+ *	Returns STATUS_ERROR if some block could not be written.
+ */
+
+static int ntfs_batch_commit(ntfs_inode *ni, struct INDEX_BATCH *batch)
+{
+	ntfs_attr *na;
+	int err, i;
+	int ret = STATUS_OK;
+
+	err = 0;
+	for (i=0; (i<batch->count) && !batch->blocks[i].dirty; i++) { }
+	if (i < batch->count) {
+		qsort(batch->blocks, batch->count,
+			sizeof(struct INDEX_BATCH_BLOCK), ntfs_batch_compare);
+		na = ntfs_attr_open(ni, AT_INDEX_ALLOCATION, NTFS_INDEX_I30, 4);
+		if (!na) {
+			ntfs_log_perror("Failed to open index allocation of "
+				"inode %llu", (unsigned long long)ni->mft_no);
+			err = errno;
+			ret = STATUS_ERROR;
+		} else {
+			for (i=0; i<batch->count; i++) {
+				if (batch->blocks[i].dirty
+				    && ntfs_ib_store(na, batch->blocks[i].ib,
+						batch->block_size,
+						batch->vcn_size_bits)) {
+					err = errno;
+					ret = STATUS_ERROR;
+				}
+			}
+			ntfs_attr_close(na);
+		}
+	}
+	for (i=0; i<batch->count; i++)
+		free(batch->blocks[i].ib);
+	free(batch);
+	if (ret)
+		errno = err;
+	return (ret);
+}
+
+/**
+ * ntfs_index_add_filenames - add many filenames to a directory index
+ * @ni:		ntfs inode describing directory to which index add filenames
+ * @fns:	FILE_NAME attributes to add
+ * @mrefs:	references of the inodes which @fns describe
+ * @count:	number of filenames to add
+ *
+ * The filenames are inserted in the given order, the insertions are
+ * cheaper when they are sorted in the collation order of the index.
+ * The index blocks are kept in memory while inserting, so that each
+ * modified block is written once when all names have been inserted.
+ *
+ * The number of filenames inserted, the first ones in @fns, is returned
+ * through @added, even on error : when the index blocks could not all
+ * be written, these filenames may still be present in the index, so
+ * the inodes they designate have to be kept.
+ *
+ * Return 0 on success or -1 on error with errno set to the error code.
+ */
+int ntfs_index_add_filenames(ntfs_inode *ni, FILE_NAME_ATTR **fns,
+			const MFT_REF *mrefs, int count, int *added)
+{
+	INDEX_ENTRY *ie;
+	ntfs_index_context *icx;
+	struct INDEX_BATCH *batch;
+	int fn_size, ie_size, err;
+	int done;
+
+	ntfs_log_trace("Entering\n");
+	
+	if (added)
+		*added = 0;
+	if (!ni || !added || (count && (!fns || !mrefs)) || (count < 0)) {
+		ntfs_log_error("Invalid arguments.\n");
+		errno = EINVAL;
+		return -1;
+	}
+	
+	ie = ntfs_malloc(sizeof(INDEX_ENTRY_HEADER) + sizeof(FILE_NAME_ATTR)
+			+ NTFS_MAX_NAME_LEN*sizeof(ntfschar) + 8);
+	if (!ie)
+		return -1;
+	batch = (struct INDEX_BATCH*)ntfs_calloc(sizeof(struct INDEX_BATCH));
+	if (!batch) {
+		free(ie);
+		return -1;
+	}
+	icx = ntfs_index_ctx_get(ni, NTFS_INDEX_I30, 4);
+	if (!icx) {
+		free(batch);
+		free(ie);
+		return -1;
+	}
+	icx->batch = batch;
+	err = 0;
+	for (done=0; done<count; done++) {
+		fn_size = (fns[done]->file_name_length * sizeof(ntfschar)) +
+				sizeof(FILE_NAME_ATTR);
+		ie_size = (sizeof(INDEX_ENTRY_HEADER) + fn_size + 7) & ~7;
+		memset(ie, 0, ie_size);
+		ie->indexed_file = cpu_to_le64(mrefs[done]);
+		ie->length 	 = cpu_to_le16(ie_size);
+		ie->key_length 	 = cpu_to_le16(fn_size);
+		memcpy(&ie->key, fns[done], fn_size);
+		if (ntfs_ie_add(icx, ie)) {
+			err = errno;
+			break;
+		}
+		ntfs_dir_hash_add(ni, fns[done], mrefs[done]);
+		ntfs_index_ctx_reinit(icx);
+	}
+	ntfs_index_ctx_put(icx);
+	free(ie);
+	*added = done;
+	if (ntfs_batch_commit(ni, batch) && !err)
+		err = errno;
+	if (err) {
+		ntfs_dir_hash_free(ni);
+		errno = err;
+		return -1;
+	}
+	return 0;
+}
+
 static int ntfs_ih_takeout(ntfs_index_context *icx, INDEX_HEADER *ih,
 			   INDEX_ENTRY *ie, INDEX_BLOCK *ib)
 {
@@ -1877,6 +2163,10 @@ int ntfs_index_remove(ntfs_inode *dir_ni, ntfs_inode *ni,
 	ntfs_inode_mark_dirty(icx->actx->ntfs_ino);
 out:	
 	ntfs_index_ctx_put(icx);
+	if (ret == STATUS_OK)
+		ntfs_dir_hash_remove(dir_ni, (const FILE_NAME_ATTR*)key);
+	else
+		ntfs_dir_hash_free(dir_ni);
 	return ret;
 err_out:
 	ret = STATUS_ERROR;
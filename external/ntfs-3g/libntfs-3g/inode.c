@@ -94,9 +94,15 @@ static ntfs_inode *__ntfs_inode_allocate(ntfs_volume *vol)
 {
 	ntfs_inode *ni;
 
-	ni = (ntfs_inode*)ntfs_calloc(sizeof(ntfs_inode));
-	if (ni)
-		ni->vol = vol;
+	if (vol) {
+		ni = (ntfs_inode*)ntfs_pool_get(&vol->inode_pool,
+					sizeof(ntfs_inode));
+		if (ni) {
+			memset(ni, 0, sizeof(ntfs_inode));
+			ni->vol = vol;
+		}
+	} else
+		ni = (ntfs_inode*)ntfs_calloc(sizeof(ntfs_inode));
 	return ni;
 }
 
@@ -128,8 +134,16 @@ static void __ntfs_inode_release(ntfs_inode *ni)
 			       (long long)ni->mft_no);
 	if (NInoAttrList(ni) && ni->attr_list)
 		free(ni->attr_list);
-	free(ni->mrec);
-	free(ni);
+	ntfs_attrlist_index_free(ni);
+	ntfs_dir_hash_free(ni);
+	if (ni->vol) {
+		/* recycle the mft record and the inode */
+		ntfs_pool_put(&ni->vol->mrec_pool, ni->mrec);
+		ntfs_pool_put(&ni->vol->inode_pool, ni);
+	} else {
+		free(ni->mrec);
+		free(ni);
+	}
 	return;
 }
 
@@ -173,6 +187,10 @@ static ntfs_inode *ntfs_inode_real_open(ntfs_volume *vol, const MFT_REF mref)
 	ni = __ntfs_inode_allocate(vol);
 	if (!ni)
 		goto out;
+	ni->mrec = (MFT_RECORD*)ntfs_pool_get(&vol->mrec_pool,
+					vol->mft_record_size);
+	if (!ni->mrec)
+		goto err_out;
 	if (ntfs_file_record_read(vol, mref, &ni->mrec, NULL))
 		goto err_out;
 	if (!(ni->mrec->flags & MFT_RECORD_IN_USE)) {
@@ -647,6 +665,10 @@ ntfs_inode *ntfs_extent_inode_open(ntfs_inode *base_ni, const MFT_REF mref)
 	ni = __ntfs_inode_allocate(base_ni->vol);
 	if (!ni)
 		goto out;
+	ni->mrec = (MFT_RECORD*)ntfs_pool_get(&base_ni->vol->mrec_pool,
+					base_ni->vol->mft_record_size);
+	if (!ni->mrec)
+		goto err_out;
 	if (ntfs_file_record_read(base_ni->vol, le64_to_cpu(mref), &ni->mrec, NULL))
 		goto err_out;
 	ni->mft_no = mft_no;
@@ -1270,6 +1292,7 @@ rollback:
 		ale = (ATTR_LIST_ENTRY*)((u8*)ale + le16_to_cpu(ale->length));
 	}
 	/* Remove in-memory attribute list. */
+	ntfs_attrlist_index_free(ni);
 	ni->attr_list = NULL;
 	ni->attr_list_size = 0;
 	NInoClearAttrList(ni);
@@ -54,9 +54,150 @@
 #include "layout.h"
 #include "lcnalloc.h"
 #include "mft.h"
+#include "cache.h"
 #include "logging.h"
 #include "misc.h"
 
+#if CACHE_MFTREC_SIZE
+
+/*
+ *		Cache of mft records
+ *
+ *	Deprotected copies of the mft records read from the device are
+ *	kept, independently of the inodes, so that opening again an
+ *	inode which has been dropped from the idata cache, or prefetched,
+ *	only costs a copy. The cache entries are allocated once in an
+ *	array, and the record for an entry is at the same rank in the
+ *	block vol->mftrec_data.
+ *
+ *	The records are dropped from the cache when they are written,
+ *	so the cache never has older records than the device.
+ */
+
+/*
+ *		Mft record hashing for the mft record cache
+ */
+
+int ntfs_mft_record_hash(const struct CACHED_GENERIC *item)
+{
+	return (((const struct CACHED_MFTREC*)item)->inum
+			% (2*CACHE_MFTREC_SIZE));
+}
+
+/*
+ *		inum comparing for entering/fetching from cache
+ */
+
+static int mftrec_cache_compare(const struct CACHED_GENERIC *cached,
+			const struct CACHED_GENERIC *wanted)
+{
+	return (((const struct CACHED_MFTREC*)cached)->inum
+			!= ((const struct CACHED_MFTREC*)wanted)->inum);
+}
+
+/*
+ *		Get the location of the record for a cache entry
+ */
+
+static MFT_RECORD *ntfs_mft_record_slot(const ntfs_volume *vol,
+			const struct CACHED_MFTREC *cached)
+{
+	size_t rank;
+
+	rank = (const struct CACHED_MFTREC*)cached
+		- (const struct CACHED_MFTREC*)vol->mftrec_cache->entry;
+	return ((MFT_RECORD*)((char*)vol->mftrec_data
+			+ (rank << vol->mft_record_size_bits)));
+}
+
+/*
+ *		Get a copy of a cached mft record
+ *
+ *	Returns TRUE if the record was found in cache
+ */
+
+static BOOL ntfs_mft_record_fetch(const ntfs_volume *vol, const MFT_REF mref,
+			MFT_RECORD *b)
+{
+	struct CACHED_MFTREC item;
+	struct CACHED_MFTREC *cached;
+	BOOL found;
+
+	found = FALSE;
+	if (vol->mftrec_cache) {
+		item.inum = MREF(mref);
+		item.unused = (const char*)NULL;
+		item.varsize = 0;
+		cached = (struct CACHED_MFTREC*)ntfs_fetch_cache(
+				vol->mftrec_cache, GENERIC(&item),
+				mftrec_cache_compare);
+		if (cached) {
+			memcpy(b, ntfs_mft_record_slot(vol, cached),
+					vol->mft_record_size);
+			found = TRUE;
+		}
+	}
+	return (found);
+}
+
+/*
+ *		Enter a copy of an mft record into cache
+ */
+
+static void ntfs_mft_record_enter(const ntfs_volume *vol, VCN m,
+			const MFT_RECORD *b)
+{
+	struct CACHED_MFTREC item;
+	struct CACHED_MFTREC *cached;
+
+	if (vol->mftrec_cache) {
+		item.inum = m;
+		item.unused = (const char*)NULL;
+		item.varsize = 0;
+		cached = (struct CACHED_MFTREC*)ntfs_enter_cache(
+				vol->mftrec_cache, GENERIC(&item),
+				mftrec_cache_compare);
+		if (cached)
+			memcpy(ntfs_mft_record_slot(vol, cached), b,
+					vol->mft_record_size);
+	}
+}
+
+/*
+ *		Check whether an mft record is cached
+ */
+
+static BOOL ntfs_mft_record_cached(const ntfs_volume *vol, VCN m)
+{
+	struct CACHED_MFTREC item;
+
+	item.inum = m;
+	item.unused = (const char*)NULL;
+	item.varsize = 0;
+	return (ntfs_fetch_cache(vol->mftrec_cache, GENERIC(&item),
+			mftrec_cache_compare) != (struct CACHED_GENERIC*)NULL);
+}
+
+/*
+ *		Drop cached mft records which are being overwritten
+ */
+
+static void ntfs_mft_records_uncache(const ntfs_volume *vol, VCN m,
+			s64 count)
+{
+	struct CACHED_MFTREC item;
+
+	if (vol->mftrec_cache) {
+		item.unused = (const char*)NULL;
+		item.varsize = 0;
+		for (item.inum=m; item.inum<(u64)(m + count); item.inum++)
+			ntfs_invalidate_cache(vol->mftrec_cache,
+					GENERIC(&item), mftrec_cache_compare, 0);
+	}
+}
+
+#endif /* CACHE_MFTREC_SIZE */
+
 /**
  * ntfs_mft_records_read - read records from the mft from disk
  * @vol:	volume to read from
@@ -163,6 +304,9 @@ int ntfs_mft_records_write(const ntfs_volume *vol, const MFT_REF mref,
 				vol->mft_record_size_bits);
 		return -1;
 	}
+#if CACHE_MFTREC_SIZE
+	ntfs_mft_records_uncache(vol, m, count);
+#endif
 	if (m < vol->mftmirr_size) {
 		if (!vol->mftmirr_na) {
 			errno = EINVAL;
@@ -293,11 +437,23 @@ int ntfs_file_record_read(const ntfs_volume *vol, const MFT_REF mref,
 		if (!m)
 			return -1;
 	}
+#if CACHE_MFTREC_SIZE
+	if (!ntfs_mft_record_fetch(vol, mref, m)) {
+		if (ntfs_mft_record_read(vol, mref, m))
+			goto err_out;
+		if (ntfs_mft_record_check(vol, mref, m))
+			goto err_out;
+		ntfs_mft_record_enter(vol, MREF(mref), m);
+	} else
+		if (ntfs_mft_record_check(vol, mref, m))
+			goto err_out;
+#else
 	if (ntfs_mft_record_read(vol, mref, m))
 		goto err_out;
 
 	if (ntfs_mft_record_check(vol, mref, m))
 		goto err_out;
+#endif
 	
 	if (MSEQNO(mref) && MSEQNO(mref) != le16_to_cpu(m->sequence_number)) {
 		ntfs_log_error("Record %llu has wrong SeqNo (%d <> %d)\n",
@@ -316,6 +472,98 @@ err_out:
 	return -1;
 }
 
+#if CACHE_MFTREC_SIZE
+
+static int mref_compare(const void *p1, const void *p2)
+{
+	MFT_REF m1, m2;
+
+	m1 = MREF(*(const MFT_REF*)p1);
+	m2 = MREF(*(const MFT_REF*)p2);
+	return (m1 < m2 ? -1 : (m1 > m2 ? 1 : 0));
+}
+
+#endif /* CACHE_MFTREC_SIZE */
+
+/**
+ * ntfs_mft_prefetch - read ahead mft records into the mft record cache
+ * @vol:	volume to read from
+ * @refs:	mft references of the records which will be wanted
+ * @count:	number of references in @refs
+ *
+ * Read the mft records referenced in @refs which are not cached yet, so
+ * that the next ntfs_file_record_read() for them does not have to access
+ * the device. The records are read in ascending order, and records close
+ * to each other are read in a single request. The array @refs is sorted
+ * in the process.
+ *
+ * Records which cannot be read are ignored, the error will be reported
+ * when they are actually needed.
+ *
+ * Return the number of records entered into the cache, or -1 with errno
+ * set if no memory could be allocated.
+ */
+int ntfs_mft_prefetch(ntfs_volume *vol, MFT_REF *refs, int count)
+{
+	int entered;
+#if CACHE_MFTREC_SIZE
+	MFT_RECORD *buf;
+	s64 limit;
+	VCN first, last, m;
+	int i, j, k;
+
+	entered = 0;
+	if (vol && vol->mftrec_cache && vol->mft_na && refs && (count > 0)) {
+		buf = (MFT_RECORD*)ntfs_malloc(MFT_PREFETCH_MAX
+					* vol->mft_record_size);
+		if (!buf)
+			return (-1);
+		qsort(refs, count, sizeof(MFT_REF), mref_compare);
+		limit = vol->mft_na->initialized_size
+				>> vol->mft_record_size_bits;
+		i = 0;
+		while (i < count) {
+			first = MREF(refs[i]);
+			if ((first >= limit)
+			    || ntfs_mft_record_cached(vol, first)) {
+				i++;
+				continue;
+			}
+				/* gather the next records not cached yet */
+			last = first;
+			for (j=i+1; j<count; j++) {
+				m = MREF(refs[j]);
+				if ((m > last + MFT_PREFETCH_GAP + 1)
+				    || (m >= first + MFT_PREFETCH_MAX)
+				    || (m >= limit))
+					break;
+				if ((m > last)
+				    && !ntfs_mft_record_cached(vol, m))
+					last = m;
+			}
+			if (!ntfs_mft_records_read(vol, first,
+					last - first + 1, buf)) {
+				for (k=i; k<j; k++) {
+					m = MREF(refs[k]);
+					if (m > last)
+						break;
+					ntfs_mft_record_enter(vol, m,
+						(MFT_RECORD*)((char*)buf
+						+ ((m - first)
+						<< vol->mft_record_size_bits)));
+					entered++;
+				}
+			}
+			i = j;
+		}
+		free(buf);
+	}
+#else
+	entered = 0;
+#endif
+	return (entered);
+}
+
 /**
  * ntfs_mft_record_layout - layout an mft record into a memory buffer
  * @vol:	volume to which the mft record will belong
@@ -1,6 +1,7 @@
 /**
  * misc.c : miscellaneous :
  *		- dealing with errors in memory allocation
+ *		- recycling memory blocks through pools
  *
  * Copyright (c) 2008 Jean-Pierre Andre
  *
@@ -32,9 +33,18 @@
 #endif
 
 #include "types.h"
+#include "param.h"
 #include "misc.h"
 #include "logging.h"
 
+/*
+ * The allocators may be called concurrently by threads examining
+ * records, so the count is updated atomically.
+ */
+static unsigned long heap_allocations = 0;
+
+#define COUNT_ALLOCATION() __sync_fetch_and_add(&heap_allocations, 1)
+
 /**
  * ntfs_calloc
  * 
@@ -45,7 +55,9 @@ void *ntfs_calloc(size_t size)
 	void *p;
 	
 	p = calloc(1, size);
-	if (!p)
+	if (p)
+		COUNT_ALLOCATION();
+	else
 		ntfs_log_perror("Failed to calloc %lld bytes", (long long)size);
 	return p;
 }
@@ -55,7 +67,83 @@ void *ntfs_malloc(size_t size)
 	void *p;
 	
 	p = malloc(size);
-	if (!p)
+	if (p)
+		COUNT_ALLOCATION();
+	else
 		ntfs_log_perror("Failed to malloc %lld bytes", (long long)size);
 	return p;
 }
+
+/*
+ *		Get the count of memory blocks allocated from heap
+ *	through ntfs_malloc() and ntfs_calloc(), mostly for statistics
+ */
+
+unsigned long ntfs_heap_allocations(void)
+{
+	return (__sync_fetch_and_add(&heap_allocations, 0));
+}
+
+/*
+ *		Get a memory block from a pool
+ *
+ *	All the blocks in a pool must have the same size. A recycled
+ *	block is returned uninitialized, it has to be cleared by the
+ *	caller when needed.
+ *
+ *	Returns the block, or NULL if there is no memory left
+ */
+
+void *ntfs_pool_get(struct NTFS_POOL *pool, size_t size)
+{
+	void *p;
+
+	p = pool->first;
+	if (p) {
+		pool->first = *(void**)p;
+		pool->count--;
+		pool->reused++;
+	} else {
+		p = ntfs_malloc(size);
+		if (p)
+			pool->allocated++;
+	}
+	return (p);
+}
+
+/*
+ *		Return a memory block to a pool
+ *
+ *	The block must have been allocated by malloc() with the size
+ *	of the blocks in the pool, and it must be big enough for
+ *	holding a pointer. When there are already enough free blocks
+ *	in the pool, the block is freed.
+ */
+
+void ntfs_pool_put(struct NTFS_POOL *pool, void *p)
+{
+	if (p) {
+		if (pool->count < POOL_FREE_MAX) {
+			*(void**)p = pool->first;
+			pool->first = p;
+			pool->count++;
+		} else
+			free(p);
+	}
+}
+
+/*
+ *		Free all the blocks held in a pool
+ */
+
+void ntfs_pool_release(struct NTFS_POOL *pool)
+{
+	void *p;
+
+	while (pool->first) {
+		p = pool->first;
+		pool->first = *(void**)p;
+		free(p);
+	}
+	pool->count = 0;
+}
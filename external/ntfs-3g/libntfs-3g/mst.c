@@ -245,3 +245,74 @@ void ntfs_mst_post_write_fixup(NTFS_RECORD *b)
 	}
 }
 
+
+/**
+ * ntfs_mst_post_read_fixups - deprotect consecutive mst protected records
+ * @b:		pointer to the first record
+ * @size:	size in bytes of each record
+ * @count:	number of records
+ * @warn:	whether to log invalid records
+ *
+ * Apply ntfs_mst_post_read_fixup_warn() to @count records of @size bytes
+ * stored consecutively from @b, as read by a single multi-record request.
+ * A record which fails is marked as with a single record, and the following
+ * ones are still deprotected.
+ *
+ * Return 0 if all the records were deprotected, or -1 if some of them
+ * failed, with errno set as for the last failing record.
+ */
+int ntfs_mst_post_read_fixups(NTFS_RECORD *b, const u32 size, s64 count,
+					BOOL warn)
+{
+	int res;
+
+	res = 0;
+	while (count-- > 0) {
+		if (ntfs_mst_post_read_fixup_warn(b, size, warn))
+			res = -1;
+		b = (NTFS_RECORD*)((u8*)b + size);
+	}
+	return (res);
+}
+
+/**
+ * ntfs_mst_pre_write_fixups - protect consecutive records before writing
+ * @b:		pointer to the first record
+ * @size:	size in bytes of each record
+ * @count:	number of records
+ *
+ * Apply ntfs_mst_pre_write_fixup() to @count records of @size bytes stored
+ * consecutively from @b, stopping at the first record which cannot be
+ * protected.
+ *
+ * Return the number of records protected, which are the ones to write, or
+ * -1 if the first record could not be protected, with errno set.
+ */
+s64 ntfs_mst_pre_write_fixups(NTFS_RECORD *b, const u32 size, s64 count)
+{
+	s64 i;
+
+	for (i=0; i<count; i++) {
+		if (ntfs_mst_pre_write_fixup(b, size))
+			return (i ? i : -1);
+		b = (NTFS_RECORD*)((u8*)b + size);
+	}
+	return (count);
+}
+
+/**
+ * ntfs_mst_post_write_fixups - deprotect consecutive records after writing
+ * @b:		pointer to the first record
+ * @size:	size in bytes of each record
+ * @count:	number of records
+ *
+ * Apply ntfs_mst_post_write_fixup() to @count records of @size bytes
+ * stored consecutively from @b, as protected by ntfs_mst_pre_write_fixups().
+ */
+void ntfs_mst_post_write_fixups(NTFS_RECORD *b, const u32 size, s64 count)
+{
+	while (count-- > 0) {
+		ntfs_mst_post_write_fixup(b);
+		b = (NTFS_RECORD*)((u8*)b + size);
+	}
+}
@@ -228,6 +228,142 @@ int ntfs_names_full_collate(const ntfschar *name1, const u32 name1_len,
 	return 0;
 }
 
+/*
+ *		Get the count of leading identical characters in two names
+ *
+ *	The characters are compared four at a time as long as they match.
+ */
+
+static u32 ntfs_ucs_same_count(const ntfschar *s1, const ntfschar *s2,
+			u32 cnt)
+{
+	u64 w1, w2;
+	u32 i;
+
+	i = 0;
+	while ((i + 4) <= cnt) {
+		memcpy(&w1, &s1[i], sizeof(w1));
+		memcpy(&w2, &s2[i], sizeof(w2));
+		if (w1 != w2)
+			break;
+		i += 4;
+	}
+	while ((i < cnt) && (s1[i] == s2[i]))
+		i++;
+	return (i);
+}
+
+/*
+ *		Compare upcased names from some position
+ *
+ *	@upname1 is already upcased, the characters of @name2 are upcased
+ *	when needed. The comparison stops at the first difference, and
+ *	the position of the difference (or @cnt) is returned, along with
+ *	the upcased characters found there.
+ *
+ *	The upcase table normally covers the whole BMP, and there is then
+ *	no need to check the characters against the size of the table.
+ */
+
+static u32 ntfs_upcased_same_count(const ntfschar *upname1,
+			const ntfschar *name2, u32 i, u32 cnt,
+			const ntfschar *upcase, const u32 upcase_len,
+			u16 *pu1, u16 *pu2)
+{
+	u16 u1, u2;
+
+	u1 = u2 = 0;
+	if (upcase_len > 0xffff) {
+		for ( ; i < cnt; i++) {
+			u1 = le16_to_cpu(upname1[i]);
+			u2 = le16_to_cpu(upcase[le16_to_cpu(name2[i])]);
+			if (u1 != u2)
+				break;
+		}
+	} else {
+		for ( ; i < cnt; i++) {
+			u1 = le16_to_cpu(upname1[i]);
+			u2 = le16_to_cpu(name2[i]);
+			if (u2 < upcase_len)
+				u2 = le16_to_cpu(upcase[u2]);
+			if (u1 != u2)
+				break;
+		}
+	}
+	*pu1 = u1;
+	*pu2 = u2;
+	return (i);
+}
+
+/*
+ * ntfs_names_full_collate_upcased() fully collate two Unicode names,
+ *		the first one being also available upcased
+ *
+ * @name1:	first Unicode name to compare
+ * @upname1:	first Unicode name, upcased by ntfs_name_upcase()
+ * @name1_len:	length of first Unicode name to compare
+ * @name2:	second Unicode name to compare
+ * @name2_len:	length of second Unicode name to compare
+ * @ic:		either CASE_SENSITIVE or IGNORE_CASE
+ * @upcase:	upcase table
+ * @upcase_len:	upcase table size
+ *
+ * This collates the same way as ntfs_names_full_collate(), and it is
+ * meant for searching a name in an index, so that the name being
+ * searched is only upcased once.
+ *
+ *  -1 if the first name collates before the second one,
+ *   0 if the names match,
+ *   1 if the second name collates before the first one
+ */
+int ntfs_names_full_collate_upcased(const ntfschar *name1,
+		const ntfschar *upname1, const u32 name1_len,
+		const ntfschar *name2, const u32 name2_len,
+		const IGNORE_CASE_BOOL ic, const ntfschar *upcase,
+		const u32 upcase_len)
+{
+	u32 cnt;
+	u32 i;
+	u16 c1, c2;
+	u16 u1, u2;
+
+	cnt = min(name1_len, name2_len);
+	i = 0;
+	if (ic == CASE_SENSITIVE) {
+		i = ntfs_ucs_same_count(name1, name2, cnt);
+		if (i < cnt) {
+			if (ntfs_upcased_same_count(upname1, name2, i, cnt,
+					upcase, upcase_len, &u1, &u2) < cnt) {
+				if (u1 < u2)
+					return -1;
+				if (u1 > u2)
+					return 1;
+			}
+		}
+	} else {
+		if (ntfs_upcased_same_count(upname1, name2, 0, cnt,
+				upcase, upcase_len, &u1, &u2) < cnt) {
+			if (u1 < u2)
+				return -1;
+			if (u1 > u2)
+				return 1;
+		}
+	}
+	if (name1_len < name2_len)
+		return -1;
+	if (name1_len > name2_len)
+		return 1;
+	if ((ic == CASE_SENSITIVE) && (i < cnt)) {
+		c1 = le16_to_cpu(name1[i]);
+		c2 = le16_to_cpu(name2[i]);
+		if (c1 < c2)
+			return -1;
+		if (c1 > c2)
+			return 1;
+	}
+	return 0;
+}
+
 /**
  * ntfs_ucsncmp - compare two little endian Unicode strings
  * @s1:		first string
@@ -443,60 +579,6 @@ void ntfs_file_value_upcase(FILE_NAME_ATTR *file_name_attr,
    Jean-Pierre Andre made it compliant with RFC3629/RFC2781.
 */
  
-/* 
- * Return the amount of 8-bit elements in UTF-8 needed (without the terminating
- * null) to store a given UTF-16LE string.
- *
- * Return -1 with errno set if string has invalid byte sequence or too long.
- */
-static int utf16_to_utf8_size(const ntfschar *ins, const int ins_len, int outs_len)
-{
-	int i, ret = -1;
-	int count = 0;
-	BOOL surrog;
-
-	surrog = FALSE;
-	for (i = 0; i < ins_len && ins[i]; i++) {
-		unsigned short c = le16_to_cpu(ins[i]);
-		if (surrog) {
-			if ((c >= 0xdc00) && (c < 0xe000)) {
-				surrog = FALSE;
-				count += 4;
-			} else 
-				goto fail;
-		} else
-			if (c < 0x80)
-				count++;
-			else if (c < 0x800)
-				count += 2;
-			else if (c < 0xd800)
-				count += 3;
-			else if (c < 0xdc00)
-				surrog = TRUE;
-#if NOREVBOM
-			else if ((c >= 0xe000) && (c < 0xfffe))
-#else
-			else if (c >= 0xe000)
-#endif
-				count += 3;
-			else 
-				goto fail;
-		if (count > outs_len) {
-			errno = ENAMETOOLONG;
-			goto out;
-		}
-	}
-	if (surrog) 
-		goto fail;
-
-	ret = count;
-out:
-	return ret;
-fail:
-	errno = EILSEQ;
-	goto out;
-}
-
 /*
  * ntfs_utf16_to_utf8 - convert a little endian UTF16LE string to an UTF-8 string
  * @ins:	input utf16 string buffer
@@ -517,32 +599,59 @@ static int ntfs_utf16_to_utf8(const ntfschar *ins, const int ins_len,
 #endif /* defined(__APPLE__) || defined(__DARWIN__) */
 
 	char *t;
-	int i, size, ret = -1;
+	char *end;
+	int i, ret = -1;
 	int halfpair;
+	BOOL allocated;
+	unsigned short c;
+	u64 w;
 
 	halfpair = 0;
-	if (!*outs)
-		outs_len = PATH_MAX;
-
-	size = utf16_to_utf8_size(ins, ins_len, outs_len);
-
-	if (size < 0)
-		goto out;
-
+	allocated = FALSE;
 	if (!*outs) {
-		outs_len = size + 1;
-		*outs = ntfs_malloc(outs_len);
+			/* at most three bytes per utf16 character */
+		outs_len = (ins_len < PATH_MAX/3 ? 3*ins_len : PATH_MAX);
+		*outs = ntfs_malloc(outs_len + 1);
 		if (!*outs)
 			goto out;
+		allocated = TRUE;
 	}
 
 	t = *outs;
-
-	for (i = 0; i < ins_len && ins[i]; i++) {
-	    unsigned short c = le16_to_cpu(ins[i]);
-			/* size not double-checked */
+	end = t + outs_len;
+
+	i = 0;
+	while (i < ins_len) {
+			/*
+			 * Fast path for plain ASCII : copy four characters
+			 * at a time as long as they are in the range 1..127
+			 */
+		if (!halfpair) {
+			while (((i + 4) <= ins_len) && ((end - t) >= 4)) {
+				memcpy(&w, &ins[i], sizeof(w));
+				w = le64_to_cpu(w);
+				if ((w & 0xff80ff80ff80ff80ULL)
+				    || (((w + 0x007f007f007f007fULL)
+						& 0x0080008000800080ULL)
+					!= 0x0080008000800080ULL))
+					break;
+				t[0] = w;
+				t[1] = w >> 16;
+				t[2] = w >> 32;
+				t[3] = w >> 48;
+				t += 4;
+				i += 4;
+			}
+			if (i >= ins_len)
+				break;
+		}
+		c = le16_to_cpu(ins[i]);
+		if (!c)
+			break;
 		if (halfpair) {
 			if ((c >= 0xdc00) && (c < 0xe000)) {
+				if ((end - t) < 4)
+					goto toolong;
 				*t++ = 0xf0 + (((halfpair + 64) >> 8) & 7);
 				*t++ = 0x80 + (((halfpair + 64) >> 2) & 63);
 				*t++ = 0x80 + ((c >> 6) & 15) + ((halfpair & 3) << 4);
@@ -551,25 +660,40 @@ static int ntfs_utf16_to_utf8(const ntfschar *ins, const int ins_len,
 			} else 
 				goto fail;
 		} else if (c < 0x80) {
+			if (t >= end)
+				goto toolong;
 			*t++ = c;
 	    	} else {
 			if (c < 0x800) {
+				if ((end - t) < 2)
+					goto toolong;
 			   	*t++ = (0xc0 | ((c >> 6) & 0x3f));
 			        *t++ = 0x80 | (c & 0x3f);
 			} else if (c < 0xd800) {
+				if ((end - t) < 3)
+					goto toolong;
 			   	*t++ = 0xe0 | (c >> 12);
 			   	*t++ = 0x80 | ((c >> 6) & 0x3f);
 		        	*t++ = 0x80 | (c & 0x3f);
 			} else if (c < 0xdc00)
 				halfpair = c;
+#if NOREVBOM
+			else if ((c >= 0xe000) && (c < 0xfffe)) {
+#else
 			else if (c >= 0xe000) {
+#endif
+				if ((end - t) < 3)
+					goto toolong;
 				*t++ = 0xe0 | (c >> 12);
 				*t++ = 0x80 | ((c >> 6) & 0x3f);
 			        *t++ = 0x80 | (c & 0x3f);
 			} else 
 				goto fail;
 	        }
+		i++;
 	}
+	if (halfpair)
+		goto fail;
 	*t = '\0';
 	
 #if defined(__APPLE__) || defined(__DARWIN__)
@@ -604,58 +728,20 @@ static int ntfs_utf16_to_utf8(const ntfschar *ins, const int ins_len,
 	ret = t - *outs;
 out:
 	return ret;
+toolong:
+	errno = ENAMETOOLONG;
+	goto failed;
 fail:
 	errno = EILSEQ;
-	goto out;
-}
-
-/* 
- * Return the amount of 16-bit elements in UTF-16LE needed 
- * (without the terminating null) to store given UTF-8 string.
- *
- * Return -1 with errno set if it's longer than PATH_MAX or string is invalid.
- *
- * Note: This does not check whether the input sequence is a valid utf8 string,
- *	 and should be used only in context where such check is made!
- */
-static int utf8_to_utf16_size(const char *s)
-{
-	int ret = -1;
-	unsigned int byte;
-	size_t count = 0;
-
-	while ((byte = *((const unsigned char *)s++))) {
-		if (++count >= PATH_MAX) 
-			goto fail;
-		if (byte >= 0xc0) {
-			if (byte >= 0xF5) {
-				errno = EILSEQ;
-				goto out;
-			}
-			if (!*s) 
-				break;
-			if (byte >= 0xC0) 
-				s++;
-			if (!*s) 
-				break;
-			if (byte >= 0xE0) 
-				s++;
-			if (!*s) 
-				break;
-			if (byte >= 0xF0) {
-				s++;
-				if (++count >= PATH_MAX)
-					goto fail;
-			}
-		}
+failed:
+		/* do not leave space allocated if failed */
+	if (allocated) {
+		free(*outs);
+		*outs = (char*)NULL;
 	}
-	ret = count;
-out:
-	return ret;
-fail:
-	errno = ENAMETOOLONG;
 	goto out;
 }
+
 /* 
  * This converts one UTF-8 sequence to cpu-endian Unicode value
  * within range U+0 .. U+10ffff and excluding U+D800 .. U+DFFF
@@ -745,18 +831,22 @@ static int ntfs_utf8_to_utf16(const char *ins, ntfschar **outs)
 #endif /* ENABLE_NFCONV */
 #endif /* defined(__APPLE__) || defined(__DARWIN__) */
 	const char *t = ins;
+	const char *end;
 	u32 wc;
 	BOOL allocated;
 	ntfschar *outpos;
-	int shorts, ret = -1;
+	int ret = -1;
+	size_t len;
+	u64 w;
+	int k;
 
-	shorts = utf8_to_utf16_size(ins);
-	if (shorts < 0)
-		goto fail;
+	len = strlen(ins);
+	end = ins + len;
 
 	allocated = FALSE;
 	if (!*outs) {
-		*outs = ntfs_malloc((shorts + 1) * sizeof(ntfschar));
+			/* at most one utf16 character per byte */
+		*outs = ntfs_malloc((len + 1) * sizeof(ntfschar));
 		if (!*outs)
 			goto fail;
 		allocated = TRUE;
@@ -765,17 +855,29 @@ static int ntfs_utf8_to_utf16(const char *ins, ntfschar **outs)
 	outpos = *outs;
 
 	while(1) {
+			/*
+			 * Fast path for plain ASCII : expand eight bytes
+			 * at a time as long as they are below 128
+			 */
+		while ((t + 8) <= end) {
+			memcpy(&w, t, sizeof(w));
+			if (w & 0x8080808080808080ULL)
+				break;
+			for (k=0; k<8; k++)
+				outpos[k] = cpu_to_le16(((const u8*)t)[k]);
+			outpos += 8;
+			t += 8;
+		}
 		int m  = utf8_to_unicode(&wc, t);
 		if (m <= 0) {
-			if (m < 0) {
-				/* do not leave space allocated if failed */
-				if (allocated) {
-					free(*outs);
-					*outs = (ntfschar*)NULL;
+			if (!m) {
+				*outpos = const_cpu_to_le16(0);
+				ret = outpos - *outs;
+				if (ret >= PATH_MAX) {
+					errno = ENAMETOOLONG;
+					ret = -1;
 				}
-				goto fail;
 			}
-			*outpos++ = const_cpu_to_le16(0);
 			break;
 		}
 		if (wc < 0x10000)
@@ -788,7 +890,11 @@ static int ntfs_utf8_to_utf16(const char *ins, ntfschar **outs)
 		t += m;
 	}
 	
-	ret = --outpos - *outs;
+	/* do not leave space allocated if failed */
+	if ((ret < 0) && allocated) {
+		free(*outs);
+		*outs = (ntfschar*)NULL;
+	}
 fail:
 #if defined(__APPLE__) || defined(__DARWIN__)
 #ifdef ENABLE_NFCONV
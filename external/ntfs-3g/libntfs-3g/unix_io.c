@@ -389,3 +389,23 @@ struct ntfs_device_operations ntfs_device_unix_io_ops = {
 	.stat		= ntfs_device_unix_io_stat,
 	.ioctl		= ntfs_device_unix_io_ioctl,
 };
+
+/**
+ * ntfs_device_unix_io_fd - Get the file descriptor of an open device
+ * @dev:	device opened through the unix style operations
+ *
+ * This gives direct access to the device, for instance for splicing
+ * data which needs no processing, bypassing the device operations.
+ *
+ * Returns the file descriptor, or -1 with errno set to EINVAL if
+ * the device is not open or not handled by the unix style operations.
+ */
+int ntfs_device_unix_io_fd(struct ntfs_device *dev)
+{
+	if (!dev || (dev->d_ops != &ntfs_device_unix_io_ops)
+	    || !NDevOpen(dev) || !dev->d_private) {
+		errno = EINVAL;
+		return -1;
+	}
+	return (DEV_FD(dev));
+}
@@ -202,6 +202,10 @@ static int __ntfs_volume_release(ntfs_volume *v)
 	}
 
 	ntfs_free_lru_caches(v);
+	ntfs_pool_release(&v->inode_pool);
+	ntfs_pool_release(&v->mrec_pool);
+	ntfs_pool_release(&v->attr_pool);
+	ntfs_pool_release(&v->ctx_pool);
 	free(v->vol_name);
 	free(v->upcase);
 	if (v->locase) free(v->locase);
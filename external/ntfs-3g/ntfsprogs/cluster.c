@@ -32,87 +32,810 @@
 #ifdef HAVE_STRING_H
 #include <string.h>
 #endif
+#ifdef HAVE_ERRNO_H
+#include <errno.h>
+#endif
+#ifdef HAVE_SYS_STAT_H
+#include <sys/stat.h>
+#endif
 
 #include "cluster.h"
+#include "mftscan.h"
 #include "utils.h"
+#include "attrib.h"
+#include "mft.h"
 #include "logging.h"
 
+#define CLUSTER_MAP_MAGIC "NTFSCMAP"
+#define CLUSTER_MAP_VERSION 2
+#define CLUSTER_MAP_BATCH 1024		/* runs converted per read or write */
+
+/*
+ *	Layout of the side file holding a map, all fields little endian :
+ *	a header followed by the runs, sorted by first cluster, then by
+ *	the attribute names from index 1, each as its length followed
+ *	by its characters.
+ */
+struct cluster_map_header {
+	char magic[8];
+	le32 version;
+	le32 cluster_size;
+	le64 nr_clusters;
+	le64 stamp;
+	le64 count;
+	le32 nr_names;
+	le32 reserved;
+} ;
+
+struct cluster_map_entry {
+	le64 lcn;
+	le64 length;
+	le64 vcn;
+	le64 mft_num;
+	le64 inode;
+	ATTR_TYPES type;
+	le16 instance;
+	le16 reserved;
+	le32 name;
+	le32 reserved2;
+} ;
+
+struct cluster_build {
+	cluster_map *map;
+	s64 room;		/* count of runs allocated in the map */
+	u32 names_room;		/* count of names allocated in the map */
+} ;
+
+struct cluster_scan {
+	LCN c_begin;
+	LCN c_end;
+	cluster_cb *cb;
+	void *data;
+} ;
+
 /**
- * cluster_find
+ * cluster_record - Look for the clusters in the runs of an MFT record
+ *
+ * Called by the MFT scan, possibly by several threads. The user function
+ * is called with the base inode of the record, under the scan lock.
  */
-int cluster_find(ntfs_volume *vol, LCN c_begin, LCN c_end, cluster_cb *cb, void *data)
+static int cluster_record(ntfs_volume *vol, u64 mft_num, MFT_RECORD *mrec,
+		void *data)
 {
-	int j;
-	int result = -1;
-	struct mft_search_ctx *m_ctx = NULL;
-	ntfs_attr_search_ctx  *a_ctx = NULL;
+	struct cluster_scan *cs;
+	ntfs_attr_search_ctx *a_ctx;
+	ntfs_inode *ino = NULL;
 	ATTR_RECORD *rec;
 	runlist *runs;
+	int result = 0;
+	int j;
 
-	if (!vol || !cb)
-		return -1;
+	cs = (struct cluster_scan*)data;
+	ntfs_log_verbose("Inode: %llu\n", (unsigned long long)mft_num);
 
-	m_ctx = mft_get_search_ctx(vol);
-	m_ctx->flags_search = FEMR_IN_USE | FEMR_BASE_RECORD;
+	/* A search context without an inode stays within the record */
+	a_ctx = ntfs_attr_get_search_ctx(NULL, mrec);
+	if (!a_ctx)
+		return -1;
 
-	while (mft_next_record(m_ctx) == 0) {
+	while (!result && (rec = find_attribute(AT_UNUSED, a_ctx))) {
 
-		if (!(m_ctx->flags_match & FEMR_BASE_RECORD))
+		if (!rec->non_resident) {
+			ntfs_log_verbose("0x%02x skipped - attr is resident\n", a_ctx->attr->type);
 			continue;
+		}
 
-		ntfs_log_verbose("Inode: %llu\n", (unsigned long long)
-				m_ctx->inode->mft_no);
+		runs = ntfs_mapping_pairs_decompress(vol, a_ctx->attr, NULL);
+		if (!runs) {
+			ntfs_log_error("Couldn't read the data runs.\n");
+			result = -1;
+			break;
+		}
+
+		ntfs_log_verbose("\t[0x%02X]\n", a_ctx->attr->type);
+
+		ntfs_log_verbose("\t\tVCN\tLCN\tLength\n");
+		for (j = 0; !result && (runs[j].length > 0); j++) {
+			LCN a_begin = runs[j].lcn;
+			LCN a_end   = a_begin + runs[j].length - 1;
 
-		a_ctx = ntfs_attr_get_search_ctx(m_ctx->inode, NULL);
+			if (a_begin < 0)
+				continue;	// sparse, discontiguous, etc
 
-		while ((rec = find_attribute(AT_UNUSED, a_ctx))) {
+			ntfs_log_verbose("\t\t%lld\t%lld-%lld (%lld)\n",
+					(long long)runs[j].vcn,
+					(long long)runs[j].lcn,
+					(long long)(runs[j].lcn +
+					runs[j].length - 1),
+					(long long)runs[j].length);
+			//dprint list
 
-			if (!rec->non_resident) {
-				ntfs_log_verbose("0x%02x skipped - attr is resident\n", a_ctx->attr->type);
-				continue;
+			if ((a_begin > cs->c_end) || (a_end < cs->c_begin))
+				continue;	// before or after search range
+
+			mft_scan_lock();
+			if (!ino) {
+				/* report extents as their base inode */
+				ino = ntfs_inode_open(vol, mrec->base_mft_record
+					? MREF_LE(mrec->base_mft_record)
+					: (MFT_REF)mft_num);
+				if (!ino)
+					ntfs_log_error("Error reading inode %llu.\n",
+						(unsigned long long)mft_num);
 			}
+			if (ino && (*cs->cb) (ino, a_ctx->attr, runs+j, cs->data))
+				result = 1;
+			mft_scan_unlock();
+		}
+		free(runs);
+	}
+
+	if (ino) {
+		mft_scan_lock();
+		ntfs_inode_close(ino);
+		mft_scan_unlock();
+	}
+	ntfs_attr_put_search_ctx(a_ctx);
+	return result;
+}
+
+/**
+ * cluster_find
+ */
+int cluster_find(ntfs_volume *vol, LCN c_begin, LCN c_end, cluster_cb *cb, void *data)
+{
+	struct cluster_scan cs;
+	int result;
+
+	if (!vol || !cb)
+		return -1;
+
+	cs.c_begin = c_begin;
+	cs.c_end = c_end;
+	cs.cb = cb;
+	cs.data = data;
+	result = mft_scan(vol, 0, cluster_record, &cs);
+	return (result > 0 ? 1 : result);
+}
 
-			runs = ntfs_mapping_pairs_decompress(vol, a_ctx->attr, NULL);
-			if (!runs) {
-				ntfs_log_error("Couldn't read the data runs.\n");
-				goto done;
+/*
+ *		Get the index of an attribute name in the map
+ *
+ *	The name is added if it was not met before. To be called under
+ *	the scan lock.
+ *
+ *	Returns the index, or zero if the name could not be added
+ */
+
+static u32 cluster_map_name(struct cluster_build *cb, const ntfschar *uname,
+			int uname_len)
+{
+	cluster_map *map;
+	cluster_name *grown;
+	ntfschar *copy;
+	u32 room;
+	u32 i;
+
+	map = cb->map;
+	for (i=1; i<map->nr_names; i++)
+		if ((map->names[i].uname_len == uname_len)
+		    && !memcmp(map->names[i].uname, uname,
+				uname_len*sizeof(ntfschar)))
+			return (i);
+	if (map->nr_names >= cb->names_room) {
+		room = 2*cb->names_room;
+		grown = (cluster_name*)realloc(map->names,
+				room*sizeof(cluster_name));
+		if (!grown)
+			return (0);
+		map->names = grown;
+		cb->names_room = room;
+	}
+	copy = (ntfschar*)malloc(uname_len*sizeof(ntfschar));
+	if (!copy)
+		return (0);
+	memcpy(copy, uname, uname_len*sizeof(ntfschar));
+	map->names[map->nr_names].uname = copy;
+	map->names[map->nr_names].uname_len = uname_len;
+	return (map->nr_names++);
+}
+
+/**
+ * cluster_map_record - Collect the runs of an MFT record into the map
+ *
+ * Called by the MFT scan, possibly by several threads. The runs are
+ * gathered locally, then appended to the map in a single locked step.
+ */
+static int cluster_map_record(ntfs_volume *vol, u64 mft_num, MFT_RECORD *mrec,
+		void *data)
+{
+	struct cluster_build *cb;
+	ntfs_attr_search_ctx *a_ctx;
+	cluster_extent *local = NULL;
+	cluster_extent *grown;
+	cluster_map *map;
+	ATTR_RECORD *rec;
+	runlist *runs;
+	s64 count = 0;
+	s64 room = 0;
+	u64 base;
+	u32 name;
+	int result = 0;
+	int j;
+
+	cb = (struct cluster_build*)data;
+	base = (mrec->base_mft_record ? MREF_LE(mrec->base_mft_record)
+				: mft_num);
+
+	a_ctx = ntfs_attr_get_search_ctx(NULL, mrec);
+	if (!a_ctx)
+		return -1;
+
+	while (!result && (rec = find_attribute(AT_UNUSED, a_ctx))) {
+		if (!rec->non_resident)
+			continue;
+
+		name = 0;
+		if (rec->name_length) {
+			mft_scan_lock();
+			name = cluster_map_name(cb, (const ntfschar*)((const u8*)
+					rec + le16_to_cpu(rec->name_offset)),
+					rec->name_length);
+			mft_scan_unlock();
+			if (!name) {
+				result = -1;
+				break;
 			}
+		}
+		runs = ntfs_mapping_pairs_decompress(vol, rec, NULL);
+		if (!runs) {
+			ntfs_log_error("Couldn't read the data runs of record "
+				"%llu.\n", (unsigned long long)mft_num);
+			result = -1;
+			break;
+		}
+		for (j = 0; !result && (runs[j].length > 0); j++) {
+			if (runs[j].lcn < 0)
+				continue;	// sparse, discontiguous, etc
+			if (count >= room) {
+				room = (room ? 2*room : 16);
+				grown = (cluster_extent*)realloc(local,
+					room*sizeof(cluster_extent));
+				if (!grown) {
+					result = -1;
+					break;
+				}
+				local = grown;
+			}
+			local[count].lcn = runs[j].lcn;
+			local[count].length = runs[j].length;
+			local[count].vcn = runs[j].vcn;
+			local[count].mft_num = mft_num;
+			local[count].inode = base;
+			local[count].type = rec->type;
+			local[count].instance = le16_to_cpu(rec->instance);
+			local[count].name = name;
+			local[count].reach = 0;
+			count++;
+		}
+		free(runs);
+	}
+	ntfs_attr_put_search_ctx(a_ctx);
 
-			ntfs_log_verbose("\t[0x%02X]\n", a_ctx->attr->type);
+	if (!result && count) {
+		mft_scan_lock();
+		map = cb->map;
+		if ((map->count + count) > cb->room) {
+			room = 2*cb->room;
+			if (room < (map->count + count))
+				room = map->count + count;
+			grown = (cluster_extent*)realloc(map->extents,
+					room*sizeof(cluster_extent));
+			if (grown) {
+				map->extents = grown;
+				cb->room = room;
+			} else
+				result = -1;
+		}
+		if (!result) {
+			memcpy(&map->extents[map->count], local,
+					count*sizeof(cluster_extent));
+			map->count += count;
+		}
+		mft_scan_unlock();
+	}
+	free(local);
+	return result;
+}
 
-			ntfs_log_verbose("\t\tVCN\tLCN\tLength\n");
-			for (j = 0; runs[j].length > 0; j++) {
-				LCN a_begin = runs[j].lcn;
-				LCN a_end   = a_begin + runs[j].length - 1;
+static int cluster_map_cmp(const void *p1, const void *p2)
+{
+	const cluster_extent *e1 = (const cluster_extent*)p1;
+	const cluster_extent *e2 = (const cluster_extent*)p2;
+
+	if (e1->lcn != e2->lcn)
+		return (e1->lcn < e2->lcn ? -1 : 1);
+	if (e1->mft_num != e2->mft_num)
+		return (e1->mft_num < e2->mft_num ? -1 : 1);
+	if (e1->vcn != e2->vcn)
+		return (e1->vcn < e2->vcn ? -1 : 1);
+	return (0);
+}
+
+/*
+ *		Record the highest cluster reached by each run and the
+ *	previous ones, so that a range can be located by a binary search
+ *	even when runs overlap.
+ */
 
-				if (a_begin < 0)
-					continue;	// sparse, discontiguous, etc
+static void cluster_map_reach(cluster_map *map)
+{
+	cluster_extent *ext;
+	LCN reach;
+	s64 i;
+
+	reach = -1;
+	for (i=0; i<map->count; i++) {
+		ext = &map->extents[i];
+		if ((ext->lcn + ext->length - 1) > reach)
+			reach = ext->lcn + ext->length - 1;
+		ext->reach = reach;
+	}
+}
+
+/**
+ * cluster_map_build - Build the reverse map of a volume
+ *
+ * A single MFT scan, possibly by several threads, collects the runs of all
+ * the attributes, which are then sorted by first cluster.
+ *
+ * Return:  the map, to be freed by cluster_map_free()
+ *	    NULL on error
+ */
+cluster_map *cluster_map_build(ntfs_volume *vol)
+{
+	struct cluster_build cb;
+	cluster_map *map;
 
-				ntfs_log_verbose("\t\t%lld\t%lld-%lld (%lld)\n",
-						(long long)runs[j].vcn,
-						(long long)runs[j].lcn,
-						(long long)(runs[j].lcn +
-						runs[j].length - 1),
-						(long long)runs[j].length);
-				//dprint list
+	if (!vol)
+		return NULL;
 
-				if ((a_begin > c_end) || (a_end < c_begin))
-					continue;	// before or after search range
+	map = (cluster_map*)calloc(1, sizeof(cluster_map));
+	if (!map)
+		return NULL;
 
-				if ((*cb) (m_ctx->inode, a_ctx->attr, runs+j, data))
-					return 1;
+	/* the unnamed attributes get the index zero */
+	map->names = (cluster_name*)calloc(16, sizeof(cluster_name));
+	map->nr_names = 1;
+	if (!map->names || utils_allocation_stamp(vol, &map->stamp)) {
+		cluster_map_free(map);
+		return NULL;
+	}
+
+	cb.map = map;
+	cb.room = 0;
+	cb.names_room = 16;
+	if (mft_scan(vol, 0, cluster_map_record, &cb)) {
+		cluster_map_free(map);
+		return NULL;
+	}
+	if (map->count)
+		qsort(map->extents, map->count, sizeof(cluster_extent),
+				cluster_map_cmp);
+	cluster_map_reach(map);
+	return map;
+}
+
+/**
+ * cluster_map_save - Save a map into a side file
+ *
+ * Return:  0 Success
+ *	   -1 Error, the file could not be written
+ */
+int cluster_map_save(ntfs_volume *vol, const cluster_map *map, const char *path)
+{
+	struct cluster_map_header header;
+	struct cluster_map_entry *entries;
+	const cluster_extent *ext;
+	const cluster_name *name;
+	FILE *f;
+	le16 len;
+	s64 i;
+	int n;
+	int j;
+	int err;
+
+	if (!vol || !map || !path)
+		return -1;
+
+	f = fopen(path, "w");
+	if (!f) {
+		ntfs_log_perror("Failed to create %s", path);
+		return -1;
+	}
+
+	memset(&header, 0, sizeof(header));
+	memcpy(header.magic, CLUSTER_MAP_MAGIC, sizeof(header.magic));
+	header.version = cpu_to_le32(CLUSTER_MAP_VERSION);
+	header.cluster_size = cpu_to_le32(vol->cluster_size);
+	header.nr_clusters = cpu_to_le64(vol->nr_clusters);
+	header.stamp = cpu_to_le64(map->stamp);
+	header.count = cpu_to_le64(map->count);
+	header.nr_names = cpu_to_le32(map->nr_names);
+
+	entries = (struct cluster_map_entry*)calloc(CLUSTER_MAP_BATCH,
+				sizeof(struct cluster_map_entry));
+	err = (!entries || (fwrite(&header, sizeof(header), 1, f) != 1));
+	for (i=0; !err && (i<map->count); i+=n) {
+		n = CLUSTER_MAP_BATCH;
+		if ((map->count - i) < n)
+			n = map->count - i;
+		for (j=0; j<n; j++) {
+			ext = &map->extents[i + j];
+			entries[j].lcn = cpu_to_le64(ext->lcn);
+			entries[j].length = cpu_to_le64(ext->length);
+			entries[j].vcn = cpu_to_le64(ext->vcn);
+			entries[j].mft_num = cpu_to_le64(ext->mft_num);
+			entries[j].inode = cpu_to_le64(ext->inode);
+			entries[j].type = ext->type;
+			entries[j].instance = cpu_to_le16(ext->instance);
+			entries[j].name = cpu_to_le32(ext->name);
+		}
+		if (fwrite(entries, sizeof(struct cluster_map_entry), n, f)
+				!= (size_t)n)
+			err = 1;
+	}
+	for (i=1; !err && (i<map->nr_names); i++) {
+		name = &map->names[i];
+		len = cpu_to_le16(name->uname_len);
+		if ((fwrite(&len, sizeof(len), 1, f) != 1)
+		    || (fwrite(name->uname, sizeof(ntfschar),
+				name->uname_len, f) != (size_t)name->uname_len))
+			err = 1;
+	}
+	if (fclose(f))
+		err = 1;
+	if (err)
+		ntfs_log_perror("Failed to write %s", path);
+	free(entries);
+	return (err ? -1 : 0);
+}
+
+/**
+ * cluster_map_load - Load a map saved into a side file
+ *
+ * The map is only accepted if it was built on the same volume, and no
+ * clusters or MFT records have been allocated or freed since then.
+ * A map saved in an older layout is considered as stale.
+ *
+ * Return:  the map, to be freed by cluster_map_free()
+ *	    NULL on error, with errno set to ENOENT if there is no file,
+ *		 EINVAL if the file is not a map of this volume or ESTALE
+ *		 if the volume has changed since the map was built
+ */
+cluster_map *cluster_map_load(ntfs_volume *vol, const char *path)
+{
+	struct cluster_map_header header;
+	struct cluster_map_entry *entries;
+	cluster_extent *ext;
+	cluster_name *name;
+	cluster_map *map;
+	struct stat st;
+	FILE *f;
+	size_t got;
+	u64 stamp;
+	u64 count;
+	u64 room;
+	u32 nr_names;
+	le16 len;
+	s64 i;
+	int n;
+	int j;
+	int err;
+
+	if (!vol || !path) {
+		errno = EINVAL;
+		return NULL;
+	}
+
+	f = fopen(path, "r");
+	if (!f)
+		return NULL;
+
+	map = (cluster_map*)calloc(1, sizeof(cluster_map));
+	entries = (struct cluster_map_entry*)malloc(CLUSTER_MAP_BATCH
+				* sizeof(struct cluster_map_entry));
+	err = (!map || !entries) ? ENOMEM : 0;
+	got = (err ? 0 : fread(&header, 1, sizeof(header), f));
+	/* the fields up to nr_clusters are the same in all layouts */
+	if (!err
+	    && ((got < offsetof(struct cluster_map_header, stamp))
+		|| memcmp(header.magic, CLUSTER_MAP_MAGIC, sizeof(header.magic))
+		|| (le32_to_cpu(header.cluster_size) != vol->cluster_size)
+		|| (sle64_to_cpu(header.nr_clusters) != vol->nr_clusters)))
+		err = EINVAL;
+	if (!err && (le32_to_cpu(header.version) < CLUSTER_MAP_VERSION))
+		err = ESTALE;
+	if (!err
+	    && ((got != sizeof(header))
+		|| (le32_to_cpu(header.version) != CLUSTER_MAP_VERSION)))
+		err = EINVAL;
+	if (!err && utils_allocation_stamp(vol, &stamp))
+		err = EIO;
+	if (!err && (le64_to_cpu(header.stamp) != stamp))
+		err = ESTALE;
+	if (!err) {
+		/*
+		 * The count must fit in the file, and cannot exceed the
+		 * number of clusters as the runs are not empty. The names
+		 * which follow have at least one character.
+		 */
+		count = le64_to_cpu(header.count);
+		nr_names = le32_to_cpu(header.nr_names);
+		room = 0;
+		if (!fstat(fileno(f), &st)
+		    && (st.st_size >= (off_t)sizeof(header)))
+			room = st.st_size - sizeof(header);
+		if ((count > room/sizeof(struct cluster_map_entry))
+		    || (count > (u64)vol->nr_clusters))
+			err = EINVAL;
+		else {
+			room -= count*sizeof(struct cluster_map_entry);
+			if (!nr_names || ((nr_names - 1)
+					> room/(sizeof(le16) + sizeof(ntfschar))))
+				err = EINVAL;
+			else if (count > SIZE_MAX/sizeof(cluster_extent))
+				err = ENOMEM;
+		}
+	}
+	if (!err) {
+		map->stamp = stamp;
+		map->count = count;
+		if (map->count) {
+			map->extents = (cluster_extent*)malloc((size_t)count
+					* sizeof(cluster_extent));
+			if (!map->extents)
+				err = ENOMEM;
+		}
+		map->names = (cluster_name*)calloc(nr_names,
+					sizeof(cluster_name));
+		if (!map->names)
+			err = ENOMEM;
+		else
+			map->nr_names = nr_names;
+	}
+	for (i=0; !err && (i<map->count); i+=n) {
+		n = CLUSTER_MAP_BATCH;
+		if ((map->count - i) < n)
+			n = map->count - i;
+		if (fread(entries, sizeof(struct cluster_map_entry), n, f)
+				!= (size_t)n)
+			err = EINVAL;
+		for (j=0; !err && (j<n); j++) {
+			ext = &map->extents[i + j];
+			ext->lcn = sle64_to_cpu(entries[j].lcn);
+			ext->length = sle64_to_cpu(entries[j].length);
+			ext->vcn = sle64_to_cpu(entries[j].vcn);
+			ext->mft_num = le64_to_cpu(entries[j].mft_num);
+			ext->inode = le64_to_cpu(entries[j].inode);
+			ext->type = entries[j].type;
+			ext->instance = le16_to_cpu(entries[j].instance);
+			ext->name = le32_to_cpu(entries[j].name);
+			/* reject what cannot be queried safely */
+			if ((ext->lcn < 0) || (ext->length <= 0)
+			    || ((ext->lcn + ext->length) > vol->nr_clusters)
+			    || ((i + j) && (ext->lcn < ext[-1].lcn))
+			    || (ext->name >= map->nr_names))
+				err = EINVAL;
+		}
+	}
+	for (i=1; !err && (i<map->nr_names); i++) {
+		name = &map->names[i];
+		if ((fread(&len, sizeof(len), 1, f) != 1)
+		    || !le16_to_cpu(len) || (le16_to_cpu(len) > 255))
+			err = EINVAL;
+		else {
+			name->uname_len = le16_to_cpu(len);
+			name->uname = (ntfschar*)malloc(name->uname_len
+						* sizeof(ntfschar));
+			if (!name->uname)
+				err = ENOMEM;
+			else if (fread(name->uname, sizeof(ntfschar),
+					name->uname_len, f)
+					!= (size_t)name->uname_len)
+				err = EINVAL;
+		}
+	}
+	fclose(f);
+	free(entries);
+	if (err) {
+		cluster_map_free(map);
+		errno = err;
+		return NULL;
+	}
+	cluster_map_reach(map);
+	return map;
+}
+
+/*
+ *		Locate the first run which may contain a cluster
+ *
+ *	Returns the index of the first run reaching the cluster, or the
+ *	count of runs if there is none.
+ */
+
+static s64 cluster_map_first(const cluster_map *map, LCN lcn)
+{
+	s64 lo;
+	s64 hi;
+	s64 mid;
+
+	lo = 0;
+	hi = map->count;
+	while (lo < hi) {
+		mid = lo + (hi - lo)/2;
+		if (map->extents[mid].reach < lcn)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	return (lo);
+}
+
+/*
+ *		Check a run of the map against the current attribute
+ *
+ *	The stamp of the map does not change when a record is reused,
+ *	or when clusters change owner with no allocation left over, so
+ *	the run has to be found in the current mapping pairs.
+ *	The runlist of the attribute is kept for the next runs.
+ *
+ *	Returns TRUE if the run is still owned by the attribute
+ */
+
+static BOOL cluster_map_current(ntfs_volume *vol, MFT_RECORD *mrec,
+			ATTR_RECORD *rec, const cluster_extent *ext,
+			runlist **runs)
+{
+	u64 base;
+	int j;
+
+	base = (mrec->base_mft_record ? MREF_LE(mrec->base_mft_record)
+				: ext->mft_num);
+	if (!(mrec->flags & MFT_RECORD_IN_USE)
+	    || (base != ext->inode)
+	    || !rec->non_resident
+	    || (sle64_to_cpu(rec->lowest_vcn) > ext->vcn)
+	    || (sle64_to_cpu(rec->highest_vcn) < ext->vcn))
+		return (FALSE);
+	if (!*runs) {
+		*runs = ntfs_mapping_pairs_decompress(vol, rec, NULL);
+		if (!*runs)
+			return (FALSE);
+	}
+	j = 0;
+	while (((*runs)[j].length > 0) && ((*runs)[j].vcn < ext->vcn))
+		j++;
+	return (((*runs)[j].vcn == ext->vcn)
+		&& ((*runs)[j].lcn == ext->lcn)
+		&& ((*runs)[j].length == ext->length));
+}
+
+/**
+ * cluster_map_find - Look for the owners of a range of clusters in a map
+ *
+ * Same as cluster_find(), except that only the matching runs are examined,
+ * in the order of their first cluster. The user function gets the base
+ * inode and the attribute as found in the record holding it. Each run is
+ * checked against the record before being reported.
+ *
+ * Return:  0 Success, 1 if stopped by the user function
+ *	   -1 Error, with errno set to ESTALE if the map has to be rebuilt
+ */
+int cluster_map_find(ntfs_volume *vol, const cluster_map *map,
+			LCN c_begin, LCN c_end, cluster_cb *cb, void *data)
+{
+	const cluster_extent *ext;
+	ntfs_attr_search_ctx *a_ctx;
+	ntfs_inode *ino = NULL;
+	MFT_RECORD *mrec = NULL;
+	ATTR_RECORD *rec;
+	runlist_element run;
+	runlist *runs = NULL;
+	u64 mft_num = 0;
+	u16 instance = 0;
+	BOOL stale = FALSE;
+	s64 i;
+	int result = 0;
+
+	if (!vol || !map || !cb)
+		return -1;
+
+	for (i = cluster_map_first(map, c_begin);
+	     !result && (i < map->count) && (map->extents[i].lcn <= c_end);
+	     i++) {
+		ext = &map->extents[i];
+		if ((ext->lcn + ext->length - 1) < c_begin)
+			continue;	// overlapped by a previous run
+
+		if (!mrec || (ext->mft_num != mft_num)) {
+			mft_num = ext->mft_num;
+			free(runs);
+			runs = NULL;
+			if (ntfs_file_record_read(vol, mft_num, &mrec, NULL)) {
+				ntfs_log_error("Error reading record %llu.\n",
+					(unsigned long long)mft_num);
+				result = -1;
+				break;
+			}
+		}
+		if (!ino || (ino->mft_no != ext->inode)) {
+			if (ino)
+				ntfs_inode_close(ino);
+			ino = ntfs_inode_open(vol, ext->inode);
+			if (!ino) {
+				ntfs_log_error("Inode %llu does not match the "
+					"map, it has to be rebuilt.\n",
+					(unsigned long long)ext->inode);
+				stale = TRUE;
+				result = -1;
+				break;
 			}
 		}
 
+		a_ctx = ntfs_attr_get_search_ctx(NULL, mrec);
+		if (!a_ctx) {
+			result = -1;
+			break;
+		}
+		do {
+			rec = find_attribute(ext->type, a_ctx);
+		} while (rec && (le16_to_cpu(rec->instance) != ext->instance));
+		if (runs && (ext->instance != instance)) {
+			free(runs);
+			runs = NULL;
+		}
+		instance = ext->instance;
+		if (rec && cluster_map_current(vol, mrec, rec, ext, &runs)) {
+			run.vcn = ext->vcn;
+			run.lcn = ext->lcn;
+			run.length = ext->length;
+			if ((*cb) (ino, rec, &run, data))
+				result = 1;
+		} else {
+			ntfs_log_error("Record %llu does not match the map, "
+				"it has to be rebuilt.\n",
+				(unsigned long long)mft_num);
+			stale = TRUE;
+			result = -1;
+		}
 		ntfs_attr_put_search_ctx(a_ctx);
-		a_ctx = NULL;
 	}
 
-	result = 0;
-done:
-	ntfs_attr_put_search_ctx(a_ctx);
-	mft_put_search_ctx(m_ctx);
-
+	if (ino)
+		ntfs_inode_close(ino);
+	free(runs);
+	free(mrec);
+	if (stale)
+		errno = ESTALE;
 	return result;
 }
 
+/**
+ * cluster_map_free - Free a map
+ */
+void cluster_map_free(cluster_map *map)
+{
+	u32 i;
+
+	if (map) {
+		free(map->extents);
+		if (map->names) {
+			for (i=1; i<map->nr_names; i++)
+				free(map->names[i].uname);
+			free(map->names);
+		}
+		free(map);
+	}
+}
+
@@ -33,7 +33,47 @@ typedef struct {
 
 typedef int (cluster_cb)(ntfs_inode *ino, ATTR_RECORD *attr, runlist_element *run, void *data);
 
+/*
+ * The reverse map of a volume : a run of clusters of each attribute,
+ * sorted by first cluster. The attribute is identified by the record
+ * holding it, its type and its instance. As the instances differ in
+ * each extent of an attribute, its name is also recorded, as an index
+ * into the names of the map.
+ */
+typedef struct {
+	LCN lcn;		/* first cluster of the run */
+	s64 length;		/* count of clusters */
+	VCN vcn;		/* first vcn of the run */
+	u64 mft_num;		/* record holding the attribute */
+	u64 inode;		/* base inode */
+	ATTR_TYPES type;	/* attribute type */
+	u16 instance;		/* attribute instance within the record */
+	u32 name;		/* attribute name, zero if unnamed */
+	LCN reach;		/* last cluster of this run and previous ones */
+} cluster_extent;
+
+typedef struct {
+	ntfschar *uname;
+	int uname_len;
+} cluster_name;
+
+typedef struct {
+	cluster_extent *extents;
+	s64 count;
+	cluster_name *names;	/* distinct attribute names, from index 1 */
+	u32 nr_names;		/* count of names, including the unnamed */
+	u64 stamp;		/* state of the volume when built */
+} cluster_map;
+
 int cluster_find(ntfs_volume *vol, LCN c_begin, LCN c_end, cluster_cb *cb, void *data);
 
+cluster_map *cluster_map_build(ntfs_volume *vol);
+cluster_map *cluster_map_load(ntfs_volume *vol, const char *path);
+int cluster_map_save(ntfs_volume *vol, const cluster_map *map,
+			const char *path);
+int cluster_map_find(ntfs_volume *vol, const cluster_map *map,
+			LCN c_begin, LCN c_end, cluster_cb *cb, void *data);
+void cluster_map_free(cluster_map *map);
+
 #endif /* _CLUSTER_H_ */
 
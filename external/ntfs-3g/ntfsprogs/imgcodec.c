@@ -0,0 +1,600 @@
+/**
+ * imgcodec - Part of the ntfs-3g project.
+ *
+ * Compression and checksums of the chunks of ntfsclone images.
+ *
+ * The chunks are compressed independently, so that several of them
+ * can be processed simultaneously, and a chunk can be restored
+ * without the preceding ones. All the functions may be called by
+ * several threads.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program (in the main directory of the NTFS-3G
+ * distribution in the file COPYING); if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#include "config.h"
+
+#ifdef HAVE_STDLIB_H
+#include <stdlib.h>
+#endif
+#ifdef HAVE_STRING_H
+#include <string.h>
+#endif
+#ifdef HAVE_ERRNO_H
+#include <errno.h>
+#endif
+#ifdef HAVE_UNISTD_H
+#include <unistd.h>
+#endif
+#ifdef HAVE_FCNTL_H
+#include <fcntl.h>
+#endif
+#include <pthread.h>
+#ifndef HAVE_WINDOWS_H
+#include <poll.h>
+#include <sys/wait.h>
+#endif
+
+#include "imgcodec.h"
+
+#define LZ_HASH_BITS	13
+#define LZ_MIN_MATCH	4
+#define LZ_MAX_OFFSET	65535
+#define LZ_SKIP_TRIGGER	6	/* log2 of misses before skipping faster */
+
+#ifndef HAVE_WINDOWS_H
+static const char *external_codecs[] = {
+	"gzip", "bzip2", "xz", "zstd", "lz4", (const char*)NULL
+} ;
+#endif
+
+static u32 crc_table[256];
+static pthread_once_t crc_once = PTHREAD_ONCE_INIT;
+static pthread_mutex_t filter_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static void crc_table_build(void)
+{
+	u32 c;
+	int i, j;
+
+	for (i=0; i<256; i++) {
+		c = i;
+		for (j=0; j<8; j++)
+			c = (c & 1 ? 0xedb88320 ^ (c >> 1) : c >> 1);
+		crc_table[i] = c;
+	}
+}
+
+/*
+ *		Compute the crc32 of a buffer
+ *
+ *	The crc of consecutive buffers may be computed by passing the
+ *	crc of the previous ones, starting from zero.
+ */
+
+u32 image_crc32(u32 crc, const void *buf, size_t size)
+{
+	const u8 *p;
+
+	pthread_once(&crc_once, crc_table_build);
+	p = (const u8*)buf;
+	crc = ~crc;
+	while (size--)
+		crc = crc_table[(crc ^ *p++) & 255] ^ (crc >> 8);
+	return (~crc);
+}
+
+/*
+ *		Digests of buffers (SHA-256, FIPS 180-4)
+ *
+ *	The digest of consecutive buffers is computed by updating the
+ *	same context. A cryptographic digest is used, as data is not
+ *	saved when its digest did not change, and no collision must be
+ *	constructible.
+ */
+
+static const u32 sha256_k[64] = {
+	0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5,
+	0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+	0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3,
+	0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+	0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc,
+	0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+	0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7,
+	0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+	0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13,
+	0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+	0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3,
+	0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+	0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5,
+	0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+	0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208,
+	0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2,
+} ;
+
+#define ROR32(x, n) (((x) >> (n)) | ((x) << (32 - (n))))
+
+static void sha256_block(u32 *state, const u8 *p)
+{
+	u32 w[64];
+	u32 a, b, c, d, e, f, g, h;
+	u32 t1, t2;
+	int i;
+
+	for (i=0; i<16; i++)
+		w[i] = ((u32)p[4*i] << 24) | ((u32)p[4*i + 1] << 16)
+			| ((u32)p[4*i + 2] << 8) | p[4*i + 3];
+	for (i=16; i<64; i++)
+		w[i] = w[i - 16] + w[i - 7]
+			+ (ROR32(w[i - 15], 7) ^ ROR32(w[i - 15], 18)
+				^ (w[i - 15] >> 3))
+			+ (ROR32(w[i - 2], 17) ^ ROR32(w[i - 2], 19)
+				^ (w[i - 2] >> 10));
+	a = state[0]; b = state[1]; c = state[2]; d = state[3];
+	e = state[4]; f = state[5]; g = state[6]; h = state[7];
+	for (i=0; i<64; i++) {
+		t1 = h + (ROR32(e, 6) ^ ROR32(e, 11) ^ ROR32(e, 25))
+			+ ((e & f) ^ (~e & g)) + sha256_k[i] + w[i];
+		t2 = (ROR32(a, 2) ^ ROR32(a, 13) ^ ROR32(a, 22))
+			+ ((a & b) ^ (a & c) ^ (b & c));
+		h = g; g = f; f = e; e = d + t1;
+		d = c; c = b; b = a; a = t1 + t2;
+	}
+	state[0] += a; state[1] += b; state[2] += c; state[3] += d;
+	state[4] += e; state[5] += f; state[6] += g; state[7] += h;
+}
+
+void image_digest_init(struct image_digest *dg)
+{
+	static const u32 sha256_init[8] = {
+		0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a,
+		0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19,
+	} ;
+
+	memcpy(dg->state, sha256_init, sizeof(dg->state));
+	dg->length = 0;
+}
+
+void image_digest_update(struct image_digest *dg, const void *buf,
+			size_t size)
+{
+	const u8 *p;
+	u32 fill, n;
+
+	p = (const u8*)buf;
+	fill = dg->length & 63;
+	dg->length += size;
+	if (fill) {
+		n = 64 - fill;
+		if (n > size)
+			n = size;
+		memcpy(dg->block + fill, p, n);
+		p += n;
+		size -= n;
+		if ((fill + n) < 64)
+			return;
+		sha256_block(dg->state, dg->block);
+	}
+	while (size >= 64) {
+		sha256_block(dg->state, p);
+		p += 64;
+		size -= 64;
+	}
+	if (size)
+		memcpy(dg->block, p, size);
+}
+
+/*
+ *		Get the digest, only the first IMAGE_DIGEST_SIZE bytes
+ *	of the SHA-256 are kept
+ */
+
+void image_digest_final(struct image_digest *dg, u8 *digest)
+{
+	u8 tail[72];
+	u64 bits;
+	u32 fill, pad;
+	int i;
+
+	bits = dg->length << 3;
+	fill = dg->length & 63;
+	pad = (fill < 56 ? 56 - fill : 120 - fill);
+	memset(tail, 0, pad);
+	tail[0] = 0x80;
+	for (i=0; i<8; i++)
+		tail[pad + i] = bits >> (56 - 8*i);
+	image_digest_update(dg, tail, pad + 8);
+	for (i=0; i<IMAGE_DIGEST_SIZE; i++)
+		digest[i] = dg->state[i >> 2] >> (24 - 8*(i & 3));
+}
+
+static u32 lz_hash(const u8 *p)
+{
+	u32 v;
+
+	memcpy(&v, p, sizeof(v));
+	return ((v * 2654435761U) >> (32 - LZ_HASH_BITS));
+}
+
+/*
+ *		Output a length in excess of a token field
+ */
+
+static u8 *lz_put_length(u8 *dst, int len)
+{
+	while (len >= 255) {
+		*dst++ = 255;
+		len -= 255;
+	}
+	*dst++ = len;
+	return (dst);
+}
+
+/*
+ *		Output a sequence of literals, optionally followed by a match
+ *
+ *	The token holds the literal count in its high nibble and the
+ *	match length minus the minimum in its low nibble, the value 15
+ *	meaning that more length bytes follow. The last sequence has
+ *	no match, it is recognized by the end of input.
+ *
+ *	Returns the next output position, or NULL if there is no room.
+ */
+
+static u8 *lz_put_sequence(u8 *dst, u8 *end, const u8 *lit, int lit_len,
+			int offset, int match_len)
+{
+	u8 *token;
+
+	if ((end - dst) < (1 + lit_len + lit_len/255 + 1
+				+ (offset ? 2 + match_len/255 + 1 : 0)))
+		return ((u8*)NULL);
+	token = dst++;
+	*token = (lit_len < 15 ? lit_len : 15) << 4;
+	if (lit_len >= 15)
+		dst = lz_put_length(dst, lit_len - 15);
+	memcpy(dst, lit, lit_len);
+	dst += lit_len;
+	if (offset) {
+		*dst++ = offset & 255;
+		*dst++ = offset >> 8;
+		match_len -= LZ_MIN_MATCH;
+		*token |= (match_len < 15 ? match_len : 15);
+		if (match_len >= 15)
+			dst = lz_put_length(dst, match_len - 15);
+	}
+	return (dst);
+}
+
+int image_lz_compress(const char *in, int size, char *out, int room)
+{
+	u32 table[1 << LZ_HASH_BITS];
+	const u8 *src, *end, *anchor, *p, *ref;
+	u8 *dst, *dst_end;
+	u32 h;
+	int len;
+	int misses;
+
+	src = (const u8*)in;
+	end = src + size;
+	dst = (u8*)out;
+	dst_end = dst + room;
+	memset(table, 0, sizeof(table));
+	anchor = p = src;
+	misses = 0;
+	while ((end - p) >= LZ_MIN_MATCH) {
+			/* table entries are positions plus one */
+		h = lz_hash(p);
+		ref = (table[h] ? src + table[h] - 1 : p);
+		table[h] = p - src + 1;
+		if ((ref < p)
+		    && ((p - ref) <= LZ_MAX_OFFSET)
+		    && !memcmp(ref, p, LZ_MIN_MATCH)) {
+			len = LZ_MIN_MATCH;
+			while (((p + len) < end) && (ref[len] == p[len]))
+				len++;
+			dst = lz_put_sequence(dst, dst_end, anchor,
+					p - anchor, p - ref, len);
+			if (!dst)
+				return (-1);
+			p += len;
+			anchor = p;
+			misses = 0;
+		} else
+			p += 1 + (misses++ >> LZ_SKIP_TRIGGER);
+	}
+	dst = lz_put_sequence(dst, dst_end, anchor, end - anchor, 0, 0);
+	return (dst ? (int)(dst - (u8*)out) : -1);
+}
+
+/*
+ *		Get a length in excess of a token field
+ *
+ *	Returns -1 if the input is truncated
+ */
+
+static int lz_get_length(const u8 **pp, const u8 *end)
+{
+	const u8 *p;
+	int len;
+	int b;
+
+	p = *pp;
+	len = 0;
+	do {
+		if (p >= end)
+			return (-1);
+		b = *p++;
+		len += b;
+	} while ((b == 255) && (len < 0x40000000));
+	*pp = p;
+	return (len);
+}
+
+int image_lz_decompress(const char *in, int size, char *out, int room)
+{
+	const u8 *p, *end, *ref;
+	u8 *dst, *dst_end;
+	int token;
+	int len;
+	int more;
+	int offset;
+
+	p = (const u8*)in;
+	end = p + size;
+	dst = (u8*)out;
+	dst_end = dst + room;
+	while (p < end) {
+		token = *p++;
+		len = token >> 4;
+		if (len == 15) {
+			more = lz_get_length(&p, end);
+			if (more < 0)
+				return (-1);
+			len += more;
+		}
+		if ((len > (end - p)) || (len > (dst_end - dst)))
+			return (-1);
+		memcpy(dst, p, len);
+		dst += len;
+		p += len;
+		if (p >= end)
+			break;
+		if ((end - p) < 2)
+			return (-1);
+		offset = p[0] | (p[1] << 8);
+		p += 2;
+		if (!offset || (offset > (dst - (u8*)out)))
+			return (-1);
+		len = token & 15;
+		if (len == 15) {
+			more = lz_get_length(&p, end);
+			if (more < 0)
+				return (-1);
+			len += more;
+		}
+		len += LZ_MIN_MATCH;
+		if (len > (dst_end - dst))
+			return (-1);
+		ref = dst - offset;
+		if (offset >= len) {
+			memcpy(dst, ref, len);
+			dst += len;
+		} else
+			while (len--)
+				*dst++ = *ref++;
+	}
+	return (dst - (u8*)out);
+}
+
+/*
+ *		Check whether a codec can be used
+ *
+ *	Only well-known compressors are accepted, as the codec recorded
+ *	in an image is run when restoring it.
+ */
+
+BOOL image_codec_known(const char *codec)
+{
+	BOOL known;
+#ifndef HAVE_WINDOWS_H
+	int i;
+#endif
+
+	known = !strcmp(codec, IMAGE_CODEC_LZ);
+#ifndef HAVE_WINDOWS_H
+	for (i=0; !known && external_codecs[i]; i++)
+		known = !strcmp(codec, external_codecs[i]);
+#endif
+	return (known);
+}
+
+#ifndef HAVE_WINDOWS_H
+
+/*
+ *		Start an external codec
+ *
+ *	The pipes are created and the process is forked while holding
+ *	a lock, so that a codec started by another thread does not
+ *	inherit them, and keep them open after we close our ends.
+ */
+
+static pid_t filter_start(const char *codec, BOOL decompress,
+			int *pin, int *pout)
+{
+	int to_child[2];
+	int from_child[2];
+	pid_t pid;
+	int i;
+
+	pid = -1;
+	pthread_mutex_lock(&filter_lock);
+	if (!pipe(to_child)) {
+		if (!pipe(from_child)) {
+			for (i=0; i<2; i++) {
+				fcntl(to_child[i], F_SETFD, FD_CLOEXEC);
+				fcntl(from_child[i], F_SETFD, FD_CLOEXEC);
+			}
+			pid = fork();
+			if (!pid) {
+				if ((dup2(to_child[0], 0) < 0)
+				    || (dup2(from_child[1], 1) < 0))
+					_exit(127);
+				if (decompress)
+					execlp(codec, codec, "-d", "-c",
+						(char*)NULL);
+				else
+					execlp(codec, codec, "-c",
+						(char*)NULL);
+				_exit(127);
+			}
+			if (pid < 0) {
+				close(from_child[0]);
+				close(from_child[1]);
+			}
+		}
+		if (pid < 0) {
+			close(to_child[0]);
+			close(to_child[1]);
+		}
+	}
+	pthread_mutex_unlock(&filter_lock);
+	if (pid > 0) {
+		close(to_child[0]);
+		close(from_child[1]);
+		fcntl(to_child[1], F_SETFL,
+			fcntl(to_child[1], F_GETFL) | O_NONBLOCK);
+		*pin = to_child[1];
+		*pout = from_child[0];
+	}
+	return (pid);
+}
+
+/*
+ *		Pass a buffer through an external codec
+ *
+ *	The input is fed while the output is being collected, so that
+ *	the codec is never blocked on a full pipe.
+ *
+ *	Returns the size of the output, or -1 if there was an error,
+ *	with errno set to EFBIG if the output is bigger than allowed.
+ */
+
+int image_filter(const char *codec, BOOL decompress, const char *in,
+			int size, char **pout, int *proom, int max)
+{
+	struct pollfd pfd[2];
+	char *newbuf;
+	pid_t pid;
+	int fd_in, fd_out;
+	int done, got;
+	int newroom;
+	int status;
+	int err;
+	int n;
+	int k;
+
+	pid = filter_start(codec, decompress, &fd_in, &fd_out);
+	if (pid < 0)
+		return (-1);
+	done = got = err = 0;
+	if (!size) {
+		close(fd_in);
+		fd_in = -1;
+	}
+	while ((fd_out >= 0) && !err) {
+		n = 0;
+		if (fd_in >= 0) {
+			pfd[n].fd = fd_in;
+			pfd[n++].events = POLLOUT;
+		}
+		pfd[n].fd = fd_out;
+		pfd[n++].events = POLLIN;
+		if (poll(pfd, n, -1) < 0) {
+			if (errno != EINTR)
+				err = errno;
+			continue;
+		}
+		if ((fd_in >= 0) && pfd[0].revents) {
+			k = write(fd_in, in + done, size - done);
+			if (k > 0) {
+				done += k;
+				if (done == size) {
+					close(fd_in);
+					fd_in = -1;
+				}
+			} else
+				if ((errno != EAGAIN) && (errno != EINTR))
+					err = (errno ? errno : EIO);
+		}
+		if (!err && pfd[n - 1].revents) {
+			if (got >= max) {
+				err = EFBIG;
+				continue;
+			}
+			if (got == *proom) {
+				newroom = (*proom ? 2*(*proom) : 65536);
+				if (newroom > max)
+					newroom = max;
+				newbuf = (char*)realloc(*pout, newroom);
+				if (!newbuf) {
+					err = ENOMEM;
+					continue;
+				}
+				*pout = newbuf;
+				*proom = newroom;
+			}
+			k = read(fd_out, *pout + got,
+				(*proom < max ? *proom : max) - got);
+			if (k > 0)
+				got += k;
+			else if (!k) {
+				close(fd_out);
+				fd_out = -1;
+			} else
+				if (errno != EINTR)
+					err = errno;
+		}
+	}
+	if (fd_in >= 0)
+		close(fd_in);
+	if (fd_out >= 0)
+		close(fd_out);
+	while ((waitpid(pid, &status, 0) < 0) && (errno == EINTR)) { }
+	if (!err && (!WIFEXITED(status) || WEXITSTATUS(status)
+				|| (done < size)))
+		err = EIO;
+	if (err) {
+		errno = err;
+		got = -1;
+	}
+	return (got);
+}
+
+#else /* HAVE_WINDOWS_H */
+
+int image_filter(const char *codec __attribute__((unused)),
+			BOOL decompress __attribute__((unused)),
+			const char *in __attribute__((unused)),
+			int size __attribute__((unused)),
+			char **pout __attribute__((unused)),
+			int *proom __attribute__((unused)),
+			int max __attribute__((unused)))
+{
+	errno = EOPNOTSUPP;
+	return (-1);
+}
+
+#endif /* HAVE_WINDOWS_H */
@@ -0,0 +1,65 @@
+/*
+ * imgcodec - Part of the ntfs-3g project.
+ *
+ * Compression and checksums of the chunks of ntfsclone images.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program (in the main directory of the NTFS-3G
+ * distribution in the file COPYING); if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#ifndef _IMGCODEC_H_
+#define _IMGCODEC_H_
+
+#include "types.h"
+
+#define IMAGE_CODEC_LZ "lz"	/* the built-in codec */
+
+#define IMAGE_DIGEST_SIZE 16	/* bytes kept from a SHA-256 */
+
+struct image_digest {
+	u32 state[8];
+	u64 length;
+	u8 block[64];
+} ;
+
+u32 image_crc32(u32 crc, const void *buf, size_t size);
+
+void image_digest_init(struct image_digest *dg);
+void image_digest_update(struct image_digest *dg, const void *buf,
+			size_t size);
+void image_digest_final(struct image_digest *dg, u8 *digest);
+
+/*
+ * The built-in codec is a byte oriented LZ77 : sequences of literals
+ * followed by a back reference within the previous 64K. It is fast
+ * rather than strong. Both functions return the size of the output,
+ * or -1 if the output does not fit or the input is corrupted.
+ */
+int image_lz_compress(const char *in, int size, char *out, int room);
+int image_lz_decompress(const char *in, int size, char *out, int room);
+
+BOOL image_codec_known(const char *codec);
+
+/*
+ * An external codec is a compressor program, such as gzip or xz,
+ * run as a filter on each chunk. The output buffer is reallocated
+ * as needed, up to max bytes. A process is created for each chunk,
+ * as the chunks must be decoded separately, so external codecs are
+ * only suited to small images.
+ */
+int image_filter(const char *codec, BOOL decompress, const char *in,
+			int size, char **pout, int *proom, int max);
+
+#endif /* _IMGCODEC_H_ */
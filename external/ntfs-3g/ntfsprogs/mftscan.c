@@ -0,0 +1,441 @@
+/**
+ * mftscan - Part of the ntfs-3g project.
+ *
+ * Scan the MFT records of a volume by several threads.
+ *
+ * The MFT bitmap is read whole, and the MFT data is read by the calling
+ * thread in big sequential chunks, skipping the chunks which have no
+ * record in use. The chunks are then passed to worker threads which
+ * apply the fixups to the records in use and call the user function.
+ * The records not in use can be scanned the same way, for undeleting.
+ * When a chunk cannot be read whole, it is read again record by record,
+ * and the records which still cannot be read are skipped.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program (in the main directory of the NTFS-3G
+ * distribution in the file COPYING); if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#include "config.h"
+
+#ifdef HAVE_STDLIB_H
+#include <stdlib.h>
+#endif
+#ifdef HAVE_STRING_H
+#include <string.h>
+#endif
+#ifdef HAVE_ERRNO_H
+#include <errno.h>
+#endif
+#ifdef HAVE_UNISTD_H
+#include <unistd.h>
+#endif
+#include <pthread.h>
+
+#include "mftscan.h"
+#include "attrib.h"
+#include "mst.h"
+#include "logging.h"
+#include "misc.h"
+
+enum {
+	CHUNK_FREE,	/* may be filled by the reader */
+	CHUNK_FULL,	/* waiting for a worker */
+	CHUNK_BUSY	/* being examined by a worker */
+} ;
+
+struct mft_scan_chunk {
+	u8 *buf;
+	u8 *bad;		/* set for the records which could not be read */
+	u64 first;		/* number of first record */
+	s64 count;		/* count of records read */
+	int state;
+} ;
+
+struct mft_scan {
+	ntfs_volume *vol;
+	mft_scan_cb *cb;
+	void *data;
+	u8 *bitmap;
+	s64 bitmap_size;	/* bytes */
+	BOOL unused;		/* examine the records not in use */
+	pthread_mutex_t lock;
+	pthread_cond_t filled;
+	pthread_cond_t emptied;
+	struct mft_scan_chunk *chunks;
+	int nr_chunks;
+	s64 per_chunk;		/* count of records in a chunk */
+	u64 next_fill;		/* sequence number of next chunk to read */
+	u64 next_take;		/* sequence number of next chunk to examine */
+	BOOL eof;
+	BOOL stop;
+	int result;
+} ;
+
+/* Serializes the calls to the library, which is not thread-safe */
+static pthread_mutex_t mft_scan_vol_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/**
+ * mft_scan_lock - Get exclusive access to the library
+ *
+ * To be called by the user function of mft_scan() before calling the
+ * library on the volume being scanned.
+ */
+void mft_scan_lock(void)
+{
+	pthread_mutex_lock(&mft_scan_vol_lock);
+}
+
+/**
+ * mft_scan_unlock - Release exclusive access to the library
+ */
+void mft_scan_unlock(void)
+{
+	pthread_mutex_unlock(&mft_scan_vol_lock);
+}
+
+/*
+ *		Check whether a record is to be examined
+ *
+ *	Only the records described by the bitmap are examined, either
+ *	the ones in use or the ones not in use.
+ */
+
+static BOOL mft_scan_wanted(struct mft_scan *scan, u64 mft_num)
+{
+	BOOL in_use;
+
+	if ((s64)(mft_num >> 3) >= scan->bitmap_size)
+		return (FALSE);
+	in_use = (scan->bitmap[mft_num >> 3] & (1 << (mft_num & 7))) != 0;
+	return (in_use != scan->unused);
+}
+
+/*
+ *		Check whether a range of records has any record to examine
+ */
+
+static BOOL mft_scan_any_wanted(struct mft_scan *scan, u64 first, s64 count)
+{
+	u64 num;
+
+	for (num=first; (s64)(num - first) < count; num++) {
+		if (!(num & 7) && ((s64)(num - first + 8) <= count)
+		    && ((s64)(num >> 3) < scan->bitmap_size)
+		    && (scan->bitmap[num >> 3] == (scan->unused ? 0xff : 0)))
+			num += 7;
+		else
+			if (mft_scan_wanted(scan, num))
+				return (TRUE);
+	}
+	return (FALSE);
+}
+
+/*
+ *		Examine the records of a chunk
+ *
+ *	Returns the non-zero value returned by the user function if any
+ */
+
+static int mft_scan_records(struct mft_scan *scan, struct mft_scan_chunk *chunk)
+{
+	ntfs_volume *vol;
+	MFT_RECORD *mrec;
+	u64 mft_num;
+	s64 i;
+	int res;
+
+	vol = scan->vol;
+	res = 0;
+	for (i=0; (i<chunk->count) && !res; i++) {
+		mft_num = chunk->first + i;
+		if (!mft_scan_wanted(scan, mft_num) || chunk->bad[i])
+			continue;
+		mrec = (MFT_RECORD*)(chunk->buf
+				+ (i << vol->mft_record_size_bits));
+		if (scan->unused)
+			/* whatever is left is worth examining */
+			ntfs_mst_post_read_fixup_warn((NTFS_RECORD*)mrec,
+					vol->mft_record_size, FALSE);
+		else if (!ntfs_is_file_record(mrec->magic)
+		    || ntfs_mst_post_read_fixup_warn((NTFS_RECORD*)mrec,
+				vol->mft_record_size, FALSE)) {
+			ntfs_log_error("Error reading inode %llu.\n",
+					(unsigned long long)mft_num);
+			continue;
+		}
+		res = (*scan->cb)(vol, mft_num, mrec, scan->data);
+	}
+	return (res);
+}
+
+static void *mft_scan_worker(void *arg)
+{
+	struct mft_scan *scan;
+	struct mft_scan_chunk *chunk;
+	int res;
+
+	scan = (struct mft_scan*)arg;
+	pthread_mutex_lock(&scan->lock);
+	for (;;) {
+		while (!scan->stop && !scan->eof
+		    && (scan->next_take == scan->next_fill))
+			pthread_cond_wait(&scan->filled, &scan->lock);
+		if (scan->stop || (scan->next_take == scan->next_fill))
+			break;
+		chunk = &scan->chunks[scan->next_take++ % scan->nr_chunks];
+		chunk->state = CHUNK_BUSY;
+		pthread_mutex_unlock(&scan->lock);
+		res = mft_scan_records(scan, chunk);
+		pthread_mutex_lock(&scan->lock);
+		chunk->state = CHUNK_FREE;
+		if (res && !scan->stop) {
+			scan->stop = TRUE;
+			scan->result = res;
+			pthread_cond_broadcast(&scan->filled);
+		}
+		pthread_cond_broadcast(&scan->emptied);
+	}
+	pthread_mutex_unlock(&scan->lock);
+	return ((void*)NULL);
+}
+
+/*
+ *		Read again record by record the end of a chunk after a short read
+ *
+ *	The records to examine which still cannot be read are logged and
+ *	marked as bad, so that the workers skip them. The other records
+ *	are not needed and are not read again.
+ */
+
+static void mft_scan_read_records(struct mft_scan *scan,
+			struct mft_scan_chunk *chunk, u64 first, s64 count,
+			s64 done)
+{
+	ntfs_volume *vol;
+	s64 br;
+	s64 i;
+
+	vol = scan->vol;
+	for (i=done; i<count; i++) {
+		if (!mft_scan_wanted(scan, first + i))
+			continue;
+		mft_scan_lock();
+		br = ntfs_attr_pread(vol->mft_na,
+				(first + i) << vol->mft_record_size_bits,
+				vol->mft_record_size,
+				chunk->buf + (i << vol->mft_record_size_bits));
+		mft_scan_unlock();
+		if (br != vol->mft_record_size) {
+			ntfs_log_error("Couldn't read MFT Record %llu.\n",
+					(unsigned long long)(first + i));
+			chunk->bad[i] = 1;
+		}
+	}
+}
+
+/*
+ *		Read the MFT into the chunks, as they get free
+ *
+ *	The records which cannot be read are skipped, so the whole MFT
+ *	is always scanned, unless a user function stops the scan.
+ */
+
+static void mft_scan_read(struct mft_scan *scan)
+{
+	struct mft_scan_chunk *chunk;
+	ntfs_volume *vol;
+	s64 nr_mft_records;
+	s64 count;
+	s64 br;
+	u64 first;
+
+	vol = scan->vol;
+	nr_mft_records = vol->mft_na->initialized_size
+				>> vol->mft_record_size_bits;
+	first = 0;
+	while ((s64)first < nr_mft_records) {
+		count = nr_mft_records - first;
+		if (count > scan->per_chunk)
+			count = scan->per_chunk;
+		if (!mft_scan_any_wanted(scan, first, count)) {
+			first += count;
+			continue;
+		}
+		pthread_mutex_lock(&scan->lock);
+		chunk = &scan->chunks[scan->next_fill % scan->nr_chunks];
+		while (!scan->stop && (chunk->state != CHUNK_FREE))
+			pthread_cond_wait(&scan->emptied, &scan->lock);
+		pthread_mutex_unlock(&scan->lock);
+		if (scan->stop)
+			break;
+		mft_scan_lock();
+		br = ntfs_attr_pread(vol->mft_na,
+				first << vol->mft_record_size_bits,
+				count << vol->mft_record_size_bits, chunk->buf);
+		mft_scan_unlock();
+		memset(chunk->bad, 0, count);
+		if (br < (count << vol->mft_record_size_bits))
+			mft_scan_read_records(scan, chunk, first, count,
+				(br > 0 ? br >> vol->mft_record_size_bits : 0));
+		pthread_mutex_lock(&scan->lock);
+		chunk->first = first;
+		chunk->count = count;
+		chunk->state = CHUNK_FULL;
+		scan->next_fill++;
+		pthread_cond_signal(&scan->filled);
+		pthread_mutex_unlock(&scan->lock);
+		first += count;
+	}
+}
+
+/*
+ *		Examine the MFT records in use or not in use
+ */
+
+static int mft_scan_run(ntfs_volume *vol, int threads, BOOL unused,
+			mft_scan_cb *cb, void *data)
+{
+	struct mft_scan scan;
+	pthread_t *workers;
+	int started;
+	int err;
+	int i;
+
+	if (!vol || !cb) {
+		errno = EINVAL;
+		return (-1);
+	}
+	if (threads <= 0) {
+#ifdef _SC_NPROCESSORS_ONLN
+		threads = sysconf(_SC_NPROCESSORS_ONLN);
+#endif
+		if (threads <= 0)
+			threads = 1;
+	}
+	if (threads > MFT_SCAN_THREADS_MAX)
+		threads = MFT_SCAN_THREADS_MAX;
+	scan.vol = vol;
+	scan.cb = cb;
+	scan.data = data;
+	scan.next_fill = 0;
+	scan.next_take = 0;
+	scan.eof = FALSE;
+	scan.stop = FALSE;
+	scan.result = 0;
+	scan.nr_chunks = 2*threads;
+	scan.per_chunk = MFT_SCAN_CHUNK >> vol->mft_record_size_bits;
+	if (scan.per_chunk < 1)
+		scan.per_chunk = 1;
+	scan.unused = unused;
+	err = -1;
+		/* bits beyond the initialized size do not describe records */
+	scan.bitmap_size = (unused ? vol->mftbmp_na->initialized_size
+				: vol->mftbmp_na->data_size);
+	scan.bitmap = (u8*)ntfs_malloc(scan.bitmap_size + 1);
+	if (!scan.bitmap)
+		return (-1);
+	if (ntfs_attr_pread(vol->mftbmp_na, 0, scan.bitmap_size, scan.bitmap)
+			!= scan.bitmap_size) {
+		ntfs_log_perror("Couldn't read $MFT/$BITMAP");
+		goto free_bitmap;
+	}
+	workers = (pthread_t*)ntfs_malloc(threads*sizeof(pthread_t));
+	scan.chunks = (struct mft_scan_chunk*)ntfs_calloc(scan.nr_chunks
+				*sizeof(struct mft_scan_chunk));
+	if (!workers || !scan.chunks)
+		goto free_chunks;
+	for (i=0; i<scan.nr_chunks; i++) {
+		scan.chunks[i].state = CHUNK_FREE;
+		scan.chunks[i].buf = (u8*)ntfs_malloc(MFT_SCAN_CHUNK
+					+ vol->mft_record_size);
+		scan.chunks[i].bad = (u8*)ntfs_malloc(scan.per_chunk);
+		if (!scan.chunks[i].buf || !scan.chunks[i].bad)
+			goto free_chunks;
+	}
+	pthread_mutex_init(&scan.lock, (pthread_mutexattr_t*)NULL);
+	pthread_cond_init(&scan.filled, (pthread_condattr_t*)NULL);
+	pthread_cond_init(&scan.emptied, (pthread_condattr_t*)NULL);
+	for (started=0; started<threads; started++)
+		if (pthread_create(&workers[started], (pthread_attr_t*)NULL,
+				mft_scan_worker, &scan))
+			break;
+	if (started) {
+		mft_scan_read(&scan);
+		err = 0;
+		pthread_mutex_lock(&scan.lock);
+		scan.eof = TRUE;
+		pthread_cond_broadcast(&scan.filled);
+		pthread_mutex_unlock(&scan.lock);
+		for (i=0; i<started; i++)
+			pthread_join(workers[i], (void**)NULL);
+		if (scan.result)
+			err = scan.result;
+	} else
+		ntfs_log_perror("Couldn't start the MFT scan");
+	pthread_cond_destroy(&scan.emptied);
+	pthread_cond_destroy(&scan.filled);
+	pthread_mutex_destroy(&scan.lock);
+free_chunks:
+	if (scan.chunks)
+		for (i=0; i<scan.nr_chunks; i++)
+		{
+			free(scan.chunks[i].buf);
+			free(scan.chunks[i].bad);
+		}
+	free(scan.chunks);
+	free(workers);
+free_bitmap:
+	free(scan.bitmap);
+	return (err);
+}
+
+/**
+ * mft_scan - Examine all the MFT records in use
+ * @vol:      An ntfs volume obtained from ntfs_mount
+ * @threads:  Count of worker threads, or zero to get one per processor
+ * @cb:       Function to call for each record in use
+ * @data:     Parameter to pass to @cb
+ *
+ * The records are passed to @cb in no specified order, and possibly
+ * simultaneously, the records of a chunk being examined in ascending
+ * order by the same thread. The MFT cannot be changed during the scan.
+ * The records which cannot be read are logged and skipped.
+ *
+ * Return:  0  All the records in use have been examined
+ *	    n  The non-zero value returned by @cb which stopped the scan
+ *	   -1  Error occurred, errno is set
+ */
+int mft_scan(ntfs_volume *vol, int threads, mft_scan_cb *cb, void *data)
+{
+	return (mft_scan_run(vol, threads, FALSE, cb, data));
+}
+
+/**
+ * mft_scan_unused - Examine all the MFT records not in use
+ * @vol:      An ntfs volume obtained from ntfs_mount
+ * @threads:  Count of worker threads, or zero to get one per processor
+ * @cb:       Function to call for each record not in use
+ * @data:     Parameter to pass to @cb
+ *
+ * Same as mft_scan() for the records which the MFT bitmap marks as free,
+ * such as the records of deleted files. They are passed to @cb even when
+ * they are not valid file records, with the fixups applied if possible.
+ * As with mft_scan(), the records which cannot be read are only logged,
+ * so that the files which can still be recovered are all listed.
+ */
+int mft_scan_unused(ntfs_volume *vol, int threads, mft_scan_cb *cb, void *data)
+{
+	return (mft_scan_run(vol, threads, TRUE, cb, data));
+}
@@ -0,0 +1,48 @@
+/*
+ * mftscan - Part of the ntfs-3g project.
+ *
+ * Scan the MFT records of a volume by several threads.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program (in the main directory of the NTFS-3G
+ * distribution in the file COPYING); if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#ifndef _MFTSCAN_H_
+#define _MFTSCAN_H_
+
+#include "types.h"
+#include "layout.h"
+#include "volume.h"
+
+#define MFT_SCAN_CHUNK 1048576	/* bytes of $MFT read in a single request */
+#define MFT_SCAN_THREADS_MAX 16	/* max count of threads examining records */
+
+/*
+ * Called by the worker threads for each record examined, after the
+ * fixups have been applied. Several calls may be made simultaneously,
+ * and the library must only be called on the volume between
+ * mft_scan_lock() and mft_scan_unlock(). A non-zero return stops
+ * the scan.
+ */
+typedef int (mft_scan_cb)(ntfs_volume *vol, u64 mft_num, MFT_RECORD *mrec,
+			void *data);
+
+int mft_scan(ntfs_volume *vol, int threads, mft_scan_cb *cb, void *data);
+int mft_scan_unused(ntfs_volume *vol, int threads, mft_scan_cb *cb,
+			void *data);
+void mft_scan_lock(void);
+void mft_scan_unlock(void);
+
+#endif /* _MFTSCAN_H_ */
@@ -62,6 +62,12 @@
 #ifdef HAVE_FCNTL_H
 #include <fcntl.h>
 #endif
+#ifdef HAVE_SYS_IOCTL_H
+#include <sys/ioctl.h>
+#endif
+#ifdef HAVE_SYS_SYSMACROS_H
+#include <sys/sysmacros.h>
+#endif
 #ifdef HAVE_LIMITS_H
 #include <limits.h>
 #endif
@@ -119,6 +125,13 @@
 #	endif
 #endif
 
+#if defined(linux) && defined(_IO) && !defined(BLKZEROOUT)
+#define BLKZEROOUT	_IO(0x12,127)	/* Zero out a range of bytes. */
+#endif
+
+#define ZERO_CHUNK_SIZE	(16*1024*1024)	/* bytes zeroed by a single request */
+#define MAX_ERASE_BLOCK_SIZE (64*1024*1024) /* bigger ones are not detected */
+
 #include "security.h"
 #include "types.h"
 #include "attrib.h"
@@ -227,6 +240,7 @@ static struct mkntfs_options {
 	long mft_zone_multiplier;	/* -z, value from 1 to 4. Default is 1. */
 	long long num_sectors;		/* size of device in sectors */
 	long cluster_size;		/* -c, format with this cluster-size */
+	long erase_block_size;		/* -e, align to flash erase blocks */
 	BOOL with_uuid;			/* -U, request setting an uuid */
 	char *label;			/* -L, volume label */
 } opts;
@@ -257,6 +271,7 @@ static void mkntfs_usage(void)
 "\n"
 "Advanced options:\n"
 "    -c, --cluster-size BYTES        Specify the cluster size for the volume\n"
+"    -e, --erase-block-size BYTES    Align the layout to flash erase blocks\n"
 "    -s, --sector-size BYTES         Specify the sector size for the device\n"
 "    -p, --partition-start SECTOR    Specify the partition start sector\n"
 "    -H, --heads NUM                 Specify the number of heads\n"
@@ -583,6 +598,7 @@ static void mkntfs_init_options(struct mkntfs_options *opts2)
 
 	/* Mark all the numeric options as "unset". */
 	opts2->cluster_size		= -1;
+	opts2->erase_block_size		= -1;
 	opts2->heads			= -1;
 	opts2->mft_zone_multiplier	= -1;
 	opts2->num_sectors		= -1;
@@ -596,11 +612,12 @@ static void mkntfs_init_options(struct mkntfs_options *opts2)
  */
 static BOOL mkntfs_parse_options(int argc, char *argv[], struct mkntfs_options *opts2)
 {
-	static const char *sopt = "-c:CfFhH:IlL:np:qQs:S:TUvVz:";
+	static const char *sopt = "-c:Ce:fFhH:IlL:np:qQs:S:TUvVz:";
 	static const struct option lopt[] = {
 		{ "cluster-size",	required_argument,	NULL, 'c' },
 		{ "debug",		no_argument,		NULL, 'Z' },
 		{ "enable-compression",	no_argument,		NULL, 'C' },
+		{ "erase-block-size",	required_argument,	NULL, 'e' },
 		{ "fast",		no_argument,		NULL, 'f' },
 		{ "force",		no_argument,		NULL, 'F' },
 		{ "heads",		required_argument,	NULL, 'H' },
@@ -653,6 +670,11 @@ static BOOL mkntfs_parse_options(int argc, char *argv[], struct mkntfs_options *
 					&opts2->cluster_size))
 				err++;
 			break;
+		case 'e':
+			if (!mkntfs_parse_long(optarg, "erase block size",
+					&opts2->erase_block_size))
+				err++;
+			break;
 		case 'F':
 			opts2->force = TRUE;
 			break;
@@ -733,10 +755,11 @@ static BOOL mkntfs_parse_options(int argc, char *argv[], struct mkntfs_options *
 		default:
 			if (ntfs_log_parse_option (argv[optind-1]))
 				break;
-			if (((optopt == 'c') || (optopt == 'H') ||
-			     (optopt == 'L') || (optopt == 'p') ||
-			     (optopt == 's') || (optopt == 'S') ||
-			     (optopt == 'N') || (optopt == 'z')) &&
+			if (((optopt == 'c') || (optopt == 'e') ||
+			     (optopt == 'H') || (optopt == 'L') ||
+			     (optopt == 'p') || (optopt == 's') ||
+			     (optopt == 'S') || (optopt == 'N') ||
+			     (optopt == 'z')) &&
 			     (!optarg)) {
 				ntfs_log_error("Option '%s' requires an "
 						"argument.\n", argv[optind-1]);
@@ -3563,6 +3586,74 @@ static long mkntfs_get_page_size(void)
 	return page_size;
 }
 
+#if defined(linux) && defined(HAVE_SYS_SYSMACROS_H)
+
+/**
+ * mkntfs_sysfs_get - read a numeric attribute of a block device from sysfs
+ *
+ * The attributes of the queue and of the device are those of the whole
+ * disk, which is the parent of a partition.
+ */
+static unsigned long mkntfs_sysfs_get(dev_t rdev, BOOL partition,
+		const char *attr)
+{
+	char path[80];
+	unsigned long value;
+	FILE *f;
+
+	value = 0;
+	snprintf(path, sizeof(path), "/sys/dev/block/%u:%u/%s%s",
+			(unsigned int)major(rdev), (unsigned int)minor(rdev),
+			(partition ? "../" : ""), attr);
+	f = fopen(path, "r");
+	if (f) {
+		if (fscanf(f, "%lu", &value) != 1)
+			value = 0;
+		fclose(f);
+	}
+	return value;
+}
+
+#endif
+
+/**
+ * mkntfs_erase_block_size_get - detect the erase block size of flash memory
+ *
+ * This is the preferred erase size of SD and MMC cards, otherwise the
+ * optimal io size or a large discard granularity. Return 0 if unknown.
+ */
+static long mkntfs_erase_block_size_get(struct ntfs_device *dev)
+{
+	long size = 0;
+#if defined(linux) && defined(HAVE_SYS_SYSMACROS_H)
+	static const char *attrs[] = {
+		"device/preferred_erase_size",
+		"queue/optimal_io_size",
+		"queue/discard_granularity",
+	} ;
+	struct stat sbuf;
+	unsigned long value;
+	BOOL partition;
+	unsigned int i;
+
+	if (!dev->d_ops->stat(dev, &sbuf) && S_ISBLK(sbuf.st_mode)) {
+		partition = mkntfs_sysfs_get(sbuf.st_rdev, FALSE,
+				"partition") != 0;
+		for (i=0; !size && (i<sizeof(attrs)/sizeof(attrs[0])); i++) {
+			value = mkntfs_sysfs_get(sbuf.st_rdev, partition,
+					attrs[i]);
+			/* a small discard granularity is just the sector */
+			if ((value > 4096)
+			    && (value <= MAX_ERASE_BLOCK_SIZE)
+			    && !(value & (value - 1)))
+				size = value;
+		}
+	}
+#endif
+	ntfs_log_debug("erase block size = %ld bytes\n", size);
+	return size;
+}
+
 /**
  * mkntfs_override_vol_params -
  */
@@ -3771,6 +3862,35 @@ static BOOL mkntfs_override_vol_params(ntfs_volume *vol)
 				"Compression has been disabled for this "
 				"volume.\n");
 	}
+	/* If user didn't specify the erase block size, try to detect it. */
+	if (opts.erase_block_size < 0) {
+		opts.erase_block_size = mkntfs_erase_block_size_get(vol->dev);
+		if (opts.erase_block_size < (long)vol->cluster_size)
+			opts.erase_block_size = 0;
+	} else if (opts.erase_block_size) {
+		if ((opts.erase_block_size & (opts.erase_block_size - 1))
+		    || (opts.erase_block_size < (long)vol->cluster_size)) {
+			ntfs_log_error("The erase block size is invalid.  It "
+				"must be a power of two, and equal to, or "
+				"larger than, the cluster size.\n");
+			return FALSE;
+		}
+	}
+	/*
+	 * The erase blocks are relative to the device, the partition has
+	 * to start on a cluster boundary for the volume to be aligned.
+	 */
+	if (opts.erase_block_size
+	    && ((opts.part_start_sect * opts.sector_size)
+			& (vol->cluster_size - 1))) {
+		ntfs_log_warning("The partition does not start on a cluster "
+			"boundary, the volume cannot be aligned to erase "
+			"blocks.\n");
+		opts.erase_block_size = 0;
+	}
+	if (opts.erase_block_size)
+		ntfs_log_verbose("Aligning the layout to erase blocks of %ld "
+			"bytes.\n", opts.erase_block_size);
 	vol->nr_clusters = volume_size / vol->cluster_size;
 	/*
 	 * Check the cluster_size and num_sectors for consistency with
@@ -3920,6 +4040,28 @@ static BOOL mkntfs_initialize_bitmaps(void)
 	return (bitmap_allocate(i,1));
 }
 
+/**
+ * mkntfs_erase_align - move a cluster up to the next erase block boundary
+ *
+ * The boundaries are relative to the device, not to the partition. The
+ * cluster is not moved when there is no erase block size, or when the
+ * boundary is beyond @limit.
+ */
+static long long mkntfs_erase_align(long long lcn, long long limit)
+{
+	long long offset;
+	long long aligned;
+
+	if (opts.erase_block_size <= 0)
+		return lcn;
+	offset = opts.part_start_sect * opts.sector_size;
+	aligned = ((lcn << g_vol->cluster_size_bits) + offset
+			+ opts.erase_block_size - 1)
+			& ~((long long)opts.erase_block_size - 1);
+	aligned = (aligned - offset) >> g_vol->cluster_size_bits;
+	return (aligned <= limit ? aligned : lcn);
+}
+
 /**
  * mkntfs_initialize_rl_mft -
  */
@@ -3938,6 +4080,9 @@ static BOOL mkntfs_initialize_rl_mft(void)
 		if (g_mft_lcn * g_vol->cluster_size < 16 * 1024)
 			g_mft_lcn = (16 * 1024 + g_vol->cluster_size - 1) /
 					g_vol->cluster_size;
+		/* Flash memory: start the mft on an erase block. */
+		g_mft_lcn = mkntfs_erase_align(g_mft_lcn,
+				g_vol->nr_clusters >> 3);
 	}
 	ntfs_log_debug("$MFT logical cluster number = 0x%llx\n", g_mft_lcn);
 	/* Determine MFT zone size. */
@@ -3964,6 +4109,9 @@ static BOOL mkntfs_initialize_rl_mft(void)
 	 * of the device.
 	 */
 	g_mft_zone_end += g_mft_lcn;
+	/* Flash memory: start the data allocation on an erase block. */
+	g_mft_zone_end = mkntfs_erase_align(g_mft_zone_end,
+			g_vol->nr_clusters >> 1);
 	/* Create runlist for mft. */
 	g_rl_mft = ntfs_malloc(2 * sizeof(runlist));
 	if (!g_rl_mft)
@@ -3982,6 +4130,8 @@ static BOOL mkntfs_initialize_rl_mft(void)
 	/* Determine mftmirr_lcn (middle of volume). */
 	g_mftmirr_lcn = (opts.num_sectors * opts.sector_size >> 1)
 			/ g_vol->cluster_size;
+	g_mftmirr_lcn = mkntfs_erase_align(g_mftmirr_lcn,
+			g_vol->nr_clusters * 5 >> 3);
 	ntfs_log_debug("$MFTMirr logical cluster number = 0x%llx\n",
 			g_mftmirr_lcn);
 	/* Create runlist for mft mirror. */
@@ -4005,7 +4155,9 @@ static BOOL mkntfs_initialize_rl_mft(void)
 	g_rl_mftmirr[1].length = 0LL;
 	/* Allocate clusters for mft mirror. */
 	done = bitmap_allocate(g_mftmirr_lcn,j);
-	g_logfile_lcn = g_mftmirr_lcn + j;
+	/* Flash memory: the journal is rewritten, start it on an erase block. */
+	g_logfile_lcn = mkntfs_erase_align(g_mftmirr_lcn + j,
+			g_vol->nr_clusters * 5 >> 3);
 	ntfs_log_debug("$LogFile logical cluster number = 0x%llx\n",
 			g_logfile_lcn);
 	return (done);
@@ -4140,6 +4292,66 @@ static BOOL mkntfs_initialize_rl_bad(void)
 	return TRUE;
 }
 
+/**
+ * mkntfs_can_zeroout - tell whether the device can zero blocks itself
+ *
+ * Discarding is not used: whether discarded blocks read as zeroes is not
+ * reliably reported, and discarding would not detect the bad clusters.
+ */
+static BOOL mkntfs_can_zeroout(void)
+{
+#ifdef BLKZEROOUT
+	struct stat sbuf;
+#endif
+	BOOL zeroout;
+
+	zeroout = FALSE;
+#ifdef BLKZEROOUT
+	if (!opts.no_action
+	    && !g_vol->dev->d_ops->stat(g_vol->dev, &sbuf)
+	    && S_ISBLK(sbuf.st_mode))
+		zeroout = TRUE;
+#endif
+	return (zeroout);
+}
+
+/**
+ * mkntfs_zero_clusters - zero a range of clusters by a single request
+ *
+ * When the device cannot zero out, zeroes are written from then on.
+ * Return FALSE if the range could not be zeroed at once, the caller has
+ * then to find the bad clusters, as the device reports them the same way
+ * when zeroing out and when writing.
+ */
+static BOOL mkntfs_zero_clusters(BOOL *zeroout, const char *zeroes,
+			s64 lcn, s64 count)
+{
+	u64 range[2];
+	s64 size;
+	int err;
+
+	size = count << g_vol->cluster_size_bits;
+	if (*zeroout) {
+		range[0] = lcn << g_vol->cluster_size_bits;
+		range[1] = size;
+		err = -1;
+#ifdef BLKZEROOUT
+		err = g_vol->dev->d_ops->ioctl(g_vol->dev, BLKZEROOUT, range);
+#endif
+		if (!err)
+			return TRUE;
+		if (errno == EIO)
+			return FALSE;
+		ntfs_log_verbose("Could not zero out %s (%s), writing "
+			"zeroes.\n", g_vol->dev->d_name, strerror(errno));
+		*zeroout = FALSE;
+	}
+	if (g_vol->dev->d_ops->seek(g_vol->dev,
+			lcn << g_vol->cluster_size_bits, SEEK_SET) == -1)
+		return FALSE;
+	return (mkntfs_write(g_vol->dev, zeroes, size) == size);
+}
+
 /**
  * mkntfs_fill_device_with_zeroes -
  */
@@ -4148,47 +4360,79 @@ static BOOL mkntfs_fill_device_with_zeroes(void)
 	/*
 	 * If not quick format, fill the device with 0s.
 	 * FIXME: Except bad blocks! (AIA)
+	 *
+	 * The device is zeroed by big chunks, and only a chunk which
+	 * fails is zeroed again cluster by cluster to locate the bad ones.
 	 */
 	int i;
 	ssize_t bw;
 	unsigned long long position;
-	float progress_inc = (float)g_vol->nr_clusters / 100;
 	u64 volume_size;
+	s64 lcn, count, chunk;
+	char *zeroes;
+	BOOL zeroout;
 
 	volume_size = g_vol->nr_clusters << g_vol->cluster_size_bits;
 
+	chunk = ZERO_CHUNK_SIZE >> g_vol->cluster_size_bits;
+	if (!chunk)
+		chunk = 1;
+	zeroes = ntfs_calloc(chunk << g_vol->cluster_size_bits);
+	if (!zeroes)
+		return FALSE;
+	zeroout = mkntfs_can_zeroout();
+
 	ntfs_log_progress("Initializing device with zeroes:   0%%");
 	for (position = 0; position < (unsigned long long)g_vol->nr_clusters;
-			position++) {
-		if (!(position % (int)(progress_inc+1))) {
-			ntfs_log_progress("\b\b\b\b%3.0f%%", position /
-					progress_inc);
-		}
-		bw = mkntfs_write(g_vol->dev, g_buf, g_vol->cluster_size);
-		if (bw != (ssize_t)g_vol->cluster_size) {
+			position += count) {
+		ntfs_log_progress("\b\b\b\b%3.0f%%", position * 100.0 /
+				g_vol->nr_clusters);
+		count = g_vol->nr_clusters - position;
+		if (count > chunk)
+			count = chunk;
+		if (mkntfs_zero_clusters(&zeroout, zeroes, position, count))
+			continue;
+		for (lcn = position; lcn < (s64)position + count; lcn++) {
+			if (g_vol->dev->d_ops->seek(g_vol->dev,
+					lcn << g_vol->cluster_size_bits,
+					SEEK_SET) == -1) {
+				ntfs_log_perror("Failed to seek in %s",
+					g_vol->dev->d_name);
+				free(zeroes);
+				return FALSE;
+			}
+			bw = mkntfs_write(g_vol->dev, zeroes,
+					g_vol->cluster_size);
+			if (bw == (ssize_t)g_vol->cluster_size)
+				continue;
 			if (bw != -1 || errno != EIO) {
 				ntfs_log_error("This should not happen.\n");
+				free(zeroes);
 				return FALSE;
 			}
-			if (!position) {
+			if (!lcn) {
 				ntfs_log_error("Error: Cluster zero is bad. "
 					"Cannot create NTFS file "
 					"system.\n");
+				free(zeroes);
 				return FALSE;
 			}
 			/* Add the baddie to our bad blocks list. */
-			if (!append_to_bad_blocks(position))
+			if (!append_to_bad_blocks(lcn)) {
+				free(zeroes);
 				return FALSE;
+			}
 			ntfs_log_quiet("\nFound bad cluster (%lld). Adding to "
 				"list of bad blocks.\nInitializing "
-				"device with zeroes: %3.0f%%", position,
-				position / progress_inc);
-			/* Seek to next cluster. */
-			g_vol->dev->d_ops->seek(g_vol->dev,
-					((off_t)position + 1) *
-					g_vol->cluster_size, SEEK_SET);
+				"device with zeroes: %3.0f%%", (long long)lcn,
+				lcn * 100.0 / g_vol->nr_clusters);
 		}
 	}
+	free(zeroes);
+	if (g_vol->dev->d_ops->seek(g_vol->dev, volume_size, SEEK_SET) == -1) {
+		ntfs_log_perror("Failed to seek in %s", g_vol->dev->d_name);
+		return FALSE;
+	}
 	ntfs_log_progress("\b\b\b\b100%%");
 	position = (volume_size & (g_vol->cluster_size - 1)) /
 			opts.sector_size;
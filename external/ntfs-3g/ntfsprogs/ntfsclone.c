@@ -61,6 +61,10 @@
 #ifdef HAVE_UNISTD_H
 #include <unistd.h>
 #endif
+#ifndef HAVE_WINDOWS_H
+#include <signal.h>
+#endif
+#include <pthread.h>
 
 /*
  * FIXME: ntfsclone do bad things about endians handling. Fix it and remove
@@ -87,6 +91,7 @@
 #include "utils.h"
 /* #include "version.h" */
 #include "misc.h"
+#include "imgcodec.h"
 
 #if defined(linux) && defined(_IO) && !defined(BLKGETSIZE)
 #define BLKGETSIZE	_IO(0x12,96)  /* Get device size in 512-byte blocks. */
@@ -94,6 +99,12 @@
 #if defined(linux) && defined(_IOR) && !defined(BLKGETSIZE64)
 #define BLKGETSIZE64	_IOR(0x12,114,size_t)	/* Get device size in bytes. */
 #endif
+#if defined(linux) && defined(_IO) && !defined(BLKDISCARD)
+#define BLKDISCARD	_IO(0x12,119)	/* Discard a range of bytes. */
+#endif
+#if defined(linux) && defined(_IO) && !defined(BLKZEROOUT)
+#define BLKZEROOUT	_IO(0x12,127)	/* Zero out a range of bytes. */
+#endif
 
 #if defined(linux) || defined(__uClinux__) || defined(__sun) \
 		|| defined(__APPLE__) || defined(__DARWIN__)
@@ -158,6 +169,12 @@ static struct {
 	int metadata_image;
 	int preserve_timestamps;
 	int restore_image;
+	int verify_image;
+	int discard;		/* discard unused clusters of device */
+	int zero_unused;	/* zero unused clusters of device */
+	const char *codec;	/* compression of image chunks */
+	const char *base;	/* base of a differential image */
+	const char *manifest;	/* hashes saved along with an image */
 	char *output;
 	char *volume;
 #ifndef NO_STATFS
@@ -173,6 +190,7 @@ struct bitmap {
 struct progress_bar {
 	u64 start;
 	u64 stop;
+	u64 last;
 	int resolution;
 	float unit;
 };
@@ -213,6 +231,20 @@ static le64 volume_serial_number; /* new random serial number */
 static u64 full_device_size; /* full size, including the backup boot sector */
 
 static BOOL image_is_host_endian = FALSE;
+static BOOL image_is_chunked = FALSE;
+static s64 image_pos; /* next cluster described in the saved image */
+static u32 image_checksum; /* checksum of the index of the saved image */
+static u32 diff_extent_clusters; /* clusters compared at once in diffs */
+static FILE *manifest_out = (FILE*)NULL;
+static BOOL stdout_sparse = FALSE; /* standard output is a regular file */
+static BOOL stdout_punch = FALSE; /* same, with data to overwrite */
+
+	/* buffered input of plain images */
+static struct {
+	char *buf;
+	int size;
+	int pos;
+} image_input;
 
 #define IMAGE_MAGIC "\0ntfsclone-image"
 #define IMAGE_MAGIC_SIZE 16
@@ -238,6 +270,22 @@ static BOOL image_is_host_endian = FALSE;
 #define NTFSCLONE_IMG_VER_MAJOR	10
 #define NTFSCLONE_IMG_VER_MINOR	1
 
+/*
+ * Version 11.0 : the data is the same as in version 10.1, but it is cut
+ * into chunks which are compressed separately, and an index of chunks
+ * is appended. Saved only when compression is requested.
+ */
+#define NTFSCLONE_IMG_VER_MAJOR_CHUNKED	11
+#define NTFSCLONE_IMG_VER_MINOR_CHUNKED	0
+
+/*
+ * Version 12.0 : a chunked image which only holds the extents which
+ * changed since a base image. It cannot be restored without its base,
+ * which is designated by name and by the checksum of its index.
+ */
+#define NTFSCLONE_IMG_VER_MAJOR_DIFF	12
+#define NTFSCLONE_IMG_VER_MINOR_DIFF	0
+
 enum { CMD_GAP, CMD_NEXT } ;
 
 /* All values are in little endian. */
@@ -253,7 +301,66 @@ static struct image_hdr {
 	le32 offset_to_image_data;	/* From start of image_hdr. */
 } __attribute__((__packed__)) image_hdr;
 
+#define IMAGE_CODEC_SIZE 16
+#define IMAGE_INDEX_MAGIC "ntfsidx"
+#define IMAGE_INDEX_MAGIC_SIZE 8
+
+/* Follows the aligned image_hdr in chunked images, in little endian. */
+static struct image_ext_hdr {
+	char codec[IMAGE_CODEC_SIZE];	/* "lz" or an external compressor */
+	le32 chunk_size;		/* Max uncompressed size of chunks */
+	le32 reserved;
+} __attribute__((__packed__)) image_ext_hdr;
+
+/*
+ * Precedes each chunk, the last one being an empty chunk, and the
+ * same headers are repeated in the index at the end of the image.
+ */
+struct image_chunk_hdr {
+	sle64 lcn;			/* First cluster described */
+	le64 offset;			/* Of this header in the image */
+	le32 size;			/* Stored size, zero at the end */
+	le32 raw_size;			/* Uncompressed size */
+	le32 checksum;			/* crc32 of uncompressed data */
+	le32 flags;
+} __attribute__((__packed__));
+
+#define IMAGE_CHUNK_STORED 1		/* compression did not help */
+
+/* Ends a chunked image, so that the index can be found */
+struct image_index_tail {
+	le64 index_offset;
+	le64 nr_chunks;
+	le32 checksum;			/* crc32 of the index */
+	le32 reserved;
+	char magic[IMAGE_INDEX_MAGIC_SIZE];
+} __attribute__((__packed__));
+
+#define IMAGE_BASE_NAME_SIZE 256
+
+/* Follows image_ext_hdr in differential images, in little endian. */
+static struct image_base_hdr {
+	le32 base_checksum;		/* Checksum of the base index */
+	le32 extent_clusters;		/* Clusters compared at once */
+	char base_name[IMAGE_BASE_NAME_SIZE];	/* As designated when saving */
+} __attribute__((__packed__)) image_base_hdr;
+
+#define IMAGE_MANIFEST_MAGIC "ntfsclone-digest"
+#define IMAGE_MANIFEST_MAGIC_SIZE 16
+
+/* Starts a manifest, followed by the digests of extents */
+struct image_manifest_hdr {
+	char magic[IMAGE_MANIFEST_MAGIC_SIZE];
+	le32 cluster_size;
+	le32 extent_clusters;
+	sle64 nr_clusters;
+	le32 image_checksum;		/* Checksum of the image index */
+	le32 reserved;
+	char image_name[IMAGE_BASE_NAME_SIZE];	/* As designated when saving */
+} __attribute__((__packed__));
+
 static int compare_bitmaps(struct bitmap *a, BOOL copy);
+static s64 open_image(const char *name);
 
 #define NTFSCLONE_IMG_HEADER_SIZE_OLD	\
 		(offsetof(struct image_hdr, offset_to_image_data))
@@ -269,6 +376,18 @@ static int compare_bitmaps(struct bitmap *a, BOOL copy);
 #define NTFS_MAX_CLUSTER_SIZE	65536
 #define NTFS_SECTOR_SIZE	  512
 
+#define CLONE_BUFFER_SIZE	(4*1024*1024) /* max bytes read at once */
+#define CLONE_BUFFERS		4 /* buffers between reader and writer */
+#define IMAGE_INPUT_SIZE	(1024*1024) /* buffered input of plain images */
+
+#define IMAGE_CHUNK_SIZE	(1024*1024) /* uncompressed bytes in chunks */
+#define IMAGE_CHUNK_SIZE_MAX	(64*1024*1024) /* accepted when restoring */
+#define IMAGE_CHUNK_WORKERS_MAX	16 /* threads compressing chunks */
+
+#define IMAGE_EXTENT_SIZE	(256*1024) /* bytes compared at once in diffs */
+#define IMAGE_EXTENT_BATCH	64 /* extents hashed at once by a thread */
+#define IMAGE_CHAIN_MAX		64 /* images in a differential chain */
+
 #define rounded_up_division(a, b) (((a) + (b - 1)) / (b))
 
 #define read_all(f, p, n)  io_all((f), (p), (n), 0)
@@ -356,6 +475,12 @@ static void usage(void)
 		"    -O, --overwrite FILE   Clone NTFS to FILE, overwriting if exists\n"
 		"    -s, --save-image       Save to the special image format\n"
 		"    -r, --restore-image    Restore from the special image format\n"
+		"        --compress[=CODEC] Compress the special image by chunks\n"
+		"        --verify-image     Check the chunks of a compressed image\n"
+		"        --base FILE        Only save the changes since the image or manifest FILE\n"
+		"        --manifest FILE    Save the digests of the volume to FILE\n"
+		"        --discard          Discard the unused clusters of the device\n"
+		"        --zero-unused      Zero the unused clusters of the device\n"
 		"        --rescue           Continue after disk read errors\n"
 		"    -m, --metadata         Clone *only* metadata (for NTFS experts)\n"
 		"    -n, --no-action        Test restoring, without outputting anything\n"
@@ -372,6 +497,8 @@ static void usage(void)
 		"\n"
 		"    If FILE is '-' then send the image to the standard output. If SOURCE is '-'\n"
 		"    and --restore-image is used then read the image from the standard input.\n"
+		"\n"
+		"    CODEC is lz (the default, built in), gzip, bzip2, xz, zstd or lz4.\n"
 		"\n", EXEC_NAME);
 	fprintf(stderr, "%s%s", ntfs_bugs, ntfs_home);
 	exit(1);
@@ -398,6 +525,12 @@ static void parse_options(int argc, char **argv)
 		{ "new-half-serial",  no_argument,	 NULL, 'i' },
 		{ "save-image",	      no_argument,	 NULL, 's' },
 		{ "preserve-timestamps",   no_argument,  NULL, 't' },
+		{ "compress",	      optional_argument, NULL, 'z' },
+		{ "verify-image",     no_argument,	 NULL, 'V' },
+		{ "base",	      required_argument, NULL, 'B' },
+		{ "manifest",	      required_argument, NULL, 'M' },
+		{ "discard",	      no_argument,	 NULL, 'D' },
+		{ "zero-unused",      no_argument,	 NULL, 'Z' },
 		{ NULL, 0, NULL, 0 }
 	};
 
@@ -458,6 +591,29 @@ static void parse_options(int argc, char **argv)
 		case 't':
 			opt.preserve_timestamps++;
 			break;
+		case 'B':	/* not proposed as a short option */
+			opt.base = optarg;
+			break;
+		case 'M':	/* not proposed as a short option */
+			opt.manifest = optarg;
+			break;
+		case 'D':	/* not proposed as a short option */
+			opt.discard++;
+			break;
+		case 'Z':	/* not proposed as a short option */
+			opt.zero_unused++;
+			break;
+		case 'V':	/* not proposed as a short option */
+			opt.verify_image++;
+			opt.restore_image++;
+			opt.no_action++;
+			break;
+		case 'z':	/* not proposed as a short option */
+			opt.codec = (optarg ? optarg : IMAGE_CODEC_LZ);
+			if (!image_codec_known(opt.codec))
+				err_exit("Unknown compression codec '%s'\n",
+					opt.codec);
+			break;
 		default:
 			err_printf("Unknown option '%s'.\n", argv[optind-1]);
 			usage();
@@ -482,6 +638,9 @@ static void parse_options(int argc, char **argv)
 		usage();
 	}
 
+	if (opt.metadata && opt.codec)
+		err_exit("Metadata images cannot be compressed\n");
+
 	if (opt.metadata && opt.save_image) {
 		opt.metadata_image++;
 		opt.save_image = 0;
@@ -502,6 +661,33 @@ static void parse_options(int argc, char **argv)
 		err_exit("Saving and restoring an image at the same time "
 			 "is not supported!\n");
 
+	if (opt.manifest && (!opt.save_image || !strcmp(opt.manifest, "-")))
+		err_exit("A manifest can only be saved to a file along "
+			 "with an image\n");
+
+	if (opt.base && !opt.save_image && !opt.restore_image)
+		err_exit("A base image is only used when saving or "
+			 "restoring an image\n");
+
+		/* differential images are chunked */
+	if ((opt.base || opt.manifest) && opt.save_image && !opt.codec)
+		opt.codec = IMAGE_CODEC_LZ;
+
+	if (opt.codec && !opt.save_image)
+		err_exit("Only the special image format can be compressed\n");
+
+	if ((opt.discard || opt.zero_unused) && !opt.restore_image)
+		err_exit("Unused clusters are only discarded or zeroed "
+			 "when restoring an image\n");
+
+	if (opt.discard && opt.zero_unused)
+		err_exit("Unused clusters cannot be both discarded "
+			 "and zeroed\n");
+
+	if (opt.verify_image && !strcmp(opt.volume, "-"))
+		err_exit("Verifying an image requires seeking in it, "
+			 "it cannot be read from standard input\n");
+
 	if (opt.no_action && !opt.restore_image)
 		err_exit("A restoring test requires the restore option!\n");
 
@@ -578,6 +764,7 @@ static void progress_init(struct progress_bar *p, u64 start, u64 stop, int res)
 {
 	p->start = start;
 	p->stop = stop;
+	p->last = start;
 	p->unit = 100.0 / (stop - start);
 	p->resolution = res;
 }
@@ -591,11 +778,21 @@ static void progress_update(struct progress_bar *p, u64 current)
 		return;
 
 	if (current != p->stop) {
-		if ((current - p->start) % p->resolution)
+			/*
+			 * Clusters may be counted by whole runs, so also
+			 * print when a multiple of the resolution was
+			 * skipped over since the previous update
+			 */
+		if (((current - p->start) % p->resolution)
+		    && (((current - p->start) / p->resolution)
+			== ((p->last - p->start) / p->resolution))) {
+			p->last = current;
 			return;
+		}
 		Printf("%6.2f percent completed\r", percent);
 	} else
 		Printf("100.00 percent completed\n");
+	p->last = current;
 	fflush(msg_out);
 }
 
@@ -632,9 +829,568 @@ static s64 is_critical_metadata(ntfs_walk_clusters_ctx *image, runlist *rl)
 	return 0;
 }
 
+/*
+ *		Chunked images
+ *
+ *	The image data is cut into chunks of about IMAGE_CHUNK_SIZE bytes,
+ *	only between commands, so that each chunk describes a range of
+ *	clusters and can be restored on its own. When saving, the chunks
+ *	are filled by the main thread, compressed by worker threads, and
+ *	written in order by the main thread. When restoring, the main
+ *	thread reads the chunks ahead, and the workers decompress them
+ *	and check their checksums.
+ */
+
+enum {
+	CHUNK_FREE,	/* available to the main thread */
+	CHUNK_FILLED,	/* waiting for a worker */
+	CHUNK_BUSY,	/* being processed by a worker */
+	CHUNK_DONE	/* to be written or consumed */
+} ;
+
+struct image_chunk {
+	struct image_chunk_hdr hdr;
+	char *raw;		/* uncompressed data */
+	char *packed;		/* compressed data */
+	int raw_room;
+	int packed_room;
+	int raw_size;
+	int size;		/* size as stored */
+	int pos;		/* consumed while restoring */
+	int state;		/* only changed while locked */
+	int error;		/* errno, or -1 for bad data */
+	BOOL used;		/* only accessed by the main thread */
+} ;
+
+static struct {
+	pthread_mutex_t lock;
+	pthread_cond_t filled;
+	pthread_cond_t done;
+	pthread_t workers[IMAGE_CHUNK_WORKERS_MAX];
+	int nr_workers;
+	struct image_chunk *ring;
+	int ring_size;
+	int current;		/* chunk being filled or consumed */
+	int next_read;		/* chunk to read ahead into */
+	const char *codec;
+	BOOL active;
+	BOOL decompress;
+	BOOL stop;
+	BOOL eof;		/* the final empty chunk has been read */
+	struct image_chunk_hdr last;	/* the final empty chunk */
+	s64 offset;		/* current position in image */
+	s64 count;		/* chunks written or read */
+	struct image_chunk_hdr *index;
+	s64 index_room;
+} image_chunks;
+
+static void image_pack_chunk(struct image_chunk *pc)
+{
+	const char *codec = image_chunks.codec;
+	BOOL builtin;
+	int size;
+
+	builtin = !strcmp(codec, IMAGE_CODEC_LZ);
+	pc->hdr.checksum = cpu_to_le32(image_crc32(0, pc->raw, pc->raw_size));
+		/* only keep the compressed data when smaller */
+	if (builtin)
+		size = image_lz_compress(pc->raw, pc->raw_size,
+				pc->packed, pc->raw_size - 1);
+	else
+		size = image_filter(codec, FALSE, pc->raw, pc->raw_size,
+				&pc->packed, &pc->packed_room,
+				pc->raw_size - 1);
+	if (size < 0) {
+		if (!builtin && (errno != EFBIG))
+			pc->error = errno;
+		pc->hdr.flags = const_cpu_to_le32(IMAGE_CHUNK_STORED);
+		size = pc->raw_size;
+	} else
+		pc->hdr.flags = const_cpu_to_le32(0);
+	pc->size = size;
+}
+
+static void image_unpack_chunk(struct image_chunk *pc)
+{
+	const char *codec = image_chunks.codec;
+	int size;
+
+	if (pc->hdr.flags & const_cpu_to_le32(IMAGE_CHUNK_STORED))
+		size = pc->size;
+	else if (!strcmp(codec, IMAGE_CODEC_LZ))
+		size = image_lz_decompress(pc->packed, pc->size,
+				pc->raw, pc->raw_room);
+	else {
+		size = image_filter(codec, TRUE, pc->packed, pc->size,
+				&pc->raw, &pc->raw_room, pc->raw_room);
+		if ((size < 0) && (errno != EFBIG))
+			pc->error = errno;
+	}
+	if (!pc->error
+	    && ((size != pc->raw_size)
+		|| (image_crc32(0, pc->raw, size)
+				!= le32_to_cpu(pc->hdr.checksum))))
+		pc->error = -1;
+}
+
+static void *image_chunk_worker(void *arg __attribute__((unused)))
+{
+	struct image_chunk *pc;
+	int i;
+
+	pthread_mutex_lock(&image_chunks.lock);
+	do {
+		pc = (struct image_chunk*)NULL;
+		for (i=0; !pc && (i<image_chunks.ring_size); i++)
+			if (image_chunks.ring[i].state == CHUNK_FILLED)
+				pc = &image_chunks.ring[i];
+		if (pc) {
+			pc->state = CHUNK_BUSY;
+			pthread_mutex_unlock(&image_chunks.lock);
+			if (image_chunks.decompress)
+				image_unpack_chunk(pc);
+			else
+				image_pack_chunk(pc);
+			pthread_mutex_lock(&image_chunks.lock);
+			pc->state = CHUNK_DONE;
+			pthread_cond_broadcast(&image_chunks.done);
+		} else
+			if (!image_chunks.stop)
+				pthread_cond_wait(&image_chunks.filled,
+						&image_chunks.lock);
+	} while (pc || !image_chunks.stop);
+	pthread_mutex_unlock(&image_chunks.lock);
+	return ((void*)NULL);
+}
+
+/*
+ *		Get the number of worker threads, one per processor
+ */
+
+static int worker_count(void)
+{
+	long cpus;
+
+	cpus = sysconf(_SC_NPROCESSORS_ONLN);
+	if (cpus < 1)
+		cpus = 1;
+	if (cpus > IMAGE_CHUNK_WORKERS_MAX)
+		cpus = IMAGE_CHUNK_WORKERS_MAX;
+	return (cpus);
+}
+
+static void image_chunks_start(const char *codec, BOOL decompress,
+			int chunk_size)
+{
+	struct image_chunk *pc;
+	int cpus;
+	int i;
+
+	cpus = worker_count();
+	image_chunks.nr_workers = cpus;
+	image_chunks.ring_size = 2*cpus + 2;
+	image_chunks.ring = (struct image_chunk*)ntfs_calloc(
+			image_chunks.ring_size*sizeof(struct image_chunk));
+	if (!image_chunks.ring)
+		perr_exit("image_chunks_start");
+	for (i=0; i<image_chunks.ring_size; i++) {
+		pc = &image_chunks.ring[i];
+			/* a chunk is cut after it reaches chunk_size */
+		pc->raw_room = chunk_size + 1 + NTFS_MAX_CLUSTER_SIZE;
+		pc->packed_room = pc->raw_room;
+		pc->raw = (char*)ntfs_malloc(pc->raw_room);
+		pc->packed = (char*)ntfs_malloc(pc->packed_room);
+		if (!pc->raw || !pc->packed)
+			perr_exit("image_chunks_start");
+		pc->state = CHUNK_FREE;
+	}
+#ifndef HAVE_WINDOWS_H
+		/* get write errors from external codecs which fail */
+	if (strcmp(codec, IMAGE_CODEC_LZ))
+		signal(SIGPIPE, SIG_IGN);
+#endif
+	image_chunks.codec = codec;
+	image_chunks.decompress = decompress;
+	image_chunks.stop = FALSE;
+	image_chunks.eof = FALSE;
+	image_chunks.current = 0;
+	image_chunks.next_read = 0;
+	image_chunks.offset = le32_to_cpu(image_hdr.offset_to_image_data);
+	image_chunks.count = 0;
+	image_chunks.index = (struct image_chunk_hdr*)NULL;
+	image_chunks.index_room = 0;
+	image_chunks.ring[0].hdr.lcn = cpu_to_sle64(image_pos);
+	pthread_mutex_init(&image_chunks.lock, (pthread_mutexattr_t*)NULL);
+	pthread_cond_init(&image_chunks.filled, (pthread_condattr_t*)NULL);
+	pthread_cond_init(&image_chunks.done, (pthread_condattr_t*)NULL);
+	for (i=0; i<image_chunks.nr_workers; i++)
+		if (pthread_create(&image_chunks.workers[i],
+				(pthread_attr_t*)NULL, image_chunk_worker,
+				(void*)NULL))
+			err_exit("Could not start the chunk workers\n");
+	image_chunks.active = TRUE;
+}
+
+static void image_chunks_stop(void)
+{
+	int i;
+
+	pthread_mutex_lock(&image_chunks.lock);
+	image_chunks.stop = TRUE;
+	pthread_cond_broadcast(&image_chunks.filled);
+	pthread_mutex_unlock(&image_chunks.lock);
+	for (i=0; i<image_chunks.nr_workers; i++)
+		pthread_join(image_chunks.workers[i], (void**)NULL);
+	pthread_cond_destroy(&image_chunks.done);
+	pthread_cond_destroy(&image_chunks.filled);
+	pthread_mutex_destroy(&image_chunks.lock);
+	for (i=0; i<image_chunks.ring_size; i++) {
+		free(image_chunks.ring[i].raw);
+		free(image_chunks.ring[i].packed);
+	}
+	free(image_chunks.ring);
+	free(image_chunks.index);
+	image_chunks.active = FALSE;
+}
+
+/*
+ *		Mark a chunk as ready for a worker
+ */
+
+static void image_chunk_post(struct image_chunk *pc)
+{
+	pc->used = TRUE;
+	pthread_mutex_lock(&image_chunks.lock);
+	pc->state = CHUNK_FILLED;
+	pthread_cond_signal(&image_chunks.filled);
+	pthread_mutex_unlock(&image_chunks.lock);
+}
+
+/*
+ *		Wait until a chunk has been processed by a worker
+ *
+ *	Returns NULL if the chunk was not in use.
+ */
+
+static struct image_chunk *image_chunk_wait(int n)
+{
+	struct image_chunk *pc;
+
+	pc = &image_chunks.ring[n];
+	if (pc->used) {
+		pthread_mutex_lock(&image_chunks.lock);
+		while (pc->state != CHUNK_DONE)
+			pthread_cond_wait(&image_chunks.done,
+					&image_chunks.lock);
+		pthread_mutex_unlock(&image_chunks.lock);
+	} else
+		pc = (struct image_chunk*)NULL;
+	return (pc);
+}
+
+static void image_chunk_release(struct image_chunk *pc)
+{
+	pthread_mutex_lock(&image_chunks.lock);
+	pc->state = CHUNK_FREE;
+	pthread_mutex_unlock(&image_chunks.lock);
+	pc->used = FALSE;
+}
+
+static void image_index_add(const struct image_chunk_hdr *hdr)
+{
+	struct image_chunk_hdr *index;
+
+	if (image_chunks.count >= image_chunks.index_room) {
+		image_chunks.index_room = (image_chunks.index_room
+				? 2*image_chunks.index_room : 1024);
+		index = (struct image_chunk_hdr*)realloc(image_chunks.index,
+				image_chunks.index_room
+					*sizeof(struct image_chunk_hdr));
+		if (!index)
+			perr_exit("image_index_add");
+		image_chunks.index = index;
+	}
+	image_chunks.index[image_chunks.count++] = *hdr;
+}
+
+static void image_write_out(const void *buf, size_t size)
+{
+	if (fwrite(buf, 1, size, stream_out) != size)
+		perr_exit("Write failed");
+	image_chunks.offset += size;
+}
+
+static void image_chunk_output(struct image_chunk *pc)
+{
+	if (pc->error) {
+		errno = pc->error;
+		perr_exit("Compressing with %s failed", image_chunks.codec);
+	}
+	pc->hdr.offset = cpu_to_le64(image_chunks.offset);
+	pc->hdr.size = cpu_to_le32(pc->size);
+	pc->hdr.raw_size = cpu_to_le32(pc->raw_size);
+	image_index_add(&pc->hdr);
+	image_write_out(&pc->hdr, sizeof(pc->hdr));
+	if (pc->hdr.flags & const_cpu_to_le32(IMAGE_CHUNK_STORED))
+		image_write_out(pc->raw, pc->size);
+	else
+		image_write_out(pc->packed, pc->size);
+	image_chunk_release(pc);
+}
+
+/*
+ *		Pass the current chunk to the workers, and start a new one
+ *
+ *	The oldest chunk has to be written out if it is still in use.
+ */
+
+static void image_chunk_submit(void)
+{
+	struct image_chunk *pc;
+
+	image_chunk_post(&image_chunks.ring[image_chunks.current]);
+	image_chunks.current = (image_chunks.current + 1)
+				% image_chunks.ring_size;
+	pc = image_chunk_wait(image_chunks.current);
+	if (pc)
+		image_chunk_output(pc);
+	pc = &image_chunks.ring[image_chunks.current];
+	pc->hdr.lcn = cpu_to_sle64(image_pos);
+	pc->raw_size = 0;
+	pc->error = 0;
+}
+
+/*
+ *		Cut the current chunk if it is full
+ *
+ *	This must only be called between commands.
+ */
+
+static void image_chunk_mark(void)
+{
+	if (image_chunks.active
+	    && (image_chunks.ring[image_chunks.current].raw_size
+				>= (int)le32_to_cpu(image_ext_hdr.chunk_size)))
+		image_chunk_submit();
+}
+
+static int image_chunk_append(const void *buf, int count)
+{
+	struct image_chunk *pc;
+
+	pc = &image_chunks.ring[image_chunks.current];
+	if ((pc->raw_size + count) > pc->raw_room)
+		err_exit("Image chunk overflow\n");
+	memcpy(pc->raw + pc->raw_size, buf, count);
+	pc->raw_size += count;
+	return (count);
+}
+
+/*
+ *		Write out all the chunks, followed by the index
+ */
+
+static void image_chunks_finish(void)
+{
+	struct image_chunk_hdr last;
+	struct image_index_tail tail;
+	struct image_chunk *pc;
+	int i;
+
+	if (image_chunks.ring[image_chunks.current].raw_size)
+		image_chunk_submit();
+	for (i=1; i<=image_chunks.ring_size; i++) {
+		pc = image_chunk_wait((image_chunks.current + i)
+					% image_chunks.ring_size);
+		if (pc)
+			image_chunk_output(pc);
+	}
+	memset(&last, 0, sizeof(last));
+	last.lcn = cpu_to_sle64(image_pos);
+	last.offset = cpu_to_le64(image_chunks.offset);
+	image_index_add(&last);
+	image_write_out(&last, sizeof(last));
+	memset(&tail, 0, sizeof(tail));
+	tail.index_offset = cpu_to_le64(image_chunks.offset);
+	tail.nr_chunks = cpu_to_le64(image_chunks.count);
+	image_checksum = image_crc32(0, image_chunks.index,
+			image_chunks.count*sizeof(struct image_chunk_hdr));
+	tail.checksum = cpu_to_le32(image_checksum);
+	memcpy(tail.magic, IMAGE_INDEX_MAGIC, IMAGE_INDEX_MAGIC_SIZE);
+	image_write_out(image_chunks.index,
+			image_chunks.count*sizeof(struct image_chunk_hdr));
+	image_write_out(&tail, sizeof(tail));
+	image_chunks_stop();
+}
+
+static void image_read_in(void *buf, int size)
+{
+	char *p;
+	int n;
+
+	p = (char*)buf;
+	while (size > 0) {
+		n = read(fd_in, p, size);
+		if (n > 0) {
+			p += n;
+			size -= n;
+		} else
+			if (!n)
+				err_exit("Short image file...\n");
+			else
+				if ((errno != EINTR) && (errno != EAGAIN))
+					perr_exit("read_all");
+	}
+}
+
+/*
+ *		Read chunks ahead into the free buffers
+ */
+
+static void image_chunk_fetch(void)
+{
+	struct image_chunk_hdr hdr;
+	struct image_chunk *pc;
+	u32 size, raw_size;
+	BOOL stored;
+
+	pc = &image_chunks.ring[image_chunks.next_read];
+	while (!image_chunks.eof && !pc->used) {
+		image_read_in(&hdr, sizeof(hdr));
+		size = le32_to_cpu(hdr.size);
+		raw_size = le32_to_cpu(hdr.raw_size);
+		stored = (hdr.flags & const_cpu_to_le32(IMAGE_CHUNK_STORED))
+				!= const_cpu_to_le32(0);
+		if ((le64_to_cpu(hdr.offset) != (u64)image_chunks.offset)
+		    || (raw_size > (u32)pc->raw_room)
+		    || (size > (u32)pc->packed_room)
+		    || (stored && (size != raw_size)))
+			err_exit("Bad chunk header at image offset %lld\n",
+				(long long)image_chunks.offset);
+		image_chunks.offset += sizeof(hdr) + size;
+		if (!size) {
+			image_chunks.last = hdr;
+			image_chunks.eof = TRUE;
+		} else {
+			image_read_in(stored ? pc->raw : pc->packed, size);
+			pc->hdr = hdr;
+			pc->size = size;
+			pc->raw_size = raw_size;
+			pc->pos = 0;
+			pc->error = 0;
+			image_chunks.count++;
+			image_chunk_post(pc);
+			image_chunks.next_read = (image_chunks.next_read + 1)
+					% image_chunks.ring_size;
+			pc = &image_chunks.ring[image_chunks.next_read];
+		}
+	}
+}
+
+static void image_chunk_check(struct image_chunk *pc)
+{
+	if (pc->error > 0) {
+		errno = pc->error;
+		perr_exit("Decompressing with %s failed",
+			image_chunks.codec);
+	}
+	if (pc->error)
+		err_exit("Corrupted chunk at image offset %lld\n",
+			(long long)le64_to_cpu(pc->hdr.offset));
+}
+
+/*
+ *		Get the next uncompressed data when restoring
+ *
+ *	Returns the count of bytes got, or zero at the end of chunks.
+ */
+
+static int image_chunk_read(void *buf, int count)
+{
+	struct image_chunk *pc;
+	int n;
+
+	pc = &image_chunks.ring[image_chunks.current];
+	while (!pc->used || (pc->pos >= pc->raw_size)) {
+		if (pc->used) {
+			image_chunk_release(pc);
+			image_chunks.current = (image_chunks.current + 1)
+					% image_chunks.ring_size;
+		}
+		image_chunk_fetch();
+		pc = image_chunk_wait(image_chunks.current);
+		if (!pc)
+			return (0);
+		image_chunk_check(pc);
+	}
+	n = pc->raw_size - pc->pos;
+	if (n > count)
+		n = count;
+	memcpy(buf, pc->raw + pc->pos, n);
+	pc->pos += n;
+	return (n);
+}
+
+/*
+ *		Get an exact count of uncompressed bytes
+ *
+ *	Returns FALSE if the chunks end before.
+ */
+
+static BOOL image_chunk_get(void *buf, int count)
+{
+	char *p;
+	int n;
+
+	p = (char*)buf;
+	while (count > 0) {
+		n = image_chunk_read(p, count);
+		if (!n)
+			return (FALSE);
+		p += n;
+		count -= n;
+	}
+	return (TRUE);
+}
+
 static off_t tellin(int in)
 {
-	return (lseek(in, 0, SEEK_CUR));
+	return (lseek(in, 0, SEEK_CUR)
+			- (image_input.size - image_input.pos));
+}
+
+/*
+ *		Read a plain image through a buffer
+ *
+ *	The image is made of one byte commands, mostly followed by
+ *	a cluster, so reading them separately is slow.
+ */
+
+static int image_input_read(int fd, void *buf, int count)
+{
+	int n;
+
+	if (image_input.pos >= image_input.size) {
+		if (!image_input.buf) {
+			image_input.buf = (char*)ntfs_malloc(IMAGE_INPUT_SIZE);
+			if (!image_input.buf)
+				return (-1);
+		}
+			/* big requests are not worth buffering */
+		if (count >= IMAGE_INPUT_SIZE)
+			return (read(fd, buf, count));
+		n = read(fd, image_input.buf, IMAGE_INPUT_SIZE);
+		if (n <= 0)
+			return (n);
+		image_input.size = n;
+		image_input.pos = 0;
+	}
+	n = image_input.size - image_input.pos;
+	if (n > count)
+		n = count;
+	memcpy(buf, image_input.buf + image_input.pos, n);
+	image_input.pos += n;
+	return (n);
 }
 
 static int io_all(void *fd, void *buf, int count, int do_write)
@@ -646,6 +1402,9 @@ static int io_all(void *fd, void *buf, int count, int do_write)
 		if (do_write) {
 			if (opt.no_action) {
 				i = count;
+			} else if (image_chunks.active
+				    && !image_chunks.decompress) {
+				i = image_chunk_append(buf, count);
 			} else {
 				if (opt.save_image || opt.metadata_image)
 					i = fwrite(buf, 1, count, stream_out);
@@ -658,7 +1417,9 @@ static int io_all(void *fd, void *buf, int count, int do_write)
 					i = write(*(int *)fd, buf, count);
 			}
 		} else if (opt.restore_image)
-			i = read(*(int *)fd, buf, count);
+			i = (image_chunks.active
+				? image_chunk_read(buf, count)
+				: image_input_read(*(int *)fd, buf, count));
 		else
 			i = dev->d_ops->read(dev, buf, count);
 		if (i < 0) {
@@ -724,6 +1485,38 @@ static void read_rescue(void *fd, char *buff, u32 csize, u32 bytes_per_sector,
 	}
 }
 
+static void write_clusters(char *buff, s32 size)
+{
+	if (write_all(&fd_out, buff, size) == -1) {
+#ifndef NO_STATFS
+		int err = errno;
+		perr_printf("Write failed");
+		if (err == EIO && opt.stfs.f_type == 0x517b)
+			Printf("Apparently you tried to clone to a remote "
+			       "Windows computer but they don't\nhave "
+			       "efficient sparse file handling by default. "
+			       "Please try a different method.\n");
+		exit(1);
+#else
+		perr_printf("Write failed");
+#endif
+	}
+}
+
+/*
+ *		Announce the next cluster in an image
+ */
+
+static void image_next_cluster(void)
+{
+	char cmd = CMD_NEXT;
+
+	image_chunk_mark();
+	if (write_all(&fd_out, &cmd, sizeof(cmd)) == -1)
+		perr_exit("write_all");
+	image_pos++;
+}
+
 static void copy_cluster(int rescue, u64 rescue_lcn, u64 lcn)
 {
 	char buff[NTFS_MAX_CLUSTER_SIZE]; /* overflow checked at mount time */
@@ -807,27 +1600,11 @@ static void copy_cluster(int rescue, u64 rescue_lcn, u64 lcn)
 						bs->volume_serial_number));
 	}
 
-	if (opt.save_image || (opt.metadata_image && wipe)) {
-		char cmd = CMD_NEXT;
-		if (write_all(&fd_out, &cmd, sizeof(cmd)) == -1)
-			perr_exit("write_all");
-	}
+	if (opt.save_image || (opt.metadata_image && wipe))
+		image_next_cluster();
 
-	if ((!opt.metadata_image || wipe)
-	    && (write_all(&fd_out, buff, csize) == -1)) {
-#ifndef NO_STATFS
-		int err = errno;
-		perr_printf("Write failed");
-		if (err == EIO && opt.stfs.f_type == 0x517b)
-			Printf("Apparently you tried to clone to a remote "
-			       "Windows computer but they don't\nhave "
-			       "efficient sparse file handling by default. "
-			       "Please try a different method.\n");
-		exit(1);
-#else
-		perr_printf("Write failed");
-#endif
-	}
+	if (!opt.metadata_image || wipe)
+		write_clusters(buff, csize);
 }
 
 static s64 lseek_out(int fd, s64 pos, int mode)
@@ -863,11 +1640,13 @@ static void gap_to_cluster(s64 gap)
 	char buf[1 + sizeof(count)];
 
 	if (gap) {
+		image_chunk_mark();
 		count = cpu_to_sle64(gap);
 		buf[0] = CMD_GAP;
 		memcpy(&buf[1], &count, sizeof(count));
 		if (write_all(&fd_out, buf, sizeof(buf)) == -1)
 			perr_exit("write_all");
+		image_pos += gap;
 	}
 }
 
@@ -877,12 +1656,14 @@ static void image_skip_clusters(s64 count)
 		s64 count_buf;
 		char buff[1 + sizeof(count)];
 
+		image_chunk_mark();
 		buff[0] = CMD_GAP;
 		count_buf = cpu_to_sle64(count);
 		memcpy(buff + 1, &count_buf, sizeof(count_buf));
 
 		if (write_all(&fd_out, buff, sizeof(buff)) == -1)
 			perr_exit("write_all");
+		image_pos += count;
 	}
 }
 
@@ -901,6 +1682,231 @@ static void write_image_hdr(void)
 	}
 }
 
+/*
+ *		Cloning of used clusters by big runs
+ *
+ *	A reader thread finds the runs of used clusters in the bitmap,
+ *	and reads them into a ring of buffers, while the calling thread
+ *	writes the runs in the output format. A run which cannot be read
+ *	at once is read cluster by cluster, so that the bad sectors are
+ *	rescued the same way as when cloning a single cluster.
+ */
+
+struct clone_buffer {
+	char *data;
+	s64 lcn;		/* first cluster of run */
+	s64 count;		/* clusters in run, zero at end */
+} ;
+
+static struct {
+	pthread_mutex_t lock;
+	pthread_cond_t filled;
+	pthread_cond_t emptied;
+	struct clone_buffer buf[CLONE_BUFFERS];
+	int nr_filled;
+	s64 first;		/* first cluster to clone */
+	s64 end;		/* cluster after the last one to clone */
+} clone_ring;
+
+/*
+ *		Find the first cluster whose bit in the bitmap has some value
+ *
+ *	The bitmap is skipped by words which have no such bit.
+ *	Returns end if there is no such cluster before end.
+ */
+
+static s64 find_cluster(s64 cl, s64 end, int used)
+{
+	u64 word;
+	u64 skip;
+
+	skip = (used ? 0 : ~(u64)0);
+	while (cl < end) {
+		if (!(cl & 63) && ((cl + 64) <= end)) {
+			memcpy(&word, &lcn_bitmap.bm[cl >> 3], sizeof(word));
+			if (word == skip) {
+				cl += 64;
+				continue;
+			}
+		}
+		if (ntfs_bit_get(lcn_bitmap.bm, cl) == used)
+			break;
+		cl++;
+	}
+	return (cl < end ? cl : end);
+}
+
+static void read_run(char *buff, s64 lcn, s64 count)
+{
+	u32 csize = vol->cluster_size;
+	s64 i;
+
+	if (vol->dev->d_ops->seek(vol->dev, lcn*csize, SEEK_SET) == (off_t)-1)
+		perr_exit("lseek input");
+	if (read_all(vol->dev, buff, count*csize) == -1) {
+		if (errno != EIO)
+			perr_exit("read_all");
+			/* retry cluster by cluster, rescuing if requested */
+		for (i=0; i<count; i++) {
+			if (vol->dev->d_ops->seek(vol->dev, (lcn + i)*csize,
+					SEEK_SET) == (off_t)-1)
+				perr_exit("lseek input");
+			read_rescue(vol->dev, buff + i*csize, csize,
+					vol->sector_size, lcn + i);
+		}
+	}
+}
+
+static void *clone_reader(void *arg __attribute__((unused)))
+{
+	struct clone_buffer *pbuf;
+	s64 max_count;
+	s64 lcn, end;
+	int next;
+
+	max_count = CLONE_BUFFER_SIZE/vol->cluster_size;
+	next = 0;
+	lcn = clone_ring.first;
+	do {
+		lcn = find_cluster(lcn, clone_ring.end, 1);
+		if (lcn < clone_ring.end) {
+			end = find_cluster(lcn, clone_ring.end, 0);
+			if ((end - lcn) > max_count)
+				end = lcn + max_count;
+		} else
+			end = lcn;
+		pthread_mutex_lock(&clone_ring.lock);
+		while (clone_ring.nr_filled >= CLONE_BUFFERS)
+			pthread_cond_wait(&clone_ring.emptied,
+						&clone_ring.lock);
+		pthread_mutex_unlock(&clone_ring.lock);
+		pbuf = &clone_ring.buf[next];
+		pbuf->lcn = lcn;
+		pbuf->count = end - lcn;
+		if (pbuf->count)
+			read_run(pbuf->data, lcn, pbuf->count);
+		pthread_mutex_lock(&clone_ring.lock);
+		clone_ring.nr_filled++;
+		pthread_cond_signal(&clone_ring.filled);
+		pthread_mutex_unlock(&clone_ring.lock);
+		next = (next + 1) % CLONE_BUFFERS;
+		lcn = end;
+	} while (pbuf->count);
+	return ((void*)NULL);
+}
+
+/*
+ *		Clone the used clusters from first to end (excluded)
+ *
+ *	The clusters are written in the same format as by copy_cluster().
+ */
+
+static void clone_runs(s64 first, s64 end, u64 *last_cl,
+			struct progress_bar *progress, u64 *p_counter)
+{
+	struct clone_buffer *pbuf;
+	pthread_t reader;
+	char *zeroes;
+	u32 csize = vol->cluster_size;
+	s64 gap, size, count, i;
+	int next;
+
+	zeroes = (char*)NULL;
+	if (opt.std_out && !opt.save_image) {
+		zeroes = (char*)ntfs_calloc(CLONE_BUFFER_SIZE);
+		if (!zeroes)
+			perr_exit("clone_runs");
+	}
+	for (i=0; i<CLONE_BUFFERS; i++) {
+		clone_ring.buf[i].data = (char*)ntfs_malloc(CLONE_BUFFER_SIZE);
+		if (!clone_ring.buf[i].data)
+			perr_exit("clone_runs");
+	}
+	clone_ring.nr_filled = 0;
+	clone_ring.first = first;
+	clone_ring.end = end;
+	pthread_mutex_init(&clone_ring.lock, (pthread_mutexattr_t*)NULL);
+	pthread_cond_init(&clone_ring.filled, (pthread_condattr_t*)NULL);
+	pthread_cond_init(&clone_ring.emptied, (pthread_condattr_t*)NULL);
+	if (pthread_create(&reader, (pthread_attr_t*)NULL, clone_reader,
+			(void*)NULL))
+		err_exit("Could not start the reader thread\n");
+	next = 0;
+	do {
+		pthread_mutex_lock(&clone_ring.lock);
+		while (!clone_ring.nr_filled)
+			pthread_cond_wait(&clone_ring.filled,
+						&clone_ring.lock);
+		pthread_mutex_unlock(&clone_ring.lock);
+		pbuf = &clone_ring.buf[next];
+		gap = (pbuf->count ? pbuf->lcn : end) - *last_cl - 1;
+		if (zeroes) {
+				/* unused clusters to stdout */
+			for (i=0; i<gap; i+=size) {
+				size = gap - i;
+				if (size > CLONE_BUFFER_SIZE/csize)
+					size = CLONE_BUFFER_SIZE/csize;
+				if (write_all(&fd_out, zeroes, size*csize) == -1)
+					perr_exit("write_all");
+			}
+			*p_counter += gap;
+		}
+		if (pbuf->count) {
+			if (opt.save_image) {
+				image_skip_clusters(gap);
+				for (i=0; i<pbuf->count; i++) {
+					image_next_cluster();
+					write_clusters(pbuf->data + i*csize,
+							csize);
+				}
+			} else {
+				if (!opt.std_out
+				    && (lseek_out(fd_out, pbuf->lcn*csize,
+						SEEK_SET) == (off_t)-1))
+					perr_exit("lseek output");
+				write_clusters(pbuf->data, pbuf->count*csize);
+			}
+			*last_cl = pbuf->lcn + pbuf->count - 1;
+			*p_counter += pbuf->count;
+		}
+		progress_update(progress, *p_counter);
+			/* the buffer may be refilled once released */
+		count = pbuf->count;
+		pthread_mutex_lock(&clone_ring.lock);
+		clone_ring.nr_filled--;
+		pthread_cond_signal(&clone_ring.emptied);
+		pthread_mutex_unlock(&clone_ring.lock);
+		next = (next + 1) % CLONE_BUFFERS;
+	} while (count);
+	pthread_join(reader, (void**)NULL);
+	pthread_cond_destroy(&clone_ring.emptied);
+	pthread_cond_destroy(&clone_ring.filled);
+	pthread_mutex_destroy(&clone_ring.lock);
+	for (i=0; i<CLONE_BUFFERS; i++)
+		free(clone_ring.buf[i].data);
+	free(zeroes);
+}
+
+static void clone_cluster(u64 cl, u64 *last_cl, void *buf,
+			struct progress_bar *progress, u64 *p_counter)
+{
+	u32 csize = vol->cluster_size;
+
+	if (ntfs_bit_get(lcn_bitmap.bm, cl)) {
+		progress_update(progress, ++(*p_counter));
+		lseek_to_cluster(cl);
+		image_skip_clusters(cl - *last_cl - 1);
+
+		copy_cluster(opt.rescue, cl, cl);
+		*last_cl = cl;
+	} else
+		if (opt.std_out && !opt.save_image) {
+			progress_update(progress, ++(*p_counter));
+			if (write_all(&fd_out, buf, csize) == -1)
+				perr_exit("write_all");
+		}
+}
+
 static void clone_ntfs(u64 nr_clusters, int more_use)
 {
 	u64 cl, last_cl;  /* current and last used cluster */
@@ -927,52 +1933,161 @@ static void clone_ntfs(u64 nr_clusters, int more_use)
 	if (opt.save_image) {
 		int alignsize = le32_to_cpu(image_hdr.offset_to_image_data)
 				- sizeof(image_hdr);
+		if (opt.codec)
+			alignsize -= sizeof(image_ext_hdr);
+		if (opt.base)
+			alignsize -= sizeof(image_base_hdr);
 		memset(alignment,0,IMAGE_HDR_ALIGN);
 		if ((alignsize < 0)
 			|| write_all(&fd_out, &image_hdr, sizeof(image_hdr))
-			|| write_all(&fd_out, alignment, alignsize))
+			|| write_all(&fd_out, alignment, alignsize)
+			|| (opt.codec && write_all(&fd_out, &image_ext_hdr,
+						sizeof(image_ext_hdr)))
+			|| (opt.base && write_all(&fd_out, &image_base_hdr,
+						sizeof(image_base_hdr))))
 			perr_exit("write_all");
+		image_pos = 0;
+		if (opt.codec)
+			image_chunks_start(opt.codec, FALSE,
+				le32_to_cpu(image_ext_hdr.chunk_size));
 	}
 
 		/* save suspicious clusters if required */
 	if (more_use && opt.ignore_fs_check) {
 		compare_bitmaps(&lcn_bitmap, TRUE);
 	}
-		/* Examine up to the alternate boot sector */
-	for (last_cl = cl = 0; cl <= (u64)vol->nr_clusters; cl++) {
+		/*
+		 * Examine up to the alternate boot sector, the boot
+		 * sectors are copied separately, as they may have to
+		 * be updated.
+		 */
+	last_cl = 0;
+	clone_cluster(0, &last_cl, buf, &progress, &p_counter);
+	if (vol->nr_clusters > 1)
+		clone_runs(1, vol->nr_clusters, &last_cl,
+				&progress, &p_counter);
+	cl = vol->nr_clusters;
+	clone_cluster(cl++, &last_cl, buf, &progress, &p_counter);
+	image_skip_clusters(cl - last_cl - 1);
+	if (image_chunks.active)
+		image_chunks_finish();
+	free(buf);
+}
 
-		if (ntfs_bit_get(lcn_bitmap.bm, cl)) {
-			progress_update(&progress, ++p_counter);
-			lseek_to_cluster(cl);
-			image_skip_clusters(cl - last_cl - 1);
+static void write_zeroes(s64 size)
+{
+	static char *zeroes = (char*)NULL; /* kept until exiting */
+	s64 n;
 
-			copy_cluster(opt.rescue, cl, cl);
-			last_cl = cl;
-			continue;
-		}
+	if (!zeroes) {
+		zeroes = (char*)ntfs_calloc(CLONE_BUFFER_SIZE);
+		if (!zeroes)
+			perr_exit("write_zeroes");
+	}
+	while (size > 0) {
+		n = (size > CLONE_BUFFER_SIZE ? CLONE_BUFFER_SIZE : size);
+		if (write_all(&fd_out, zeroes, n) == -1)
+			perr_exit("write_all");
+		size -= n;
+	}
+}
 
-		if (opt.std_out && !opt.save_image) {
-			progress_update(&progress, ++p_counter);
-			if (write_all(&fd_out, buf, csize) == -1)
-				perr_exit("write_all");
-		}
+/*
+ *		Discard or zero a range of the output device
+ *
+ *	Returns TRUE if the range has still to be skipped, and FALSE
+ *	if zeroes had to be written instead.
+ */
+
+static BOOL release_unused(s64 offset, s64 size)
+{
+#if defined(BLKDISCARD) && defined(BLKZEROOUT)
+	static BOOL unsupported = FALSE;
+	u64 range[2];
+
+	range[0] = offset;
+	range[1] = size;
+	if (!unsupported) {
+		if (!ioctl(fd_out, (opt.zero_unused ? BLKZEROOUT : BLKDISCARD),
+				&range))
+			return (TRUE);
+		Printf("WARNING: The output device cannot %s: %s\n",
+			(opt.zero_unused ? "zero out" : "discard"),
+			strerror(errno));
+		unsupported = TRUE;
 	}
-	image_skip_clusters(cl - last_cl - 1);
-	free(buf);
+#endif
+	if (opt.zero_unused) {
+		write_zeroes(size);
+		return (FALSE);
+	}
+	return (TRUE);
 }
 
-static void write_empty_clusters(s32 csize, s64 count,
-				 struct progress_bar *progress, u64 *p_counter)
+/*
+ *		Punch a hole into the standard output at the current position
+ *
+ *	Returns TRUE if the range has still to be skipped, and FALSE
+ *	if zeroes have to be written instead.
+ */
+
+static BOOL punch_stdout(s64 size)
 {
-	s64 i;
-	char buff[NTFS_MAX_CLUSTER_SIZE];
+#if defined(FALLOC_FL_PUNCH_HOLE) && defined(FALLOC_FL_KEEP_SIZE)
+	off_t pos;
 
-	memset(buff, 0, csize);
+	pos = lseek(fd_out, 0, SEEK_CUR);
+	if ((pos != (off_t)-1)
+	    && !fallocate(fd_out, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE,
+				pos, size))
+		return (TRUE);
+	Printf("WARNING: Cannot punch holes into the standard output: %s\n",
+		strerror(errno));
+#endif
+	stdout_punch = FALSE;
+	return (FALSE);
+}
 
-	for (i = 0; i < count; i++) {
-		if (write_all(&fd_out, buff, csize) == -1)
-			perr_exit("write_all");
-		progress_update(progress, ++(*p_counter));
+/*
+ *		Restore a gap of unused clusters
+ *
+ *	A gap is written as zeroes to standard output, unless it is a
+ *	regular file, which is left sparse, as is a regular output file.
+ *	When the standard output already has data beyond the current
+ *	position, holes are punched into it, or zeroes are written.
+ *	On a device, the unused clusters are skipped, unless they are
+ *	to be discarded or zeroed, but the gaps in a differential image
+ *	are clusters to keep from the base.
+ */
+
+static void restore_gap(s64 pos, s64 count, s32 csize)
+{
+	BOOL skip;
+
+	skip = TRUE;
+	if (opt.std_out)
+		skip = stdout_sparse
+			|| (stdout_punch && punch_stdout(count*csize));
+	else if (opt.blkdev_out && (opt.discard || opt.zero_unused)
+	    && (image_hdr.major_ver != NTFSCLONE_IMG_VER_MAJOR_DIFF))
+		skip = release_unused(pos*csize, count*csize);
+	if (!skip) {
+		if (opt.std_out)
+			write_zeroes(count*csize);
+	} else
+		if (lseek_out(fd_out, count * csize, SEEK_CUR) == (off_t)-1)
+			perr_exit("restore_image: lseek");
+}
+
+/*
+ *		Write the run of clusters collected when restoring
+ */
+
+static void flush_run(char *run, s64 *run_count, s32 csize)
+{
+	if (*run_count) {
+		write_clusters(run, *run_count*csize);
+		*run_count = 0;
 	}
 }
 
@@ -983,9 +2098,18 @@ static void restore_image(void)
 	char cmd;
 	u64 p_counter = 0;
 	struct progress_bar progress;
+	char *run;
+	s64 run_count, run_max;
 
 	Printf("Restoring NTFS from image ...\n");
 
+		/* consecutive clusters are written at once */
+	run_max = CLONE_BUFFER_SIZE/csize;
+	run_count = 0;
+	run = (char*)ntfs_malloc(CLONE_BUFFER_SIZE);
+	if (!run)
+		perr_exit("restore_image");
+
 	progress_init(&progress, p_counter, opt.std_out ?
 		      sle64_to_cpu(image_hdr.nr_clusters) + 1 :
 		      sle64_to_cpu(image_hdr.inuse) + 1,
@@ -1007,6 +2131,7 @@ static void restore_image(void)
 		}
 
 		if (cmd == CMD_GAP) {
+			flush_run(run, &run_count, csize);
 			if (!image_is_host_endian) {
 				le64 lecount;
 
@@ -1028,9 +2153,11 @@ static void restore_image(void)
 				if ((!p_counter && count) || (count < 0))
 					err_exit("Cannot restore a metadata"
 						" image to stdout\n");
-				else
-					write_empty_clusters(csize, count,
-						     &progress, &p_counter);
+				else {
+					restore_gap(pos, count, csize);
+					p_counter += count;
+					progress_update(&progress, p_counter);
+				}
 			} else {
 				if (((pos + count) < 0)
 				   || ((pos + count)
@@ -1039,21 +2166,149 @@ static void restore_image(void)
 						"at input offset %lld\n",
 						(long long)tellin(fd_in) - 9);
 				else {
-					if (!opt.no_action
-					    && (lseek_out(fd_out, count * csize,
-							SEEK_CUR) == (off_t)-1))
-						perr_exit("restore_image: lseek");
+					if (!opt.no_action)
+						restore_gap(pos, count, csize);
 				}
 			}
 			pos += count;
 		} else if (cmd == CMD_NEXT) {
-			copy_cluster(0, 0, pos);
+				/* the boot sectors may have to be updated */
+			if (!pos || ((u64)(pos + 1)*csize >= full_device_size)) {
+				flush_run(run, &run_count, csize);
+				copy_cluster(0, 0, pos);
+			} else {
+				errno = 0;
+				if (read_all(&fd_in, run + run_count*csize,
+						csize) == -1) {
+					if (!errno)
+						err_exit("Short image file...\n");
+					perr_exit("read_all");
+				}
+				if (++run_count >= run_max)
+					flush_run(run, &run_count, csize);
+			}
 			pos++;
 			progress_update(&progress, ++p_counter);
 		} else
 			err_exit("Invalid command code %d at input offset 0x%llx\n",
 					cmd, (long long)tellin(fd_in) - 1);
 	}
+	flush_run(run, &run_count, csize);
+	free(run);
+}
+
+/*
+ *		Verify a compressed image
+ *
+ *	The chunks are checked against the index at the end of the image,
+ *	and decompressed by the workers to check their checksums.
+ */
+
+/*
+ *		Read the tail of a chunked image
+ *
+ *	The input is left positioned after the tail.
+ */
+
+static void image_read_tail(struct image_index_tail *tail)
+{
+	s64 nr_chunks;
+	off_t tail_offset;
+
+	tail_offset = lseek(fd_in, -(off_t)sizeof(*tail), SEEK_END);
+	if (tail_offset == (off_t)-1)
+		perr_exit("Cannot seek to the image index");
+	image_read_in(tail, sizeof(*tail));
+	nr_chunks = le64_to_cpu(tail->nr_chunks);
+	if (memcmp(tail->magic, IMAGE_INDEX_MAGIC, IMAGE_INDEX_MAGIC_SIZE)
+	    || (nr_chunks < 1)
+	    || ((s64)(le64_to_cpu(tail->index_offset)
+			+ nr_chunks*sizeof(struct image_chunk_hdr))
+				!= tail_offset))
+		err_exit("The image has no valid index\n");
+}
+
+static void verify_image(void)
+{
+	struct image_index_tail tail;
+	struct image_chunk_hdr *index;
+	struct image_chunk *pc;
+	struct progress_bar progress;
+	s64 nr_chunks, i;
+	s64 index_offset;
+	size_t index_size;
+	int errors;
+
+	if (!image_is_chunked)
+		err_exit("Only compressed images have checksums "
+			"to be verified\n");
+	image_read_tail(&tail);
+	nr_chunks = le64_to_cpu(tail.nr_chunks);
+	index_offset = le64_to_cpu(tail.index_offset);
+	index_size = nr_chunks*sizeof(struct image_chunk_hdr);
+	index = (struct image_chunk_hdr*)ntfs_malloc(index_size);
+	if (!index)
+		perr_exit("verify_image");
+	if (lseek(fd_in, index_offset, SEEK_SET) == (off_t)-1)
+		perr_exit("Cannot seek to the image index");
+	image_read_in(index, index_size);
+	if (image_crc32(0, index, index_size) != le32_to_cpu(tail.checksum))
+		err_exit("Bad checksum of the image index\n");
+	if (lseek(fd_in, le32_to_cpu(image_hdr.offset_to_image_data),
+			SEEK_SET) == (off_t)-1)
+		perr_exit("Cannot seek to the image data");
+
+	Printf("Verifying %lld chunks ...\n", (long long)nr_chunks - 1);
+	progress_init(&progress, 0, nr_chunks - 1, 1);
+	image_chunks_start(image_ext_hdr.codec, TRUE,
+			le32_to_cpu(image_ext_hdr.chunk_size));
+	errors = 0;
+		/* the last index entry is the final empty chunk */
+	for (i=0; i<(nr_chunks - 1); i++) {
+		image_chunk_fetch();
+		pc = image_chunk_wait(image_chunks.current);
+		if (!pc) {
+			err_printf("The image ends at chunk %lld\n",
+				(long long)i);
+			errors++;
+			break;
+		}
+		if (memcmp(&pc->hdr, &index[i], sizeof(pc->hdr))
+		    || (sle64_to_cpu(index[i].lcn)
+				>= sle64_to_cpu(index[i + 1].lcn))) {
+			err_printf("Chunk %lld does not match the index\n",
+				(long long)i);
+			errors++;
+		} else if (pc->error) {
+			if (pc->error > 0) {
+				errno = pc->error;
+				perr_printf("Decompressing with %s failed",
+					image_chunks.codec);
+			} else
+				err_printf("Chunk %lld at offset %lld is "
+					"corrupted\n", (long long)i,
+					(long long)le64_to_cpu(pc->hdr.offset));
+			errors++;
+		}
+		image_chunk_release(pc);
+		image_chunks.current = (image_chunks.current + 1)
+					% image_chunks.ring_size;
+		progress_update(&progress, i + 1);
+	}
+	if (!errors) {
+		image_chunk_fetch();
+		if (!image_chunks.eof
+		    || memcmp(&image_chunks.last, &index[nr_chunks - 1],
+				sizeof(image_chunks.last))) {
+			err_printf("The chunks do not end as the index\n");
+			errors++;
+		}
+	}
+	image_chunks_stop();
+	free(index);
+	if (errors)
+		err_exit("%d errors found in the image\n", errors);
+	Printf("The image is consistent\n");
 }
 
 static void wipe_index_entry_timestams(INDEX_ENTRY *e)
@@ -2080,6 +3335,15 @@ static void print_image_info(void)
 	Printf("Offset to image data   : %u (0x%x) bytes\n",
 			(unsigned)le32_to_cpu(image_hdr.offset_to_image_data),
 			(unsigned)le32_to_cpu(image_hdr.offset_to_image_data));
+	if (image_is_chunked)
+		Printf("Image compression      : %s, by %u bytes\n",
+			image_ext_hdr.codec,
+			(unsigned)le32_to_cpu(image_ext_hdr.chunk_size));
+	if (image_hdr.major_ver == NTFSCLONE_IMG_VER_MAJOR_DIFF)
+		Printf("Based on image         : %s (checksum 0x%08x)\n",
+			(image_base_hdr.base_name[0]
+				? image_base_hdr.base_name : "unnamed"),
+			(unsigned)le32_to_cpu(image_base_hdr.base_checksum));
 }
 
 static void check_if_mounted(const char *device, unsigned long new_mntflag)
@@ -2220,6 +3484,24 @@ static s64 device_size_get(int fd)
 	return (low + 1LL);
 }
 
+/*
+ *		Set the size of a sparse standard output
+ *
+ *	The output may end with unused clusters which were skipped.
+ */
+
+static void extend_stdout(void)
+{
+	struct stat st;
+	off_t end;
+
+	end = lseek(fd_out, 0, SEEK_CUR);
+	if ((end == (off_t)-1)
+	    || fstat(fd_out, &st)
+	    || ((st.st_size < end) && ftruncate(fd_out, end)))
+		perr_exit("Cannot set the size of the standard output");
+}
+
 static void fsync_clone(int fd)
 {
 	Printf("Syncing ...\n");
@@ -2281,9 +3563,13 @@ static void set_filesize(s64 filesize)
 	}
 }
 
-static s64 open_image(void)
+static s64 open_image(const char *name)
 {
-	if (strcmp(opt.volume, "-") == 0) {
+	image_is_host_endian = FALSE;
+	image_is_chunked = FALSE;
+	image_input.size = 0;
+	image_input.pos = 0;
+	if (strcmp(name, "-") == 0) {
 		if ((fd_in = fileno(stdin)) == -1)
 			perr_exit("fileno for stdin failed");
 #ifdef HAVE_WINDOWS_H
@@ -2291,11 +3577,11 @@ static s64 open_image(void)
 			perr_exit("setting binary stdin failed");
 #endif
 	} else {
-		if ((fd_in = open(opt.volume, O_RDONLY | O_BINARY)) == -1)
-			perr_exit("failed to open image");
+		if ((fd_in = open(name, O_RDONLY | O_BINARY)) == -1)
+			perr_exit("failed to open image '%s'", name);
 	}
-	if (read_all(&fd_in, &image_hdr, NTFSCLONE_IMG_HEADER_SIZE_OLD) == -1)
-		perr_exit("read_all");
+		/* not through read_all(), a base is read when saving */
+	image_read_in(&image_hdr, NTFSCLONE_IMG_HEADER_SIZE_OLD);
 	if (memcmp(image_hdr.magic, IMAGE_MAGIC, IMAGE_MAGIC_SIZE) != 0)
 		err_exit("Input file is not an image! (invalid magic)\n");
 	if (image_hdr.major_ver < NTFSCLONE_IMG_VER_MAJOR_ENDIANNESS_SAFE) {
@@ -2323,18 +3609,19 @@ static s64 open_image(void)
 	} else {
 			/* safe image : little endian data */
 		le32 offset_to_image_data;
+		BOOL based = FALSE;
+		int ext_offset;
 		int delta;
 
-		if (image_hdr.major_ver > NTFSCLONE_IMG_VER_MAJOR)
+		if (image_hdr.major_ver > NTFSCLONE_IMG_VER_MAJOR_DIFF)
 			err_exit("Do not know how to handle image format "
 					"version %d.%d.  Please obtain a "
 					"newer version of ntfsclone.\n",
 					image_hdr.major_ver,
 					image_hdr.minor_ver);
 		/* Read the image header data offset. */
-		if (read_all(&fd_in, &offset_to_image_data,
-				sizeof(offset_to_image_data)) == -1)
-			perr_exit("read_all");
+		image_read_in(&offset_to_image_data,
+				sizeof(offset_to_image_data));
 			/* do not translate little endian data */
 		image_hdr.offset_to_image_data = offset_to_image_data;
 		/*
@@ -2352,14 +3639,609 @@ static s64 open_image(void)
 			dummy_buf = malloc(delta);
 			if (!dummy_buf)
 				perr_exit("malloc dummy_buffer");
-			if (read_all(&fd_in, dummy_buf, delta) == -1)
-				perr_exit("read_all");
+			image_read_in(dummy_buf, delta);
+				/* the extensions follow the aligned header */
+			ext_offset = ((sizeof(image_hdr) + IMAGE_HDR_ALIGN - 1)
+					& -IMAGE_HDR_ALIGN) - sizeof(image_hdr);
+			if ((image_hdr.major_ver
+					>= NTFSCLONE_IMG_VER_MAJOR_CHUNKED)
+			    && (delta >= (int)(ext_offset
+					+ sizeof(image_ext_hdr)))) {
+				memcpy(&image_ext_hdr, dummy_buf + ext_offset,
+					sizeof(image_ext_hdr));
+				image_is_chunked = TRUE;
+			}
+			ext_offset += sizeof(image_ext_hdr);
+			if ((image_hdr.major_ver
+					== NTFSCLONE_IMG_VER_MAJOR_DIFF)
+			    && (delta >= (int)(ext_offset
+					+ sizeof(image_base_hdr)))) {
+				memcpy(&image_base_hdr, dummy_buf + ext_offset,
+					sizeof(image_base_hdr));
+				image_base_hdr.base_name[IMAGE_BASE_NAME_SIZE
+							- 1] = 0;
+				based = (le32_to_cpu(
+					image_base_hdr.extent_clusters) > 0);
+			}
 			free(dummy_buf);
 		}
+		if (image_hdr.major_ver >= NTFSCLONE_IMG_VER_MAJOR_CHUNKED) {
+			image_ext_hdr.codec[IMAGE_CODEC_SIZE - 1] = 0;
+			if (!image_is_chunked
+			    || (le32_to_cpu(image_ext_hdr.chunk_size)
+					> IMAGE_CHUNK_SIZE_MAX)
+			    || ((image_hdr.major_ver
+					== NTFSCLONE_IMG_VER_MAJOR_DIFF)
+				&& !based))
+				err_exit("Bad header of compressed image\n");
+			if (!image_codec_known(image_ext_hdr.codec))
+				err_exit("Unknown compression codec '%s'\n",
+					image_ext_hdr.codec);
+		}
 	}
 	return sle64_to_cpu(image_hdr.device_size);
 }
 
+/*
+ *		Differential images
+ *
+ *	The clusters from 1 to nr_clusters - 1 are grouped into extents
+ *	of diff_extent_clusters, and each extent is given a digest of its
+ *	used clusters (their position in the extent and their data).
+ *	A differential image holds the boot sectors and the used clusters
+ *	of the extents whose digest differs from the base. The digests of
+ *	the base are read from a manifest saved along with the base, or
+ *	computed by replaying the base images, from the full one.
+ *
+ *	Restoring a differential image means restoring its chain of
+ *	images, from the full one, to the same output. The clusters which
+ *	became unused keep the data from the base, which does not matter.
+ */
+
+/* A digest of zeroes designates an extent which could not be read */
+struct extent_hash {
+	u8 digest[IMAGE_DIGEST_SIZE];
+} ;
+
+static struct {
+	pthread_mutex_t lock;
+	struct extent_hash *hashes;
+	s64 nr_extents;
+	s64 next;		/* next extent to hash */
+} extent_hashing;
+
+static s64 extent_count(s64 nr_clusters)
+{
+	return (rounded_up_division(nr_clusters, (s64)diff_extent_clusters));
+}
+
+static void extent_hash_cluster(struct image_digest *dg, s64 lcn,
+			const void *data, u32 size)
+{
+	le32 pos;
+
+	pos = cpu_to_le32(lcn % diff_extent_clusters);
+	image_digest_update(dg, &pos, sizeof(pos));
+	image_digest_update(dg, data, size);
+}
+
+static void extent_hash_final(struct image_digest *dg,
+			struct extent_hash *hash)
+{
+	static const struct extent_hash unreadable;
+
+	image_digest_final(dg, hash->digest);
+	if (!memcmp(hash, &unreadable, sizeof(unreadable)))
+		hash->digest[0] = 1;
+}
+
+/*
+ *		Hash the used clusters of an extent of the volume
+ *
+ *	The digest is zeroed if the extent cannot be read, so that it
+ *	is considered as changed, and saved with rescuing if requested.
+ */
+
+static void hash_extent(s64 extent, char *buf, struct extent_hash *hash)
+{
+	u32 csize = vol->cluster_size;
+	s64 first, end, lcn, run_end, i;
+	struct image_digest dg;
+
+	first = extent*diff_extent_clusters;
+	end = first + diff_extent_clusters;
+	if (!first)
+		first = 1;
+	if (end > vol->nr_clusters)
+		end = vol->nr_clusters;
+	image_digest_init(&dg);
+	lcn = find_cluster(first, end, 1);
+	while (lcn < end) {
+		run_end = find_cluster(lcn, end, 0);
+		if (ntfs_pread(vol->dev, lcn*csize, (run_end - lcn)*csize,
+				buf) != (run_end - lcn)*csize) {
+			memset(hash, 0, sizeof(*hash));
+			return;
+		}
+		for (i=lcn; i<run_end; i++)
+			extent_hash_cluster(&dg, i,
+					buf + (i - lcn)*csize, csize);
+		lcn = find_cluster(run_end, end, 1);
+	}
+	extent_hash_final(&dg, hash);
+}
+
+static void *extent_hash_worker(void *arg __attribute__((unused)))
+{
+	char *buf;
+	s64 first, end, k;
+
+	buf = (char*)ntfs_malloc((size_t)diff_extent_clusters
+				*vol->cluster_size);
+	if (!buf)
+		perr_exit("extent_hash_worker");
+	do {
+		pthread_mutex_lock(&extent_hashing.lock);
+		first = extent_hashing.next;
+		extent_hashing.next += IMAGE_EXTENT_BATCH;
+		pthread_mutex_unlock(&extent_hashing.lock);
+		end = first + IMAGE_EXTENT_BATCH;
+		if (end > extent_hashing.nr_extents)
+			end = extent_hashing.nr_extents;
+		for (k=first; k<end; k++)
+			hash_extent(k, buf, &extent_hashing.hashes[k]);
+	} while (first < extent_hashing.nr_extents);
+	free(buf);
+	return ((void*)NULL);
+}
+
+/*
+ *		Hash the extents of the volume, by parallel threads
+ */
+
+static void hash_volume_extents(struct extent_hash *hashes)
+{
+	pthread_t workers[IMAGE_CHUNK_WORKERS_MAX];
+	int nr_workers, i;
+
+	Printf("Hashing the used clusters ...\n");
+	extent_hashing.hashes = hashes;
+	extent_hashing.nr_extents = extent_count(vol->nr_clusters);
+	extent_hashing.next = 0;
+	pthread_mutex_init(&extent_hashing.lock, (pthread_mutexattr_t*)NULL);
+	nr_workers = worker_count();
+	for (i=0; i<nr_workers; i++)
+		if (pthread_create(&workers[i], (pthread_attr_t*)NULL,
+				extent_hash_worker, (void*)NULL))
+			err_exit("Could not start the hashing threads\n");
+	for (i=0; i<nr_workers; i++)
+		pthread_join(workers[i], (void**)NULL);
+	pthread_mutex_destroy(&extent_hashing.lock);
+}
+
+/*
+ *		Get the path to the base of an image
+ *
+ *	A relative name is searched for in the directory of the image,
+ *	then in the current directory. The path has to be freed.
+ */
+
+static char *image_base_path(const char *image, const char *base)
+{
+	const char *slash;
+	char *path;
+	int dirlen;
+
+	path = (char*)NULL;
+	slash = strrchr(image, '/');
+	if ((base[0] != '/') && slash) {
+		dirlen = slash - image + 1;
+		path = (char*)ntfs_malloc(dirlen + strlen(base) + 1);
+		if (!path)
+			perr_exit("image_base_path");
+		memcpy(path, image, dirlen);
+		strcpy(path + dirlen, base);
+		if (access(path, R_OK)) {
+			free(path);
+			path = (char*)NULL;
+		}
+	}
+	if (!path) {
+		path = strdup(base);
+		if (!path)
+			perr_exit("image_base_path");
+	}
+	return (path);
+}
+
+/*
+ *		Open an image which a differential image is based on
+ *
+ *	The base must be a chunked image, whose index has the expected
+ *	checksum. The input is left positioned on the image data.
+ */
+
+static void open_base_image(const char *name, u32 checksum)
+{
+	struct image_index_tail tail;
+
+	open_image(name);
+	if (!image_is_chunked)
+		err_exit("The base image '%s' is not compressed\n", name);
+	image_read_tail(&tail);
+	if (le32_to_cpu(tail.checksum) != checksum)
+		err_exit("'%s' is not the base image, its checksum differs\n",
+			name);
+	if (lseek(fd_in, le32_to_cpu(image_hdr.offset_to_image_data),
+			SEEK_SET) == (off_t)-1)
+		perr_exit("Cannot seek to the image data");
+}
+
+/*
+ *		Locate the images which a differential image is based on
+ *
+ *	The differential image must be open, and a base may be designated
+ *	instead of the one recorded in it. Returns the number of images
+ *	in the chain, from the differential image to the full one. All
+ *	the images are closed on return.
+ */
+
+static int image_chain(const char *name, const char *base,
+			char **names, u32 *checksums)
+{
+	le32 cluster_size;
+	sle64 nr_clusters;
+	char *path;
+	int n;
+
+	cluster_size = image_hdr.cluster_size;
+	nr_clusters = image_hdr.nr_clusters;
+	n = 0;
+	names[0] = (char*)NULL;
+	checksums[0] = 0;
+	while (image_hdr.major_ver == NTFSCLONE_IMG_VER_MAJOR_DIFF) {
+		if ((n + 1) >= IMAGE_CHAIN_MAX)
+			err_exit("Too many differential images based on "
+				"each other\n");
+		if (!n && base) {
+			path = strdup(base);
+			if (!path)
+				perr_exit("image_chain");
+		} else {
+			if (!image_base_hdr.base_name[0])
+				err_exit("The base of '%s' is not named, use "
+					"--base to designate it\n",
+					(n ? names[n] : name));
+			path = image_base_path((n ? names[n] : name),
+					image_base_hdr.base_name);
+		}
+		checksums[n + 1] = le32_to_cpu(image_base_hdr.base_checksum);
+		close(fd_in);
+		open_base_image(path, checksums[n + 1]);
+		if ((image_hdr.cluster_size != cluster_size)
+		    || (image_hdr.nr_clusters != nr_clusters))
+			err_exit("The base image '%s' is not from the same "
+				"volume\n", path);
+		names[++n] = path;
+	}
+	close(fd_in);
+	return (n + 1);
+}
+
+/*
+ *		Restore a differential image along with its bases
+ */
+
+static void restore_chain(void)
+{
+	char *names[IMAGE_CHAIN_MAX];
+	u32 checksums[IMAGE_CHAIN_MAX];
+	int n, i;
+
+	if (!strcmp(opt.volume, "-"))
+		err_exit("A differential image cannot be read from "
+			"standard input\n");
+	if (opt.std_out)
+		err_exit("A differential image cannot be restored to "
+			"standard output\n");
+	n = image_chain(opt.volume, opt.base, names, checksums);
+	for (i=n-1; i>=0; i--) {
+		if (i) {
+			Printf("Restoring the base image '%s'\n", names[i]);
+			open_base_image(names[i], checksums[i]);
+		} else
+			open_image(opt.volume);
+			/* the gaps are relative to the output position */
+		if (!opt.no_action
+		    && (lseek_out(fd_out, 0, SEEK_SET) == (off_t)-1))
+			perr_exit("restore_chain: lseek");
+		image_chunks_start(image_ext_hdr.codec, TRUE,
+				le32_to_cpu(image_ext_hdr.chunk_size));
+		restore_image();
+		image_chunks_stop();
+		close(fd_in);
+		free(names[i]);
+	}
+}
+
+/*
+ *		Hash the clusters of the open image into their extents
+ *
+ *	The extents which have clusters in the image have their digests
+ *	replaced. The clusters of an extent are stored together and in
+ *	order, so a single extent is being digested at a time.
+ */
+
+static void hash_image_clusters(struct extent_hash *hashes)
+{
+	char buf[NTFS_MAX_CLUSTER_SIZE];
+	struct image_digest dg;
+	s64 nr_clusters, device_size;
+	s64 pos, count, extent, current;
+	u32 csize, size;
+	sle64 lecount;
+	char cmd;
+
+	nr_clusters = sle64_to_cpu(image_hdr.nr_clusters);
+	device_size = sle64_to_cpu(image_hdr.device_size);
+	csize = le32_to_cpu(image_hdr.cluster_size);
+	image_chunks_start(image_ext_hdr.codec, TRUE,
+			le32_to_cpu(image_ext_hdr.chunk_size));
+	pos = 0;
+	current = -1;
+	while ((pos <= nr_clusters) && image_chunk_get(&cmd, sizeof(cmd))) {
+		if (cmd == CMD_GAP) {
+			if (!image_chunk_get(&lecount, sizeof(lecount)))
+				err_exit("Short image file...\n");
+			count = sle64_to_cpu(lecount);
+			if ((count <= 0) || ((pos + count) > (nr_clusters + 1)))
+				err_exit("Corrupt base image at cluster %lld\n",
+					(long long)pos);
+			pos += count;
+		} else if (cmd == CMD_NEXT) {
+				/* possible partial backup boot sector */
+			size = csize;
+			if ((s64)((pos + 1)*csize) >= device_size)
+				size = device_size - pos*csize;
+			if ((size > csize) || !image_chunk_get(buf, size))
+				err_exit("Short image file...\n");
+			if (pos && (pos < nr_clusters)) {
+				extent = pos/diff_extent_clusters;
+				if (extent != current) {
+					if (current >= 0)
+						extent_hash_final(&dg,
+							&hashes[current]);
+					image_digest_init(&dg);
+					current = extent;
+				}
+				extent_hash_cluster(&dg, pos, buf, size);
+			}
+			pos++;
+		} else
+			err_exit("Invalid command code %d in base image\n",
+				cmd);
+	}
+	if (current >= 0)
+		extent_hash_final(&dg, &hashes[current]);
+	image_chunks_stop();
+}
+
+/*
+ *		Get the digests of the base image by replaying its chain
+ *
+ *	The extents must be the ones of the volume to be saved.
+ */
+
+static struct extent_hash *hash_image_chain(void)
+{
+	char *names[IMAGE_CHAIN_MAX];
+	u32 checksums[IMAGE_CHAIN_MAX];
+	struct image_index_tail tail;
+	struct image_digest dg;
+	struct extent_hash empty;
+	struct extent_hash *hashes;
+	s64 nr_extents, k;
+	int n, i;
+
+	open_image(opt.base);
+	if (!image_is_chunked)
+		err_exit("The base image '%s' is not compressed, save a "
+			"manifest along with it\n", opt.base);
+	if ((le32_to_cpu(image_hdr.cluster_size) != vol->cluster_size)
+	    || (sle64_to_cpu(image_hdr.nr_clusters) != vol->nr_clusters))
+		err_exit("The base image '%s' is not from this volume\n",
+			opt.base);
+	image_read_tail(&tail);
+	if (lseek(fd_in, le32_to_cpu(image_hdr.offset_to_image_data),
+			SEEK_SET) == (off_t)-1)
+		perr_exit("Cannot seek to the image data");
+	if ((image_hdr.major_ver == NTFSCLONE_IMG_VER_MAJOR_DIFF)
+	    && (le32_to_cpu(image_base_hdr.extent_clusters)
+			!= diff_extent_clusters))
+		err_exit("The base image '%s' does not have the same "
+			"extents\n", opt.base);
+	n = image_chain(opt.base, (const char*)NULL, names, checksums);
+	checksums[0] = le32_to_cpu(tail.checksum);
+
+	nr_extents = extent_count(vol->nr_clusters);
+	hashes = (struct extent_hash*)ntfs_malloc(nr_extents
+				*sizeof(struct extent_hash));
+	if (!hashes)
+		perr_exit("hash_image_chain");
+	image_digest_init(&dg);
+	extent_hash_final(&dg, &empty);
+	for (k=0; k<nr_extents; k++)
+		hashes[k] = empty;
+	for (i=n-1; i>=0; i--) {
+		Printf("Hashing the base image '%s' ...\n",
+			(i ? names[i] : opt.base));
+		open_base_image((i ? names[i] : opt.base), checksums[i]);
+		if ((image_hdr.major_ver == NTFSCLONE_IMG_VER_MAJOR_DIFF)
+		    && (le32_to_cpu(image_base_hdr.extent_clusters)
+				!= diff_extent_clusters))
+			err_exit("The images based on each other do not "
+				"have the same extents\n");
+		hash_image_clusters(hashes);
+		close(fd_in);
+		free(names[i]);
+	}
+	memset(&image_base_hdr, 0, sizeof(image_base_hdr));
+	image_base_hdr.base_checksum = tail.checksum;
+	strncpy(image_base_hdr.base_name, opt.base, IMAGE_BASE_NAME_SIZE - 1);
+	return (hashes);
+}
+
+/*
+ *		Get the digests of the base, from a manifest or an image
+ */
+
+static struct extent_hash *load_base_hashes(void)
+{
+	struct image_manifest_hdr hdr;
+	struct extent_hash *hashes;
+	s64 nr_extents;
+
+	if ((fd_in = open(opt.base, O_RDONLY | O_BINARY)) == -1)
+		perr_exit("Opening the base '%s' failed", opt.base);
+	image_read_in(&hdr, sizeof(hdr));
+	if (memcmp(hdr.magic, IMAGE_MANIFEST_MAGIC,
+			IMAGE_MANIFEST_MAGIC_SIZE)) {
+		if (memcmp(hdr.magic, IMAGE_MAGIC, IMAGE_MAGIC_SIZE))
+			err_exit("'%s' is neither an image nor a manifest\n",
+				opt.base);
+		close(fd_in);
+		return (hash_image_chain());
+	}
+	if ((le32_to_cpu(hdr.cluster_size) != vol->cluster_size)
+	    || (sle64_to_cpu(hdr.nr_clusters) != vol->nr_clusters)
+	    || (le32_to_cpu(hdr.extent_clusters) != diff_extent_clusters))
+		err_exit("The manifest '%s' is not for this volume\n",
+			opt.base);
+	nr_extents = extent_count(vol->nr_clusters);
+	hashes = (struct extent_hash*)ntfs_malloc(nr_extents
+				*sizeof(struct extent_hash));
+	if (!hashes)
+		perr_exit("load_base_hashes");
+	image_read_in(hashes, nr_extents*sizeof(struct extent_hash));
+	close(fd_in);
+	memset(&image_base_hdr, 0, sizeof(image_base_hdr));
+	image_base_hdr.base_checksum = hdr.image_checksum;
+	hdr.image_name[IMAGE_BASE_NAME_SIZE - 1] = 0;
+	strcpy(image_base_hdr.base_name, hdr.image_name);
+	return (hashes);
+}
+
+/*
+ *		Only keep the used clusters of the extents which changed
+ *
+ *	Returns the number of clusters dropped from the bitmap.
+ */
+
+static s64 keep_changed_extents(const struct extent_hash *hashes,
+			const struct extent_hash *base_hashes)
+{
+	static const struct extent_hash unreadable;
+	s64 nr_extents, changed, dropped;
+	s64 k, lcn, end;
+
+	nr_extents = extent_count(vol->nr_clusters);
+	changed = 0;
+	dropped = 0;
+	for (k=0; k<nr_extents; k++) {
+		if (memcmp(&hashes[k], &unreadable, sizeof(unreadable))
+		    && !memcmp(&hashes[k], &base_hashes[k],
+				sizeof(struct extent_hash))) {
+			lcn = k*diff_extent_clusters;
+			end = lcn + diff_extent_clusters;
+			if (!lcn)
+				lcn = 1;
+			if (end > vol->nr_clusters)
+				end = vol->nr_clusters;
+			for ( ; lcn<end; lcn++)
+				if (ntfs_bit_get_and_set(lcn_bitmap.bm, lcn, 0))
+					dropped++;
+		} else
+			changed++;
+	}
+	Printf("Changed extents        : %lld of %lld\n",
+		(long long)changed, (long long)nr_extents);
+	return (dropped);
+}
+
+/*
+ *		Compute the digests of the volume to be saved
+ *
+ *	When a base is designated, the extents which did not change are
+ *	dropped from the clusters to save.
+ */
+
+static struct extent_hash *hash_extents(ntfs_walk_clusters_ctx *image)
+{
+	struct extent_hash *hashes, *base_hashes;
+
+	diff_extent_clusters = IMAGE_EXTENT_SIZE/vol->cluster_size;
+	if (!diff_extent_clusters)
+		diff_extent_clusters = 1;
+	base_hashes = (struct extent_hash*)NULL;
+	if (opt.base)
+		base_hashes = load_base_hashes();
+	hashes = (struct extent_hash*)ntfs_malloc(
+			extent_count(vol->nr_clusters)
+				*sizeof(struct extent_hash));
+	if (!hashes)
+		perr_exit("hash_extents");
+	hash_volume_extents(hashes);
+	if (base_hashes) {
+		image->inuse -= keep_changed_extents(hashes, base_hashes);
+		free(base_hashes);
+	}
+	return (hashes);
+}
+
+static void open_manifest(void)
+{
+	int flags = O_WRONLY | O_CREAT | O_TRUNC | O_BINARY;
+	int fd;
+
+	if (!opt.overwrite)
+		flags |= O_EXCL;
+	fd = open(opt.manifest, flags, S_IRUSR | S_IWUSR);
+	if (fd == -1)
+		perr_exit("Opening the manifest '%s' failed", opt.manifest);
+	manifest_out = fdopen(fd, BINWMODE);
+	if (!manifest_out)
+		perr_exit("Opening the manifest '%s' failed", opt.manifest);
+}
+
+/*
+ *		Save the digests of the volume along with the image
+ *
+ *	The checksum of the image index is only known after the image.
+ */
+
+static void write_manifest(const struct extent_hash *hashes)
+{
+	struct image_manifest_hdr hdr;
+	s64 nr_extents;
+
+	memset(&hdr, 0, sizeof(hdr));
+	memcpy(hdr.magic, IMAGE_MANIFEST_MAGIC, IMAGE_MANIFEST_MAGIC_SIZE);
+	hdr.cluster_size = cpu_to_le32(vol->cluster_size);
+	hdr.extent_clusters = cpu_to_le32(diff_extent_clusters);
+	hdr.nr_clusters = cpu_to_sle64(vol->nr_clusters);
+	hdr.image_checksum = cpu_to_le32(image_checksum);
+	if (!opt.std_out)
+		strncpy(hdr.image_name, opt.output, IMAGE_BASE_NAME_SIZE - 1);
+	if (fwrite(&hdr, sizeof(hdr), 1, manifest_out) != 1)
+		perr_exit("Writing the manifest failed");
+	nr_extents = extent_count(vol->nr_clusters);
+	if (fwrite(hashes, sizeof(struct extent_hash), nr_extents,
+			manifest_out) != (size_t)nr_extents)
+		perr_exit("Writing the manifest failed");
+	if (fclose(manifest_out))
+		perr_exit("Writing the manifest failed");
+}
+
 static s64 open_volume(void)
 {
 	s64 device_size;
@@ -2392,6 +4274,26 @@ static void initialise_image_hdr(s64 device_size, s64 inuse)
 	image_hdr.inuse = cpu_to_sle64(inuse);
 	image_hdr.offset_to_image_data = cpu_to_le32((sizeof(image_hdr)
 			 + IMAGE_HDR_ALIGN - 1) & -IMAGE_HDR_ALIGN);
+	if (opt.codec && !opt.metadata_image) {
+		image_hdr.major_ver = NTFSCLONE_IMG_VER_MAJOR_CHUNKED;
+		image_hdr.minor_ver = NTFSCLONE_IMG_VER_MINOR_CHUNKED;
+		image_hdr.offset_to_image_data = cpu_to_le32(
+				le32_to_cpu(image_hdr.offset_to_image_data)
+				+ sizeof(image_ext_hdr));
+		memset(&image_ext_hdr, 0, sizeof(image_ext_hdr));
+		strncpy(image_ext_hdr.codec, opt.codec, IMAGE_CODEC_SIZE - 1);
+		image_ext_hdr.chunk_size = const_cpu_to_le32(IMAGE_CHUNK_SIZE);
+		if (opt.base) {
+			image_hdr.major_ver = NTFSCLONE_IMG_VER_MAJOR_DIFF;
+			image_hdr.minor_ver = NTFSCLONE_IMG_VER_MINOR_DIFF;
+			image_hdr.offset_to_image_data = cpu_to_le32(
+				le32_to_cpu(image_hdr.offset_to_image_data)
+				+ sizeof(image_base_hdr));
+				/* the base itself was set by load_base_hashes */
+			image_base_hdr.extent_clusters
+					= cpu_to_le32(diff_extent_clusters);
+		}
+	}
 }
 
 static void check_output_device(s64 input_size)
@@ -2534,6 +4436,7 @@ int main(int argc, char **argv)
 	ntfs_walk_clusters_ctx image;
 	s64 device_size;        /* input device size in bytes */
 	s64 ntfs_size;
+	struct extent_hash *hashes;
 	unsigned int wiped_total = 0;
 
 	/* make sure the layout of header is not affected by alignments */
@@ -2552,7 +4455,7 @@ int main(int argc, char **argv)
 	utils_set_locale();
 
 	if (opt.restore_image) {
-		device_size = open_image();
+		device_size = open_image(opt.volume);
 		ntfs_size = sle64_to_cpu(image_hdr.nr_clusters) *
 				le32_to_cpu(image_hdr.cluster_size);
 	} else {
@@ -2570,6 +4473,27 @@ int main(int argc, char **argv)
 #ifdef HAVE_WINDOWS_H
 		if (setmode(fileno(stdout),O_BINARY) == -1)
 			perr_exit("setting binary stdout failed");
+#else
+		if (opt.restore_image) {
+			struct stat st;
+			off_t pos;
+
+				/*
+				 * Unused clusters are skipped in a file, when
+				 * nothing has been written beyond, otherwise
+				 * stale data has to be cleared.
+				 */
+			if (!fstat(fd_out, &st) && S_ISREG(st.st_mode)
+			    && !(fcntl(fd_out, F_GETFL) & O_APPEND)) {
+				pos = lseek(fd_out, 0, SEEK_CUR);
+				if (pos != (off_t)-1) {
+					if (st.st_size <= pos)
+						stdout_sparse = TRUE;
+					else
+						stdout_punch = TRUE;
+				}
+			}
+		}
 #endif
 	} else {
 		/* device_size_get() might need to read() */
@@ -2613,7 +4537,22 @@ int main(int argc, char **argv)
 
 	if (opt.restore_image) {
 		print_image_info();
-		restore_image();
+		if (opt.verify_image) {
+			verify_image();
+			exit(0);
+		}
+		if (image_hdr.major_ver == NTFSCLONE_IMG_VER_MAJOR_DIFF)
+			restore_chain();
+		else {
+			if (image_is_chunked)
+				image_chunks_start(image_ext_hdr.codec, TRUE,
+					le32_to_cpu(image_ext_hdr.chunk_size));
+			restore_image();
+			if (image_is_chunked)
+				image_chunks_stop();
+		}
+		if (stdout_sparse || stdout_punch)
+			extend_stdout();
 		if (!opt.no_action)
 			fsync_clone(fd_out);
 		exit(0);
@@ -2632,6 +4571,13 @@ int main(int argc, char **argv)
 
 	ignore_bad_clusters(&image);
 
+	hashes = (struct extent_hash*)NULL;
+	if (opt.save_image && (opt.base || opt.manifest)) {
+		if (opt.manifest)
+			open_manifest();
+		hashes = hash_extents(&image);
+	}
+
 	if (opt.save_image)
 		initialise_image_hdr(device_size, image.inuse);
 
@@ -2645,6 +4591,9 @@ int main(int argc, char **argv)
 		fsync_clone(fd_out);
 		if (opt.save_image)
 			fclose(stream_out);
+		if (opt.manifest)
+			write_manifest(hashes);
+		free(hashes);
 		ntfs_umount(vol,FALSE);
 		free(lcn_bitmap.bm);
 		exit(0);
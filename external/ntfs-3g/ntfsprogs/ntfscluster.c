@@ -40,6 +40,12 @@
 #ifdef HAVE_LIMITS_H
 #include <limits.h>
 #endif
+#ifdef HAVE_ERRNO_H
+#include <errno.h>
+#endif
+#ifdef HAVE_UNISTD_H
+#include <unistd.h>
+#endif
 
 #include "ntfscluster.h"
 #include "types.h"
@@ -49,9 +55,12 @@
 #include "debug.h"
 #include "dir.h"
 #include "cluster.h"
+#include "mftscan.h"
 /* #include "version.h" */
 #include "logging.h"
 
+#define FRAG_TOP 10	/* most fragmented files to report */
+
 static const char *EXEC_NAME = "ntfscluster";
 static struct options opts;
 
@@ -89,7 +98,10 @@ static void usage(void)
 		"    -I, --inode NUM      Show information about this inode\n"
 		"    -F, --filename NAME  Show information about this file\n"
 	/*	"    -l, --last           Find the last file on the volume\n" */
+		"        --overlaps       List the clusters used by several files\n"
+		"        --fragmentation  Report about the fragmentation\n"
 		"\n"
+		"        --map FILE       Use the cluster map saved in FILE\n"
 		"    -f, --force          Use less caution\n"
 		"    -q, --quiet          Less output\n"
 		"    -v, --verbose        More output\n"
@@ -115,10 +127,13 @@ static int parse_options(int argc, char **argv)
 		{ "cluster",	required_argument,	NULL, 'c' },
 		{ "filename",	required_argument,	NULL, 'F' },
 		{ "force",	no_argument,		NULL, 'f' },
+		{ "fragmentation", no_argument,		NULL, 'G' },
 		{ "help",	no_argument,		NULL, 'h' },
 		{ "info",	no_argument,		NULL, 'i' },
 		{ "inode",	required_argument,	NULL, 'I' },
 		{ "last",	no_argument,		NULL, 'l' },
+		{ "map",	required_argument,	NULL, 'M' },
+		{ "overlaps",	no_argument,		NULL, 'O' },
 		{ "quiet",	no_argument,		NULL, 'q' },
 		{ "sector",	required_argument,	NULL, 's' },
 		{ "verbose",	no_argument,		NULL, 'v' },
@@ -168,6 +183,12 @@ static int parse_options(int argc, char **argv)
 		case 'f':
 			opts.force++;
 			break;
+		case 'G':	/* not proposed as a short option */
+			if (opts.action == act_none)
+				opts.action = act_fragmentation;
+			else
+				opts.action = act_error;
+			break;
 		case 'h':
 		case '?':
 			if (strncmp (argv[optind-1], "--log-", 6) == 0) {
@@ -199,6 +220,15 @@ static int parse_options(int argc, char **argv)
 			else
 				opts.action = act_error;
 			break;
+		case 'M':	/* not proposed as a short option */
+			opts.map = optarg;
+			break;
+		case 'O':	/* not proposed as a short option */
+			if (opts.action == act_none)
+				opts.action = act_overlaps;
+			else
+				opts.action = act_error;
+			break;
 		case 'q':
 			opts.quiet++;
 			ntfs_log_clear_levels(NTFS_LOG_LEVEL_QUIET);
@@ -254,7 +284,7 @@ static int parse_options(int argc, char **argv)
 		}
 
 		if (opts.action == act_error) {
-			ntfs_log_error("You may only specify one action: --info, --cluster, --sector or --last.\n");
+			ntfs_log_error("You may only specify one action: --info, --cluster, --sector, --last, --overlaps or --fragmentation.\n");
 			err++;
 		} else if (opts.range_begin > opts.range_end) {
 			ntfs_log_error("The range must be in ascending order.\n");
@@ -271,57 +301,92 @@ static int parse_options(int argc, char **argv)
 }
 
 
+struct info_counts {
+	u64 uc;		/* clusters of user data */
+	u64 mc;		/* clusters of metadata */
+	int inuse;
+} ;
+
 /**
- * info
+ * info_record - Count the clusters allocated to an MFT record
+ *
+ * Called by the MFT scan, possibly by several threads.
  */
-static int info(ntfs_volume *vol)
+static int info_record(ntfs_volume *vol, u64 mft_num, MFT_RECORD *mrec,
+		void *data)
 {
-	u64 a, b, c, d, e, f, g, h, i, j, k, l, m, n, o, p, q, r, s, t, u;
-	int cb, sb, cps;
-	u64 uc = 0, mc = 0, fc = 0;
-
-	struct mft_search_ctx *m_ctx;
+	struct info_counts *counts;
 	ntfs_attr_search_ctx *a_ctx;
+	ntfs_inode ino;
 	runlist_element *rl;
 	ATTR_RECORD *rec;
+	u64 uc = 0, mc = 0;
+	BOOL metadata;
 	int z;
-	int inuse = 0;
-
-	m_ctx = mft_get_search_ctx(vol);
-	m_ctx->flags_search = FEMR_IN_USE | FEMR_METADATA | FEMR_BASE_RECORD | FEMR_NOT_BASE_RECORD;
-	while (mft_next_record(m_ctx) == 0) {
-
-		if (!(m_ctx->flags_match & FEMR_IN_USE))
-			continue;
 
-		inuse++;
+	counts = (struct info_counts*)data;
 
-		a_ctx = ntfs_attr_get_search_ctx(m_ctx->inode, NULL);
+	/* only used for the metadata check */
+	memset(&ino, 0, sizeof(ino));
+	ino.mft_no = mft_num;
+	ino.vol = vol;
+	ino.mrec = mrec;
+	metadata = utils_is_metadata(&ino) == 1;
 
-		while ((rec = find_attribute(AT_UNUSED, a_ctx))) {
+	a_ctx = ntfs_attr_get_search_ctx(NULL, mrec);
+	if (!a_ctx)
+		return -1;
 
-			if (!rec->non_resident)
-				continue;
+	while ((rec = find_attribute(AT_UNUSED, a_ctx))) {
 
-			rl = ntfs_mapping_pairs_decompress(vol, rec, NULL);
+		if (!rec->non_resident)
+			continue;
 
-			for (z = 0; rl[z].length > 0; z++)
-			{
-				if (rl[z].lcn >= 0) {
-					if (m_ctx->flags_match & FEMR_METADATA)
-						mc += rl[z].length;
-					else
-						uc += rl[z].length;
-				}
+		rl = ntfs_mapping_pairs_decompress(vol, rec, NULL);
+		if (!rl)
+			continue;
 
+		for (z = 0; rl[z].length > 0; z++)
+		{
+			if (rl[z].lcn >= 0) {
+				if (metadata)
+					mc += rl[z].length;
+				else
+					uc += rl[z].length;
 			}
 
-			free(rl);
 		}
 
-		ntfs_attr_put_search_ctx(a_ctx);
+		free(rl);
 	}
-	mft_put_search_ctx(m_ctx);
+
+	ntfs_attr_put_search_ctx(a_ctx);
+
+	mft_scan_lock();
+	counts->inuse++;
+	counts->uc += uc;
+	counts->mc += mc;
+	mft_scan_unlock();
+	return 0;
+}
+
+/**
+ * info
+ */
+static int info(ntfs_volume *vol)
+{
+	u64 a, b, c, d, e, f, g, h, i, j, k, l, m, n, o, p, q, r, s, t, u;
+	int cb, sb, cps;
+	u64 uc = 0, mc = 0, fc = 0;
+	struct info_counts counts;
+	int inuse = 0;
+
+	memset(&counts, 0, sizeof(counts));
+	if (mft_scan(vol, 0, info_record, &counts))
+		return 1;
+	uc = counts.uc;
+	mc = counts.mc;
+	inuse = counts.inuse;
 
 	cb  = vol->cluster_size_bits;
 	sb  = vol->sector_size_bits;
@@ -469,6 +534,244 @@ static int find_last(ntfs_inode *ino, ATTR_RECORD *attr, runlist_element *run,
 	return 0;
 }
 
+/**
+ * get_map - Get the reverse map of the volume
+ *
+ * The map is loaded from its side file if it is still valid for the volume,
+ * otherwise it is built by a single MFT scan and saved into the side file.
+ * A file which is not a map of this volume is never overwritten.
+ *
+ * Return:  the map, or NULL on error
+ */
+static cluster_map *get_map(ntfs_volume *vol)
+{
+	cluster_map *map = NULL;
+
+	if (opts.map) {
+		map = cluster_map_load(vol, opts.map);
+		if (!map && (errno == ESTALE))
+			ntfs_log_quiet("The volume has changed since %s was "
+					"built\n", opts.map);
+		else if (!map && (errno == EINVAL)) {
+			ntfs_log_error("%s is not a cluster map of this "
+					"volume\n", opts.map);
+			return NULL;
+		} else if (!map && (errno != ENOENT)) {
+			ntfs_log_perror("Cannot load %s", opts.map);
+			return NULL;
+		}
+	}
+	if (!map) {
+		ntfs_log_quiet("Building the cluster map\n");
+		map = cluster_map_build(vol);
+		if (!map)
+			ntfs_log_error("Failed to build the cluster map\n");
+		else if (opts.map && cluster_map_save(vol, map, opts.map)) {
+			cluster_map_free(map);
+			map = NULL;
+		}
+	}
+	return map;
+}
+
+/**
+ * find_clusters - Look for the owners of a range of clusters
+ *
+ * Use the map if there is one, otherwise scan the MFT. A side file found
+ * to be stale is removed, so that the map is rebuilt on next run.
+ */
+static int find_clusters(ntfs_volume *vol, cluster_map *map, LCN c_begin,
+		LCN c_end, cluster_cb *cb, void *data)
+{
+	int result;
+
+	if (!map)
+		return cluster_find(vol, c_begin, c_end, cb, data);
+	result = cluster_map_find(vol, map, c_begin, c_end, cb, data);
+	if ((result < 0) && (errno == ESTALE) && opts.map) {
+		if (unlink(opts.map))
+			ntfs_log_perror("Cannot remove %s", opts.map);
+		else
+			ntfs_log_error("Removed %s, please run again.\n",
+					opts.map);
+	}
+	return result;
+}
+
+/**
+ * list_overlaps - List the clusters allocated to several attributes
+ *
+ * The runs are sorted by first cluster, so a run overlaps a previous one
+ * when it begins before the end of the previous run reaching farthest.
+ *
+ * Return:  0  No overlap
+ *	    1  Some clusters are used several times
+ */
+static int list_overlaps(const cluster_map *map)
+{
+	const cluster_extent *owner = NULL;
+	const cluster_extent *ext;
+	LCN owner_end = -1;
+	LCN end;
+	s64 count = 0;
+	s64 i;
+
+	for (i = 0; i < map->count; i++) {
+		ext = &map->extents[i];
+		end = ext->lcn + ext->length - 1;
+		if (owner && (ext->lcn <= owner_end)) {
+			ntfs_log_info("Clusters %lld-%lld : inode %llu 0x%02x "
+				"and inode %llu 0x%02x\n",
+				(long long)ext->lcn,
+				(long long)(end < owner_end ? end : owner_end),
+				(unsigned long long)owner->inode,
+				(int)le32_to_cpu(owner->type),
+				(unsigned long long)ext->inode,
+				(int)le32_to_cpu(ext->type));
+			count++;
+		}
+		if (!owner || (end > owner_end)) {
+			owner = ext;
+			owner_end = end;
+		}
+	}
+	ntfs_log_quiet("%lld overlapping runs found\n", (long long)count);
+	return (count ? 1 : 0);
+}
+
+static int frag_cmp(const void *p1, const void *p2)
+{
+	const cluster_extent *e1 = (const cluster_extent*)p1;
+	const cluster_extent *e2 = (const cluster_extent*)p2;
+
+	if (e1->inode != e2->inode)
+		return (e1->inode < e2->inode ? -1 : 1);
+	if (e1->type != e2->type)
+		return (le32_to_cpu(e1->type) < le32_to_cpu(e2->type) ? -1 : 1);
+	if (e1->name != e2->name)
+		return (e1->name < e2->name ? -1 : 1);
+	if (e1->vcn != e2->vcn)
+		return (e1->vcn < e2->vcn ? -1 : 1);
+	if (e1->lcn != e2->lcn)
+		return (e1->lcn < e2->lcn ? -1 : 1);
+	return (0);
+}
+
+/**
+ * report_fragmentation - Report about the fragmentation of files and space
+ *
+ * A fragment of a file is a run which does not follow physically the
+ * previous run of the same attribute (same type and name), so that sparse
+ * and compressed files are not reported as fragmented when their data is
+ * contiguous. A file is fragmented when it has more fragments than
+ * attributes.
+ */
+static int report_fragmentation(ntfs_volume *vol, const cluster_map *map)
+{
+	struct {
+		u64 inum;
+		s64 fragments;
+	} top[FRAG_TOP];
+	cluster_extent *runs;
+	const cluster_extent *ext;
+	const cluster_extent *prev;
+	char *buffer;
+	ntfs_inode *ino;
+	s64 files = 0, fragmented = 0, fragments = 0, frags = 0, attrs = 0;
+	s64 free_runs = 0, largest_free = 0;
+	LCN next = 0;
+	LCN start;
+	s64 i;
+	int ntop = 0;
+	int t;
+
+	/* the space between runs, in the order of clusters */
+	for (i = 0; i <= map->count; i++) {
+		ext = (i < map->count ? &map->extents[i] : NULL);
+		start = (ext ? ext->lcn : vol->nr_clusters);
+		if (start > next) {
+			free_runs++;
+			if ((start - next) > largest_free)
+				largest_free = start - next;
+		}
+		if (ext && ((ext->lcn + ext->length) > next))
+			next = ext->lcn + ext->length;
+	}
+
+	/* the runs of each file, in the order of attributes and vcns */
+	runs = (cluster_extent*)malloc((map->count ? map->count : 1)
+				* sizeof(cluster_extent));
+	buffer = malloc(MAX_PATH);
+	if (!runs || !buffer) {
+		ntfs_log_error("Not enough memory for the report\n");
+		free(runs);
+		free(buffer);
+		return 1;
+	}
+	memcpy(runs, map->extents, map->count*sizeof(cluster_extent));
+	qsort(runs, map->count, sizeof(cluster_extent), frag_cmp);
+
+	for (i = 0; i <= map->count; i++) {
+		ext = (i < map->count ? &runs[i] : NULL);
+		prev = (i ? &runs[i - 1] : NULL);
+		if (prev && (!ext || (ext->inode != prev->inode))) {
+			/* done with the previous file */
+			files++;
+			fragments += frags;
+			if (frags > attrs) {
+				fragmented++;
+				for (t = ntop; (t > 0)
+				    && (top[t - 1].fragments < frags); t--)
+					if (t < FRAG_TOP)
+						top[t] = top[t - 1];
+				if (t < FRAG_TOP) {
+					top[t].inum = prev->inode;
+					top[t].fragments = frags;
+					if (ntop < FRAG_TOP)
+						ntop++;
+				}
+			}
+			frags = 0;
+			attrs = 0;
+		}
+		if (!ext)
+			continue;
+		if (!prev || (ext->inode != prev->inode)
+		    || (ext->type != prev->type)
+		    || (ext->name != prev->name)) {
+			/* first run of an attribute */
+			attrs++;
+			frags++;
+		} else if (ext->lcn != (prev->lcn + prev->length))
+			frags++;
+	}
+
+	ntfs_log_info("files with clusters     : %lld\n", (long long)files);
+	ntfs_log_info("fragmented files        : %lld\n", (long long)fragmented);
+	ntfs_log_info("fragments of files      : %lld\n", (long long)fragments);
+	ntfs_log_info("fragments per file      : %.2f\n",
+			(files ? (double)fragments/files : 0.0));
+	ntfs_log_info("runs of unused clusters : %lld\n", (long long)free_runs);
+	ntfs_log_info("largest unused run      : %lld\n", (long long)largest_free);
+	if (ntop)
+		ntfs_log_info("\nMost fragmented files:\n");
+	for (t = 0; t < ntop; t++) {
+		ino = ntfs_inode_open(vol, top[t].inum);
+		if (ino) {
+			utils_inode_get_name(ino, buffer, MAX_PATH);
+			ntfs_inode_close(ino);
+		} else
+			strcpy(buffer, "<unknown>");
+		ntfs_log_info("%8lld fragments : inode %llu %s\n",
+				(long long)top[t].fragments,
+				(unsigned long long)top[t].inum, buffer);
+	}
+
+	free(buffer);
+	free(runs);
+	return 0;
+}
+
 /**
  * main - Begin here
  *
@@ -481,6 +784,7 @@ int main(int argc, char *argv[])
 {
 	ntfs_volume *vol;
 	ntfs_inode *ino = NULL;
+	cluster_map *map = NULL;
 	struct match m;
 	int result = 1;
 
@@ -496,6 +800,15 @@ int main(int argc, char *argv[])
 	if (!vol)
 		return 1;
 
+	if (opts.map || (opts.action == act_overlaps)
+	    || (opts.action == act_fragmentation)) {
+		map = get_map(vol);
+		if (!map) {
+			ntfs_umount(vol, FALSE);
+			return 1;
+		}
+	}
+
 	switch (opts.action) {
 		case act_sector:
 			if (opts.range_begin == opts.range_end)
@@ -506,7 +819,7 @@ int main(int argc, char *argv[])
 			/* Convert to clusters */
 			opts.range_begin >>= (vol->cluster_size_bits - vol->sector_size_bits);
 			opts.range_end   >>= (vol->cluster_size_bits - vol->sector_size_bits);
-			result = cluster_find(vol, opts.range_begin, opts.range_end, (cluster_cb*)&print_match, NULL);
+			result = find_clusters(vol, map, opts.range_begin, opts.range_end, (cluster_cb*)&print_match, NULL);
 			break;
 		case act_cluster:
 			if (opts.range_begin == opts.range_end)
@@ -514,7 +827,7 @@ int main(int argc, char *argv[])
 						(unsigned long long)opts.range_begin);
 			else
 				ntfs_log_quiet("Searching for cluster range %llu-%llu\n", (unsigned long long)opts.range_begin, (unsigned long long)opts.range_end);
-			result = cluster_find(vol, opts.range_begin, opts.range_end, (cluster_cb*)&print_match, NULL);
+			result = find_clusters(vol, map, opts.range_begin, opts.range_end, (cluster_cb*)&print_match, NULL);
 			break;
 		case act_file:
 			ino = ntfs_pathname_to_inode(vol, NULL, opts.filename);
@@ -534,7 +847,10 @@ int main(int argc, char *argv[])
 		case act_last:
 			memset(&m, 0, sizeof(m));
 			m.lcn = -1;
-			result = cluster_find(vol, 0, LONG_MAX, (cluster_cb*)&find_last, &m);
+			/* with a map, only the runs reaching the end matter */
+			result = find_clusters(vol, map,
+				(map && map->count ? map->extents[map->count - 1].reach : 0),
+				LONG_MAX, (cluster_cb*)&find_last, &m);
 			if (m.lcn >= 0) {
 				ino = ntfs_inode_open(vol, m.inum);
 				if (ino) {
@@ -550,12 +866,19 @@ int main(int argc, char *argv[])
 				result = 1;
 			}
 			break;
+		case act_overlaps:
+			result = list_overlaps(map);
+			break;
+		case act_fragmentation:
+			result = report_fragmentation(vol, map);
+			break;
 		case act_info:
 		default:
 			result = info(vol);
 			break;
 	}
 
+	cluster_map_free(map);
 	ntfs_umount(vol, FALSE);
 	return result;
 }
@@ -35,6 +35,8 @@ enum action {
 	act_inode,
 	act_file,
 	act_last,
+	act_overlaps,
+	act_fragmentation,
 	act_error,
 };
 
@@ -48,6 +50,7 @@ struct options {
 	u64		 inode;		/* Inode to examine */
 	s64		 range_begin;	/* Look for objects in this range */
 	s64		 range_end;
+	char		*map;		/* Side file of the cluster map */
 };
 
 struct match {
@@ -53,6 +53,7 @@
 #include "utils.h"
 #include "volume.h"
 #include "dir.h"
+#include "unistr.h"
 #include "debug.h"
 /* #include "version.h" */
 #include "logging.h"
@@ -61,6 +62,8 @@ struct options {
 	char		*device;	/* Device/File to work with */
 	char		*src_file;	/* Source file */
 	char		*dest_file;	/* Destination file */
+	char		**src_files;	/* Source files */
+	int		 nr_src_files;	/* Number of source files */
 	char		*attr_name;	/* Write to attribute with this name. */
 	int		 force;		/* Override common sense */
 	int		 quiet;		/* Less output */
@@ -73,6 +76,7 @@ struct options {
 static const char *EXEC_NAME = "ntfscp";
 static struct options opts;
 static volatile sig_atomic_t caught_terminate = 0;
+static ntfs_volume *sort_vol;	/* volume whose collation sorts new names */
 
 /**
  * version - Print version information about the program
@@ -100,7 +104,8 @@ static void version(void)
  */
 static void usage(void)
 {
-	ntfs_log_info("\nUsage: %s [options] device src_file dest_file\n\n"
+	ntfs_log_info("\nUsage: %s [options] device src_file dest_file\n"
+		"       %s [options] device src_file... dest_directory\n\n"
 		"    -a, --attribute NUM   Write to this attribute\n"
 		"    -i, --inode           Treat dest_file as inode number\n"
 		"    -f, --force           Use less caution\n"
@@ -110,7 +115,7 @@ static void usage(void)
 		"    -q, --quiet           Less output\n"
 		"    -V, --version         Version information\n"
 		"    -v, --verbose         More output\n\n",
-		EXEC_NAME);
+		EXEC_NAME, EXEC_NAME);
 	ntfs_log_info("%s%s\n", ntfs_bugs, ntfs_home);
 }
 
@@ -150,6 +155,8 @@ static int parse_options(int argc, char **argv)
 	opts.device = NULL;
 	opts.src_file = NULL;
 	opts.dest_file = NULL;
+	opts.src_files = (char**)calloc(argc, sizeof(char*));
+	opts.nr_src_files = 0;
 	opts.attr_name = NULL;
 	opts.inode = 0;
 	opts.attribute = AT_DATA;
@@ -161,14 +168,9 @@ static int parse_options(int argc, char **argv)
 		case 1:	/* A non-option argument */
 			if (!opts.device) {
 				opts.device = argv[optind - 1];
-			} else if (!opts.src_file) {
-				opts.src_file = argv[optind - 1];
-			} else if (!opts.dest_file) {
-				opts.dest_file = argv[optind - 1];
-			} else {
-				ntfs_log_error("You must specify exactly two "
-						"files.\n");
-				err++;
+			} else if (opts.src_files) {
+				opts.src_files[opts.nr_src_files++]
+					= argv[optind - 1];
 			}
 			break;
 		case 'a':
@@ -231,6 +233,13 @@ static int parse_options(int argc, char **argv)
 		}
 	}
 
+	/* The last file is the destination */
+	if (opts.nr_src_files > 1) {
+		opts.dest_file = opts.src_files[--opts.nr_src_files];
+		opts.src_file = opts.src_files[0];
+	} else if (opts.nr_src_files)
+		opts.src_file = opts.src_files[0];
+
 	/* Make sure we're in sync with the log levels */
 	levels = ntfs_log_get_levels();
 	if (levels & NTFS_LOG_LEVEL_VERBOSE)
@@ -241,7 +250,10 @@ static int parse_options(int argc, char **argv)
 	if (help || ver) {
 		opts.quiet = 0;
 	} else {
-		if (!opts.device) {
+		if (!opts.src_files) {
+			ntfs_log_error("Not enough memory.\n");
+			err++;
+		} else if (!opts.device) {
 			ntfs_log_error("You must specify a device.\n");
 			err++;
 		} else if (!opts.src_file) {
@@ -304,6 +316,340 @@ static ntfs_inode *ntfs_new_file(ntfs_inode *dir_ni,
 	return ni;
 }
 
+/**
+ * copy_file - Copy an opened source file into an inode
+ *
+ * Write the source file into the attribute of the inode selected by the
+ * options, adding the attribute if the inode does not have it yet.
+ *
+ * Return:  0  Success
+ *	    1  Error, something went wrong
+ */
+static int copy_file(FILE *in, s64 new_size, ntfs_inode *out)
+{
+	ntfs_attr *na;
+	int result = 1;
+	u64 offset;
+	char *buf;
+	s64 br, bw;
+	ntfschar *attr_name;
+	int attr_name_len = 0;
+
+	attr_name = ntfs_str2ucs(opts.attr_name, &attr_name_len);
+	if (!attr_name) {
+		ntfs_log_perror("ERROR: Failed to parse attribute name '%s'",
+				opts.attr_name);
+		return result;
+	}
+
+	na = ntfs_attr_open(out, opts.attribute, attr_name, attr_name_len);
+	if (!na) {
+		if (errno != ENOENT) {
+			ntfs_log_perror("ERROR: Couldn't open attribute");
+			goto free_name;
+		}
+		/* Requested attribute isn't present, add it. */
+		if (ntfs_attr_add(out, opts.attribute, attr_name,
+				attr_name_len, NULL, 0)) {
+			ntfs_log_perror("ERROR: Couldn't add attribute");
+			goto free_name;
+		}
+		na = ntfs_attr_open(out, opts.attribute, attr_name,
+				attr_name_len);
+		if (!na) {
+			ntfs_log_perror("ERROR: Couldn't open just added "
+					"attribute");
+			goto free_name;
+		}
+	}
+	ntfs_ucsfree(attr_name);
+	attr_name = (ntfschar*)NULL;
+
+	ntfs_log_verbose("Old file size: %lld\n", (long long)na->data_size);
+	if (na->data_size != new_size) {
+		if (ntfs_attr_truncate_solid(na, new_size)) {
+			ntfs_log_perror("ERROR: Couldn't resize attribute");
+			goto close_attr;
+		}
+	}
+
+	buf = malloc(NTFS_BUF_SIZE);
+	if (!buf) {
+		ntfs_log_perror("ERROR: malloc failed");
+		goto close_attr;
+	}
+
+	ntfs_log_verbose("Starting write.\n");
+	offset = 0;
+	while (!feof(in)) {
+		if (caught_terminate) {
+			ntfs_log_error("SIGTERM or SIGINT received.  "
+					"Aborting write.\n");
+			break;
+		}
+		br = fread(buf, 1, NTFS_BUF_SIZE, in);
+		if (!br) {
+			if (!feof(in)) ntfs_log_perror("ERROR: fread failed");
+			break;
+		}
+		bw = ntfs_attr_pwrite(na, offset, br, buf);
+		if (bw != br) {
+			ntfs_log_perror("ERROR: ntfs_attr_pwrite failed");
+			break;
+		}
+		offset += bw;
+	}
+	if ((na->data_flags & ATTR_COMPRESSION_MASK)
+	    && ntfs_attr_pclose(na))
+		ntfs_log_perror("ERROR: ntfs_attr_pclose failed");
+	ntfs_log_verbose("Syncing.\n");
+	result = 0;
+	free(buf);
+close_attr:
+	ntfs_attr_close(na);
+free_name:
+	if (attr_name)
+		ntfs_ucsfree(attr_name);
+	return result;
+}
+
+/**
+ * close_dst - Close the destination inode, retrying while the device is busy
+ */
+static void close_dst(ntfs_inode *out)
+{
+	while (ntfs_inode_close(out)) {
+		if (errno != EBUSY) {
+			ntfs_log_error("Sync failed. Run chkdsk.\n");
+			break;
+		}
+		ntfs_log_error("Device busy.  Will retry sync in 3 seconds.\n");
+		sleep(3);
+	}
+}
+
+struct copy_item {
+	const char	*src_file;	/* Source file */
+	char		*filename;	/* Name of the destination file */
+	ntfschar	*ufilename;	/* Same in unicode, NULL if skipped */
+	int		 ufilename_len;
+	ntfs_inode	*ni;		/* Destination inode */
+};
+
+/**
+ * copy_item_collate - Compare the destination names as in a directory index
+ *
+ * Names which only differ by case are distinct and both allowed, they
+ * are ordered as in the index, so zero means the very same name.
+ */
+static int copy_item_collate(const struct copy_item *c1,
+			const struct copy_item *c2)
+{
+	return (ntfs_names_full_collate(c1->ufilename, c1->ufilename_len,
+			c2->ufilename, c2->ufilename_len, CASE_SENSITIVE,
+			sort_vol->upcase, sort_vol->upcase_len));
+}
+
+/**
+ * copy_item_cmp - Sort the destination names, keeping equal ones in order
+ */
+static int copy_item_cmp(const void *p1, const void *p2)
+{
+	const struct copy_item *c1 = *(const struct copy_item* const*)p1;
+	const struct copy_item *c2 = *(const struct copy_item* const*)p2;
+	int r;
+
+	r = copy_item_collate(c1, c2);
+	if (!r)
+		r = (c1 < c2 ? -1 : 1);
+	return (r);
+}
+
+/**
+ * copy_many - Copy several files into a directory
+ *
+ * The files which do not exist in the destination directory are all
+ * created by a single call to ntfs_create_many(), in the collation order
+ * of the directory index, then the files are copied one by one.
+ *
+ * Return:  0  Success
+ *	    1  Error, some files could not be copied
+ */
+static int copy_many(ntfs_volume *vol)
+{
+	struct copy_item *items;
+	struct copy_item **sorted;
+	const ntfschar **unames;
+	u8 *ulens;
+	ntfs_inode **nis;
+	ntfs_inode *dir_ni;
+	FILE *in;
+	struct stat fst;
+	int nr = opts.nr_src_files;
+	int nr_valid, nr_new;
+	int result = 0;
+	int i, j;
+
+	if (opts.inode) {
+		s64 inode_num;
+		char *s;
+
+		inode_num = strtoll(opts.dest_file, &s, 0);
+		if (*s) {
+			ntfs_log_error("ERROR: Couldn't parse inode number.\n");
+			return 1;
+		}
+		dir_ni = ntfs_inode_open(vol, inode_num);
+	} else
+		dir_ni = ntfs_pathname_to_inode(vol, NULL, opts.dest_file);
+	if (!dir_ni) {
+		ntfs_log_perror("ERROR: Couldn't open '%s'", opts.dest_file);
+		return 1;
+	}
+	if (!(dir_ni->mrec->flags & MFT_RECORD_IS_DIRECTORY)) {
+		ntfs_log_error("The destination '%s' is not a directory. "
+				"Aborting.\n", opts.dest_file);
+		ntfs_inode_close(dir_ni);
+		return 1;
+	}
+
+	items = (struct copy_item*)calloc(nr, sizeof(struct copy_item));
+	sorted = (struct copy_item**)calloc(nr, sizeof(struct copy_item*));
+	unames = (const ntfschar**)calloc(nr, sizeof(ntfschar*));
+	ulens = (u8*)calloc(nr, sizeof(u8));
+	nis = (ntfs_inode**)calloc(nr, sizeof(ntfs_inode*));
+	if (!items || !sorted || !unames || !ulens || !nis) {
+		ntfs_log_perror("ERROR: malloc failed");
+		result = 1;
+		goto free_items;
+	}
+
+	nr_valid = 0;
+	for (i=0; i<nr; i++) {
+		items[i].src_file = opts.src_files[i];
+		items[i].filename = basename(opts.src_files[i]);
+		items[i].ufilename = NULL;
+		items[i].ufilename_len = ntfs_mbstoucs(items[i].filename,
+					&items[i].ufilename);
+		if (items[i].ufilename_len == -1) {
+			ntfs_log_perror("ERROR: Failed to convert '%s' to "
+					"unicode", items[i].filename);
+			items[i].ufilename = NULL;
+			result = 1;
+		} else if (items[i].ufilename_len > NTFS_MAX_NAME_LEN) {
+			ntfs_log_error("ERROR: The name '%s' is too long.\n",
+					items[i].filename);
+			ntfs_ucsfree(items[i].ufilename);
+			items[i].ufilename = NULL;
+			result = 1;
+		} else
+			sorted[nr_valid++] = &items[i];
+	}
+
+	/* Sort the names, and skip the ones which are given twice */
+	sort_vol = vol;
+	qsort(sorted, nr_valid, sizeof(struct copy_item*), copy_item_cmp);
+	for (i=1, j=1; i<nr_valid; i++) {
+		if (!copy_item_collate(sorted[j - 1], sorted[i])) {
+			ntfs_log_error("ERROR: '%s' and '%s' would both be "
+					"copied to '%s'. Skipping '%s'.\n",
+					sorted[j - 1]->src_file,
+					sorted[i]->src_file,
+					sorted[i]->filename,
+					sorted[i]->src_file);
+			ntfs_ucsfree(sorted[i]->ufilename);
+			sorted[i]->ufilename = NULL;
+			result = 1;
+		} else
+			sorted[j++] = sorted[i];
+	}
+	if (nr_valid)
+		nr_valid = j;
+
+	/* Open the existing files, to be overwritten */
+	nr_new = 0;
+	for (i=0; i<nr_valid; i++) {
+		sorted[i]->ni = ntfs_pathname_to_inode(vol, dir_ni,
+					sorted[i]->filename);
+		if (!sorted[i]->ni) {
+			unames[nr_new] = sorted[i]->ufilename;
+			ulens[nr_new] = sorted[i]->ufilename_len;
+			sorted[nr_new++] = sorted[i];
+		} else if (sorted[i]->ni->mrec->flags
+				& MFT_RECORD_IS_DIRECTORY) {
+			ntfs_log_error("ERROR: '%s' is a directory. "
+					"Skipping '%s'.\n",
+					sorted[i]->filename,
+					sorted[i]->src_file);
+			ntfs_inode_close(sorted[i]->ni);
+			sorted[i]->ni = NULL;
+			result = 1;
+		} else
+			ntfs_log_verbose("Overwriting the file '%s'\n",
+					sorted[i]->filename);
+	}
+
+	/* Create all the new files at once */
+	if (nr_new) {
+		ntfs_log_verbose("Creating %d new files under '%s'\n",
+				nr_new, opts.dest_file);
+		if (ntfs_create_many(dir_ni, 0, unames, ulens, S_IFREG,
+				nis, nr_new)) {
+			ntfs_log_perror("ERROR: Failed to create some "
+					"files under '%s'", opts.dest_file);
+			result = 1;
+		}
+		for (i=0; i<nr_new; i++) {
+			sorted[i]->ni = nis[i];
+			if (!nis[i])
+				ntfs_log_error("ERROR: '%s' was not "
+						"created.\n",
+						sorted[i]->filename);
+		}
+	}
+	ntfs_inode_close(dir_ni);
+
+	/* Copy the files in the order they were given */
+	for (i=0; i<nr; i++) {
+		if (!items[i].ni)
+			continue;
+		if (caught_terminate)
+			result = 1;
+		else if (stat(items[i].src_file, &fst) == -1) {
+			ntfs_log_perror("ERROR: Couldn't stat source file "
+					"'%s'", items[i].src_file);
+			result = 1;
+		} else {
+			in = fopen(items[i].src_file, "r");
+			if (!in) {
+				ntfs_log_perror("ERROR: Couldn't open source "
+					"file '%s'", items[i].src_file);
+				result = 1;
+			} else {
+				ntfs_log_verbose("Copying '%s', size %lld\n",
+					items[i].src_file,
+					(long long)fst.st_size);
+				if (copy_file(in, fst.st_size, items[i].ni))
+					result = 1;
+				fclose(in);
+			}
+		}
+		close_dst(items[i].ni);
+	}
+
+free_items:
+	if (items)
+		for (i=0; i<nr; i++)
+			if (items[i].ufilename)
+				ntfs_ucsfree(items[i].ufilename);
+	free(items);
+	free(sorted);
+	free(unames);
+	free(ulens);
+	free(nis);
+	return result;
+}
+
 /**
  * main - Begin here
  *
@@ -317,15 +663,9 @@ int main(int argc, char *argv[])
 	FILE *in;
 	ntfs_volume *vol;
 	ntfs_inode *out;
-	ntfs_attr *na;
 	int flags = 0;
 	int result = 1;
 	s64 new_size;
-	u64 offset;
-	char *buf;
-	s64 br, bw;
-	ntfschar *attr_name;
-	int attr_name_len = 0;
 
 	ntfs_log_set_handler(ntfs_log_handler_stderr);
 
@@ -365,6 +705,11 @@ int main(int argc, char *argv[])
 		goto umount;
 	}
 
+	if (opts.nr_src_files > 1) {
+		result = copy_many(vol);
+		goto umount;
+	}
+
 	{
 		struct stat fst;
 		if (stat(opts.src_file, &fst) == -1) {
@@ -501,86 +846,8 @@ int main(int argc, char *argv[])
 		free(overwrite_filename);
 	}
 
-	attr_name = ntfs_str2ucs(opts.attr_name, &attr_name_len);
-	if (!attr_name) {
-		ntfs_log_perror("ERROR: Failed to parse attribute name '%s'",
-				opts.attr_name);
-		goto close_dst;
-	}
-
-	na = ntfs_attr_open(out, opts.attribute, attr_name, attr_name_len);
-	if (!na) {
-		if (errno != ENOENT) {
-			ntfs_log_perror("ERROR: Couldn't open attribute");
-			goto close_dst;
-		}
-		/* Requested attribute isn't present, add it. */
-		if (ntfs_attr_add(out, opts.attribute, attr_name,
-				attr_name_len, NULL, 0)) {
-			ntfs_log_perror("ERROR: Couldn't add attribute");
-			goto close_dst;
-		}
-		na = ntfs_attr_open(out, opts.attribute, attr_name,
-				attr_name_len);
-		if (!na) {
-			ntfs_log_perror("ERROR: Couldn't open just added "
-					"attribute");
-			goto close_dst;
-		}
-	}
-	ntfs_ucsfree(attr_name);
-
-	ntfs_log_verbose("Old file size: %lld\n", (long long)na->data_size);
-	if (na->data_size != new_size) {
-		if (ntfs_attr_truncate_solid(na, new_size)) {
-			ntfs_log_perror("ERROR: Couldn't resize attribute");
-			goto close_attr;
-		}
-	}
-
-	buf = malloc(NTFS_BUF_SIZE);
-	if (!buf) {
-		ntfs_log_perror("ERROR: malloc failed");
-		goto close_attr;
-	}
-
-	ntfs_log_verbose("Starting write.\n");
-	offset = 0;
-	while (!feof(in)) {
-		if (caught_terminate) {
-			ntfs_log_error("SIGTERM or SIGINT received.  "
-					"Aborting write.\n");
-			break;
-		}
-		br = fread(buf, 1, NTFS_BUF_SIZE, in);
-		if (!br) {
-			if (!feof(in)) ntfs_log_perror("ERROR: fread failed");
-			break;
-		}
-		bw = ntfs_attr_pwrite(na, offset, br, buf);
-		if (bw != br) {
-			ntfs_log_perror("ERROR: ntfs_attr_pwrite failed");
-			break;
-		}
-		offset += bw;
-	}
-	if ((na->data_flags & ATTR_COMPRESSION_MASK)
-	    && ntfs_attr_pclose(na))
-		ntfs_log_perror("ERROR: ntfs_attr_pclose failed");
-	ntfs_log_verbose("Syncing.\n");
-	result = 0;
-	free(buf);
-close_attr:
-	ntfs_attr_close(na);
-close_dst:
-	while (ntfs_inode_close(out)) {
-		if (errno != EBUSY) {
-			ntfs_log_error("Sync failed. Run chkdsk.\n");
-			break;
-		}
-		ntfs_log_error("Device busy.  Will retry sync in 3 seconds.\n");
-		sleep(3);
-	}
+	result = copy_file(in, new_size, out);
+	close_dst(out);
 close_src:
 	fclose(in);
 umount:
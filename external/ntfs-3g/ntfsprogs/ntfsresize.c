@@ -58,6 +58,7 @@
 #ifdef HAVE_FCNTL_H
 #include <fcntl.h>
 #endif
+#include <pthread.h>
 
 #include "debug.h"
 #include "types.h"
@@ -199,6 +200,22 @@ typedef struct {
 	struct bitmap lcn_bitmap;
 } ntfsck_t;
 
+struct RELOC_MOVE {
+	s64 src;		/* first cluster to move */
+	s64 dest;		/* its new location */
+	s64 len;		/* clusters in move */
+} ;
+
+struct RELOC_PLAN {
+	struct RELOC_MOVE *moves;	/* moves not done yet */
+	int nr_moves;
+	int max_moves;
+	s64 clusters;		/* clusters in the moves */
+	MFT_REF *mrefs;		/* records to write after the moves */
+	char *records;
+	int nr_records;
+} ;
+
 typedef struct {
 	ntfs_volume *vol;
 	ntfs_inode *ni;		     /* inode being processed */
@@ -216,6 +233,7 @@ typedef struct {
 	VCN mft_highest_vcn;	     /* used for relocating the $MFT */
 	runlist_element *new_mft_start; /* new first run for $MFT:$DATA */
 	struct DELAYED *delayed_runlists; /* runlists to process later */
+	struct RELOC_PLAN plan;	     /* relocations to do at next checkpoint */
 	struct progress_bar progress;
 	struct bitmap lcn_bitmap;
 	/* Temporary statistics until all case is supported */
@@ -245,6 +263,11 @@ static s64 max_free_cluster_range = 0;
 
 #define NTFS_MAX_CLUSTER_SIZE	(65536)
 
+#define RELOC_BUFFER_SIZE	(8*1024*1024) /* max bytes moved at once */
+#define RELOC_BUFFERS		4 /* buffers between reader and writer */
+#define RELOC_PLAN_SIZE		(256*1024*1024) /* bytes moved per checkpoint */
+#define RELOC_PLAN_RECORDS	1024 /* records written per checkpoint */
+
 static s64 rounded_up_division(s64 numer, s64 denom)
 {
 	return (numer + (denom - 1)) / denom;
@@ -1713,35 +1736,273 @@ static void lseek_to_cluster(ntfs_volume *vol, s64 lcn)
 		perr_exit("seek failed to position %lld", (long long)lcn);
 }
 
-static void copy_clusters(ntfs_resize_t *resize, s64 dest, s64 src, s64 len)
+/*
+ *		Relocation plan
+ *
+ *	The moves of clusters are not done when the runlists are updated,
+ *	they are collected with the records which reference their new
+ *	location. The moves are then sorted by source and merged, and
+ *	copied by big chunks : a reader thread reads the old locations
+ *	into a ring of buffers, while the calling thread writes them to
+ *	their new locations.
+ *
+ *	The new locations are free clusters within the new volume size and
+ *	the old locations are beyond it, so the moves never overlap and
+ *	can be done in any order.
+ *
+ *	The device is synced after the moves, before the records are
+ *	written, so that an interrupted relocation never leaves a record
+ *	pointing to clusters which were not copied. The old clusters are
+ *	not released before the end, so the volume is consistent at each
+ *	checkpoint.
+ */
+
+struct reloc_buffer {
+	char *data;
+	s64 src;		/* first cluster to read */
+	s64 dest;		/* first cluster to write */
+	s64 count;		/* clusters in buffer, zero at end */
+} ;
+
+static struct {
+	pthread_mutex_t lock;
+	pthread_cond_t filled;
+	pthread_cond_t emptied;
+	struct reloc_buffer buf[RELOC_BUFFERS];
+	int nr_filled;
+	s64 max_count;		/* clusters in a buffer */
+} reloc_ring;
+
+static void plan_move(ntfs_resize_t *resize, s64 dest, s64 src, s64 len)
+{
+	struct RELOC_PLAN *plan = &resize->plan;
+	struct RELOC_MOVE *moves;
+	int max_moves;
+
+	if (plan->nr_moves >= plan->max_moves) {
+		max_moves = (plan->max_moves ? 2*plan->max_moves : 256);
+		moves = (struct RELOC_MOVE*)realloc(plan->moves,
+				max_moves*sizeof(struct RELOC_MOVE));
+		if (!moves)
+			perr_exit("realloc");
+		plan->moves = moves;
+		plan->max_moves = max_moves;
+	}
+	moves = &plan->moves[plan->nr_moves++];
+	moves->src = src;
+	moves->dest = dest;
+	moves->len = len;
+	plan->clusters += len;
+}
+
+static int move_cmp(const void *p1, const void *p2)
 {
-	s64 i;
-	char buff[NTFS_MAX_CLUSTER_SIZE]; /* overflow checked at mount time */
-	ntfs_volume *vol = resize->vol;
+	const struct RELOC_MOVE *m1 = (const struct RELOC_MOVE*)p1;
+	const struct RELOC_MOVE *m2 = (const struct RELOC_MOVE*)p2;
 
-	for (i = 0; i < len; i++) {
+	return (m1->src < m2->src ? -1 : (m1->src > m2->src ? 1 : 0));
+}
 
-		lseek_to_cluster(vol, src + i);
+/*
+ *		Sort the moves by source and merge the contiguous ones
+ */
 
-		if (read_all(vol->dev, buff, vol->cluster_size) == -1) {
-			perr_printf("Failed to read from the disk");
-			if (errno == EIO)
-				printf("%s", bad_sectors_warning_msg);
-			exit(1);
-		}
+static void sort_moves(struct RELOC_PLAN *plan)
+{
+	struct RELOC_MOVE *last;
+	int i;
+
+	qsort(plan->moves, plan->nr_moves, sizeof(struct RELOC_MOVE),
+			move_cmp);
+	last = plan->moves;
+	for (i=1; i<plan->nr_moves; i++) {
+		if ((plan->moves[i].src == last->src + last->len)
+		    && (plan->moves[i].dest == last->dest + last->len))
+			last->len += plan->moves[i].len;
+		else
+			*++last = plan->moves[i];
+	}
+	plan->nr_moves = last - plan->moves + 1;
+}
 
-		lseek_to_cluster(vol, dest + i);
+static void *reloc_reader(void *arg)
+{
+	ntfs_resize_t *resize = (ntfs_resize_t*)arg;
+	struct RELOC_PLAN *plan = &resize->plan;
+	ntfs_volume *vol = resize->vol;
+	struct reloc_buffer *pbuf;
+	s64 done, count;
+	int next, i;
 
-		if (write_all(vol->dev, buff, vol->cluster_size) == -1) {
-			perr_printf("Failed to write to the disk");
-			if (errno == EIO)
-				printf("%s", bad_sectors_warning_msg);
-			exit(1);
+	next = 0;
+	i = 0;
+	done = 0;
+	do {
+		count = 0;
+		if (i < plan->nr_moves) {
+			count = plan->moves[i].len - done;
+			if (count > reloc_ring.max_count)
+				count = reloc_ring.max_count;
+		}
+		pthread_mutex_lock(&reloc_ring.lock);
+		while (reloc_ring.nr_filled >= RELOC_BUFFERS)
+			pthread_cond_wait(&reloc_ring.emptied,
+						&reloc_ring.lock);
+		pthread_mutex_unlock(&reloc_ring.lock);
+		pbuf = &reloc_ring.buf[next];
+		pbuf->count = count;
+		if (count) {
+			pbuf->src = plan->moves[i].src + done;
+			pbuf->dest = plan->moves[i].dest + done;
+			if (!NDevReadOnly(vol->dev)
+			    && (ntfs_pread(vol->dev,
+					pbuf->src << vol->cluster_size_bits,
+					count << vol->cluster_size_bits,
+					pbuf->data)
+				!= (count << vol->cluster_size_bits))) {
+				perr_printf("Failed to read from the disk");
+				if (errno == EIO)
+					printf("%s", bad_sectors_warning_msg);
+				exit(1);
+			}
+			done += count;
+			if (done >= plan->moves[i].len) {
+				done = 0;
+				i++;
+			}
 		}
+		pthread_mutex_lock(&reloc_ring.lock);
+		reloc_ring.nr_filled++;
+		pthread_cond_signal(&reloc_ring.filled);
+		pthread_mutex_unlock(&reloc_ring.lock);
+		next = (next + 1) % RELOC_BUFFERS;
+	} while (count);
+	return ((void*)NULL);
+}
+
+static void copy_moves(ntfs_resize_t *resize)
+{
+	ntfs_volume *vol = resize->vol;
+	struct reloc_buffer *pbuf;
+	pthread_t reader;
+	s64 count;
+	int next, i;
+
+	reloc_ring.max_count = RELOC_BUFFER_SIZE >> vol->cluster_size_bits;
+	if (reloc_ring.max_count > resize->plan.clusters)
+		reloc_ring.max_count = resize->plan.clusters;
+	for (i=0; i<RELOC_BUFFERS; i++) {
+		reloc_ring.buf[i].data = (char*)ntfs_malloc(
+			reloc_ring.max_count << vol->cluster_size_bits);
+		if (!reloc_ring.buf[i].data)
+			perr_exit("ntfs_malloc failed");
+	}
+	reloc_ring.nr_filled = 0;
+	pthread_mutex_init(&reloc_ring.lock, (pthread_mutexattr_t*)NULL);
+	pthread_cond_init(&reloc_ring.filled, (pthread_condattr_t*)NULL);
+	pthread_cond_init(&reloc_ring.emptied, (pthread_condattr_t*)NULL);
+	if (pthread_create(&reader, (pthread_attr_t*)NULL, reloc_reader,
+			(void*)resize))
+		err_exit("Could not start the reader thread\n");
+	next = 0;
+	do {
+		pthread_mutex_lock(&reloc_ring.lock);
+		while (!reloc_ring.nr_filled)
+			pthread_cond_wait(&reloc_ring.filled,
+						&reloc_ring.lock);
+		pthread_mutex_unlock(&reloc_ring.lock);
+		pbuf = &reloc_ring.buf[next];
+		count = pbuf->count;
+		if (count) {
+			if (!NDevReadOnly(vol->dev)
+			    && (ntfs_pwrite(vol->dev,
+					pbuf->dest << vol->cluster_size_bits,
+					count << vol->cluster_size_bits,
+					pbuf->data)
+				!= (count << vol->cluster_size_bits))) {
+				perr_printf("Failed to write to the disk");
+				if (errno == EIO)
+					printf("%s", bad_sectors_warning_msg);
+				exit(1);
+			}
+			resize->relocations += count;
+			progress_update(&resize->progress,
+					resize->relocations);
+		}
+			/* the buffer may be refilled once released */
+		pthread_mutex_lock(&reloc_ring.lock);
+		reloc_ring.nr_filled--;
+		pthread_cond_signal(&reloc_ring.emptied);
+		pthread_mutex_unlock(&reloc_ring.lock);
+		next = (next + 1) % RELOC_BUFFERS;
+	} while (count);
+	pthread_join(reader, (void**)NULL);
+	pthread_cond_destroy(&reloc_ring.emptied);
+	pthread_cond_destroy(&reloc_ring.filled);
+	pthread_mutex_destroy(&reloc_ring.lock);
+	for (i=0; i<RELOC_BUFFERS; i++)
+		free(reloc_ring.buf[i].data);
+}
+
+/*
+ *		Queue an updated record until the data it references is moved
+ */
+
+static void plan_record(ntfs_resize_t *resize, MFT_REF mref)
+{
+	struct RELOC_PLAN *plan = &resize->plan;
+	u32 size = resize->vol->mft_record_size;
+
+	plan->mrefs[plan->nr_records] = mref;
+	memcpy(plan->records + plan->nr_records*size, resize->mrec, size);
+	plan->nr_records++;
+}
+
+/*
+ *		Checkpoint : do the planned moves, then write the records
+ */
 
-		resize->relocations++;
-		progress_update(&resize->progress, resize->relocations);
+static void flush_relocations(ntfs_resize_t *resize)
+{
+	struct RELOC_PLAN *plan = &resize->plan;
+	ntfs_volume *vol = resize->vol;
+	u32 size = vol->mft_record_size;
+	int i;
+
+	if (plan->nr_moves) {
+		sort_moves(plan);
+#ifndef BAN_NEW_TEXT
+		ntfs_log_verbose("Moving %lld clusters by %d runs, then "
+				"updating %d records\n",
+				(long long)plan->clusters, plan->nr_moves,
+				plan->nr_records);
+#endif
+		copy_moves(resize);
+		if (!opt.ro_flag && (vol->dev->d_ops->sync(vol->dev) == -1))
+			perr_exit("Failed to sync device");
 	}
+	for (i=0; i<plan->nr_records; i++)
+		if (write_mft_record(vol, plan->mrefs[i],
+				(MFT_RECORD*)(plan->records + i*size)))
+			perr_exit("Couldn't update record %llu",
+				(unsigned long long)plan->mrefs[i]);
+	plan->nr_moves = 0;
+	plan->nr_records = 0;
+	plan->clusters = 0;
+}
+
+/*
+ *		Release the moves of a plan which has been flushed
+ */
+
+static void free_moves(ntfs_resize_t *resize)
+{
+	struct RELOC_PLAN *plan = &resize->plan;
+
+	free(plan->moves);
+	plan->moves = (struct RELOC_MOVE*)NULL;
+	plan->nr_moves = 0;
+	plan->max_moves = 0;
 }
 
 static void relocate_clusters(ntfs_resize_t *r, runlist *dest_rl, s64 src_lcn)
@@ -1757,7 +2018,7 @@ static void relocate_clusters(ntfs_resize_t *r, runlist *dest_rl, s64 src_lcn)
 	}
 
 	for (; dest_rl->length; src_lcn += dest_rl->length, dest_rl++)
-		copy_clusters(r, dest_rl->lcn, src_lcn, dest_rl->length);
+		plan_move(r, dest_rl->lcn, src_lcn, dest_rl->length);
 }
 
 static void rl_split_run(runlist **rl, int run, s64 pos)
@@ -2026,8 +2287,13 @@ static void relocate_inode(ntfs_resize_t *resize, MFT_REF mref, int do_mftdata)
 
 	relocate_attributes(resize, do_mftdata);
 
-//		if (vol->dev->d_ops->sync(vol->dev) == -1)
-//			perr_exit("Failed to sync device");
+		/*
+		 * During the second step the MFT data is moved, it must
+		 * be copied before its records are written at their new
+		 * location.
+		 */
+	if (do_mftdata)
+		flush_relocations(resize);
 		/* relocate MFT during second step, even if not dirty */
 	if ((mref == FILE_MFT) && do_mftdata && resize->new_mft_start) {
 		s64 pos;
@@ -2041,9 +2307,18 @@ static void relocate_inode(ntfs_resize_t *resize, MFT_REF mref, int do_mftdata)
 				vol->mft_record_size, resize->mrec) != 1))
 			perr_exit("Couldn't update MFT own record");
 	} else {
-		if ((resize->dirty_inode == DIRTY_INODE)
-		   && write_mft_record(vol, mref, resize->mrec)) {
-			perr_exit("Couldn't update record %llu",
+		if (resize->dirty_inode == DIRTY_INODE) {
+			if (!do_mftdata) {
+				plan_record(resize, mref);
+				if ((resize->plan.nr_records
+						>= RELOC_PLAN_RECORDS)
+				    || ((resize->plan.clusters
+						<< vol->cluster_size_bits)
+						>= RELOC_PLAN_SIZE))
+					flush_relocations(resize);
+			} else
+				if (write_mft_record(vol, mref, resize->mrec))
+					perr_exit("Couldn't update record %llu",
 						(unsigned long long)mref);
 		}
 	}
@@ -2065,6 +2340,13 @@ static void relocate_inodes(ntfs_resize_t *resize)
 	if (!resize->mrec)
 		perr_exit("ntfs_malloc failed");
 
+	resize->plan.mrefs = (MFT_REF*)ntfs_malloc(RELOC_PLAN_RECORDS
+				* sizeof(MFT_REF));
+	resize->plan.records = (char*)ntfs_malloc(RELOC_PLAN_RECORDS
+				* resize->vol->mft_record_size);
+	if (!resize->plan.mrefs || !resize->plan.records)
+		perr_exit("ntfs_malloc failed");
+
 	nr_mft_records = resize->vol->mft_na->initialized_size >>
 			resize->vol->mft_record_size_bits;
 
@@ -2121,6 +2403,8 @@ static void relocate_inodes(ntfs_resize_t *resize)
 
 	for (mref = 0; mref < (MFT_REF)nr_mft_records; mref++)
 		relocate_inode(resize, mref, 0);
+		/* the second step reads the records updated by the first one */
+	flush_relocations(resize);
 
 	while (1) {
 		highest_vcn = resize->mft_highest_vcn;
@@ -2137,6 +2421,11 @@ static void relocate_inodes(ntfs_resize_t *resize)
 	}
 done:
 	free(resize->mrec);
+	free_moves(resize);
+	free(resize->plan.mrefs);
+	free(resize->plan.records);
+	resize->plan.mrefs = (MFT_REF*)NULL;
+	resize->plan.records = (char*)NULL;
 }
 
 static void print_hint(ntfs_volume *vol, const char *s, struct llcn_t llcn)
@@ -2596,11 +2885,13 @@ static void update_bootsector(ntfs_resize_t *r)
 		r->progress.flags |= NTFS_PROGBAR_SUPPRESS;
 		/* Be sure the MFTMirr holds the updated MFT runlist */
 		if (r->new_mft_start)
-			copy_clusters(r, r->mftmir_rl.lcn,
+			plan_move(r, r->mftmir_rl.lcn,
 				 r->new_mft_start->lcn, r->mftmir_rl.length);
 		else
-			copy_clusters(r, r->mftmir_rl.lcn, r->mftmir_old,
+			plan_move(r, r->mftmir_rl.lcn, r->mftmir_old,
 				      r->mftmir_rl.length);
+		flush_relocations(r);
+		free_moves(r);
 		bs->mftmirr_lcn = cpu_to_sle64(r->mftmir_rl.lcn);
 		r->progress.flags &= ~NTFS_PROGBAR_SUPPRESS;
 	}
@@ -89,6 +89,7 @@
 #include "inode.h"
 #include "device.h"
 #include "utils.h"
+#include "mftscan.h"
 #include "debug.h"
 #include "ntfstime.h"
 /* #include "version.h" */
@@ -107,8 +108,38 @@ static const char *MFTFILE   = "mft";
 static const char *UNNAMED   = "<unnamed>";
 static const char *NONE      = "<none>";
 static const char *UNKNOWN   = "unknown";
+static const char *INDEX_MAGIC = "NTFSUNDX";
 static struct options opts;
 
+#define INDEX_VERSION 2
+
+/*
+ *	Layout of the side file holding a scan index, all fields little
+ *	endian : a header, then each entry followed by its filenames.
+ */
+struct index_header {
+	char	magic[8];
+	le32	version;
+	le32	reserved;
+	le64	stamp;
+	le64	count;
+} ;
+
+struct index_record {
+	le64	inode;
+	sle64	date;
+	sle64	max_size;
+	sle64	size;
+	u8	percent;
+	u8	data_percent;
+	char	flags[4];
+	le16	pref;		/* 0xffff if there is no preferred name */
+	le16	nr_names;
+	le16	sequence;	/* to detect a record reused since the scan */
+	le32	names_len;
+	sle64	lsn;
+} ;
+
 typedef struct
 {
 	u32 begin;
@@ -119,6 +150,8 @@ static short	with_regex;			/* Flag  Regular expression available */
 static short	avoid_duplicate_printing;	/* Flag  No duplicate printing of file infos */
 static range	*ranges;			/* Array containing all Inode-Ranges for undelete */
 static long	nr_entries;			/* Number of range entries */
+static u8	*lcn_bitmap;			/* $Bitmap, once loaded */
+static s64	lcn_bitmap_size;		/* Size of $Bitmap in bytes */
 
 #ifdef HAVE_WINDOWS_H
 /*
@@ -412,6 +445,7 @@ static void usage(void)
 		"    -C, --case             Case sensitive matching\n"
 		"    -S, --size RANGE       Match files of this size\n"
 		"    -t, --time SINCE       Last referenced since this time\n"
+		"        --index FILE       Reuse the scan saved in FILE\n"
 		"\n"
 		"    -u, --undelete         Undelete mode\n"
 		"    -i, --inodes RANGE     Recover these inodes\n"
@@ -606,6 +640,7 @@ static int parse_options(int argc, char *argv[])
 		{ "destination", required_argument,	NULL, 'd' },
 		{ "force",	 no_argument,		NULL, 'f' },
 		{ "help",	 no_argument,		NULL, 'h' },
+		{ "index",	 required_argument,	NULL, 'x' },
 		{ "inodes",	 required_argument,	NULL, 'i' },
 		//{ "interactive", no_argument,		NULL, 'I' },
 		{ "match",	 required_argument,	NULL, 'm' },
@@ -685,6 +720,13 @@ static int parse_options(int argc, char *argv[])
 				break;
 			help++;
 			break;
+		case 'x':	/* not proposed as a short option */
+			if (!opts.index) {
+				opts.index = optarg;
+			} else {
+				err++;
+			}
+			break;
 		case 'i':
 			end = NULL;
 			/* parse inodes */
@@ -818,7 +860,8 @@ static int parse_options(int argc, char *argv[])
 			if (opts.output || opts.dest || opts.truncate ||
 					(opts.fillbyte != (char)-1)) {
 				ntfs_log_error("Scan can only be used with --percent, "
-					"--match, --ignore-case, --size and --time.\n");
+					"--match, --ignore-case, --size, --time "
+					"and --index.\n");
 				err++;
 			}
 			if (opts.match_case && !opts.match) {
@@ -837,7 +880,7 @@ static int parse_options(int argc, char *argv[])
 		case MODE_COPY:
 			if ((opts.fillbyte != (char)-1) || opts.truncate ||
 			    (opts.percent != -1) ||
-			    opts.match || opts.match_case ||
+			    opts.match || opts.match_case || opts.index ||
 			    (opts.size_begin > 0) ||
 			    (opts.size_end > 0)) {
 				ntfs_log_error("Copy can only be used with --output and --destination.\n");
@@ -994,6 +1037,22 @@ static FILE_NAME_ATTR* verify_parent(struct filename* name, MFT_RECORD* rec)
 	return (found_same_space ? filename_attr : lowest_space_name);
 }
 
+/**
+ * name_to_locale - Translate a name into the current locale
+ *
+ * The records may be examined by several threads of the MFT scan, and
+ * the translation may rely on wctomb() which is not thread-safe.
+ */
+static int name_to_locale(const ntfschar *uname, int uname_len, char **name)
+{
+	int res;
+
+	mft_scan_lock();
+	res = ntfs_ucstombs(uname, uname_len, name, 0);
+	mft_scan_unlock();
+	return (res);
+}
+
 /**
  * get_parent_name - Find the name of a file's parent.
  * @name:	the filename whose parent's name to find
@@ -1026,9 +1085,9 @@ static void get_parent_name(struct filename* name, ntfs_volume* vol)
 			ntfs_log_error("ERROR: Couldn't read MFT Record %lld"
 					".\n", inode_num);
 		} else if ((filename_attr = verify_parent(name, rec))) {
-			if (ntfs_ucstombs(filename_attr->file_name,
+			if (name_to_locale(filename_attr->file_name,
 					filename_attr->file_name_length,
-					&name->parent_name, 0) < 0) {
+					&name->parent_name) < 0) {
 				ntfs_log_debug("ERROR: Couldn't translate "
 						"filename to current "
 						"locale.\n");
@@ -1099,8 +1158,8 @@ static struct filename *rescue_name(MFT_RECORD *mft, ntfs_attr_search_ctx *ctx)
 						((char*)mft + off_name + 2);
 					name->uname_len = length;
 					name->name_space = type;
-					if (ntfs_ucstombs(name->uname, length,
-							&name->name, 0) < 0) {
+					if (name_to_locale(name->uname, length,
+							&name->name) < 0) {
 						free(name);
 						name = (struct filename*)NULL;
 					}
@@ -1118,7 +1177,9 @@ static struct filename *rescue_name(MFT_RECORD *mft, ntfs_attr_search_ctx *ctx)
 
 /**
  * get_filenames - Read an MFT Record's $FILENAME attributes
- * @file:  The file object to work with
+ * @file:     The file object to work with
+ * @vol:      An ntfs volume obtained from ntfs_mount
+ * @parents:  Also look for the names of the parent directories
  *
  * A single file may have more than one filename.  This is quite common.
  * Windows creates a short DOS name for each long name, e.g. LONGFI~1.XYZ,
@@ -1135,7 +1196,7 @@ static struct filename *rescue_name(MFT_RECORD *mft, ntfs_attr_search_ctx *ctx)
  * Return:  n  The number of $FILENAME attributes found
  *	   -1  Error
  */
-static int get_filenames(struct ufile *file, ntfs_volume* vol)
+static int get_filenames(struct ufile *file, ntfs_volume* vol, BOOL parents)
 {
 	ATTR_RECORD *rec;
 	FILE_NAME_ATTR *attr;
@@ -1176,15 +1237,15 @@ static int get_filenames(struct ufile *file, ntfs_volume* vol)
 		name->date_m     = ntfs2timespec(attr->last_mft_change_time).tv_sec;
 		name->date_r     = ntfs2timespec(attr->last_access_time).tv_sec;
 
-		if (ntfs_ucstombs(name->uname, name->uname_len, &name->name,
-				0) < 0) {
+		if (name_to_locale(name->uname, name->uname_len,
+				&name->name) < 0) {
 			ntfs_log_debug("ERROR: Couldn't translate filename to "
 					"current locale.\n");
 		}
 
 		name->parent_name = NULL;
 
-		if (opts.parent) {
+		if (parents) {
 			name->parent_mref = attr->parent_directory;
 			get_parent_name(name, vol);
 		}
@@ -1282,8 +1343,8 @@ static int get_data(struct ufile *file, ntfs_volume *vol)
 					le16_to_cpu(rec->name_offset));
 			data->uname_len = rec->name_length;
 
-			if (ntfs_ucstombs(data->uname, data->uname_len,
-						&data->name, 0) < 0) {
+			if (name_to_locale(data->uname, data->uname_len,
+						&data->name) < 0) {
 				ntfs_log_error("ERROR: Cannot translate name "
 						"into current locale.\n");
 			}
@@ -1318,29 +1379,20 @@ static int get_data(struct ufile *file, ntfs_volume *vol)
 }
 
 /**
- * read_record - Read an MFT record into memory
+ * alloc_file - Create a file object for an MFT record
  * @vol:     An ntfs volume obtained from ntfs_mount
- * @record:  The record number to read
+ * @record:  The record number
  *
- * Read the specified MFT record and gather as much information about it as
- * possible.
- *
- * Return:  Pointer  A ufile object containing the results
+ * Return:  Pointer  A ufile object, with room for the raw MFT record
  *	    NULL     Error
  */
-static struct ufile * read_record(ntfs_volume *vol, long long record)
+static struct ufile *alloc_file(ntfs_volume *vol, long long record)
 {
-	ATTR_RECORD *attr10, *attr20, *attr90;
 	struct ufile *file;
-	ntfs_attr *mft;
-	u32 log_levels;
-
-	if (!vol)
-		return NULL;
 
 	file = calloc(1, sizeof(*file));
 	if (!file) {
-		ntfs_log_error("ERROR: Couldn't allocate memory in read_record()\n");
+		ntfs_log_error("ERROR: Couldn't allocate memory in alloc_file()\n");
 		return NULL;
 	}
 
@@ -1350,30 +1402,28 @@ static struct ufile * read_record(ntfs_volume *vol, long long record)
 
 	file->mft = malloc(vol->mft_record_size);
 	if (!file->mft) {
-		ntfs_log_error("ERROR: Couldn't allocate memory in read_record()\n");
-		free_file(file);
-		return NULL;
-	}
-
-	mft = ntfs_attr_open(vol->mft_ni, AT_DATA, AT_UNNAMED, 0);
-	if (!mft) {
-		ntfs_log_perror("ERROR: Couldn't open $MFT/$DATA");
-		free_file(file);
-		return NULL;
-	}
-
-	if (ntfs_attr_mst_pread(mft, vol->mft_record_size * record, 1, vol->mft_record_size, file->mft) < 1) {
-		ntfs_log_error("ERROR: Couldn't read MFT Record %lld.\n", record);
-		ntfs_attr_close(mft);
+		ntfs_log_error("ERROR: Couldn't allocate memory in alloc_file()\n");
 		free_file(file);
 		return NULL;
 	}
+	return file;
+}
 
-	ntfs_attr_close(mft);
-	mft = NULL;
+/**
+ * examine_record - Gather information from the raw MFT record of a file
+ * @file:     The file object, holding the raw MFT record
+ * @vol:      An ntfs volume obtained from ntfs_mount
+ * @parents:  Also look for the names of the parent directories
+ *
+ * The caller has to disable the logging of errors, as the record may be
+ * damaged or partially overwritten.
+ *
+ * Return:  none
+ */
+static void examine_record(struct ufile *file, ntfs_volume *vol, BOOL parents)
+{
+	ATTR_RECORD *attr10, *attr20, *attr90;
 
-	/* disable errors logging, while examining suspicious records */
-	log_levels = ntfs_log_clear_levels(NTFS_LOG_LEVEL_PERROR);
 	attr10 = find_first_attribute(AT_STANDARD_INFORMATION,	file->mft);
 	attr20 = find_first_attribute(AT_ATTRIBUTE_LIST,	file->mft);
 	attr90 = find_first_attribute(AT_INDEX_ROOT,		file->mft);
@@ -1392,18 +1442,137 @@ static struct ufile * read_record(ntfs_volume *vol, long long record)
 	if (attr90)
 		file->directory = 1;
 
-	if (get_filenames(file, vol) < 0) {
+	if (get_filenames(file, vol, parents) < 0) {
 		ntfs_log_error("ERROR: Couldn't get filenames.\n");
 	}
 	if (get_data(file, vol) < 0) {
 		ntfs_log_error("ERROR: Couldn't get data streams.\n");
 	}
+}
+
+/**
+ * read_record - Read an MFT record into memory
+ * @vol:     An ntfs volume obtained from ntfs_mount
+ * @record:  The record number to read
+ *
+ * Read the specified MFT record and gather as much information about it as
+ * possible.
+ *
+ * Return:  Pointer  A ufile object containing the results
+ *	    NULL     Error
+ */
+static struct ufile * read_record(ntfs_volume *vol, long long record)
+{
+	struct ufile *file;
+	ntfs_attr *mft;
+	u32 log_levels;
+
+	if (!vol)
+		return NULL;
+
+	file = alloc_file(vol, record);
+	if (!file)
+		return NULL;
+
+	mft = ntfs_attr_open(vol->mft_ni, AT_DATA, AT_UNNAMED, 0);
+	if (!mft) {
+		ntfs_log_perror("ERROR: Couldn't open $MFT/$DATA");
+		free_file(file);
+		return NULL;
+	}
+
+	if (ntfs_attr_mst_pread(mft, vol->mft_record_size * record, 1, vol->mft_record_size, file->mft) < 1) {
+		ntfs_log_error("ERROR: Couldn't read MFT Record %lld.\n", record);
+		ntfs_attr_close(mft);
+		free_file(file);
+		return NULL;
+	}
+
+	ntfs_attr_close(mft);
+	mft = NULL;
+
+	/* disable errors logging, while examining suspicious records */
+	log_levels = ntfs_log_clear_levels(NTFS_LOG_LEVEL_PERROR);
+	examine_record(file, vol, opts.parent);
 	/* restore errors logging */
 	ntfs_log_set_levels(log_levels);
 
 	return file;
 }
 
+/**
+ * load_bitmap - Load $Bitmap into memory
+ * @vol:  An ntfs volume obtained from ntfs_mount
+ *
+ * The whole bitmap is read once, so that checking whether clusters are in
+ * use needs no further reading, and can be done by several threads.
+ *
+ * Return:  0  Success
+ *	   -1  Error, the bitmap could not be read
+ */
+static int load_bitmap(ntfs_volume *vol)
+{
+	s64 size;
+
+	size = vol->lcnbmp_na->data_size;
+	lcn_bitmap = malloc(size);
+	if (!lcn_bitmap) {
+		ntfs_log_error("ERROR: Couldn't allocate memory in load_bitmap()\n");
+		return -1;
+	}
+	if (ntfs_attr_pread(vol->lcnbmp_na, 0, size, lcn_bitmap) != size) {
+		ntfs_log_perror("ERROR: Couldn't read $Bitmap");
+		free(lcn_bitmap);
+		lcn_bitmap = NULL;
+		return -1;
+	}
+	lcn_bitmap_size = size;
+	return 0;
+}
+
+/*
+ *		Check whether a cluster is in use
+ *
+ *	The clusters beyond the bitmap are deemed to be in use.
+ */
+
+static int cluster_in_use(ntfs_volume *vol, long long lcn)
+{
+	if (!lcn_bitmap)
+		return (utils_cluster_in_use(vol, lcn));
+	if ((lcn < 0) || ((lcn >> 3) >= lcn_bitmap_size))
+		return (1);
+	return ((lcn_bitmap[lcn >> 3] >> (lcn & 7)) & 1);
+}
+
+/*
+ *		Count the clusters in use within a run
+ */
+
+static long long clusters_in_use(ntfs_volume *vol, long long lcn,
+			long long count)
+{
+	long long inuse;
+	u8 b;
+
+	inuse = 0;
+	while (count > 0) {
+		if (lcn_bitmap && (lcn >= 0) && !(lcn & 7) && (count >= 8)
+		    && ((lcn >> 3) < lcn_bitmap_size)) {
+			for (b=lcn_bitmap[lcn >> 3]; b; b &= b - 1)
+				inuse++;
+			lcn += 8;
+			count -= 8;
+		} else {
+			if (cluster_in_use(vol, lcn))
+				inuse++;
+			lcn++;
+			count--;
+		}
+	}
+	return (inuse);
+}
+
 /**
  * calc_percentage - Calculate how much of the file is recoverable
  * @file:  The file object to work with
@@ -1431,8 +1600,8 @@ static int calc_percentage(struct ufile *file, ntfs_volume *vol)
 	runlist_element *rl = NULL;
 	struct ntfs_list_head *pos;
 	struct data *data;
-	long long i, j;
-	long long start, end;
+	long long i;
+	long long inuse;
 	int clusters_inuse, clusters_free;
 	int percent = 0;
 
@@ -1508,15 +1677,9 @@ static int calc_percentage(struct ufile *file, ntfs_volume *vol)
 				continue;
 			}
 
-			start = rl[i].lcn;
-			end   = rl[i].lcn + rl[i].length;
-
-			for (j = start; j < end; j++) {
-				if (utils_cluster_in_use(vol, j))
-					clusters_inuse++;
-				else
-					clusters_free++;
-			}
+			inuse = clusters_in_use(vol, rl[i].lcn, rl[i].length);
+			clusters_inuse += inuse;
+			clusters_free  += rl[i].length - inuse;
 		}
 
 		if ((clusters_inuse + clusters_free) == 0) {
@@ -1653,8 +1816,104 @@ static void dump_record(struct ufile *file)
 }
 
 /**
- * list_record - Print a one line summary of the file
- * @file:  The file to work with
+ * make_entry - Summarize a file into a scan entry
+ * @file:     The file to work with
+ * @percent:  The percentage of the file which is recoverable
+ * @entry:    The entry to fill
+ *
+ * Only the filenames which could be converted to the current locale are
+ * kept in the entry, the preferred one being designated by its rank.
+ *
+ * Return:  0  Success
+ *	   -1  Error, not enough memory
+ */
+static int make_entry(struct ufile *file, int percent, struct scan_entry *entry)
+{
+	struct ntfs_list_head *item;
+	char *p;
+
+	memset(entry, 0, sizeof(*entry));
+	entry->inode = file->inode;
+	entry->sequence = le16_to_cpu(file->mft->sequence_number);
+	entry->lsn = sle64_to_cpu(file->mft->lsn);
+	entry->date = file->date;
+	entry->max_size = file->max_size;
+	entry->percent = percent;
+	entry->pref = -1;
+	entry->flags[0] = (file->directory ? 'D' : 'F');
+	entry->flags[1] = '.';
+	entry->flags[2] = '.';
+	entry->flags[3] = (file->attr_list ? '!' : '.');
+
+	ntfs_list_for_each(item, &file->data) {
+		struct data *d = ntfs_list_entry(item, struct data, list);
+
+		if (!d->name) {
+			if (d->resident)
+				entry->flags[1] = 'R';
+			else
+				entry->flags[1] = 'N';
+			if (d->compressed)
+				entry->flags[2] = 'C';
+			if (d->encrypted)
+				entry->flags[2] = 'E';
+
+			entry->data_percent = max(entry->data_percent,
+							d->percent);
+		}
+
+		entry->size = max(entry->size, d->size_data);
+		entry->size = max(entry->size, d->size_init);
+	}
+
+	ntfs_list_for_each(item, &file->name) {
+		struct filename *f =
+			ntfs_list_entry(item, struct filename, list);
+
+		if (f->name)
+			entry->names_len += strlen(f->name) + 1;
+	}
+	if (!entry->names_len)
+		return 0;
+
+	entry->names = malloc(entry->names_len);
+	if (!entry->names) {
+		ntfs_log_error("ERROR: Couldn't allocate memory in make_entry()\n");
+		return -1;
+	}
+	p = entry->names;
+	ntfs_list_for_each(item, &file->name) {
+		struct filename *f =
+			ntfs_list_entry(item, struct filename, list);
+
+		if (!f->name)
+			continue;
+		if (f->name == file->pref_name)
+			entry->pref = entry->nr_names;
+		strcpy(p, f->name);
+		p += strlen(p) + 1;
+		entry->nr_names++;
+	}
+	return 0;
+}
+
+/*
+ *		Get a filename of an entry, by rank
+ */
+
+static const char *entry_name(const struct scan_entry *entry, int rank)
+{
+	const char *p;
+
+	p = entry->names;
+	while (rank-- > 0)
+		p += strlen(p) + 1;
+	return (p);
+}
+
+/**
+ * list_entry - Print a one line summary of a file
+ * @entry:  The scan entry of the file
  *
  * Print a one line description of a file.
  *
@@ -1675,61 +1934,41 @@ static void dump_record(struct ufile *file)
  *
  * Return:  none
  */
-static void list_record(struct ufile *file)
+static void list_entry(const struct scan_entry *entry)
 {
 	char buffer[20];
-	struct ntfs_list_head *item;
-	const char *name = NULL;
-	long long size = 0;
-	int percent = 0;
-
-	char flagd = '.', flagr = '.', flagc = '.', flagx = '.';
-
-	strftime(buffer, sizeof(buffer), "%F %R", localtime(&file->date));
-
-	if (file->attr_list)
-		flagx = '!';
 
-	if (file->directory)
-		flagd = 'D';
-	else
-		flagd = 'F';
-
-	ntfs_list_for_each(item, &file->data) {
-		struct data *d = ntfs_list_entry(item, struct data, list);
+	strftime(buffer, sizeof(buffer), "%F %R", localtime(&entry->date));
 
-		if (!d->name) {
-			if (d->resident)
-				flagr = 'R';
-			else
-				flagr = 'N';
-			if (d->compressed)
-				flagc = 'C';
-			if (d->encrypted)
-				flagc = 'E';
+	ntfs_log_quiet("%-8lld %c%c%c%c   %3d%%  %s %9lld  %s\n",
+		entry->inode, entry->flags[0], entry->flags[1],
+		entry->flags[2], entry->flags[3], entry->data_percent,
+		buffer, entry->size,
+		(entry->pref >= 0 ? entry_name(entry, entry->pref) : NONE));
+}
 
-			percent = max(percent, d->percent);
-		}
+/**
+ * list_record - Print a one line summary of the file
+ * @file:  The file to work with
+ *
+ * Same as list_entry(), for a file which has been read.
+ *
+ * Return:  none
+ */
+static void list_record(struct ufile *file)
+{
+	struct scan_entry entry;
 
-		size = max(size, d->size_data);
-		size = max(size, d->size_init);
+	if (!make_entry(file, 0, &entry)) {
+		list_entry(&entry);
+		free(entry.names);
 	}
-
-	if (file->pref_name)
-		name = file->pref_name;
-	else
-		name = NONE;
-
-	ntfs_log_quiet("%-8lld %c%c%c%c   %3d%%  %s %9lld  %s\n",
-		file->inode, flagd, flagr, flagc, flagx,
-		percent, buffer, size, name);
-
 }
 
 /**
  * name_match - Does a file have a name matching a regex
- * @re:    The regular expression object
- * @file:  The file to be tested
+ * @re:     The regular expression object
+ * @entry:  The scan entry of the file to be tested
  *
  * Iterate through the file's $FILENAME attributes and compare them against the
  * regular expression, created with regcomp.
@@ -1737,24 +1976,30 @@ static void list_record(struct ufile *file)
  * Return:  1  There is a matching filename.
  *	    0  There is no match.
  */
-static int name_match(regex_t *re, struct ufile *file)
+static int name_match(regex_t *re, const struct scan_entry *entry)
 {
-	struct ntfs_list_head *item;
+	const char *name;
 	int result;
+	int i;
+#ifndef HAVE_REGEX_H
+	ntfschar *uname;
+	int uname_len;
+#endif
 
-	if (!re || !file)
+	if (!re || !entry)
 		return 0;
 
-	ntfs_list_for_each(item, &file->name) {
-		struct filename *f =
-			ntfs_list_entry(item, struct filename, list);
-
-		if (!f->name)
-			continue;
+	name = entry->names;
+	for (i = 0; i < entry->nr_names; i++, name += strlen(name) + 1) {
 #ifdef HAVE_REGEX_H
-		result = regexec(re, f->name, 0, NULL, 0);
+		result = regexec(re, name, 0, NULL, 0);
 #else
-		result = regexec(re, f->uname, f->uname_len, NULL, 0);
+		uname = (ntfschar*)NULL;
+		uname_len = ntfs_mbstoucs(name, &uname);
+		if (uname_len < 0)
+			continue;
+		result = regexec(re, uname, uname_len, NULL, 0);
+		free(uname);
 #endif
 		if (result < 0) {
 			ntfs_log_perror("Couldn't compare filename with regex");
@@ -1765,7 +2010,8 @@ static int name_match(regex_t *re, struct ufile *file)
 		}
 	}
 
-	ntfs_log_debug("Filename '%s' doesn't match regex.\n", file->pref_name);
+	ntfs_log_debug("Filename '%s' doesn't match regex.\n",
+		(entry->pref >= 0 ? entry_name(entry, entry->pref) : NONE));
 	return 0;
 }
 
@@ -2091,7 +2337,7 @@ static int undelete_file(ntfs_volume *vol, long long inode)
 				end   = rl[i].lcn + rl[i].length;
 
 				for (j = start; j < end; j++) {
-					if (utils_cluster_in_use(vol, j) && !opts.optimistic) {
+					if (cluster_in_use(vol, j) && !opts.optimistic) {
 						memset(buffer, opts.fillbyte, bufsize);
 						if (write_data(fd, buffer, bufsize) < bufsize) {
 							ntfs_log_perror("Write failed");
@@ -2159,6 +2405,399 @@ free:
 	return result;
 }
 
+/**
+ * free_index - Release the memory used by a scan index
+ * @index:  The unwanted index
+ *
+ * Return:  none
+ */
+static void free_index(struct scan_index *index)
+{
+	long long i;
+
+	if (!index)
+		return;
+	for (i = 0; i < index->count; i++)
+		free(index->entries[i].names);
+	free(index->entries);
+	free(index);
+}
+
+/*
+ *		Add the file of an MFT record not in use to the index
+ *
+ *	Called by the MFT scan, possibly by several threads. The record is
+ *	examined the same way as by read_record(), except for the parent
+ *	names which are not kept in the index.
+ */
+
+static int index_record(ntfs_volume *vol, u64 mft_num, MFT_RECORD *mrec,
+			void *data)
+{
+	struct scan_index *index;
+	struct scan_entry *grown;
+	struct scan_entry entry;
+	struct ufile *file;
+	long long room;
+	int percent;
+	int res;
+
+	index = (struct scan_index*)data;
+	file = alloc_file(vol, mft_num);
+	if (!file)
+		return -1;
+	memcpy(file->mft, mrec, vol->mft_record_size);
+	examine_record(file, vol, FALSE);
+	percent = calc_percentage(file, vol);
+	res = make_entry(file, percent, &entry);
+	free_file(file);
+	if (!res) {
+		mft_scan_lock();
+		if (index->count >= index->room) {
+			room = (index->room ? 2*index->room : 1024);
+			grown = (struct scan_entry*)realloc(index->entries,
+					room*sizeof(struct scan_entry));
+			if (grown) {
+				index->entries = grown;
+				index->room = room;
+			} else
+				res = -1;
+		}
+		if (!res)
+			index->entries[index->count++] = entry;
+		mft_scan_unlock();
+		if (res) {
+			ntfs_log_error("ERROR: Couldn't allocate memory in index_record()\n");
+			free(entry.names);
+		}
+	}
+	return res;
+}
+
+static int entry_cmp(const void *p1, const void *p2)
+{
+	const struct scan_entry *e1 = (const struct scan_entry*)p1;
+	const struct scan_entry *e2 = (const struct scan_entry*)p2;
+
+	if (e1->inode != e2->inode)
+		return (e1->inode < e2->inode ? -1 : 1);
+	return 0;
+}
+
+/**
+ * build_index - Scan the MFT records not in use
+ * @vol:  An ntfs volume obtained from ntfs_mount
+ *
+ * The records are examined by several threads, reading the MFT by big
+ * chunks, and the deleted files are summarized into an index, whatever the
+ * filters, so that it can be saved and reused with other filters.
+ * The records which cannot be read are logged and left out of the index,
+ * so that a damaged MFT does not hide the other deleted files.
+ *
+ * Return:  Pointer  The index, sorted by inode
+ *	    NULL     Error
+ */
+static struct scan_index *build_index(ntfs_volume *vol)
+{
+	struct scan_index *index;
+	u32 log_levels;
+	int res;
+
+	index = calloc(1, sizeof(*index));
+	if (!index) {
+		ntfs_log_error("ERROR: Couldn't allocate memory in build_index()\n");
+		return NULL;
+	}
+	if (utils_allocation_stamp(vol, &index->stamp)) {
+		free_index(index);
+		return NULL;
+	}
+
+	/*
+	 * Disable errors logging while examining suspicious records, and
+	 * the details about each record which are logged again when
+	 * dumping the matching ones.
+	 */
+	log_levels = ntfs_log_clear_levels(NTFS_LOG_LEVEL_PERROR
+					| NTFS_LOG_LEVEL_VERBOSE);
+	res = mft_scan_unused(vol, 0, index_record, index);
+	ntfs_log_set_levels(log_levels);
+	if (res) {
+		ntfs_log_error("ERROR: Couldn't scan the MFT.\n");
+		free_index(index);
+		return NULL;
+	}
+	if (index->count)
+		qsort(index->entries, index->count, sizeof(struct scan_entry),
+				entry_cmp);
+	return index;
+}
+
+/**
+ * save_index - Save a scan index into a side file
+ * @index:  The index to save
+ * @path:   The name of the file
+ *
+ * Return:  0  Success
+ *	   -1  Error, the file could not be written
+ */
+static int save_index(const struct scan_index *index, const char *path)
+{
+	struct index_header header;
+	struct index_record rec;
+	const struct scan_entry *entry;
+	long long i;
+	FILE *f;
+	int err;
+
+	f = fopen(path, "w");
+	if (!f) {
+		ntfs_log_perror("ERROR: Couldn't create %s", path);
+		return -1;
+	}
+
+	memset(&header, 0, sizeof(header));
+	memcpy(header.magic, INDEX_MAGIC, sizeof(header.magic));
+	header.version = cpu_to_le32(INDEX_VERSION);
+	header.stamp = cpu_to_le64(index->stamp);
+	header.count = cpu_to_le64(index->count);
+	err = (fwrite(&header, sizeof(header), 1, f) != 1);
+
+	for (i = 0; !err && (i < index->count); i++) {
+		entry = &index->entries[i];
+		memset(&rec, 0, sizeof(rec));
+		rec.inode = cpu_to_le64(entry->inode);
+		rec.date = cpu_to_sle64(entry->date);
+		rec.max_size = cpu_to_sle64(entry->max_size);
+		rec.size = cpu_to_sle64(entry->size);
+		rec.percent = entry->percent;
+		rec.data_percent = entry->data_percent;
+		memcpy(rec.flags, entry->flags, sizeof(rec.flags));
+		rec.pref = cpu_to_le16(entry->pref >= 0 ? entry->pref : 0xffff);
+		rec.nr_names = cpu_to_le16(entry->nr_names);
+		rec.sequence = cpu_to_le16(entry->sequence);
+		rec.names_len = cpu_to_le32(entry->names_len);
+		rec.lsn = cpu_to_sle64(entry->lsn);
+		if ((fwrite(&rec, sizeof(rec), 1, f) != 1)
+		    || (entry->names_len
+			&& (fwrite(entry->names, entry->names_len, 1, f) != 1)))
+			err = 1;
+	}
+	if (fclose(f))
+		err = 1;
+	if (err) {
+		ntfs_log_perror("ERROR: Couldn't write %s", path);
+		return -1;
+	}
+	return 0;
+}
+
+/*
+ *		Check the filenames of an entry read from a side file
+ */
+
+static BOOL valid_names(const struct scan_entry *entry)
+{
+	int nulls;
+	int i;
+
+	nulls = 0;
+	for (i = 0; i < entry->names_len; i++)
+		if (!entry->names[i])
+			nulls++;
+	return ((nulls == entry->nr_names)
+		&& (!entry->names_len || !entry->names[entry->names_len - 1])
+		&& (entry->pref < entry->nr_names));
+}
+
+/**
+ * load_index - Load a scan index saved into a side file
+ * @vol:   An ntfs volume obtained from ntfs_mount
+ * @path:  The name of the file
+ *
+ * The index is only accepted if no clusters or MFT records have been
+ * allocated or freed since it was saved. A record which was reused and
+ * freed again meanwhile is only detected by check_entry().
+ *
+ * Return:  Pointer  The index
+ *	    NULL     Error, with errno set to ENOENT if there is no file,
+ *		     EINVAL if the file is not a scan index of this volume
+ *		     or ESTALE if the volume has changed since the scan
+ */
+static struct scan_index *load_index(ntfs_volume *vol, const char *path)
+{
+	struct index_header header;
+	struct index_record rec;
+	struct scan_entry *entry;
+	struct scan_index *index;
+	long long count;
+	long long i;
+	u64 stamp;
+	FILE *f;
+	int err;
+
+	f = fopen(path, "r");
+	if (!f)
+		return NULL;
+
+	err = 0;
+	index = calloc(1, sizeof(*index));
+	if (!index)
+		err = ENOMEM;
+	if (!err
+	    && ((fread(&header, sizeof(header), 1, f) != 1)
+		|| memcmp(header.magic, INDEX_MAGIC, sizeof(header.magic))
+		|| (le32_to_cpu(header.version) > INDEX_VERSION)))
+		err = EINVAL;
+		/* an index from an older version has to be rebuilt */
+	if (!err && (le32_to_cpu(header.version) != INDEX_VERSION))
+		err = ESTALE;
+	if (!err && utils_allocation_stamp(vol, &stamp))
+		err = EIO;
+	if (!err && (le64_to_cpu(header.stamp) != stamp))
+		err = ESTALE;
+	if (!err) {
+		/* there cannot be more deleted files than records */
+		count = le64_to_cpu(header.count);
+		if ((count < 0) || (count > (vol->mft_na->initialized_size
+					>> vol->mft_record_size_bits)))
+			err = EINVAL;
+		else if (count) {
+			index->stamp = stamp;
+			index->room = count;
+			index->entries = calloc(count,
+					sizeof(struct scan_entry));
+			if (!index->entries)
+				err = ENOMEM;
+		}
+	}
+	for (i = 0; !err && (i < index->room); i++) {
+		entry = &index->entries[i];
+		if (fread(&rec, sizeof(rec), 1, f) != 1) {
+			err = EINVAL;
+			break;
+		}
+		index->count++;
+		entry->inode = le64_to_cpu(rec.inode);
+		entry->date = sle64_to_cpu(rec.date);
+		entry->max_size = sle64_to_cpu(rec.max_size);
+		entry->size = sle64_to_cpu(rec.size);
+		entry->percent = rec.percent;
+		entry->data_percent = rec.data_percent;
+		memcpy(entry->flags, rec.flags, sizeof(entry->flags));
+		entry->pref = le16_to_cpu(rec.pref);
+		if (entry->pref == 0xffff)
+			entry->pref = -1;
+		entry->nr_names = le16_to_cpu(rec.nr_names);
+		entry->sequence = le16_to_cpu(rec.sequence);
+		entry->lsn = sle64_to_cpu(rec.lsn);
+		/* the names of a record cannot exceed the record */
+		if ((le32_to_cpu(rec.names_len) > vol->mft_record_size*4)
+		    || (i && (entry->inode <= entry[-1].inode))) {
+			err = EINVAL;
+			break;
+		}
+		entry->names_len = le32_to_cpu(rec.names_len);
+		if (entry->names_len) {
+			entry->names = malloc(entry->names_len);
+			if (!entry->names)
+				err = ENOMEM;
+			else if (fread(entry->names, entry->names_len, 1, f) != 1)
+				err = EINVAL;
+		}
+		if (!err && !valid_names(entry))
+			err = EINVAL;
+	}
+	fclose(f);
+	if (err) {
+		free_index(index);
+		errno = err;
+		return NULL;
+	}
+	return index;
+}
+
+/**
+ * rebuild_index - Scan the MFT and save the index into its side file
+ * @vol:  An ntfs volume obtained from ntfs_mount
+ *
+ * Return:  Pointer  The index
+ *	    NULL     Error
+ */
+static struct scan_index *rebuild_index(ntfs_volume *vol)
+{
+	struct scan_index *index;
+
+	index = build_index(vol);
+	if (index && opts.index && save_index(index, opts.index)) {
+		free_index(index);
+		index = NULL;
+	}
+	return index;
+}
+
+/**
+ * get_index - Get the index of the deleted files
+ * @vol:  An ntfs volume obtained from ntfs_mount
+ *
+ * The index is loaded from its side file if it is still valid for the
+ * volume, otherwise the MFT is scanned and the index is saved into the
+ * side file. A file which is not a scan index is never overwritten.
+ *
+ * Return:  Pointer  The index
+ *	    NULL     Error
+ */
+static struct scan_index *get_index(ntfs_volume *vol)
+{
+	struct scan_index *index = NULL;
+
+	if (opts.index) {
+		index = load_index(vol, opts.index);
+		if (!index && (errno == ESTALE))
+			ntfs_log_verbose("The volume has changed since %s "
+					"was saved.\n", opts.index);
+		else if (!index && (errno == EINVAL)) {
+			ntfs_log_error("ERROR: %s is not a scan index of this "
+					"volume.\n", opts.index);
+			return NULL;
+		} else if (!index && (errno != ENOENT)) {
+			ntfs_log_perror("ERROR: Couldn't load %s", opts.index);
+			return NULL;
+		}
+	}
+	if (!index)
+		index = rebuild_index(vol);
+	return index;
+}
+
+/**
+ * check_entry - Check whether an index entry still describes its record
+ * @vol:    An ntfs volume obtained from ntfs_mount
+ * @entry:  The entry to check
+ *
+ * A record may have been used by a temporary file and freed again since
+ * the scan, leaving the bitmaps unchanged, but its sequence number and
+ * its $LogFile sequence number have changed.
+ *
+ * Return:  0  The record is the one which was scanned
+ *	    1  The record has changed, the index has to be rebuilt
+ *	   -1  Error, the record could not be read
+ */
+static int check_entry(ntfs_volume *vol, const struct scan_entry *entry)
+{
+	MFT_RECORD rec;
+
+	if (ntfs_attr_pread(vol->mft_na,
+			entry->inode << vol->mft_record_size_bits,
+			sizeof(rec), &rec) != sizeof(rec)) {
+		ntfs_log_error("ERROR: Couldn't read MFT Record %lld.\n",
+				entry->inode);
+		return -1;
+	}
+	return ((le16_to_cpu(rec.sequence_number) != entry->sequence)
+		|| (sle64_to_cpu(rec.lsn) != entry->lsn));
+}
+
 /**
  * scan_disk - Search an NTFS volume for files that could be undeleted
  * @vol:  An ntfs volume obtained from ntfs_mount
@@ -2173,36 +2812,21 @@ free:
  */
 static int scan_disk(ntfs_volume *vol)
 {
-	s64 nr_mft_records;
-	const int BUFSIZE = 8192;
-	char *buffer = NULL;
+	struct scan_index *index = NULL;
+	struct scan_entry *entry;
+	struct ufile *file;
+	BOOL rebuilt = FALSE;
 	int results = 0;
-	ntfs_attr *attr;
-	long long size;
-	long long bmpsize;
+	long long inode;
 	long long i;
-	int j, k, b;
 	int percent;
-	struct ufile *file;
+	int res;
 	regex_t re;
 
 	if (!vol)
 		return -1;
 
-	attr = ntfs_attr_open(vol->mft_ni, AT_BITMAP, AT_UNNAMED, 0);
-	if (!attr) {
-		ntfs_log_perror("ERROR: Couldn't open $MFT/$BITMAP");
-		return -1;
-	}
 	NVolSetNoFixupWarn(vol);
-	bmpsize = attr->initialized_size;
-
-	buffer = malloc(BUFSIZE);
-	if (!buffer) {
-		ntfs_log_error("ERROR: Couldn't allocate memory in scan_disk()\n");
-		results = -1;
-		goto out;
-	}
 
 	if (opts.match) {
 		int flags = REG_NOSUB;
@@ -2219,76 +2843,91 @@ static int scan_disk(ntfs_volume *vol)
 #endif
 	}
 
-	nr_mft_records = vol->mft_na->initialized_size >>
-			vol->mft_record_size_bits;
-
 	ntfs_log_quiet("Inode    Flags  %%age     Date    Time       Size  Filename\n");
 	ntfs_log_quiet("-----------------------------------------------------------------------\n");
-	for (i = 0; i < bmpsize; i += BUFSIZE) {
-		long long read_count = min((bmpsize - i), BUFSIZE);
-		size = ntfs_attr_pread(attr, i, read_count, buffer);
-		if (size < 0)
-			break;
 
-		for (j = 0; j < size; j++) {
-			b = buffer[j];
-			for (k = 0; k < 8; k++, b>>=1) {
-				if (((i+j)*8+k) >= nr_mft_records)
-					goto done;
-				if (b & 1)
-					continue;
-				file = read_record(vol, (i+j)*8+k);
-				if (!file) {
-					ntfs_log_error("Couldn't read MFT Record %lld.\n",
-							(long long)(i+j)*8+k);
-					continue;
-				}
+	index = get_index(vol);
+	if (!index) {
+		results = -1;
+		goto out;
+	}
 
-				if ((opts.since > 0) && (file->date <= opts.since))
-					goto skip;
-				if (opts.match && !name_match(&re, file))
-					goto skip;
-				if (opts.size_begin && (opts.size_begin > file->max_size))
-					goto skip;
-				if (opts.size_end && (opts.size_end < file->max_size))
-					goto skip;
-
-				percent = calc_percentage(file, vol);
-				if ((opts.percent == -1) || (percent >= opts.percent)) {
-					if (opts.verbose)
-						dump_record(file);
-					else
-						list_record(file);
-
-					/* Was -u specified with no inode
-					   so undelete file by regex */
-					if (opts.mode == MODE_UNDELETE) {
-						if  (!undelete_file(vol, file->inode))
-							ntfs_log_verbose("ERROR: Failed to undelete "
-								  "inode %lli\n!",
-								  file->inode);
-						ntfs_log_info("\n");
-					}
+	for (i = 0; i < index->count; i++) {
+		entry = &index->entries[i];
+
+		if ((opts.since > 0) && (entry->date <= opts.since))
+			continue;
+		if (opts.match && !name_match(&re, entry))
+			continue;
+		if (opts.size_begin && (opts.size_begin > entry->max_size))
+			continue;
+		if (opts.size_end && (opts.size_end < entry->max_size))
+			continue;
+
+		percent = entry->percent;
+		if ((opts.percent == -1) || (percent >= opts.percent)) {
+			/* the record is read again, it must not have changed */
+			res = check_entry(vol, entry);
+			if (res < 0)
+				continue;
+			if (res && !rebuilt) {
+				ntfs_log_verbose("MFT Record %lld has changed "
+					"since the scan.\n", entry->inode);
+				inode = entry->inode;
+				free_index(index);
+				index = rebuild_index(vol);
+				if (!index) {
+					results = -1;
+					goto out;
 				}
-				if (((opts.percent == -1) && (percent > 0)) ||
-				    ((opts.percent > 0)  && (percent >= opts.percent))) {
-					results++;
+				rebuilt = TRUE;
+				/* resume with the current state of the record */
+				i = 0;
+				while ((i < index->count)
+				    && (index->entries[i].inode < inode))
+					i++;
+				i--;
+				continue;
+			}
+			if (res) {
+				ntfs_log_error("ERROR: MFT Record %lld is "
+					"changing, skipping it.\n",
+					entry->inode);
+				continue;
+			}
+			if (opts.verbose) {
+				/* the details are not kept in the index */
+				file = read_record(vol, entry->inode);
+				if (file) {
+					calc_percentage(file, vol);
+					dump_record(file);
+					free_file(file);
 				}
-skip:
-				free_file(file);
+			} else
+				list_entry(entry);
+
+			/* Was -u specified with no inode
+			   so undelete file by regex */
+			if (opts.mode == MODE_UNDELETE) {
+				if  (!undelete_file(vol, entry->inode))
+					ntfs_log_verbose("ERROR: Failed to undelete "
+						  "inode %lli\n!",
+						  entry->inode);
+				ntfs_log_info("\n");
 			}
 		}
+		if (((opts.percent == -1) && (percent > 0)) ||
+		    ((opts.percent > 0)  && (percent >= opts.percent))) {
+			results++;
+		}
 	}
-done:
 	ntfs_log_quiet("\nFiles with potentially recoverable content: %d\n",
 		results);
 out:
 	if (opts.match)
 		regfree(&re);
-	free(buffer);
+	free_index(index);
 	NVolClearNoFixupWarn(vol);
-	if (attr)
-		ntfs_attr_close(attr);
 	return results;
 }
 
@@ -2452,6 +3091,12 @@ int main(int argc, char *argv[])
 	if (!vol)
 		return 1;
 
+	/* recoverability is checked against $Bitmap, loaded once */
+	if ((opts.mode != MODE_COPY) && load_bitmap(vol)) {
+		ntfs_umount(vol, FALSE);
+		goto free;
+	}
+
 	/* handling of the different modes */
 	switch (opts.mode) {
 	/* Scanning */
@@ -2484,6 +3129,7 @@ int main(int argc, char *argv[])
 free:
 	if (opts.match)
 		free(opts.match);
+	free(lcn_bitmap);
 
 	return result;
 }
@@ -59,6 +59,7 @@ struct options {
 	s64		 mft_begin;	/* Range for mft copy */
 	s64		 mft_end;
 	char		 fillbyte;	/* Use for unrecoverable sections */
+	char		*index;		/* Side file of the scan index */
 };
 
 struct filename {
@@ -108,5 +109,29 @@ struct ufile {
 	MFT_RECORD	*mft;		/* Raw MFT record */
 };
 
+struct scan_entry {
+	long long	 inode;		/* MFT record number */
+	time_t		 date;		/* Last modification date/time */
+	long long	 max_size;	/* Largest size we find */
+	long long	 size;		/* Largest size of the data streams */
+	int		 percent;	/* Amount potentially recoverable */
+	int		 data_percent;	/*	of the unnamed data stream */
+	char		 flags[4];	/* File/Dir, (Non-)Resident, ... */
+	int		 nr_names;	/* Count of filenames */
+	int		 pref;		/* Preferred filename, or -1 */
+	int		 names_len;	/* Size of the filenames */
+	char		*names;		/* Filenames in current locale,
+					   each terminated by a null */
+	unsigned int	 sequence;	/* Sequence number of the record */
+	long long	 lsn;		/* $LogFile sequence number */
+};
+
+struct scan_index {
+	struct scan_entry *entries;	/* Sorted by inode */
+	long long	 count;		/* Number of entries */
+	long long	 room;		/* Number of entries allocated */
+	u64		 stamp;		/* State of the volume when scanned */
+};
+
 #endif /* _NTFSUNDELETE_H_ */
 
@@ -53,6 +53,13 @@
 #ifdef HAVE_TIME_H
 #include <time.h>
 #endif
+#ifdef HAVE_SYS_STAT_H
+#include <sys/stat.h>
+#endif
+#ifdef HAVE_SYS_IOCTL_H
+#include <sys/ioctl.h>
+#endif
+#include <pthread.h>
 
 #include "ntfswipe.h"
 #include "types.h"
@@ -66,6 +73,16 @@
 #include "list.h"
 #include "mft.h"
 
+#if defined(linux) && defined(_IO) && !defined(BLKDISCARD)
+#define BLKDISCARD	_IO(0x12,119)	/* Discard a range of bytes. */
+#endif
+#if defined(linux) && defined(_IO) && !defined(BLKSECDISCARD)
+#define BLKSECDISCARD	_IO(0x12,125)	/* Securely discard a range of bytes. */
+#endif
+
+#define WIPE_BUFFER_SIZE (4*1024*1024)	/* max bytes written at once */
+#define WIPE_WRITERS	4		/* threads wiping the unused clusters */
+
 static const char *EXEC_NAME = "ntfswipe";
 static struct options opts;
 static unsigned long int npasses = 0;
@@ -169,6 +186,7 @@ static void usage(void)
 		"    -p       --pagefile    Wipe pagefile (swap space)\n"
 		"    -t       --tails       Wipe file tails\n"
 		"    -u       --unused      Wipe unused clusters\n"
+		"             --discard     Discard unused clusters instead\n"
 		"    -s       --undel       Wipe undelete data\n"
 		"\n"
 		"    -a       --all         Wipe all unused space\n"
@@ -268,6 +286,7 @@ static int parse_options(int argc, char *argv[])
 		{ "bytes",	required_argument,	NULL, 'b' },
 		{ "count",	required_argument,	NULL, 'c' },
 		{ "directory",	no_argument,		NULL, 'd' },
+		{ "discard",	no_argument,		NULL, 'D' },
 		{ "force",	no_argument,		NULL, 'f' },
 		{ "help",	no_argument,		NULL, 'h' },
 		{ "info",	no_argument,		NULL, 'i' },
@@ -339,6 +358,9 @@ static int parse_options(int argc, char *argv[])
 		case 'd':
 			opts.directory++;
 			break;
+		case 'D':	/* not proposed as a short option */
+			opts.discard++;
+			break;
 		case 'f':
 			opts.force++;
 			break;
@@ -422,6 +444,12 @@ static int parse_options(int argc, char *argv[])
 		}
 		*/
 
+		if (opts.discard && !opts.unused) {
+			ntfs_log_error("You may only use --discard with "
+					"--unused.\n");
+			err++;
+		}
+
 		if ((opts.count < 1) || (opts.count > 100)) {
 			ntfs_log_error("The iteration count must be between 1 and 100.\n");
 			err++;
@@ -454,13 +482,147 @@ static int parse_options(int argc, char *argv[])
 	return (!err && !help && !ver);
 }
 
+/*
+ * The unused clusters are found in a copy of the whole $Bitmap, and the
+ * free extents are shared between a few writer threads, each of them
+ * overwriting up to WIPE_BUFFER_SIZE bytes at once, or discarding a
+ * whole extent.
+ */
+static struct {
+	pthread_mutex_t lock;
+	ntfs_volume *vol;
+	const u8 *bitmap;	/* copy of $Bitmap */
+	const u8 *buffer;	/* the pattern to write */
+	int discard;		/* ioctl to discard, or zero to write */
+	s64 next;		/* next cluster to examine */
+	s64 max_count;		/* max clusters wiped at once */
+	s64 total;		/* bytes wiped */
+	int error;		/* errno of first failure */
+} wipe_pool;
+
+/**
+ * find_cluster - Find the next cluster marked used or unused
+ * @bitmap:  A copy of $Bitmap
+ * @lcn:     Cluster to start from
+ * @end:     Cluster to stop at
+ * @used:    Look for a used cluster if non zero
+ *
+ * The bitmap is skipped by 64 bit words which have no such cluster.
+ *
+ * Return:  The first such cluster, or @end if there is none before @end.
+ */
+static s64 find_cluster(const u8 *bitmap, s64 lcn, s64 end, int used)
+{
+	u64 word;
+	u64 skip;
+
+	skip = (used ? 0 : ~(u64)0);
+	while (lcn < end) {
+		if (!(lcn & 63) && ((lcn + 64) <= end)) {
+			memcpy(&word, &bitmap[lcn >> 3], sizeof(word));
+			if (word == skip) {
+				lcn += 64;
+				continue;
+			}
+		}
+		if (((bitmap[lcn >> 3] >> (lcn & 7)) & 1) == (used != 0))
+			break;
+		lcn++;
+	}
+	return (lcn < end ? lcn : end);
+}
+
+/**
+ * next_unused - Get the next run of unused clusters to wipe
+ * @lcn:  Set to the first cluster of the run
+ *
+ * The runs are limited to max_count clusters, so that a long free extent
+ * is shared between the writers. Must be called with the lock held.
+ *
+ * Return:  The number of clusters in the run, 0 if there are no more.
+ */
+static s64 next_unused(s64 *lcn)
+{
+	s64 nr_clusters = wipe_pool.vol->nr_clusters;
+	s64 end;
+
+	*lcn = find_cluster(wipe_pool.bitmap, wipe_pool.next, nr_clusters, 0);
+	end = *lcn + wipe_pool.max_count;
+	if (end > nr_clusters)
+		end = nr_clusters;
+	end = find_cluster(wipe_pool.bitmap, *lcn, end, 1);
+	wipe_pool.next = end;
+	return (end - *lcn);
+}
+
+/**
+ * wipe_writer - Thread wiping runs of unused clusters until there are none
+ */
+static void *wipe_writer(void *arg __attribute__((unused)))
+{
+	ntfs_volume *vol = wipe_pool.vol;
+	u64 range[2];
+	s64 lcn, count, size;
+	int request;
+	int err;
+
+	do {
+		pthread_mutex_lock(&wipe_pool.lock);
+		count = (wipe_pool.error ? 0 : next_unused(&lcn));
+		request = wipe_pool.discard;
+		pthread_mutex_unlock(&wipe_pool.lock);
+		if (!count)
+			break;
+		size = count << vol->cluster_size_bits;
+		err = 0;
+		if (request) {
+			range[0] = lcn << vol->cluster_size_bits;
+			range[1] = size;
+			while (vol->dev->d_ops->ioctl(vol->dev, request, range)) {
+				err = errno;
+#ifdef BLKSECDISCARD
+				/* not all devices can erase securely */
+				if ((request == BLKSECDISCARD)
+				    && ((err == EOPNOTSUPP) || (err == EINVAL))) {
+					pthread_mutex_lock(&wipe_pool.lock);
+					if (wipe_pool.discard == BLKSECDISCARD) {
+						ntfs_log_warning("The device "
+							"cannot discard securely, "
+							"the unused clusters may "
+							"still be readable.\n");
+						wipe_pool.discard = BLKDISCARD;
+					}
+					pthread_mutex_unlock(&wipe_pool.lock);
+					request = BLKDISCARD;
+					err = 0;
+					continue;
+				}
+#endif
+				break;
+			}
+		} else if (ntfs_pwrite(vol->dev, lcn << vol->cluster_size_bits,
+				size, wipe_pool.buffer) != size)
+			err = (errno ? errno : EIO);
+		pthread_mutex_lock(&wipe_pool.lock);
+		if (err) {
+			if (!wipe_pool.error)
+				wipe_pool.error = err;
+		} else
+			wipe_pool.total += size;
+		pthread_mutex_unlock(&wipe_pool.lock);
+	} while (!err);
+	return ((void*)NULL);
+}
+
 /**
  * wipe_unused - Wipe unused clusters
  * @vol:   An ntfs volume obtained from ntfs_mount
  * @byte:  Overwrite with this value
  * @act:   Wipe, test or info
  *
- * Read $Bitmap and wipe any clusters that are marked as not in use.
+ * Read $Bitmap and wipe any clusters that are marked as not in use, by
+ * overwriting them with big writes from a few threads, or by discarding
+ * them if requested.
  *
  * Return: >0  Success, the attribute was wiped
  *          0  Nothing to wipe
@@ -468,44 +630,97 @@ static int parse_options(int argc, char *argv[])
  */
 static s64 wipe_unused(ntfs_volume *vol, int byte, enum action act)
 {
-	s64 i;
-	s64 total = 0;
-	s64 result = 0;
+	pthread_t writers[WIPE_WRITERS];
+	struct stat sbuf;
+	u8 *bitmap = NULL;
 	u8 *buffer = NULL;
+	s64 size, lcn, count;
+	s64 total = 0;
+	int nr_writers;
 
 	if (!vol || (byte < 0))
 		return -1;
 
-	if (act != act_info) {
-		buffer = malloc(vol->cluster_size);
+	if (opts.discard && (act == act_wipe)
+	    && (vol->dev->d_ops->stat(vol->dev, &sbuf)
+		|| !S_ISBLK(sbuf.st_mode))) {
+		ntfs_log_error("Only a block device can be discarded.\n");
+		return -1;
+	}
+
+	/* Whole bytes of the bitmap, rounded up for reading by words */
+	size = ((vol->nr_clusters + 63) >> 6) << 3;
+	bitmap = malloc(size);
+	if (!bitmap) {
+		ntfs_log_error("malloc failed\n");
+		return -1;
+	}
+	/* Mark the bitmap as in use, in case the read is shorter. */
+	memset(bitmap, 0xFF, size);
+	if (ntfs_attr_pread(vol->lcnbmp_na, 0,
+			(vol->nr_clusters + 7) >> 3, bitmap) < 0) {
+		ntfs_log_perror("Couldn't read $Bitmap");
+		free(bitmap);
+		return -1;
+	}
+
+	memset(&wipe_pool, 0, sizeof(wipe_pool));
+	wipe_pool.vol = vol;
+	wipe_pool.bitmap = bitmap;
+	if (act != act_wipe) {
+		wipe_pool.max_count = vol->nr_clusters;
+		while ((count = next_unused(&lcn)))
+			total += count << vol->cluster_size_bits;
+		goto done;
+	}
+
+	if (opts.discard) {
+#if defined(BLKSECDISCARD) && defined(BLKDISCARD)
+		wipe_pool.discard = BLKSECDISCARD;
+		wipe_pool.max_count = vol->nr_clusters;
+#else
+		ntfs_log_error("Discarding is not supported on this "
+				"system.\n");
+		free(bitmap);
+		return -1;
+#endif
+	} else {
+		buffer = malloc(WIPE_BUFFER_SIZE);
 		if (!buffer) {
 			ntfs_log_error("malloc failed\n");
+			free(bitmap);
 			return -1;
 		}
-		memset(buffer, byte, vol->cluster_size);
+		memset(buffer, byte, WIPE_BUFFER_SIZE);
+		wipe_pool.buffer = buffer;
+		wipe_pool.max_count = WIPE_BUFFER_SIZE
+					>> vol->cluster_size_bits;
 	}
 
-	for (i = 0; i < vol->nr_clusters; i++) {
-		if (utils_cluster_in_use(vol, i)) {
-			//ntfs_log_verbose("cluster %lld is in use\n", i);
-			continue;
-		}
-
-		if (act == act_wipe) {
-			//ntfs_log_verbose("cluster %lld is not in use\n", i);
-			result = ntfs_pwrite(vol->dev, vol->cluster_size * i, vol->cluster_size, buffer);
-			if (result != vol->cluster_size) {
-				ntfs_log_error("write failed\n");
-				goto free;
-			}
-		}
-
-		total += vol->cluster_size;
+	pthread_mutex_init(&wipe_pool.lock, (pthread_mutexattr_t*)NULL);
+	for (nr_writers = 0; nr_writers < WIPE_WRITERS; nr_writers++)
+		if (pthread_create(&writers[nr_writers],
+				(pthread_attr_t*)NULL, wipe_writer,
+				(void*)NULL))
+			break;
+	if (!nr_writers)
+		wipe_writer((void*)NULL);
+	while (nr_writers)
+		pthread_join(writers[--nr_writers], (void**)NULL);
+	pthread_mutex_destroy(&wipe_pool.lock);
+	total = wipe_pool.total;
+	if (wipe_pool.error) {
+		errno = wipe_pool.error;
+		ntfs_log_perror("%s failed",
+			(opts.discard ? "discard" : "write"));
+		goto free;
 	}
 
+done:
 	ntfs_log_quiet("wipe_unused 0x%02x, %lld bytes\n", byte, (long long)total);
 free:
 	free(buffer);
+	free(bitmap);
 	return total;
 }
 
@@ -1956,7 +2171,8 @@ static void print_summary(void)
 
 	ntfs_log_quiet("%s is about to wipe:\n", EXEC_NAME);
 	if (opts.unused)
-		ntfs_log_quiet("\tunused disk space\n");
+		ntfs_log_quiet("\tunused disk space%s\n",
+			(opts.discard ? " (by discarding it)" : ""));
 	if (opts.tails)
 		ntfs_log_quiet("\tfile tails\n");
 	if (opts.mft)
@@ -2095,7 +2311,8 @@ int main(int argc, char *argv[])
 					total += wiped;
 			}
 
-			if (opts.unused) {
+				/* discarding once is enough */
+			if (opts.unused && (!opts.discard || (!i && !j))) {
 				wiped = wipe_unused(vol, byte, act);
 				if (wiped < 0)
 					goto umount;
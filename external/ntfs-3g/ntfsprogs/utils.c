@@ -74,6 +74,8 @@
 #include "logging.h"
 #include "misc.h"
 
+#define UTILS_STAMP_CHUNK 65536	/* bytes of bitmaps hashed per read */
+
 const char *ntfs_bugs = "Developers' email address: "NTFS_DEV_LIST"\n";
 const char *ntfs_gpl = "This program is free software, released under the GNU "
 	"General Public License\nand you are welcome to redistribute it under "
@@ -816,6 +818,79 @@ int utils_mftrec_in_use(ntfs_volume *vol, MFT_REF mref)
 	return (buffer[byte] & bit);
 }
 
+/*
+ *		Hash some bytes into a running FNV-1a hash
+ */
+
+static u64 utils_hash64(u64 hash, const void *buf, size_t size)
+{
+	const u8 *p;
+
+	for (p=(const u8*)buf; size; size--) {
+		hash ^= *p++;
+		hash *= 0x100000001b3ULL;
+	}
+	return (hash);
+}
+
+/**
+ * utils_allocation_stamp - Get a stamp of the allocations on a volume
+ * @vol:    An ntfs volume obtained from ntfs_mount
+ * @stamp:  Where to return the stamp
+ *
+ * The stamp is a hash of the volume size, of $Bitmap and of $MFT/$BITMAP.
+ * It changes whenever clusters or MFT records are allocated or freed, so
+ * that information about a volume saved into a side file can be checked
+ * to be still valid.
+ *
+ * Return:  0  Success
+ *	   -1  Error, the bitmaps could not be read
+ */
+int utils_allocation_stamp(ntfs_volume *vol, u64 *stamp)
+{
+	ntfs_attr *bitmaps[2];
+	ntfs_attr *na;
+	u8 *buf;
+	le64 size;
+	s64 pos;
+	s64 got;
+	u64 hash;
+	int err;
+	int i;
+
+	if (!vol || !stamp) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	buf = (u8*)malloc(UTILS_STAMP_CHUNK);
+	if (!buf)
+		return -1;
+
+	err = 0;
+	size = cpu_to_le64(vol->nr_clusters);
+	hash = utils_hash64(0xcbf29ce484222325ULL, &size, sizeof(size));
+	bitmaps[0] = vol->lcnbmp_na;
+	bitmaps[1] = vol->mftbmp_na;
+	for (i=0; !err && (i<2); i++) {
+		na = bitmaps[i];
+		for (pos=0; !err && (pos < na->data_size); pos+=got) {
+			got = na->data_size - pos;
+			if (got > UTILS_STAMP_CHUNK)
+				got = UTILS_STAMP_CHUNK;
+			got = ntfs_attr_pread(na, pos, got, buf);
+			if (got <= 0) {
+				ntfs_log_perror("Couldn't read the bitmaps");
+				err = -1;
+			} else
+				hash = utils_hash64(hash, buf, got);
+		}
+	}
+	free(buf);
+	*stamp = hash;
+	return err;
+}
+
 /**
  * __metadata
  */
@@ -48,6 +48,7 @@ int utils_inode_get_name(ntfs_inode *inode, char *buffer, int bufsize);
 int utils_attr_get_name(ntfs_volume *vol, ATTR_RECORD *attr, char *buffer, int bufsize);
 int utils_cluster_in_use(ntfs_volume *vol, long long lcn);
 int utils_mftrec_in_use(ntfs_volume *vol, MFT_REF mref);
+int utils_allocation_stamp(ntfs_volume *vol, u64 *stamp);
 int utils_is_metadata(ntfs_inode *inode);
 void utils_dump_mem(void *buf, int start, int length, int flags);
 
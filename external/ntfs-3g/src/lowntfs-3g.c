@@ -65,6 +65,7 @@
 #endif
 #include <syslog.h>
 #include <sys/wait.h>
+#include <pthread.h>
 
 #ifdef HAVE_SETXATTR
 #include <sys/xattr.h>
@@ -97,6 +98,8 @@
 #include "logging.h"
 #include "xattrs.h"
 #include "misc.h"
+#include "device_io.h"
+#include "cache.h"
 
 #include "ntfs-3g_common.h"
 
@@ -120,9 +123,29 @@
 #warning "Fuse cacheing is only usable with basic permissions checked by kernel"
 #endif
 
+/*	may notify the kernel about changes it cannot see */
+#if defined(FUSE_INTERNAL) || (FUSE_VERSION >= 28)
+#define NOTIFYING 1
+#else
+#define NOTIFYING 0
+#endif
+
 #if !CACHEING
+#if NOTIFYING
+	/*
+	 * When there is no user mapping, no access check is made here,
+	 * and the kernel may keep the attributes and entries it gets,
+	 * being notified about the changes it cannot see. This is not
+	 * possible when ignoring case, as the kernel cannot know the
+	 * aliases of a name (see ntfs_fuse_is_alias())
+	 */
+#define ATTR_TIMEOUT (ctx->security.mapping[MAPUSERS] ? 0.0 : CACHE_TIMEOUT)
+#define ENTRY_TIMEOUT (ctx->security.mapping[MAPUSERS] || ctx->ignore_case \
+				? 0.0 : CACHE_TIMEOUT)
+#else
 #define ATTR_TIMEOUT 0.0
 #define ENTRY_TIMEOUT 0.0
+#endif
 #else
 	/*
 	 * FUSE cacheing is only usable with basic permissions
@@ -165,6 +188,7 @@ typedef struct fill_context {
 	fuse_req_t req;
 	fuse_ino_t ino;
 	BOOL filled;
+	BOOL plus;
 } ntfs_fuse_fill_context_t;
 
 struct open_file {
@@ -578,14 +602,100 @@ static void ntfs_init(void *userdata __attribute__((unused)),
 	conn->want |= FUSE_CAP_DONT_MASK;
 #endif /* defined FUSE_CAP_DONT_MASK */
 #ifdef FUSE_CAP_BIG_WRITES
-	if (ctx->big_writes
-	    && ((ctx->vol->nr_clusters << ctx->vol->cluster_size_bits)
-			>= SAFE_CAPACITY_FOR_BIG_WRITES))
-		conn->want |= FUSE_CAP_BIG_WRITES;
+		/* the writeback cache also leads to big writes */
+	if (ctx->big_writes || ctx->writeback_cache) {
+		conn->max_write = ntfs_safe_max_write(ctx->vol,
+					conn->max_write);
+		if (ctx->big_writes && (conn->max_write > MIN_WRITE_SIZE))
+			conn->want |= FUSE_CAP_BIG_WRITES;
+	}
+#endif
+#ifdef FUSE_CAP_WRITEBACK_CACHE
+		/*
+		 * Raw encrypted data has to be written as received,
+		 * not through read-modify-write of cached pages.
+		 */
+	if (ctx->writeback_cache
+	    && (conn->capable & FUSE_CAP_WRITEBACK_CACHE)
+#ifdef HAVE_SETXATTR
+	    && !ctx->efs_raw
+#endif
+	    )
+		conn->want |= FUSE_CAP_WRITEBACK_CACHE;
+	else
+		ctx->writeback_cache = FALSE;
+#if defined(HAVE_STRUCT_STAT_ST_ATIMESPEC) \
+		|| defined(HAVE_STRUCT_STAT_ST_ATIM) \
+		|| defined(HAVE_STRUCT_STAT_ST_ATIMENSEC)
+	conn->time_gran = 100; /* the NTFS time unit */
+#else
+	conn->time_gran = 1000000000; /* nanoseconds are not transmitted */
+#endif
+#endif
+#ifdef FUSE_CAP_PARALLEL_DIROPS
+		/* requests are processed one at a time anyway */
+	conn->want |= FUSE_CAP_PARALLEL_DIROPS;
+#endif
+#ifdef FUSE_CAP_READDIRPLUS
+		/* only useful when the kernel may keep the entries */
+	if (ENTRY_TIMEOUT > 0.0)
+		conn->want |= FUSE_CAP_READDIRPLUS;
+#endif
+#ifdef FUSE_CAP_SPLICE_WRITE
+		/* splice big reads when the device can be accessed directly */
+	if ((conn->capable & FUSE_CAP_SPLICE_WRITE)
+	    && (ntfs_device_unix_io_fd(ctx->vol->dev) >= 0)) {
+		conn->want |= FUSE_CAP_SPLICE_WRITE;
+		ctx->splice_read = TRUE;
+	}
 #endif
 }
 #endif /* defined(FUSE_CAP_DONT_MASK) || (defined(__APPLE__) || defined(__DARWIN__)) */
 
+/*
+ *		Set the times in a stat structure
+ */
+
+static void ntfs_fuse_fill_times(struct stat *stbuf, ntfs_time atime,
+			ntfs_time ctime, ntfs_time mtime)
+{
+#ifdef HAVE_STRUCT_STAT_ST_ATIMESPEC
+	stbuf->st_atimespec = ntfs2timespec(atime);
+	stbuf->st_ctimespec = ntfs2timespec(ctime);
+	stbuf->st_mtimespec = ntfs2timespec(mtime);
+#elif defined(HAVE_STRUCT_STAT_ST_ATIM)
+	stbuf->st_atim = ntfs2timespec(atime);
+	stbuf->st_ctim = ntfs2timespec(ctime);
+	stbuf->st_mtim = ntfs2timespec(mtime);
+#elif defined(HAVE_STRUCT_STAT_ST_ATIMENSEC)
+	{
+	struct timespec ts;
+
+	ts = ntfs2timespec(atime);
+	stbuf->st_atime = ts.tv_sec;
+	stbuf->st_atimensec = ts.tv_nsec;
+	ts = ntfs2timespec(ctime);
+	stbuf->st_ctime = ts.tv_sec;
+	stbuf->st_ctimensec = ts.tv_nsec;
+	ts = ntfs2timespec(mtime);
+	stbuf->st_mtime = ts.tv_sec;
+	stbuf->st_mtimensec = ts.tv_nsec;
+	}
+#else
+#warning "No known way to set nanoseconds in struct stat !"
+	{
+	struct timespec ts;
+
+	ts = ntfs2timespec(atime);
+	stbuf->st_atime = ts.tv_sec;
+	ts = ntfs2timespec(ctime);
+	stbuf->st_ctime = ts.tv_sec;
+	ts = ntfs2timespec(mtime);
+	stbuf->st_mtime = ts.tv_sec;
+	}
+#endif
+}
+
 static int ntfs_fuse_getstat(struct SECURITY_CONTEXT *scx,
 				ntfs_inode *ni, struct stat *stbuf)
 {
@@ -741,41 +851,8 @@ static int ntfs_fuse_getstat(struct SECURITY_CONTEXT *scx,
 		stbuf->st_mode |= 0777;
 nodata :
 	stbuf->st_ino = ni->mft_no;
-#ifdef HAVE_STRUCT_STAT_ST_ATIMESPEC
-	stbuf->st_atimespec = ntfs2timespec(ni->last_access_time);
-	stbuf->st_ctimespec = ntfs2timespec(ni->last_mft_change_time);
-	stbuf->st_mtimespec = ntfs2timespec(ni->last_data_change_time);
-#elif defined(HAVE_STRUCT_STAT_ST_ATIM)
-	stbuf->st_atim = ntfs2timespec(ni->last_access_time);
-	stbuf->st_ctim = ntfs2timespec(ni->last_mft_change_time);
-	stbuf->st_mtim = ntfs2timespec(ni->last_data_change_time);
-#elif defined(HAVE_STRUCT_STAT_ST_ATIMENSEC)
-	{
-	struct timespec ts;
-
-	ts = ntfs2timespec(ni->last_access_time);
-	stbuf->st_atime = ts.tv_sec;
-	stbuf->st_atimensec = ts.tv_nsec;
-	ts = ntfs2timespec(ni->last_mft_change_time);
-	stbuf->st_ctime = ts.tv_sec;
-	stbuf->st_ctimensec = ts.tv_nsec;
-	ts = ntfs2timespec(ni->last_data_change_time);
-	stbuf->st_mtime = ts.tv_sec;
-	stbuf->st_mtimensec = ts.tv_nsec;
-	}
-#else
-#warning "No known way to set nanoseconds in struct stat !"
-	{
-	struct timespec ts;
-
-	ts = ntfs2timespec(ni->last_access_time);
-	stbuf->st_atime = ts.tv_sec;
-	ts = ntfs2timespec(ni->last_mft_change_time);
-	stbuf->st_ctime = ts.tv_sec;
-	ts = ntfs2timespec(ni->last_data_change_time);
-	stbuf->st_mtime = ts.tv_sec;
-	}
-#endif
+	ntfs_fuse_fill_times(stbuf, ni->last_access_time,
+			ni->last_mft_change_time, ni->last_data_change_time);
 exit:
 	return (res);
 }
@@ -803,19 +880,260 @@ static void ntfs_fuse_getattr(fuse_req_t req, fuse_ino_t ino,
 		fuse_reply_err(req, -res);
 }
 
-static __inline__ BOOL ntfs_fuse_fillstat(struct SECURITY_CONTEXT *scx,
-			struct fuse_entry_param *pentry, u64 iref)
+#if NOTIFYING
+
+/*
+ *		Notifications to the kernel
+ *
+ *	Cached attributes may be invalidated at any time, but the kernel
+ *	locks the parent directory when invalidating an entry, and it
+ *	may be holding this lock while waiting for the reply to a
+ *	request. So the entries are invalidated by a separate thread,
+ *	while the requests go on being processed.
+ */
+
+struct NOTIFIED_ENTRY {
+	struct NOTIFIED_ENTRY *next;
+	fuse_ino_t parent;
+	size_t namelen;
+	char name[1];
+} ;
+
+static struct {
+	pthread_mutex_t lock;
+	pthread_cond_t wakeup;
+	pthread_t thread;
+	struct NOTIFIED_ENTRY *first;
+	struct NOTIFIED_ENTRY *last;
+	BOOL started;
+	BOOL stopping;
+} notifier = {
+	.lock = PTHREAD_MUTEX_INITIALIZER,
+	.wakeup = PTHREAD_COND_INITIALIZER,
+} ;
+
+static void *ntfs_fuse_notifier(void *arg __attribute__((unused)))
+{
+	struct NOTIFIED_ENTRY *entry;
+
+	do {
+		pthread_mutex_lock(&notifier.lock);
+		while (!notifier.first && !notifier.stopping)
+			pthread_cond_wait(&notifier.wakeup, &notifier.lock);
+		entry = notifier.first;
+		if (entry) {
+			notifier.first = entry->next;
+			if (!entry->next)
+				notifier.last = (struct NOTIFIED_ENTRY*)NULL;
+		}
+		pthread_mutex_unlock(&notifier.lock);
+		if (entry) {
+			/* the entry may not be cached, ignore errors */
+			fuse_lowlevel_notify_inval_entry(ctx->fc,
+					entry->parent, entry->name,
+					entry->namelen);
+			free(entry);
+		}
+	} while (entry);
+	return ((void*)NULL);
+}
+
+/*
+ *		Stop the notifier thread, after sending the pending
+ *	notifications
+ */
+
+static void ntfs_fuse_stop_notifier(void)
+{
+	BOOL started;
+
+	pthread_mutex_lock(&notifier.lock);
+	notifier.stopping = TRUE;
+	started = notifier.started;
+	pthread_cond_signal(&notifier.wakeup);
+	pthread_mutex_unlock(&notifier.lock);
+	if (started)
+		pthread_join(notifier.thread, (void**)NULL);
+}
+
+/*
+ *		Queue the invalidation of the entry for a file name
+ *
+ *	The notifier thread is started on first use, which only
+ *	happens when a file is unlinked through an alias.
+ */
+
+static void ntfs_fuse_inval_entry(fuse_ino_t parent,
+			const FILE_NAME_ATTR *fn)
+{
+	struct NOTIFIED_ENTRY *entry;
+	char *name;
+	int namelen;
+
+	name = (char*)NULL;
+	namelen = ntfs_ucstombs(ntfs_fn_name(fn), fn->file_name_length,
+				&name, 0);
+	if (ctx->fc && (namelen > 0)) {
+		entry = (struct NOTIFIED_ENTRY*)ntfs_malloc(
+				sizeof(struct NOTIFIED_ENTRY) + namelen);
+		if (entry) {
+			entry->next = (struct NOTIFIED_ENTRY*)NULL;
+			entry->parent = parent;
+			entry->namelen = namelen;
+			memcpy(entry->name, name, namelen + 1);
+			pthread_mutex_lock(&notifier.lock);
+			if (!notifier.started && !notifier.stopping)
+				notifier.started = !pthread_create(
+					&notifier.thread,
+					(pthread_attr_t*)NULL,
+					ntfs_fuse_notifier, (void*)NULL);
+			if (notifier.started && !notifier.stopping) {
+				if (notifier.last)
+					notifier.last->next = entry;
+				else
+					notifier.first = entry;
+				notifier.last = entry;
+				pthread_cond_signal(&notifier.wakeup);
+			} else
+				free(entry);
+			pthread_mutex_unlock(&notifier.lock);
+		}
+	}
+	free(name);
+}
+
+/*
+ *		Invalidate the attributes of an inode
+ *
+ *	This is needed when they are changed by something the kernel
+ *	does not know about, such as a delayed update or the removal
+ *	of a ghost file.
+ */
+
+static void ntfs_fuse_inval_inode(fuse_ino_t ino)
+{
+	/* the inode may not be cached, ignore errors */
+	if (ctx->fc && (ATTR_TIMEOUT > 0.0))
+		fuse_lowlevel_notify_inval_inode(ctx->fc, ino, -1, 0);
+}
+
+#else /* NOTIFYING */
+
+static void ntfs_fuse_stop_notifier(void) { }
+
+static void ntfs_fuse_inval_entry(fuse_ino_t parent __attribute__((unused)),
+			const FILE_NAME_ATTR *fn __attribute__((unused)))
+{
+}
+
+static void ntfs_fuse_inval_inode(fuse_ino_t ino __attribute__((unused)))
+{
+}
+
+#endif /* NOTIFYING */
+
+/*
+ *		Check whether a name used for reaching a file is an alias
+ *
+ *	A file may be reached through its DOS name, which readdir does
+ *	not show, and which disappears when the file is unlinked through
+ *	its long name, and conversely. The kernel cannot know this, so
+ *	it must not keep the entries for aliases.
+ *
+ *	Returns TRUE unless the name is a non-DOS name of the file in
+ *	the directory, or if there is an error
+ */
+
+static BOOL ntfs_fuse_is_alias(ntfs_inode *ni, u64 dir_mref,
+			const ntfschar *uname, int uname_len)
+{
+	ntfs_attr_search_ctx *actx;
+	const FILE_NAME_ATTR *fn;
+	BOOL alias;
+
+	alias = TRUE;
+	actx = ntfs_attr_get_search_ctx(ni, NULL);
+	if (actx) {
+		while (alias
+		    && !ntfs_attr_lookup(AT_FILE_NAME, AT_UNNAMED, 0,
+				CASE_SENSITIVE, 0, NULL, 0, actx)) {
+			fn = (const FILE_NAME_ATTR*)((u8*)actx->attr +
+				le16_to_cpu(actx->attr->value_offset));
+			if ((fn->file_name_type != FILE_NAME_DOS)
+			    && (MREF_LE(fn->parent_directory) == MREF(dir_mref))
+			    && (fn->file_name_length == uname_len)
+			    && !memcmp(fn->file_name, uname,
+					uname_len*sizeof(ntfschar)))
+				alias = FALSE;
+		}
+		ntfs_attr_put_search_ctx(actx);
+	}
+	return (alias);
+}
+
+/*
+ *		Invalidate the names of a file in a directory
+ *
+ *	When a file is unlinked through an alias, the kernel does not
+ *	know which of its entries have to be dropped. A name of another
+ *	link in the same directory may be invalidated needlessly, this
+ *	only costs a new lookup.
+ */
+
+static void ntfs_fuse_inval_names(ntfs_inode *ni, u64 dir_mref,
+			fuse_ino_t parent)
+{
+	ntfs_attr_search_ctx *actx;
+	const FILE_NAME_ATTR *fn;
+
+	actx = ntfs_attr_get_search_ctx(ni, NULL);
+	if (actx) {
+		while (!ntfs_attr_lookup(AT_FILE_NAME, AT_UNNAMED, 0,
+				CASE_SENSITIVE, 0, NULL, 0, actx)) {
+			fn = (const FILE_NAME_ATTR*)((u8*)actx->attr +
+				le16_to_cpu(actx->attr->value_offset));
+			if ((fn->file_name_type != FILE_NAME_DOS)
+			    && (MREF_LE(fn->parent_directory) == MREF(dir_mref)))
+				ntfs_fuse_inval_entry(parent, fn);
+		}
+		ntfs_attr_put_search_ctx(actx);
+	}
+}
+
+/*
+ *		Fill the entry for a name
+ *
+ *	The kernel is not allowed to keep the entry if the name is
+ *	an alias of the file in directory dir_mref. No name means
+ *	the name is known to be listed by readdir.
+ */
+
+static BOOL ntfs_fuse_fillstat(struct SECURITY_CONTEXT *scx,
+			struct fuse_entry_param *pentry, u64 iref,
+			const char *name, u64 dir_mref)
 {
 	ntfs_inode *ni;
+	ntfschar *uname;
+	int uname_len;
 	BOOL ok = FALSE;
 
 	pentry->ino = MREF(iref);
 	ni = ntfs_inode_open(ctx->vol, pentry->ino);
 	if (ni) {
 		if (!ntfs_fuse_getstat(scx, ni, &pentry->attr)) {
-			pentry->generation = 1;
+			pentry->generation = le16_to_cpu(
+					ni->mrec->sequence_number);
 			pentry->attr_timeout = ATTR_TIMEOUT;
 			pentry->entry_timeout = ENTRY_TIMEOUT;
+			if (name && (pentry->entry_timeout > 0.0)) {
+				uname = (ntfschar*)NULL;
+				uname_len = ntfs_mbstoucs(name, &uname);
+				if ((uname_len <= 0)
+				    || ntfs_fuse_is_alias(ni, dir_mref,
+						uname, uname_len))
+					pentry->entry_timeout = 0.0;
+				free(uname);
+			}
 			ok = TRUE;
 		}
 		if (ntfs_inode_close(ni))
@@ -849,6 +1167,16 @@ static void ntfs_fuse_lookup(fuse_req_t req, fuse_ino_t parent,
 #else
 				ntfs_fuse_fill_security_context(req, &security);
 #endif
+					/*
+					 * A directory listed without the
+					 * attributes is now being looked
+					 * into, the next lookups will
+					 * probably be about other entries.
+					 */
+				if (ctx->prefetch_dir == parent) {
+					ctx->prefetch_dir = 0;
+					ntfs_dir_prefetch(dir_ni);
+				}
 				iref = ntfs_inode_lookup_by_mbsname(dir_ni,
 								name);
 					/* never return inodes 0 and 1 */
@@ -858,8 +1186,9 @@ static void ntfs_fuse_lookup(fuse_req_t req, fuse_ino_t parent,
 				}
 				ok = !ntfs_inode_close(dir_ni)
 					&& (iref != (u64)-1)
-					&& ntfs_fuse_fillstat(
-						&security,&entry,iref);
+					&& ntfs_fuse_fillstat(&security,
+						&entry, iref, name,
+						INODE(parent));
 #if !KERNELPERMS | (POSIXACLS & !KERNELACLS)
 			}
 #endif
@@ -960,12 +1289,103 @@ exit:
 		free(buf);
 }
 
+#ifdef FUSE_CAP_READDIRPLUS
+
+/*
+ *		Fill the attributes of a directory entry for readdirplus
+ *
+ *	The file name attribute in the index holds a copy of the sizes
+ *	and times of the file, which this mount keeps up to date, but the
+ *	link count is missing, and Windows only updates the name it
+ *	used when a file has several ones. So these attributes are only
+ *	given as a hint which the kernel does not keep, though the entry
+ *	itself is cached, so that no lookup is needed before a getattr.
+ *
+ *	When the index does not tell the type of the file (reparse
+ *	points, Interix files or metadata), the inode is opened, and the
+ *	attributes are those a lookup would return, and they are cached.
+ *
+ *	"." and ".." are not entered by the kernel, nor entries for
+ *	which the inode cannot be read.
+ */
+
+static void ntfs_fuse_fill_plus(struct fuse_entry_param *e,
+		const MFT_REF mref, const FILE_NAME_ATTR *fn)
+{
+	struct SECURITY_CONTEXT security;
+	struct stat *st;
+	mode_t mode;
+
+	st = &e->attr;
+	if (!fn)
+		e->ino = 0;
+	else
+		if ((MREF(mref) >= FILE_first_user)
+		    && !(fn->file_attributes
+			& (FILE_ATTR_REPARSE_POINT | FILE_ATTR_SYSTEM))) {
+			e->ino = MREF(mref);
+			e->generation = MSEQNO(mref);
+			e->entry_timeout = ENTRY_TIMEOUT;
+			e->attr_timeout = 0.0;
+			st->st_uid = ctx->uid;
+			st->st_gid = ctx->gid;
+			st->st_nlink = 1;
+			st->st_size = sle64_to_cpu(fn->data_size);
+			st->st_blocks = (sle64_to_cpu(fn->allocated_size)
+						+ 511) >> 9;
+			ntfs_fuse_fill_times(st, fn->last_access_time,
+					fn->last_mft_change_time,
+					fn->last_data_change_time);
+		} else {
+			mode = st->st_mode;
+			ntfs_fuse_fill_security_context((fuse_req_t)NULL,
+					&security);
+			if (!ntfs_fuse_fillstat(&security, e, mref,
+					(const char*)NULL, 0)) {
+				memset(e, 0, sizeof(struct fuse_entry_param));
+				st->st_ino = MREF(mref);
+				st->st_mode = mode;
+			}
+		}
+}
+
+#endif /* FUSE_CAP_READDIRPLUS */
+
+/*
+ *		Add an entry to a directory buffer
+ *
+ *	Returns the size of the entry, which is bigger than the
+ *	space left if it was not added
+ */
+
+static size_t ntfs_fuse_add_entry(ntfs_fuse_fill_context_t *fill_ctx,
+		ntfs_fuse_fill_item_t *current, const char *filename,
+		const struct fuse_entry_param *e)
+{
+	size_t sz;
+
+#ifdef FUSE_CAP_READDIRPLUS
+	if (fill_ctx->plus)
+		sz = fuse_add_direntry_plus(fill_ctx->req,
+				&current->buf[current->off],
+				current->bufsize - current->off,
+				filename, e, current->off);
+	else
+#endif
+		sz = fuse_add_direntry(fill_ctx->req,
+				&current->buf[current->off],
+				current->bufsize - current->off,
+				filename, &e->attr, current->off);
+	return (sz);
+}
+
 static int ntfs_fuse_filler(ntfs_fuse_fill_context_t *fill_ctx,
 		const ntfschar *name, const int name_len, const int name_type,
 		const s64 pos __attribute__((unused)), const MFT_REF mref,
-		const unsigned dt_type __attribute__((unused)))
+		const unsigned dt_type, const FILE_NAME_ATTR *fn)
 {
-	char *filename = NULL;
+	char filebuf[NTFS_MAX_NAME_LEN*3 + 1];
+	char *filename;
 	int ret = 0;
 	int filenamelen = -1;
 	size_t sz;
@@ -975,39 +1395,54 @@ static int ntfs_fuse_filler(ntfs_fuse_fill_context_t *fill_ctx,
 	if (name_type == FILE_NAME_DOS)
 		return 0;
         
-	if ((filenamelen = ntfs_ucstombs(name, name_len, &filename, 0)) < 0) {
+		/* UTF-8 names always fit in the buffer, avoid allocating */
+	filename = filebuf;
+	filenamelen = ntfs_ucstombs(name, name_len, &filename,
+				sizeof(filebuf) - 1);
+	if ((filenamelen < 0) && (errno == ENAMETOOLONG)) {
+		filename = (char*)NULL;
+		filenamelen = ntfs_ucstombs(name, name_len, &filename, 0);
+	}
+	if (filenamelen < 0) {
 		ntfs_log_perror("Filename decoding failed (inode %llu)",
 				(unsigned long long)MREF(mref));
 		return -1;
 	}
 		/* never return inodes 0 and 1 */
 	if (MREF(mref) > 1) {
-		struct stat st = { .st_ino = MREF(mref) };
-		 
+		struct fuse_entry_param e;
+		struct stat *st = &e.attr;
+
+		memset(&e, 0, sizeof(e));
+		st->st_ino = MREF(mref);
 		switch (dt_type) {
 		case NTFS_DT_DIR :
-			st.st_mode = S_IFDIR | (0777 & ~ctx->dmask); 
+			st->st_mode = S_IFDIR | (0777 & ~ctx->dmask); 
 			break;
 		case NTFS_DT_LNK :
-			st.st_mode = S_IFLNK | 0777;
+			st->st_mode = S_IFLNK | 0777;
 			break;
 		case NTFS_DT_FIFO :
-			st.st_mode = S_IFIFO;
+			st->st_mode = S_IFIFO;
 			break;
 		case NTFS_DT_SOCK :
-			st.st_mode = S_IFSOCK;
+			st->st_mode = S_IFSOCK;
 			break;
 		case NTFS_DT_BLK :
-			st.st_mode = S_IFBLK;
+			st->st_mode = S_IFBLK;
 			break;
 		case NTFS_DT_CHR :
-			st.st_mode = S_IFCHR;
+			st->st_mode = S_IFCHR;
 			break;
 		default : /* unexpected types shown as plain files */
 		case NTFS_DT_REG :
-			st.st_mode = S_IFREG | (0777 & ~ctx->fmask);
+			st->st_mode = S_IFREG | (0777 & ~ctx->fmask);
 			break;
 		}
+#ifdef FUSE_CAP_READDIRPLUS
+		if (fill_ctx->plus)
+			ntfs_fuse_fill_plus(&e, mref, fn);
+#endif
 	        
 #if defined(__APPLE__) || defined(__DARWIN__)
 		/* 
@@ -1024,10 +1459,7 @@ static int ntfs_fuse_filler(ntfs_fuse_fill_context_t *fill_ctx,
 #endif /* defined(__APPLE__) || defined(__DARWIN__) */
 	
 		current = fill_ctx->last;
-		sz = fuse_add_direntry(fill_ctx->req,
-				&current->buf[current->off],
-				current->bufsize - current->off,
-				filename, &st, current->off);
+		sz = ntfs_fuse_add_entry(fill_ctx, current, filename, &e);
 		if (!sz || ((current->off + sz) > current->bufsize)) {
 			newone = (ntfs_fuse_fill_item_t*)ntfs_malloc
 				(sizeof(ntfs_fuse_fill_item_t)
@@ -1039,11 +1471,10 @@ static int ntfs_fuse_filler(ntfs_fuse_fill_context_t *fill_ctx,
 				current->next = newone;
 				fill_ctx->last = newone;
 				current = newone;
-				sz = fuse_add_direntry(fill_ctx->req,
-					current->buf,
-					current->bufsize - current->off,
-					filename, &st, current->off);
-				if (!sz) {
+				sz = ntfs_fuse_add_entry(fill_ctx, current,
+					filename, &e);
+				if (!sz || (sz > current->bufsize)) {
+					sz = 0;
 					errno = EIO;
 					ntfs_log_error("Could not add a"
 						" directory entry (inode %lld)\n",
@@ -1061,7 +1492,8 @@ static int ntfs_fuse_filler(ntfs_fuse_fill_context_t *fill_ctx,
 		}
 	}
         
-	free(filename);
+	if (filename != filebuf)
+		free(filename);
 	return ret;
 }
 
@@ -1133,9 +1565,16 @@ static void ntfs_fuse_releasedir(fuse_req_t req,
 	fuse_reply_err(req, 0);
 }
 
-static void ntfs_fuse_readdir(fuse_req_t req, fuse_ino_t ino, size_t size,
-			off_t off __attribute__((unused)),
-			struct fuse_file_info *fi __attribute__((unused)))
+/*
+ *		Common code for readdir and readdirplus
+ *
+ *	The full directory is listed on the first call, with the
+ *	attributes of entries if plus is set, and the next calls
+ *	return the buffers built.
+ */
+
+static void ntfs_fuse_filldir(fuse_req_t req, fuse_ino_t ino, size_t size,
+			struct fuse_file_info *fi, BOOL plus)
 {
 	ntfs_fuse_fill_item_t *first;
 	ntfs_fuse_fill_item_t *current;
@@ -1157,15 +1596,19 @@ static void ntfs_fuse_readdir(fuse_req_t req, fuse_ino_t ino, size_t size,
 				fill->req = req;
 				fill->first = first;
 				fill->last = first;
+				fill->plus = plus;
 				ni = ntfs_inode_open(ctx->vol,INODE(ino));
 				if (!ni)
 					err = -errno;
 				else {
-					if (ntfs_readdir(ni, &pos, fill,
-						(ntfs_filldir_t)
+					if (ntfs_readdir_plus(ni, &pos, fill,
+						(ntfs_filldir_plus_t)
 							ntfs_fuse_filler))
 						err = -errno;
 					fill->filled = TRUE;
+						/* prefetch on first lookup */
+					if (!plus)
+						ctx->prefetch_dir = ino;
 					ntfs_fuse_update_times(ni,
 						NTFS_UPDATE_ATIME);
 					if (ntfs_inode_close(ni))
@@ -1205,6 +1648,22 @@ static void ntfs_fuse_readdir(fuse_req_t req, fuse_ino_t ino, size_t size,
 		fuse_reply_err(req, -err);
 }
 
+static void ntfs_fuse_readdir(fuse_req_t req, fuse_ino_t ino, size_t size,
+			off_t off __attribute__((unused)),
+			struct fuse_file_info *fi)
+{
+	ntfs_fuse_filldir(req, ino, size, fi, FALSE);
+}
+
+#ifdef FUSE_CAP_READDIRPLUS
+static void ntfs_fuse_readdirplus(fuse_req_t req, fuse_ino_t ino,
+			size_t size, off_t off __attribute__((unused)),
+			struct fuse_file_info *fi)
+{
+	ntfs_fuse_filldir(req, ino, size, fi, TRUE);
+}
+#endif /* FUSE_CAP_READDIRPLUS */
+
 static void ntfs_fuse_open(fuse_req_t req, fuse_ino_t ino,
 		      struct fuse_file_info *fi)
 {
@@ -1285,6 +1744,43 @@ static void ntfs_fuse_open(fuse_req_t req, fuse_ino_t ino,
 		fuse_reply_open(req, fi);
 }
 
+#ifdef FUSE_CAP_SPLICE_WRITE
+
+/*
+ *		Get the device position of a range of data
+ *
+ *	The range can be spliced from the device if it is located in
+ *	a single run of clusters, is fully initialized and is neither
+ *	compressed nor encrypted.
+ *
+ *	Returns the position on device, or -1 if the range cannot
+ *	be spliced.
+ */
+
+static s64 ntfs_fuse_splice_pos(ntfs_attr *na, s64 offset, s64 size)
+{
+	const ntfs_volume *vol;
+	runlist_element *rl;
+	s64 pos;
+
+	pos = -1;
+	vol = na->ni->vol;
+	if (NAttrNonResident(na)
+	    && !(na->data_flags & (ATTR_COMPRESSION_MASK | ATTR_IS_ENCRYPTED))
+	    && ((offset + size) <= na->initialized_size)) {
+		rl = ntfs_attr_find_vcn(na, offset >> vol->cluster_size_bits);
+		if (rl
+		    && (rl->lcn >= 0)
+		    && ((offset + size)
+			<= ((rl->vcn + rl->length) << vol->cluster_size_bits)))
+			pos = (rl->lcn << vol->cluster_size_bits)
+				+ offset - (rl->vcn << vol->cluster_size_bits);
+	}
+	return (pos);
+}
+
+#endif /* FUSE_CAP_SPLICE_WRITE */
+
 static void ntfs_fuse_read(fuse_req_t req, fuse_ino_t ino, size_t size,
 			off_t offset,
 			struct fuse_file_info *fi __attribute__((unused)))
@@ -1295,16 +1791,12 @@ static void ntfs_fuse_read(fuse_req_t req, fuse_ino_t ino, size_t size,
 	char *buf = (char*)NULL;
 	s64 total = 0;
 	s64 max_read;
+	s64 devpos = -1;
 
 	if (!size) {
 		res = 0;
 		goto exit;
 	}
-	buf = (char*)ntfs_malloc(size);
-	if (!buf) {
-		res = -errno;
-		goto exit;
-	}
 
 	ni = ntfs_inode_open(ctx->vol, INODE(ino));
 	if (!ni) {
@@ -1331,6 +1823,31 @@ static void ntfs_fuse_read(fuse_req_t req, fuse_ino_t ino, size_t size,
 			goto ok;
 		size = max_read - offset;
 	}
+#ifdef FUSE_CAP_SPLICE_WRITE
+	if (ctx->splice_read && (size >= MIN_SPLICED_READ)) {
+		devpos = ntfs_fuse_splice_pos(na, offset, size);
+		if (devpos >= 0) {
+				/* data will be spliced when replying */
+			total = size;
+			goto ok;
+		}
+	}
+#endif
+		/*
+		 * Requests are processed one at a time, so the buffer
+		 * is kept for next reads, only growing when needed.
+		 */
+	if (size > ctx->read_buf_size) {
+		buf = (char*)ntfs_malloc(size);
+		if (!buf) {
+			res = -errno;
+			goto exit;
+		}
+		free(ctx->read_buf);
+		ctx->read_buf = buf;
+		ctx->read_buf_size = size;
+	}
+	buf = ctx->read_buf;
 	while (size > 0) {
 		s64 ret = ntfs_attr_pread(na, offset, size, buf + total);
 		if (ret != (s64)size)
@@ -1355,9 +1872,13 @@ exit:
 		set_fuse_error(&res);
 	if (res < 0)
 		fuse_reply_err(req, -res);
+#ifdef FUSE_CAP_SPLICE_WRITE
+	else if (devpos >= 0)
+		fuse_reply_data(req, ntfs_device_unix_io_fd(ctx->vol->dev),
+				devpos, res);
+#endif
 	else
 		fuse_reply_buf(req, buf, res);
-	free(buf);
 }
 
 static void ntfs_fuse_write(fuse_req_t req, fuse_ino_t ino, const char *buf, 
@@ -1705,6 +2226,48 @@ static int ntfs_fuse_utime(struct SECURITY_CONTEXT *scx, fuse_ino_t ino,
 
 #endif /* defined(HAVE_UTIMENSAT) & defined(FUSE_SET_ATTR_ATIME_NOW) */
 
+#ifdef FUSE_CAP_WRITEBACK_CACHE
+
+/*
+ *		Set the modification time of a file being written to
+ *
+ *	With the writeback cache, the kernel owns the modification
+ *	time of files it is caching data for, and notifies it when
+ *	flushing. This is done through a file handle, so write access
+ *	was checked when the file was opened, and the access time and
+ *	the other attributes must not be changed.
+ */
+
+static int ntfs_fuse_flush_mtime(struct SECURITY_CONTEXT *scx,
+		fuse_ino_t ino, struct stat *stin, struct stat *stbuf)
+{
+	ntfs_inode *ni;
+	int res;
+	struct timespec modtime;
+
+	ni = ntfs_inode_open(ctx->vol, INODE(ino));
+	if (!ni)
+		return -errno;
+	modtime.tv_sec = stin->st_mtime;
+#ifdef HAVE_STRUCT_STAT_ST_ATIMESPEC
+	modtime.tv_nsec = stin->st_mtimespec.tv_nsec;
+#elif defined(HAVE_STRUCT_STAT_ST_ATIM)
+	modtime.tv_nsec = stin->st_mtim.tv_nsec;
+#elif defined(HAVE_STRUCT_STAT_ST_ATIMENSEC)
+	modtime.tv_nsec = stin->st_mtimensec;
+#else
+	modtime.tv_nsec = 0;
+#endif
+	ni->last_data_change_time = timespec2ntfs(modtime);
+	ntfs_fuse_update_times(ni, NTFS_UPDATE_CTIME);
+	res = ntfs_fuse_getstat(scx, ni, stbuf);
+	if (ntfs_inode_close(ni))
+		set_fuse_error(&res);
+	return res;
+}
+
+#endif /* FUSE_CAP_WRITEBACK_CACHE */
+
 static void ntfs_fuse_setattr(fuse_req_t req, fuse_ino_t ino, struct stat *attr,
 			 int to_set, struct fuse_file_info *fi __attribute__((unused)))
 {
@@ -1778,6 +2341,16 @@ static void ntfs_fuse_setattr(fuse_req_t req, fuse_ino_t ino, struct stat *attr,
 	}
 						/* some set of atime/mtime */
 	if (!res && (to_set & (FUSE_SET_ATTR_ATIME + FUSE_SET_ATTR_MTIME))) {
+#ifdef FUSE_CAP_WRITEBACK_CACHE
+		if (ctx->writeback_cache && fi
+		    && ((to_set & (FUSE_SET_ATTR_ATIME | FUSE_SET_ATTR_MTIME
+				| FUSE_SET_ATTR_ATIME_NOW
+				| FUSE_SET_ATTR_MTIME_NOW))
+				== FUSE_SET_ATTR_MTIME))
+			res = ntfs_fuse_flush_mtime(&security, ino, attr,
+						&stbuf);
+		else
+#endif /* FUSE_CAP_WRITEBACK_CACHE */
 #if defined(HAVE_UTIMENSAT) & defined(FUSE_SET_ATTR_ATIME_NOW)
 		res = ntfs_fuse_utimens(&security, ino, attr, &stbuf, to_set);
 #else /* defined(HAVE_UTIMENSAT) & defined(FUSE_SET_ATTR_ATIME_NOW) */
@@ -1957,7 +2530,7 @@ static int ntfs_fuse_create(fuse_req_t req, fuse_ino_t parent, const char *name,
 			ntfs_inode_update_mbsname(dir_ni, name, ni->mft_no);
 			NInoSetDirty(ni);
 			e->ino = ni->mft_no;
-			e->generation = 1;
+			e->generation = le16_to_cpu(ni->mrec->sequence_number);
 			e->attr_timeout = ATTR_TIMEOUT;
 			e->entry_timeout = ENTRY_TIMEOUT;
 			res = ntfs_fuse_getstat(&security, ni, &e->attr);
@@ -2096,7 +2669,7 @@ static int ntfs_fuse_newlink(fuse_req_t req __attribute__((unused)),
 		ntfs_inode_update_mbsname(dir_ni, newname, ni->mft_no);
 		if (e) {
 			e->ino = ni->mft_no;
-			e->generation = 1;
+			e->generation = le16_to_cpu(ni->mrec->sequence_number);
 			e->attr_timeout = ATTR_TIMEOUT;
 			e->entry_timeout = ENTRY_TIMEOUT;
 			res = ntfs_fuse_getstat(&security, ni, &e->attr);
@@ -2270,6 +2843,10 @@ static int ntfs_fuse_rm(fuse_req_t req, fuse_ino_t parent, const char *name,
 			goto exit;
 		}
 	}
+		/* the kernel only drops the entry for the name it used */
+	if ((ENTRY_TIMEOUT > 0.0)
+	    && ntfs_fuse_is_alias(ni, dir_ni->mft_no, uname, uname_len))
+		ntfs_fuse_inval_names(ni, dir_ni->mft_no, parent);
 	if (ntfs_delete(ctx->vol, (char*)NULL, ni, dir_ni,
 				 uname, uname_len))
 		res = -errno;
@@ -2515,12 +3092,19 @@ exit:
 		ntfs_attr_close(na);
 	if (ntfs_inode_close(ni))
 		set_fuse_error(&res);
+		/* the kernel does not know about the delayed updates */
+	if (!res)
+		ntfs_fuse_inval_inode(ino);
 out:    
 		/* remove the associate ghost file (even if release failed) */
 	if (of) {
 		if (of->state & CLOSE_GHOST) {
 			sprintf(ghostname,ghostformat,of->ghost);
-			ntfs_fuse_rm(req, of->parent, ghostname, RM_ANY);
+			if (!ntfs_fuse_rm(req, of->parent, ghostname,
+					RM_ANY)) {
+				ntfs_fuse_inval_inode(of->parent);
+				ntfs_fuse_inval_inode(ino);
+			}
 		}
 			/* remove from open files list */
 		if (of->next)
@@ -3088,18 +3672,14 @@ static void ntfs_fuse_setxattr(fuse_req_t req, fuse_ino_t ino, const char *name,
 		} else
 			res = -errno;
 #endif
-#if CACHEING && !defined(FUSE_INTERNAL)
 		/*
 		 * Most of system xattr settings cause changes to some
 		 * file attribute (st_mode, st_nlink, st_mtime, etc.),
 		 * so we must invalidate cached data when cacheing is
-		 * in use (not possible with internal fuse or external
-		 * fuse before 2.8)
+		 * in use (not possible with external fuse before 2.8)
 		 */
-		if ((res >= 0)
-		    && fuse_lowlevel_notify_inval_inode(ctx->fc, ino, -1, 0))
-			res = -errno;
-#endif
+		if (res >= 0)
+			ntfs_fuse_inval_inode(ino);
 		if (res < 0)
 			fuse_reply_err(req, -res);
 		else
@@ -3319,19 +3899,14 @@ static void ntfs_fuse_removexattr(fuse_req_t req, fuse_ino_t ino, const char *na
 			} else
 				res = -errno;
 #endif
-#if CACHEING && !defined(FUSE_INTERNAL)
 		/*
 		 * Some allowed system xattr removals cause changes to
 		 * some file attribute (st_mode, st_nlink, etc.),
 		 * so we must invalidate cached data when cacheing is
-		 * in use (not possible with internal fuse or external
-		 * fuse before 2.8)
+		 * in use (not possible with external fuse before 2.8)
 		 */
-			if ((res >= 0)
-			    && fuse_lowlevel_notify_inval_inode(ctx->fc,
-						ino, -1, 0))
-				res = -errno;
-#endif
+			if (res >= 0)
+				ntfs_fuse_inval_inode(ino);
 			break;
 		}
 		if (res < 0)
@@ -3459,12 +4034,23 @@ static void ntfs_close(void)
 			}
 		}
 		ntfs_close_secure(&security);
+		ntfs_log_info("Allocation pools : %lu inodes, %lu records, "
+			"%lu attributes, %lu contexts reused, "
+			"%lu heap allocations\n",
+			ctx->vol->inode_pool.reused,
+			ctx->vol->mrec_pool.reused,
+			ctx->vol->attr_pool.reused,
+			ctx->vol->ctx_pool.reused,
+			ntfs_heap_allocations());
 	}
         
 	if (ntfs_umount(ctx->vol, FALSE))
 		ntfs_log_perror("Failed to close volume %s", opts.device);
         
 	ctx->vol = NULL;
+	free(ctx->read_buf);
+	ctx->read_buf = (char*)NULL;
+	ctx->read_buf_size = 0;
 }
 
 static void ntfs_fuse_destroy2(void *notused __attribute__((unused)))
@@ -3478,6 +4064,9 @@ static struct fuse_lowlevel_ops ntfs_3g_ops = {
 	.readlink	= ntfs_fuse_readlink,
 	.opendir	= ntfs_fuse_opendir,
 	.readdir	= ntfs_fuse_readdir,
+#ifdef FUSE_CAP_READDIRPLUS
+	.readdirplus	= ntfs_fuse_readdirplus,
+#endif
 	.releasedir	= ntfs_fuse_releasedir,
 	.open		= ntfs_fuse_open,
 	.release	= ntfs_fuse_release,
@@ -3578,6 +4167,11 @@ static int ntfs_open(const char *device)
 
 	if (ctx->ignore_case && ntfs_set_ignore_case(vol))
 		goto err_out;
+	if ((ctx->lookup_cache >= 0)
+	    && ntfs_set_lookup_cache_size(vol, ctx->lookup_cache))
+		goto err_out;
+	if (ntfs_set_mftrec_cache_size(vol, ctx->mft_cache))
+		goto err_out;
         
 	vol->free_clusters = ntfs_attr_get_free_bits(vol->lcnbmp_na);
 	if (vol->free_clusters < 0) {
@@ -4064,6 +4658,7 @@ int main(int argc, char *argv[])
 			5 + POSIXACLS*6 - KERNELPERMS*3 + CACHEING);
         
 	fuse_session_loop(se);
+	ntfs_fuse_stop_notifier();
 	fuse_remove_signal_handlers(se);
         
 	err = 0;
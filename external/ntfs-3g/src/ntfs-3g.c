@@ -96,6 +96,7 @@
 #include "logging.h"
 #include "xattrs.h"
 #include "misc.h"
+#include "cache.h"
 
 #include "ntfs-3g_common.h"
 
@@ -654,10 +655,12 @@ static void *ntfs_init(struct fuse_conn_info *conn)
 	conn->want |= FUSE_CAP_DONT_MASK;
 #endif /* defined FUSE_CAP_DONT_MASK */
 #ifdef FUSE_CAP_BIG_WRITES
-	if (ctx->big_writes
-	    && ((ctx->vol->nr_clusters << ctx->vol->cluster_size_bits)
-			>= SAFE_CAPACITY_FOR_BIG_WRITES))
-		conn->want |= FUSE_CAP_BIG_WRITES;
+	if (ctx->big_writes) {
+		conn->max_write = ntfs_safe_max_write(ctx->vol,
+					conn->max_write);
+		if (conn->max_write > MIN_WRITE_SIZE)
+			conn->want |= FUSE_CAP_BIG_WRITES;
+	}
 #endif
 	return NULL;
 }
@@ -1001,14 +1004,23 @@ static int ntfs_fuse_filler(ntfs_fuse_fill_context_t *fill_ctx,
 		const s64 pos __attribute__((unused)), const MFT_REF mref,
 		const unsigned dt_type __attribute__((unused)))
 {
-	char *filename = NULL;
+	char filebuf[NTFS_MAX_NAME_LEN*3 + 1];
+	char *filename;
 	int ret = 0;
 	int filenamelen = -1;
 
 	if (name_type == FILE_NAME_DOS)
 		return 0;
 	
-	if ((filenamelen = ntfs_ucstombs(name, name_len, &filename, 0)) < 0) {
+		/* UTF-8 names always fit in the buffer, avoid allocating */
+	filename = filebuf;
+	filenamelen = ntfs_ucstombs(name, name_len, &filename,
+				sizeof(filebuf) - 1);
+	if ((filenamelen < 0) && (errno == ENAMETOOLONG)) {
+		filename = (char*)NULL;
+		filenamelen = ntfs_ucstombs(name, name_len, &filename, 0);
+	}
+	if (filenamelen < 0) {
 		ntfs_log_perror("Filename decoding failed (inode %llu)",
 				(unsigned long long)MREF(mref));
 		return -1;
@@ -1018,7 +1030,8 @@ static int ntfs_fuse_filler(ntfs_fuse_fill_context_t *fill_ctx,
 		ntfs_log_error("Unable to access '%s' (inode %llu) with "
 				"current named streams access interface.\n",
 				filename, (unsigned long long)MREF(mref));
-		free(filename);
+		if (filename != filebuf)
+			free(filename);
 		return 0;
 	} else {
 		struct stat st = { .st_ino = MREF(mref) };
@@ -1065,7 +1078,8 @@ static int ntfs_fuse_filler(ntfs_fuse_fill_context_t *fill_ctx,
 		ret = fill_ctx->filler(fill_ctx->buf, filename, &st, 0);
 	}
 	
-	free(filename);
+	if (filename != filebuf)
+		free(filename);
 	return ret;
 }
 
@@ -3419,6 +3433,11 @@ static int ntfs_open(const char *device)
 	if (ntfs_set_shown_files(ctx->vol, ctx->show_sys_files,
 				!ctx->hide_hid_files, ctx->hide_dot_files))
 		goto err_out;
+	if ((ctx->lookup_cache >= 0)
+	    && ntfs_set_lookup_cache_size(ctx->vol, ctx->lookup_cache))
+		goto err_out;
+	if (ntfs_set_mftrec_cache_size(ctx->vol, ctx->mft_cache))
+		goto err_out;
 	
 	ctx->vol->free_clusters = ntfs_attr_get_free_bits(ctx->vol->lcnbmp_na);
 	if (ctx->vol->free_clusters < 0) {
@@ -101,6 +101,7 @@ const struct DEFOPTION optionlist[] = {
 	{ "remove_hiberfile", OPT_REMOVE_HIBERFILE, FLGOPT_BOGUS },
 	{ "sync", OPT_SYNC, FLGOPT_BOGUS | FLGOPT_APPEND },
 	{ "big_writes", OPT_BIG_WRITES, FLGOPT_BOGUS },
+	{ "writeback_cache", OPT_WRITEBACK_CACHE, FLGOPT_BOGUS },
 	{ "locale", OPT_LOCALE, FLGOPT_STRING },
 	{ "nfconv", OPT_NFCONV, FLGOPT_BOGUS },
 	{ "nonfconv", OPT_NONFCONV, FLGOPT_BOGUS },
@@ -117,6 +118,8 @@ const struct DEFOPTION optionlist[] = {
 	{ "usermapping", OPT_USERMAPPING, FLGOPT_STRING },
 	{ "xattrmapping", OPT_XATTRMAPPING, FLGOPT_STRING },
 	{ "efs_raw", OPT_EFS_RAW, FLGOPT_BOGUS },
+	{ "lookup_cache", OPT_LOOKUP_CACHE, FLGOPT_DECIMAL },
+	{ "mft_cache", OPT_MFT_CACHE, FLGOPT_DECIMAL },
 	{ (const char*)NULL, 0, 0 } /* end marker */
 } ;
 
@@ -239,6 +242,8 @@ char *parse_mount_options(ntfs_fuse_context_t *ctx,
 	ctx->efs_raw = FALSE;
 #endif /* HAVE_SETXATTR */
 	ctx->compression = DEFAULT_COMPRESSION;
+	ctx->lookup_cache = -1;
+	ctx->mft_cache = -1;
 	options = strdup(orig_opts ? orig_opts : "");
 	if (!options) {
 		ntfs_log_perror("%s: strdup failed", EXEC_NAME);
@@ -379,6 +384,15 @@ char *parse_mount_options(ntfs_fuse_context_t *ctx,
 				ctx->big_writes = TRUE;
 				break;
 #endif
+			case OPT_WRITEBACK_CACHE :
+				if (low_fuse)
+					ctx->writeback_cache = TRUE;
+				else {
+					ntfs_log_error("'%s' is an unsupported option.\n",
+						poptl->name);
+					goto err_exit;
+				}
+				break;
 			case OPT_LOCALE :
 				ntfs_set_char_encoding(val);
 				break;
@@ -480,6 +494,22 @@ char *parse_mount_options(ntfs_fuse_context_t *ctx,
 				ctx->efs_raw = TRUE;
 				break;
 #endif /* HAVE_SETXATTR */
+			case OPT_LOOKUP_CACHE :
+				if (intarg < 0) {
+					ntfs_log_error("'%s' option needs a "
+						"non negative value\n", opt);
+					goto err_exit;
+				}
+				ctx->lookup_cache = intarg;
+				break;
+			case OPT_MFT_CACHE :
+				if (intarg < 0) {
+					ntfs_log_error("'%s' option needs a "
+						"non negative value\n", opt);
+					goto err_exit;
+				}
+				ctx->mft_cache = intarg;
+				break;
 			case OPT_FSNAME : /* Filesystem name. */
 			/*
 			 * We need this to be able to check whether filesystem
@@ -636,6 +666,29 @@ int ntfs_parse_options(struct ntfs_options *popts, void (*usage)(void),
 	return 0;
 }
 
+/*
+ *		Get the biggest size of write buffers which is safe for
+ *	the volume, not exceeding the requested one.
+ *
+ *	On a nearly full volume, the cluster allocator may not find
+ *	enough clusters for a buffer bigger than capacity/32768
+ *	(see param.h), so small volumes get smaller buffers.
+ */
+
+unsigned int ntfs_safe_max_write(const ntfs_volume *vol,
+			unsigned int max_write)
+{
+	s64 capacity;
+	unsigned int size;
+
+	capacity = vol->nr_clusters << vol->cluster_size_bits;
+	size = MIN_WRITE_SIZE;
+	while (((size << 1) <= max_write)
+	    && ((s64)(size << 1)*SAFE_CAPACITY_PER_WRITE_BYTE <= capacity))
+		size <<= 1;
+	return (size);
+}
+
 #ifdef HAVE_SETXATTR
 
 int ntfs_fuse_listxattr_common(ntfs_inode *ni, ntfs_attr_search_ctx *actx,
@@ -75,6 +75,7 @@ enum {
 	OPT_REMOVE_HIBERFILE,
 	OPT_SYNC,
 	OPT_BIG_WRITES,
+	OPT_WRITEBACK_CACHE,
 	OPT_LOCALE,
 	OPT_NFCONV,
 	OPT_NONFCONV,
@@ -91,6 +92,8 @@ enum {
 	OPT_USERMAPPING,
 	OPT_XATTRMAPPING,
 	OPT_EFS_RAW,
+	OPT_LOOKUP_CACHE,
+	OPT_MFT_CACHE,
 } ;
 
 			/* Option flags */
@@ -119,6 +122,8 @@ typedef struct {
 	ntfs_fuse_streams_interface streams;
 	ntfs_atime_t atime;
 	u64 dmtime;
+	int lookup_cache; /* -1 for the default size */
+	int mft_cache; /* -1 for the default size */
 	BOOL ro;
 	BOOL show_sys_files;
 	BOOL hide_hid_files;
@@ -132,6 +137,7 @@ typedef struct {
 	BOOL hiberfile;
 	BOOL sync;
 	BOOL big_writes;
+	BOOL writeback_cache; /* only used in lowntfs-3g */
 	BOOL debug;
 	BOOL no_detach;
 	BOOL blkdev;
@@ -150,6 +156,10 @@ typedef struct {
 	struct PERMISSIONS_CACHE *seccache;
 	struct SECURITY_CONTEXT security;
 	struct open_file *open_files; /* only defined in lowntfs-3g */
+	BOOL splice_read; /* only used in lowntfs-3g */
+	char *read_buf; /* only used in lowntfs-3g */
+	size_t read_buf_size;
+	u64 prefetch_dir; /* only used in lowntfs-3g */
 	u64 latest_ghost;
 } ntfs_fuse_context_t;
 
@@ -178,6 +188,8 @@ char *parse_mount_options(ntfs_fuse_context_t *ctx,
 			const struct ntfs_options *popts, BOOL low_fuse);
 int ntfs_parse_options(struct ntfs_options *popts, void (*usage)(void),
 			int argc, char *argv[]);
+unsigned int ntfs_safe_max_write(const ntfs_volume *vol,
+			unsigned int max_write);
 
 int ntfs_fuse_listxattr_common(ntfs_inode *ni, ntfs_attr_search_ctx *actx,
  			char *list, size_t size, BOOL prefixing);